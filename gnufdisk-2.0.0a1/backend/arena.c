@@ -0,0 +1,278 @@
+#include "common.h"
+
+/* every chunk handed out by an arena is preceded by this header, so that
+ * arena_free() can be used directly as an unwind handler. */
+struct arena_chunk {
+  struct arena* arena;
+  size_t class;
+} __attribute__((aligned(16)));
+
+struct arena_slab {
+  struct arena_slab* next;
+  size_t used;
+} __attribute__((aligned(16)));
+
+struct arena_large {
+  struct arena_large* prev;
+  struct arena_large* next;
+} __attribute__((aligned(16)));
+
+#define ARENA_GRAIN 16
+#define ARENA_CLASSES 32 /* chunks up to ARENA_GRAIN * ARENA_CLASSES bytes come from slabs */
+#define ARENA_LARGE ARENA_CLASSES
+#define ARENA_SLAB_SIZE 16384
+
+struct arena {
+  struct arena_slab* slabs;
+  struct arena_large* large;
+  void* free[ARENA_CLASSES];
+  size_t live;
+  size_t exported; /* chunks the frontend holds a reference on */
+  int orphan;
+};
+
+static void arena_check(struct arena* _a)
+{
+  if(gnufdisk_check_memory(_a, sizeof(struct arena), 0) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL, "invalid struct arena* %p", _a);
+}
+
+static void arena_release(struct arena* _a, int _keep_first)
+{
+  struct arena_slab* slab;
+  struct arena_large* large;
+
+  GNUFDISK_LOG((ARENA, "release slabs of struct arena* %p", _a));
+
+  slab = _a->slabs;
+
+  if(_keep_first && slab != NULL)
+    {
+      /* keep the most recent slab around: a probe/close cycle will reuse it */
+      _a->slabs = slab;
+      slab = slab->next;
+      _a->slabs->next = NULL;
+      _a->slabs->used = sizeof(struct arena_slab);
+    }
+  else
+    _a->slabs = NULL;
+
+  while(slab != NULL)
+    {
+      struct arena_slab* next;
+
+      next = slab->next;
+      free(slab);
+      slab = next;
+    }
+
+  for(large = _a->large; large != NULL; )
+    {
+      struct arena_large* next;
+
+      next = large->next;
+      free(large);
+      large = next;
+    }
+
+  _a->large = NULL;
+  memset(_a->free, 0, sizeof(_a->free));
+}
+
+static void* arena_alloc_large(struct arena* _a, size_t _size)
+{
+  struct arena_large* large;
+  struct arena_chunk* chunk;
+
+  if((large = malloc(sizeof(struct arena_large) + sizeof(struct arena_chunk) + _size)) == NULL)
+    THROW_ENOMEM;
+
+  large->prev = NULL;
+  large->next = _a->large;
+
+  if(_a->large)
+    _a->large->prev = large;
+
+  _a->large = large;
+
+  chunk = (struct arena_chunk*) (large + 1);
+  chunk->class = ARENA_LARGE;
+
+  return chunk;
+}
+
+static void* arena_alloc_small(struct arena* _a, size_t _class)
+{
+  size_t size;
+  void* ret;
+
+  if((ret = _a->free[_class]) != NULL)
+    {
+      _a->free[_class] = *(void**) ((struct arena_chunk*) ret + 1);
+      return ret;
+    }
+
+  size = sizeof(struct arena_chunk) + (_class + 1) * ARENA_GRAIN;
+
+  if(_a->slabs == NULL || _a->slabs->used + size > ARENA_SLAB_SIZE)
+    {
+      struct arena_slab* slab;
+
+      if((slab = malloc(ARENA_SLAB_SIZE)) == NULL)
+	THROW_ENOMEM;
+
+      GNUFDISK_LOG((ARENA, "new slab %p for struct arena* %p", slab, _a));
+
+      slab->next = _a->slabs;
+      slab->used = sizeof(struct arena_slab);
+
+      _a->slabs = slab;
+    }
+
+  ret = (char*) _a->slabs + _a->slabs->used;
+  _a->slabs->used += size;
+
+  return ret;
+}
+
+struct arena* arena_new(void)
+{
+  struct arena* ret;
+
+  if((ret = malloc(sizeof(struct arena))) == NULL)
+    THROW_ENOMEM;
+
+  memset(ret, 0, sizeof(struct arena));
+
+  GNUFDISK_LOG((ARENA, "new struct arena* %p", ret));
+
+  return ret;
+}
+
+void* arena_alloc(struct arena* _a, size_t _size)
+{
+  struct arena_chunk* chunk;
+  size_t class;
+
+  arena_check(_a);
+
+  if(_a->orphan)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL, "allocation from deleted struct arena* %p", _a);
+
+  class = _size == 0 ? 0 : (_size - 1) / ARENA_GRAIN;
+
+  if(class >= ARENA_CLASSES)
+    chunk = arena_alloc_large(_a, _size);
+  else
+    {
+      chunk = arena_alloc_small(_a, class);
+      chunk->class = class;
+      _size = (class + 1) * ARENA_GRAIN;
+    }
+
+  chunk->arena = _a;
+  _a->live++;
+
+  memset(chunk + 1, 0, _size);
+
+  return chunk + 1;
+}
+
+void arena_free(void* _p)
+{
+  struct arena_chunk* chunk;
+  struct arena* arena;
+
+  if(_p == NULL)
+    return;
+
+  chunk = (struct arena_chunk*) _p - 1;
+  arena = chunk->arena;
+
+  arena_check(arena);
+
+  if(chunk->class == ARENA_LARGE)
+    {
+      struct arena_large* large;
+
+      large = (struct arena_large*) chunk - 1;
+
+      if(large->prev)
+	large->prev->next = large->next;
+      else
+	arena->large = large->next;
+
+      if(large->next)
+	large->next->prev = large->prev;
+
+      free(large);
+    }
+  else
+    {
+      *(void**) _p = arena->free[chunk->class];
+      arena->free[chunk->class] = chunk;
+    }
+
+  if(--arena->live == 0)
+    {
+      /* the whole object tree is gone, drop it in one step */
+      arena_release(arena, !arena->orphan);
+
+      if(arena->orphan)
+	{
+	  GNUFDISK_LOG((ARENA, "delete struct arena* %p", arena));
+	  free(arena);
+	}
+    }
+}
+
+void arena_export(struct arena* _a, int _delta)
+{
+  arena_check(_a);
+
+  _a->exported += _delta;
+
+  GNUFDISK_LOG((ARENA, "struct arena* %p has %zu exported chunks", _a, _a->exported));
+}
+
+size_t arena_exported(struct arena* _a)
+{
+  arena_check(_a);
+
+  return _a->exported;
+}
+
+/* Drop every chunk at once, live or not. Only for an arena nothing outside
+ * the device points into: the chunks are not deleted one by one. */
+void arena_clear(struct arena* _a)
+{
+  arena_check(_a);
+
+  if(_a->exported > 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL, "struct arena* %p still has %zu exported chunks", _a, _a->exported);
+
+  GNUFDISK_LOG((ARENA, "clear struct arena* %p, %zu live chunks", _a, _a->live));
+
+  arena_release(_a, 1);
+  _a->live = 0;
+}
+
+void arena_delete(struct arena* _a)
+{
+  arena_check(_a);
+
+  if(_a->live > 0)
+    {
+      /* objects allocated here still hold references; the last arena_free()
+       * releases the arena */
+      GNUFDISK_LOG((ARENA, "struct arena* %p still has %zu live chunks, defer delete", _a, _a->live));
+      _a->orphan = 1;
+      return;
+    }
+
+  arena_release(_a, 0);
+
+  GNUFDISK_LOG((ARENA, "delete struct arena* %p", _a));
+
+  free(_a);
+}
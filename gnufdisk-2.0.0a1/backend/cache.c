@@ -0,0 +1,374 @@
+#include <sys/stat.h>
+#include <stdio.h>
+#include <zlib.h>
+
+#include "common.h"
+
+/* Probe cache: the sectors read while a disklabel is probed are stored on
+ * disk, keyed by the device identity, the content of the first label sectors
+ * and the label stamp of the device, which changes with the label sectors
+ * elsewhere (EBR chain, backup GPT header). When the key still matches the
+ * probe is served from memory and nothing else is read again. */
+
+#define PROBE_CACHE_MAGIC "GFDPC001"
+
+struct probe_cache_header {
+  char magic[8];
+  uint32_t keysize;
+  uint32_t nrecords;
+};
+
+struct probe_cache_record {
+  gnufdisk_integer offset;
+  size_t size;
+  unsigned char data[];
+};
+
+struct probe_cache {
+  char* path;
+  void* key;
+  size_t keysize;
+  struct vector* records;
+  size_t cursor;
+  int hit;
+};
+
+static void delete_record(void* _p)
+{
+  GNUFDISK_LOG((CACHE, "delete struct probe_cache_record* %p", _p));
+  free(_p);
+}
+
+static void clear_records(struct probe_cache* _cache)
+{
+  while(vector_length(_cache->records) > 0)
+    free(vector_remove(_cache->records, vector_length(_cache->records) - 1));
+}
+
+static void probe_cache_check(struct probe_cache* _cache)
+{
+  if(gnufdisk_check_memory(_cache, sizeof(struct probe_cache), 0) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL, "invalid struct probe_cache* %p", _cache);
+}
+
+static char* probe_cache_path(const char* _dir, const char* _identity)
+{
+  char* ret;
+  char* iter;
+  size_t dirlen;
+
+  dirlen = strlen(_dir);
+
+  if((ret = malloc(dirlen + strlen(_identity) + 2)) == NULL)
+    THROW_ENOMEM;
+
+  memcpy(ret, _dir, dirlen);
+  ret[dirlen] = '/';
+  strcpy(ret + dirlen + 1, _identity);
+
+  /* the identity may contain anything a sysfs attribute can hold */
+  for(iter = ret + dirlen + 1; *iter != 0; iter++)
+    if(!((*iter >= 'a' && *iter <= 'z')
+	 || (*iter >= 'A' && *iter <= 'Z')
+	 || (*iter >= '0' && *iter <= '9')
+	 || *iter == '-' || *iter == '.'))
+      *iter = '_';
+
+  return ret;
+}
+
+static int probe_cache_load(struct probe_cache* _cache)
+{
+  struct probe_cache_header header;
+  FILE* file;
+  void* key;
+  uint32_t iter;
+
+  GNUFDISK_LOG((CACHE, "load probe cache from %s", _cache->path));
+
+  key = NULL;
+
+  if((file = fopen(_cache->path, "rb")) == NULL)
+    return -1;
+
+  if(fread(&header, sizeof(header), 1, file) != 1
+     || memcmp(header.magic, PROBE_CACHE_MAGIC, sizeof(header.magic)) != 0
+     || header.keysize != _cache->keysize)
+    goto lb_failure;
+
+  if((key = malloc(header.keysize)) == NULL)
+    goto lb_failure;
+
+  if(fread(key, header.keysize, 1, file) != 1
+     || memcmp(key, _cache->key, header.keysize) != 0)
+    {
+      GNUFDISK_LOG((CACHE, "label sectors changed, cache is stale"));
+      goto lb_failure;
+    }
+
+  for(iter = 0; iter < header.nrecords; iter++)
+    {
+      struct probe_cache_record* record;
+      int64_t offset;
+      uint32_t size;
+
+      if(fread(&offset, sizeof(offset), 1, file) != 1
+	 || fread(&size, sizeof(size), 1, file) != 1)
+	goto lb_failure;
+
+      if((record = malloc(sizeof(struct probe_cache_record) + size)) == NULL)
+	goto lb_failure;
+
+      record->offset = offset;
+      record->size = size;
+
+      if(fread(record->data, size, 1, file) != 1)
+	{
+	  free(record);
+	  goto lb_failure;
+	}
+
+      vector_append(_cache->records, record);
+    }
+
+  free(key);
+  fclose(file);
+
+  GNUFDISK_LOG((CACHE, "done load probe cache, %u records", header.nrecords));
+
+  return 0;
+
+lb_failure:
+
+  if(key)
+    free(key);
+
+  fclose(file);
+
+  clear_records(_cache);
+
+  return -1;
+}
+
+struct probe_cache* probe_cache_new(const char* _dir,
+				    const char* _identity,
+				    const void* _key,
+				    size_t _keysize)
+{
+  struct probe_cache* ret;
+
+  GNUFDISK_LOG((CACHE, "open probe cache for `%s' in %s", _identity, _dir));
+
+  if((ret = malloc(sizeof(struct probe_cache))) == NULL)
+    THROW_ENOMEM;
+
+  gnufdisk_exception_register_unwind_handler(&free, ret);
+
+  memset(ret, 0, sizeof(struct probe_cache));
+
+  ret->path = probe_cache_path(_dir, _identity);
+
+  gnufdisk_exception_register_unwind_handler(&free, ret->path);
+
+  if((ret->key = malloc(_keysize)) == NULL)
+    THROW_ENOMEM;
+
+  gnufdisk_exception_register_unwind_handler(&free, ret->key);
+
+  memcpy(ret->key, _key, _keysize);
+  ret->keysize = _keysize;
+
+  ret->records = vector_new(NULL);
+
+  ret->hit = probe_cache_load(ret) == 0;
+
+  gnufdisk_exception_unregister_unwind_handler(&free, ret->key);
+  gnufdisk_exception_unregister_unwind_handler(&free, ret->path);
+  gnufdisk_exception_unregister_unwind_handler(&free, ret);
+
+  GNUFDISK_LOG((CACHE, "done open probe cache, result: %p (hit: %d)", ret, ret->hit));
+
+  return ret;
+}
+
+int probe_cache_hit(struct probe_cache* _cache)
+{
+  probe_cache_check(_cache);
+
+  return _cache->hit;
+}
+
+int probe_cache_lookup(struct probe_cache* _cache, gnufdisk_integer _offset, void* _buf, size_t _size)
+{
+  size_t length;
+  size_t iter;
+
+  probe_cache_check(_cache);
+
+  if(!_cache->hit)
+    return -1;
+
+  length = vector_length(_cache->records);
+
+  /* a probe reads sectors in the same order every time, start from the
+   * record following the last match */
+  for(iter = 0; iter < length; iter++)
+    {
+      struct probe_cache_record* record;
+      size_t index;
+
+      index = (_cache->cursor + iter) % length;
+      record = vector_get(_cache->records, index);
+
+      if(record->offset == _offset && record->size == _size)
+	{
+	  GNUFDISK_LOG((CACHE, "cache hit at offset %" PRId64 ", %zu bytes", _offset, _size));
+
+	  memcpy(_buf, record->data, _size);
+	  _cache->cursor = index + 1;
+
+	  return 0;
+	}
+    }
+
+  GNUFDISK_LOG((CACHE, "cache miss at offset %" PRId64 ", %zu bytes", _offset, _size));
+
+  return -1;
+}
+
+void probe_cache_record(struct probe_cache* _cache, gnufdisk_integer _offset, const void* _buf, size_t _size)
+{
+  struct probe_cache_record* record;
+
+  probe_cache_check(_cache);
+
+  if(_cache->hit)
+    return;
+
+  if((record = malloc(sizeof(struct probe_cache_record) + _size)) == NULL)
+    THROW_ENOMEM;
+
+  gnufdisk_exception_register_unwind_handler(&free, record);
+
+  record->offset = _offset;
+  record->size = _size;
+  memcpy(record->data, _buf, _size);
+
+  vector_append(_cache->records, record);
+
+  gnufdisk_exception_unregister_unwind_handler(&free, record);
+}
+
+void probe_cache_save(struct probe_cache* _cache)
+{
+  struct probe_cache_header header;
+  char* tmp;
+  FILE* file;
+  size_t iter;
+  int err;
+
+  probe_cache_check(_cache);
+
+  if(_cache->hit)
+    return;
+
+  GNUFDISK_LOG((CACHE, "save probe cache to %s", _cache->path));
+
+  if((tmp = malloc(strlen(_cache->path) + 5)) == NULL)
+    THROW_ENOMEM;
+
+  sprintf(tmp, "%s.tmp", _cache->path);
+
+  if((file = fopen(tmp, "wb")) == NULL)
+    {
+      GNUFDISK_WARNING("can not write probe cache %s: %s", tmp, strerror(errno));
+      free(tmp);
+      return;
+    }
+
+  memcpy(header.magic, PROBE_CACHE_MAGIC, sizeof(header.magic));
+  header.keysize = _cache->keysize;
+  header.nrecords = vector_length(_cache->records);
+
+  err = fwrite(&header, sizeof(header), 1, file) != 1
+    || fwrite(_cache->key, _cache->keysize, 1, file) != 1;
+
+  for(iter = 0; !err && iter < vector_length(_cache->records); iter++)
+    {
+      struct probe_cache_record* record;
+      int64_t offset;
+      uint32_t size;
+
+      record = vector_get(_cache->records, iter);
+
+      offset = record->offset;
+      size = record->size;
+
+      err = fwrite(&offset, sizeof(offset), 1, file) != 1
+	|| fwrite(&size, sizeof(size), 1, file) != 1
+	|| fwrite(record->data, record->size, 1, file) != 1;
+    }
+
+  if(fclose(file) != 0)
+    err = 1;
+
+  if(err || rename(tmp, _cache->path) != 0)
+    {
+      GNUFDISK_WARNING("can not write probe cache %s: %s", _cache->path, strerror(errno));
+      unlink(tmp);
+    }
+
+  free(tmp);
+
+  GNUFDISK_LOG((CACHE, "done save probe cache"));
+}
+
+void probe_cache_delete(struct probe_cache* _cache)
+{
+  probe_cache_check(_cache);
+
+  GNUFDISK_LOG((CACHE, "delete struct probe_cache* %p", _cache));
+
+  vector_delete(_cache->records, &delete_record);
+
+  free(_cache->key);
+  free(_cache->path);
+
+  memset(_cache, 0, sizeof(struct probe_cache));
+  free(_cache);
+}
+
+void probe_cache_invalidate(const char* _dir, const char* _identity)
+{
+  char* path;
+
+  path = probe_cache_path(_dir, _identity);
+
+  GNUFDISK_LOG((CACHE, "invalidate probe cache %s", path));
+
+  if(unlink(path) != 0 && errno != ENOENT)
+    GNUFDISK_WARNING("can not remove probe cache %s: %s", path, strerror(errno));
+
+  free(path);
+}
+
+/* label stamp of a device backed by the file _fd: its size and modification
+ * time change with every write, EBRs and backup GPT included. 0 if the file
+ * can not be examined. */
+gnufdisk_integer probe_cache_file_stamp(int _fd)
+{
+  struct stat info;
+  int64_t data[3];
+  uint32_t ret;
+
+  if(fstat(_fd, &info) != 0)
+    return 0;
+
+  data[0] = info.st_size;
+  data[1] = info.st_mtim.tv_sec;
+  data[2] = info.st_mtim.tv_nsec;
+
+  ret = crc32(0, (const Bytef*) data, sizeof(data));
+
+  return ret != 0 ? ret : 1;
+}
@@ -18,7 +18,9 @@
 #define INFO 1
 #define ENDIAN 1
 #define MATH 1
-#define LIST 1
+#define VECTOR 1
+#define ARENA 1
+#define CACHE 1
 #define OBJECT 1
 #define DEVICE 1
 #define DISKLABEL 1
@@ -48,14 +50,27 @@ UINT64 swap64(UINT64 _val);
 # define LE64_TO_CPU(_v) (_v)
 #endif
 
+enum wipe_mode {
+  WIPE_NONE,
+  WIPE_ZEROOUT, /* BLKZEROOUT (or write zeros) over new partitions */
+  WIPE_SECDISCARD /* BLKSECDISCARD over new partitions */
+};
+
 struct module_options {
   int readonly;
+  int discard; /* discard the range of removed partitions on commit */
+  enum wipe_mode wipe;
   gnufdisk_integer cylinders;
   gnufdisk_integer heads;
   gnufdisk_integer sectors;
   gnufdisk_integer sector_size;
+  char* cache_dir; /* probe cache directory, NULL when disabled */
+  char* overlay; /* copy-on-write delta file, NULL when disabled */
 };
 
+/* parse the options string given to module_register */
+void parse_module_options(const char* _options, struct module_options* _dest);
+
 #define DIV_T lldiv_t
 #define DIV lldiv
 
@@ -67,17 +82,35 @@ gnufdisk_integer math_round(gnufdisk_integer _val, gnufdisk_integer _grain);
 /* common errors */
 #define THROW_ENOMEM GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOMEM, NULL, "can not allocate memory")
 
-struct list;
-struct list* list_prev(struct list* _n);
-struct list* list_next(struct list* _n);
-void* list_data(struct list* _n);
-struct list* list_first(struct list* _n);
-struct list* list_last(struct list* _n);
-struct list* list_append(struct list* _n, void* _data);
-struct list* list_append_ordered(struct list* _n, int (*_compare)(const void*, const void*), void* _data);
-struct list* list_insert(struct list* _n, void* _data);
-void* list_remove(struct list* _n);
-void list_delete(struct list* _n, void (*_free)(void*));
+/* per-device allocator for the label tree (disklabels, partitions and their private data) */
+struct arena;
+struct arena* arena_new(void);
+void* arena_alloc(struct arena* _a, size_t _size);
+void arena_free(void* _p);
+void arena_export(struct arena* _a, int _delta);
+size_t arena_exported(struct arena* _a);
+void arena_clear(struct arena* _a);
+void arena_delete(struct arena* _a);
+
+struct vector;
+struct vector* vector_new(struct arena* _arena);
+size_t vector_length(struct vector* _v);
+void* vector_get(struct vector* _v, size_t _index);
+void* vector_last(struct vector* _v);
+void vector_append(struct vector* _v, void* _data);
+void* vector_remove(struct vector* _v, size_t _index);
+void vector_delete(struct vector* _v, void (*_free)(void*));
+
+/* on-disk cache of the sectors read by disklabel_probe() */
+struct probe_cache;
+struct probe_cache* probe_cache_new(const char* _dir, const char* _identity, const void* _key, size_t _keysize);
+int probe_cache_hit(struct probe_cache* _cache);
+int probe_cache_lookup(struct probe_cache* _cache, gnufdisk_integer _offset, void* _buf, size_t _size);
+void probe_cache_record(struct probe_cache* _cache, gnufdisk_integer _offset, const void* _buf, size_t _size);
+void probe_cache_save(struct probe_cache* _cache);
+void probe_cache_delete(struct probe_cache* _cache);
+void probe_cache_invalidate(const char* _dir, const char* _identity);
+gnufdisk_integer probe_cache_file_stamp(int _fd);
 
 struct object;
 
@@ -95,8 +128,10 @@ struct object_private_operations {
 };
 
 /* object interface */
-struct object* object_new(enum object_type _type, const struct object_private_operations* _operations, void* _private);
+struct object* object_new(struct arena* _arena, enum object_type _type, const struct object_private_operations* _operations, void* _private);
 struct object* object_ref(struct object* _o);
+void object_export(struct object* _o);
+void object_unexport(struct object* _o);
 #ifdef GNUFDISK_DEBUG
 int object_nref(struct object* _o);
 #endif
@@ -106,15 +141,30 @@ struct object* object_cast(struct object* _o, enum object_type _type);
 gnufdisk_integer object_start(struct object* _o);
 gnufdisk_integer object_end(struct object* _o);
 void* object_private(struct object* _o, enum object_type _type);
+struct arena* object_arena(struct object* _o);
 
 /* device object functionalities */
 gnufdisk_integer device_seek(void* _object, gnufdisk_integer _lba, gnufdisk_integer _offset, int _whence);
 gnufdisk_integer device_read(void* _object, void* _buf, size_t _size);
 gnufdisk_integer device_write(void* _object, const void* _buf, size_t _size);
+gnufdisk_integer device_pread(void* _object, gnufdisk_integer _lba, void* _buf, size_t _size);
+gnufdisk_integer device_seek_data(void* _object, gnufdisk_integer _lba, gnufdisk_integer _end, int _whence);
+void device_zero(void* _object, gnufdisk_integer _lba, gnufdisk_integer _count);
+void device_schedule_discard(void* _object, gnufdisk_integer _start, gnufdisk_integer _end);
+void device_schedule_wipe(void* _object, gnufdisk_integer _start, gnufdisk_integer _end);
+void device_cancel_discard(void* _object, gnufdisk_integer _start, gnufdisk_integer _end);
 gnufdisk_integer device_sector_size(void* _object);
 gnufdisk_integer device_minimum_alignment(void* _object);
 gnufdisk_integer device_optimal_alignment(void* _object);
 void device_get_parameter(void* _object, struct gnufdisk_string* _param, void* _dest, size_t _size);
+struct arena* device_arena(void* _object);
+
+/* a partition as the kernel numbers it, in bytes */
+struct device_partition {
+  int number;
+  gnufdisk_integer start;
+  gnufdisk_integer length;
+};
 
 /* device's can be files, hard disk, usb drives... */
 struct device_implementation {
@@ -131,8 +181,28 @@ struct device_implementation {
   void (*get_parameter)(void *_private, struct gnufdisk_string* _param, void* _dest, size_t _size);
   void (*commit)(void* _p);
   void (*delete)(void* _p); /* delete private data */
+  /* optional: next data (SEEK_DATA) or hole (SEEK_HOLE) sector at or after _lba,
+   * -1 and errno on failure; must not move the file offset */
+  gnufdisk_integer (*seek_data)(void* _private, gnufdisk_integer _lba, int _whence);
+  /* optional: make _count sectors read back as zeros without writing them,
+   * -1 and errno EOPNOTSUPP when the device can not */
+  int (*zero)(void* _private, gnufdisk_integer _lba, gnufdisk_integer _count);
+  /* optional: tell the device _count sectors are unused (secure erase them
+   * when _secure), -1 and errno EOPNOTSUPP when the device can not */
+  int (*discard)(void* _private, gnufdisk_integer _lba, gnufdisk_integer _count, int _secure);
+  /* optional: discard unit in bytes, 0 when unknown */
+  gnufdisk_integer (*discard_granularity)(void* _private);
+  /* optional: read at _lba without moving the file offset, safe to call
+   * from several threads at once */
+  gnufdisk_integer (*pread)(void* _private, gnufdisk_integer _lba, void* _buf, size_t _size);
+  /* optional: tell the kernel the partitions now on the device, called
+   * after the disklabel is committed */
+  void (*update_partitions)(void* _private, const struct device_partition* _partitions, size_t _count);
 };
 
+/* open _path with the first implementation that accepts it, -1 if none does */
+int device_probe_implementation(const char* _path, struct module_options* _options, struct device_implementation* _implementation);
+
 extern struct gnufdisk_disklabel_operations disklabel_operations;
 
 /* disklabel functionalities */
@@ -144,6 +214,11 @@ void disklabel_enumerate_partitions(void* _object,
                                     void (*_callback)(struct object*, void*),
                                     void* _callback_data);
 int disklabel_partition_number(void* _object, struct object* _partition);
+gnufdisk_integer disklabel_align(struct gnufdisk_geometry* _range,
+				 const gnufdisk_integer* _grains,
+				 int _ngrains,
+				 int _end,
+				 gnufdisk_integer* _grain);
 
 
 
@@ -168,6 +243,8 @@ struct disklabel_implementation {
                                void (*_callback)(struct object*, void*),
                                void* _callback_data);
   int (*partition_number)(void* _private, struct object* _partition);
+  /* optional: copy the unique GUID of _partition to _guid, return 0 if it has one */
+  int (*partition_guid)(void* _private, struct object* _partition, unsigned char* _guid);
   void (*delete)(void* _private);
 };
 
@@ -186,6 +263,15 @@ struct object* guid_probe(struct object* _parent, gnufdisk_integer _start, gnufd
 int gpt_probe(struct object* _parent, struct disklabel_implementation* _implementation);
 void gpt_new(struct object* _parent, struct disklabel_implementation* _implementation);
 
+/* what partitions hold, probed with one batch of sorted reads */
+struct content_partition {
+  gnufdisk_integer start; /* bytes */
+  gnufdisk_integer length; /* bytes, 0 to skip the partition */
+  char name[GNUFDISK_PARTITION_CONTENT_SIZE]; /* empty when not recognized */
+};
+
+void content_probe(struct object* _device, struct content_partition* _partitions, size_t _count);
+
 /* partition functionalities */
 extern struct gnufdisk_partition_operations partition_operations;
 
@@ -216,6 +302,8 @@ struct object* logical_new(struct object* _parent, gnufdisk_integer _start, gnuf
 struct object* guid_new(struct object* _parent, gnufdisk_integer _start, gnufdisk_integer _end);
 void partition_commit(void* _object);
 void partition_set_parent(void* _object, struct object* _parent);
+/* the disklabel inside _object, NULL if it has none; no reference is taken */
+struct object* partition_get_disklabel(void* _object);
 
 #endif /* COMMON_H_INCLUDED */
 
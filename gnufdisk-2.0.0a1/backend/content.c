@@ -0,0 +1,247 @@
+#include "common.h"
+
+/* Content probe: the superblock offsets of all the partitions are
+ * collected, sorted and merged into as few reads as possible, then matched
+ * against a table of magic numbers. Names are the ones blkid reports. */
+
+/* reading a gap this small costs less than another request */
+#define CONTENT_MERGE_GAP (128 * 1024)
+
+struct content_signature {
+  const char* name;
+  gnufdisk_integer offset; /* from the start of the partition */
+  size_t size; /* bytes needed at offset */
+  const char* magic; /* found at offset, NULL to leave it to match */
+  const char* (*match)(const unsigned char* _data); /* optional */
+};
+
+struct content_range {
+  gnufdisk_integer start; /* bytes, sector aligned */
+  gnufdisk_integer end;
+  unsigned char* data;
+};
+
+struct content_batch {
+  struct content_range* ranges;
+  size_t nranges;
+};
+
+static const char* ext_match(const unsigned char* _data)
+{
+  UINT32 compat;
+  UINT32 incompat;
+
+  if(_data[0x38] != 0x53 || _data[0x39] != 0xef)
+    return NULL;
+
+  compat = LE32_TO_CPU(*(UINT32*) (_data + 0x5c));
+  incompat = LE32_TO_CPU(*(UINT32*) (_data + 0x60));
+
+  if(incompat & 0x0008) /* external journal */
+    return "jbd";
+  else if(incompat & (0x0040 | 0x0080 | 0x0200)) /* extents, 64bit, flex_bg */
+    return "ext4";
+  else if(compat & 0x0004) /* has_journal */
+    return "ext3";
+
+  return "ext2";
+}
+
+static const char* fat_match(const unsigned char* _data)
+{
+  if(_data[510] != 0x55 || _data[511] != 0xaa)
+    return NULL;
+
+  if(memcmp(_data + 54, "FAT1", 4) == 0 || memcmp(_data + 82, "FAT32", 5) == 0)
+    return "vfat";
+
+  return NULL;
+}
+
+/* first match wins: containers before the file systems they may hide */
+static const struct content_signature signatures[] = {
+  {"crypto_LUKS", 0, 6, "LUKS\xba\xbe", NULL},
+  {"linux_raid_member", 0, 4, "\xfc\x4e\x2b\xa9", NULL}, /* md 1.1 */
+  {"linux_raid_member", 4096, 4, "\xfc\x4e\x2b\xa9", NULL}, /* md 1.2 */
+  {"LVM2_member", 512, 32, "LABELONE", NULL},
+  {"swap", 4086, 10, "SWAPSPACE2", NULL},
+  {"swap", 16374, 10, "SWAPSPACE2", NULL},
+  {"swap", 65526, 10, "SWAPSPACE2", NULL},
+  {"xfs", 0, 4, "XFSB", NULL},
+  {"btrfs", 65600, 8, "_BHRfS_M", NULL},
+  {"ext2", 1024, 0x68, NULL, &ext_match},
+  {"f2fs", 1024, 4, "\x10\x20\xf5\xf2", NULL},
+  {"squashfs", 0, 4, "hsqs", NULL},
+  {"ntfs", 3, 8, "NTFS    ", NULL},
+  {"exfat", 3, 8, "EXFAT   ", NULL},
+  {"vfat", 0, 512, NULL, &fat_match},
+  {"iso9660", 32769, 5, "CD001", NULL}
+};
+
+#define SIGNATURES_LENGTH (sizeof(signatures) / sizeof(signatures[0]))
+
+static void free_content_batch(void* _p)
+{
+  struct content_batch* batch;
+  size_t iter;
+
+  batch = _p;
+
+  for(iter = 0; iter < batch->nranges; iter++)
+    free(batch->ranges[iter].data);
+
+  free(batch->ranges);
+}
+
+static int content_range_compare(const void* _a, const void* _b)
+{
+  const struct content_range* a;
+  const struct content_range* b;
+
+  a = _a;
+  b = _b;
+
+  return a->start < b->start ? -1 : a->start > b->start ? 1 : 0;
+}
+
+/* the bytes at [_offset, _offset + _size), NULL when they were not read */
+static const unsigned char* content_batch_find(struct content_batch* _batch, gnufdisk_integer _offset, size_t _size)
+{
+  size_t low;
+  size_t high;
+
+  low = 0;
+  high = _batch->nranges;
+
+  while(low < high)
+    {
+      struct content_range* range;
+      size_t middle;
+
+      middle = low + (high - low) / 2;
+      range = &_batch->ranges[middle];
+
+      if(_offset < range->start)
+	high = middle;
+      else if(_offset >= range->end)
+	low = middle + 1;
+      else
+	return _offset + _size <= range->end ? range->data + (_offset - range->start) : NULL;
+    }
+
+  return NULL;
+}
+
+void content_probe(struct object* _device, struct content_partition* _partitions, size_t _count)
+{
+  struct content_batch batch;
+  gnufdisk_integer sector_size;
+  size_t nreads;
+  size_t iter;
+
+  GNUFDISK_LOG((DEVICE, "perform content probe of %zu partitions on struct object* %p", _count, _device));
+
+  memset(&batch, 0, sizeof(batch));
+
+  gnufdisk_exception_register_unwind_handler(&free_content_batch, &batch);
+
+  sector_size = device_sector_size(_device);
+
+  if((batch.ranges = malloc(_count * SIGNATURES_LENGTH * sizeof(struct content_range) + 1)) == NULL)
+    THROW_ENOMEM;
+
+  for(iter = 0; iter < _count; iter++)
+    {
+      size_t signature;
+
+      memset(_partitions[iter].name, 0, sizeof(_partitions[iter].name));
+
+      for(signature = 0; signature < SIGNATURES_LENGTH; signature++)
+	{
+	  struct content_range* range;
+	  gnufdisk_integer start;
+
+	  if(signatures[signature].offset + (gnufdisk_integer) signatures[signature].size > _partitions[iter].length)
+	    continue;
+
+	  start = _partitions[iter].start + signatures[signature].offset;
+
+	  range = &batch.ranges[batch.nranges++];
+	  range->start = start - start % sector_size;
+	  range->end = start + signatures[signature].size;
+	  range->end += (sector_size - range->end % sector_size) % sector_size;
+	  range->data = NULL;
+	}
+    }
+
+  qsort(batch.ranges, batch.nranges, sizeof(struct content_range), &content_range_compare);
+
+  for(nreads = 0, iter = 0; iter < batch.nranges; iter++)
+    if(nreads > 0 && batch.ranges[iter].start <= batch.ranges[nreads - 1].end + CONTENT_MERGE_GAP)
+      {
+	if(batch.ranges[iter].end > batch.ranges[nreads - 1].end)
+	  batch.ranges[nreads - 1].end = batch.ranges[iter].end;
+      }
+    else
+      batch.ranges[nreads++] = batch.ranges[iter];
+
+  batch.nranges = nreads;
+
+  GNUFDISK_LOG((DEVICE, "%zu reads", batch.nranges));
+
+  for(iter = 0; iter < batch.nranges; iter++)
+    {
+      struct content_range* range;
+      gnufdisk_integer size;
+
+      range = &batch.ranges[iter];
+      size = range->end - range->start;
+
+      if((range->data = malloc(size)) == NULL)
+	THROW_ENOMEM;
+
+      /* past the end of the device reads as zeros and matches nothing */
+      memset(range->data, 0, size);
+
+      if(device_pread(_device, range->start / sector_size, range->data, size) < 0)
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not read sector %" PRId64 ": %s",
+		       range->start / sector_size, strerror(errno));
+    }
+
+  for(iter = 0; iter < _count; iter++)
+    {
+      size_t signature;
+
+      for(signature = 0; signature < SIGNATURES_LENGTH; signature++)
+	{
+	  const unsigned char* data;
+	  const char* name;
+
+	  if(signatures[signature].offset + (gnufdisk_integer) signatures[signature].size > _partitions[iter].length
+	     || (data = content_batch_find(&batch,
+					   _partitions[iter].start + signatures[signature].offset,
+					   signatures[signature].size)) == NULL)
+	    continue;
+
+	  if(signatures[signature].magic != NULL
+	     && memcmp(data, signatures[signature].magic, strlen(signatures[signature].magic)) != 0)
+	    continue;
+
+	  name = signatures[signature].match != NULL ? (*signatures[signature].match)(data) : signatures[signature].name;
+
+	  if(name != NULL)
+	    {
+	      strncpy(_partitions[iter].name, name, sizeof(_partitions[iter].name) - 1);
+	      break;
+	    }
+	}
+
+      GNUFDISK_LOG((DEVICE, "partition at %" PRId64 ": `%s'", _partitions[iter].start, _partitions[iter].name));
+    }
+
+  gnufdisk_exception_unregister_unwind_handler(&free_content_batch, &batch);
+
+  free_content_batch(&batch);
+
+  GNUFDISK_LOG((DEVICE, "done perform content probe"));
+}
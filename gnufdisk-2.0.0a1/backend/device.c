@@ -1,14 +1,39 @@
+#define _GNU_SOURCE
+
 #include "common.h"
 
 
 
 extern int getsubopt( );
 extern int linux_device_probe(const char* _path, struct module_options* _options, struct device_implementation* _implementation);
+extern int nbd_device_probe(const char* _path, struct module_options* _options, struct device_implementation* _implementation);
+extern int qcow2_device_probe(const char* _path, struct module_options* _options, struct device_implementation* _implementation);
+extern int seekable_device_probe(const char* _path, struct module_options* _options, struct device_implementation* _implementation);
+extern int overlay_device_probe(const char* _path, struct module_options* _options, struct device_implementation* _implementation);
+
+enum device_trim_action {
+  DEVICE_TRIM_DISCARD,
+  DEVICE_TRIM_ZEROOUT,
+  DEVICE_TRIM_SECDISCARD
+};
+
+/* a discard or wipe waiting for commit */
+struct device_trim {
+  gnufdisk_integer lba;
+  gnufdisk_integer count;
+  enum device_trim_action action;
+};
 
 struct device_private {
   struct device_implementation implementation;
   struct module_options options;
   struct object* disklabel;
+  struct arena* arena; /* owns the label tree */
+  struct probe_cache* cache; /* active while the disklabel is probed */
+  struct device_trim* trims;
+  size_t ntrims;
+  gnufdisk_integer trimmed; /* sectors discarded or wiped since open */
+  gnufdisk_integer position;
   int is_open;
 };
 
@@ -18,6 +43,10 @@ enum {
   OPTION_HEADS,
   OPTION_SECTORS,
   OPTION_SECTOR_SIZE,
+  OPTION_CACHE_DIR,
+  OPTION_DISCARD,
+  OPTION_WIPE,
+  OPTION_OVERLAY,
   OPTION_NULL
 };
 
@@ -27,12 +56,19 @@ static const char* options[] = {
   [OPTION_HEADS] = "heads",
   [OPTION_SECTORS] = "sectors",
   [OPTION_SECTOR_SIZE] = "sector-size",
+  [OPTION_CACHE_DIR] = "cache-dir",
+  [OPTION_DISCARD] = "discard",
+  [OPTION_WIPE] = "wipe",
+  [OPTION_OVERLAY] = "overlay",
   [OPTION_NULL] = NULL
 };
 
 static const struct {
   int (*probe)(const char* path, struct module_options*, struct device_implementation*);
 } implementations[] = { 
+      {&nbd_device_probe},
+      {&qcow2_device_probe},
+      {&seekable_device_probe},
       {&linux_device_probe}
 };
 
@@ -42,6 +78,8 @@ static void device_open(void* _object, struct gnufdisk_string* _path);
 static void device_close(void* _p);
 static void device_set_parameter(void* _object, struct gnufdisk_string* _param, const void* _data, size_t _size);
 static void device_delete(void* _object);
+static void device_flush_trims(void* _object);
+static void device_flush_wipes(void* _object, gnufdisk_integer _start, gnufdisk_integer _end);
 
 static void delete_object(void* _p)
 {
@@ -49,13 +87,37 @@ static void delete_object(void* _p)
   object_delete(_p);
 }
 
+static void delete_arena(void* _p)
+{
+  GNUFDISK_LOG((DEVICE, "delete struct arena* %p", _p));
+  arena_delete(_p);
+}
+
+static void delete_string(void* _p)
+{
+  GNUFDISK_LOG((DEVICE, "delete struct gnufdisk_string* %p", _p));
+  gnufdisk_string_delete(_p);
+}
+
+static void release_probe_cache(void* _p)
+{
+  struct device_private* private;
+
+  private = _p;
+
+  GNUFDISK_LOG((DEVICE, "delete struct probe_cache* %p", private->cache));
+
+  probe_cache_delete(private->cache);
+  private->cache = NULL;
+}
+
 static void device_private_check(struct device_private* _p)
 {
   if(gnufdisk_check_memory(_p, sizeof(struct device_private), 0) != 0)
     GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL, "invalid struct device_private* %p", _p);
 }
 
-static void parse_module_options(const char* _options, struct module_options* _dest)
+void parse_module_options(const char* _options, struct module_options* _dest)
 {
   GNUFDISK_LOG((DEVICE, "parse module options `%s'", _options));
 
@@ -106,6 +168,50 @@ static void parse_module_options(const char* _options, struct module_options* _d
 	    else if(sscanf(argument, "%" SCNd64, &_dest->sector_size) != 1)
 	      GNUFDISK_WARNING("bad parameter for option `%s'", options[OPTION_SECTOR_SIZE]);
 	    break;
+	  case OPTION_CACHE_DIR:
+	    if(argument == NULL)
+	      {
+		GNUFDISK_WARNING("missing parameter for option `%s'", options[OPTION_CACHE_DIR]);
+		break;
+	      }
+
+	    if(_dest->cache_dir)
+	      free(_dest->cache_dir);
+
+	    if((_dest->cache_dir = strdup(argument)) == NULL)
+	      THROW_ENOMEM;
+	    break;
+	  case OPTION_DISCARD:
+	    _dest->discard = 1;
+	    break;
+	  case OPTION_WIPE:
+	    if(argument == NULL)
+	      {
+		GNUFDISK_WARNING("missing parameter for option `%s'", options[OPTION_WIPE]);
+		break;
+	      }
+	    else if(strcmp(argument, "zeroout") == 0)
+	      _dest->wipe = WIPE_ZEROOUT;
+	    else if(strcmp(argument, "secdiscard") == 0)
+	      _dest->wipe = WIPE_SECDISCARD;
+	    else if(strcmp(argument, "none") == 0)
+	      _dest->wipe = WIPE_NONE;
+	    else
+	      GNUFDISK_WARNING("bad parameter for option `%s'", options[OPTION_WIPE]);
+	    break;
+	  case OPTION_OVERLAY:
+	    if(argument == NULL)
+	      {
+		GNUFDISK_WARNING("missing parameter for option `%s'", options[OPTION_OVERLAY]);
+		break;
+	      }
+
+	    if(_dest->overlay)
+	      free(_dest->overlay);
+
+	    if((_dest->overlay = strdup(argument)) == NULL)
+	      THROW_ENOMEM;
+	    break;
 	  default:
 	    GNUFDISK_WARNING("unknown option: `%s'", argument);
 	}
@@ -117,6 +223,10 @@ static void parse_module_options(const char* _options, struct module_options* _d
   GNUFDISK_LOG((DEVICE, "  heads       : %" PRId64, _dest->heads));
   GNUFDISK_LOG((DEVICE, "  sectors     : %" PRId64, _dest->sectors));
   GNUFDISK_LOG((DEVICE, "  sector_size : %" PRId64, _dest->sector_size));  
+  GNUFDISK_LOG((DEVICE, "  cache_dir   : %s", _dest->cache_dir ? _dest->cache_dir : "(none)"));
+  GNUFDISK_LOG((DEVICE, "  discard     : %d", _dest->discard));
+  GNUFDISK_LOG((DEVICE, "  wipe        : %d", _dest->wipe));
+  GNUFDISK_LOG((DEVICE, "  overlay     : %s", _dest->overlay ? _dest->overlay : "(none)"));
 }
 
 /* OBJECT operations */
@@ -191,6 +301,18 @@ static void device_private_delete(void* _p)
   if(private->disklabel)
     object_delete(private->disklabel);
 
+  if(private->arena)
+    arena_delete(private->arena);
+
+  if(private->options.cache_dir)
+    free(private->options.cache_dir);
+
+  if(private->options.overlay)
+    free(private->options.overlay);
+
+  if(private->trims)
+    free(private->trims);
+
   memset(private, 0, sizeof(struct device_private));
   free(private);
 
@@ -204,11 +326,21 @@ static const struct object_private_operations device_private_operations = {
   delete: &device_private_delete 
 };
 
+int device_probe_implementation(const char* _path, struct module_options* _options, struct device_implementation* _implementation)
+{
+  int iter;
+
+  for(iter = 0; iter < IMPLEMENTATIONS_LENGTH; iter++)
+    if((*implementations[iter].probe)(_path, _options, _implementation) == 0)
+      return 0;
+
+  return -1;
+}
+
 static void device_open(void* _object, struct gnufdisk_string* _path)
 {
   struct device_private* private;
   GNUFDISK_RETRY rp0;
-  int iter;
   char* path;
   struct device_implementation device_implementation;
 
@@ -235,11 +367,9 @@ static void device_open(void* _object, struct gnufdisk_string* _path)
 
   GNUFDISK_LOG((DEVICE, "path: %s", path, _object));
 
-  for(iter = 0; iter < IMPLEMENTATIONS_LENGTH; iter++)
-    if((*implementations[iter].probe)(path, &private->options, &device_implementation) == 0)
-      break;
-
-  if(iter == IMPLEMENTATIONS_LENGTH)
+  if((private->options.overlay
+      ? overlay_device_probe(path, &private->options, &device_implementation)
+      : device_probe_implementation(path, &private->options, &device_implementation)) != 0)
     {
       /* retry with a new path */
       union gnufdisk_device_exception_data data;
@@ -269,6 +399,98 @@ static void device_open(void* _object, struct gnufdisk_string* _path)
   GNUFDISK_LOG((DEVICE, "done perform open"));
 }
 
+static void device_identity(void* _object, char* _dest, size_t _size)
+{
+  struct gnufdisk_string* param;
+
+  if((param = gnufdisk_string_new("IDENTITY")) == NULL)
+    THROW_ENOMEM;
+
+  gnufdisk_exception_register_unwind_handler(&delete_string, param);
+
+  device_get_parameter(_object, param, _dest, _size);
+
+  gnufdisk_exception_unregister_unwind_handler(&delete_string, param);
+  gnufdisk_string_delete(param);
+}
+
+/* 0 when the device can not tell that its label changed */
+static gnufdisk_integer device_label_stamp(void* _object)
+{
+  struct gnufdisk_string* param;
+  gnufdisk_integer ret;
+
+  if((param = gnufdisk_string_new("LABEL-STAMP")) == NULL)
+    THROW_ENOMEM;
+
+  gnufdisk_exception_register_unwind_handler(&delete_string, param);
+
+  device_get_parameter(_object, param, &ret, sizeof(ret));
+
+  gnufdisk_exception_unregister_unwind_handler(&delete_string, param);
+  gnufdisk_string_delete(param);
+
+  return ret;
+}
+
+/* NULL when the device has no stable identity to store a cache under, or
+ * no label stamp to validate it with */
+static struct probe_cache* open_probe_cache(void* _object)
+{
+  struct device_private* private;
+  struct probe_cache* ret;
+  char identity[128];
+  gnufdisk_integer stamp;
+  gnufdisk_integer size;
+  void* key;
+
+  GNUFDISK_LOG((DEVICE, "open probe cache for struct object* %p", _object));
+
+  private = object_private(_object, OBJECT_TYPE_DEVICE);
+
+  if(!private->is_open)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL, "device is not open");
+
+  device_identity(_object, identity, sizeof(identity));
+
+  if(*identity == 0)
+    {
+      GNUFDISK_LOG((DEVICE, "no stable identity, probe cache not used"));
+      return NULL;
+    }
+
+  if((stamp = device_label_stamp(_object)) == 0)
+    {
+      GNUFDISK_LOG((DEVICE, "no label stamp, probe cache not used"));
+      return NULL;
+    }
+
+  /* the cache key is the content of the first two sectors (MBR and GPT
+   * header) followed by the label stamp, which covers the EBRs and the
+   * backup GPT header: one read is enough to validate the cached probe */
+  size = 2 * device_sector_size(_object);
+
+  if((key = malloc(size + sizeof(stamp))) == NULL)
+    THROW_ENOMEM;
+
+  gnufdisk_exception_register_unwind_handler(&free, key);
+
+  if((*private->implementation.seek)(private->implementation.private, 0, 0, SEEK_SET) == -1
+     || (*private->implementation.read)(private->implementation.private, key, size) != size)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not read label sectors");
+
+  memcpy((char*) key + size, &stamp, sizeof(stamp));
+
+  ret = probe_cache_new(private->options.cache_dir, identity, key, size + sizeof(stamp));
+
+  gnufdisk_exception_unregister_unwind_handler(&free, key);
+  free(key);
+
+  GNUFDISK_LOG((DEVICE, "done open probe cache, result: %p", ret));
+
+  return ret;
+}
+
 static void device_disklabel(void* _object, struct gnufdisk_disklabel_operations* _operations, void** _specific)
 {
   struct device_private* private;
@@ -279,19 +501,31 @@ static void device_disklabel(void* _object, struct gnufdisk_disklabel_operations
   private = object_private(_object, OBJECT_TYPE_DEVICE);
 
   if(private->disklabel)
+    disklabel = private->disklabel;
+  else
     {
-      object_ref(private->disklabel);
-      memcpy(_operations, &disklabel_operations, sizeof(struct gnufdisk_disklabel_operations));
-      *_specific = private->disklabel;
+      if(private->options.cache_dir
+	 && (private->cache = open_probe_cache(_object)) != NULL)
+	gnufdisk_exception_register_unwind_handler(&release_probe_cache, private);
+
+      if((disklabel = disklabel_probe(_object)) == NULL)
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOTSUP, NULL, "unsupported disklabel type");
+
+      if(private->cache)
+	{
+	  probe_cache_save(private->cache);
+
+	  gnufdisk_exception_unregister_unwind_handler(&release_probe_cache, private);
+	  release_probe_cache(private);
+	}
+
+      private->disklabel = disklabel;
     }
-  else if((disklabel = disklabel_probe(_object)) == NULL)
-    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOTSUP, NULL, "unsupported disklabel type");
 
   memcpy(_operations, &disklabel_operations, sizeof(struct gnufdisk_disklabel_operations));
   *_specific = disklabel;
 
-  object_ref(disklabel);
-  private->disklabel = disklabel;
+  object_export(disklabel);
 
   GNUFDISK_LOG((DEVICE, "done perform disklabel"));
 }
@@ -317,7 +551,7 @@ static void device_create_disklabel(void* _object, struct gnufdisk_string* _syst
       private->disklabel = NULL;
     }
 
-  object_ref(disklabel);
+  object_export(disklabel);
   private->disklabel = disklabel;
 
   memcpy(_operations, &disklabel_operations, sizeof(struct gnufdisk_disklabel_operations));
@@ -356,28 +590,214 @@ void device_get_parameter(void* _object, struct gnufdisk_string* _param, void* _
 
   device_private_check(private);
 
-  if(gnufdisk_check_memory(private->implementation.get_parameter, 1, 1) != 0)
-    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL, "device implementation does not support `get_parameter'");
+  /* the topology, in bytes, whatever the implementation */
+  if(strcasecmp(gnufdisk_string_c_string(_param), "MINIMUM-ALIGNMENT") == 0
+     || strcasecmp(gnufdisk_string_c_string(_param), "OPTIMAL-ALIGNMENT") == 0)
+    {
+      if(_size != sizeof(gnufdisk_integer))
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETERSIZE, NULL, "invalid parameter size");
 
-  (*private->implementation.get_parameter)(private->implementation.private, _param, _dest, _size);
+      if(strcasecmp(gnufdisk_string_c_string(_param), "MINIMUM-ALIGNMENT") == 0)
+	*(gnufdisk_integer*) _dest = device_minimum_alignment(_object);
+      else
+	*(gnufdisk_integer*) _dest = device_optimal_alignment(_object);
+    }
+  else if(strcasecmp(gnufdisk_string_c_string(_param), "TRIMMED") == 0)
+    {
+      if(_size != sizeof(gnufdisk_integer))
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETERSIZE, NULL, "invalid parameter size");
+
+      *(gnufdisk_integer*) _dest = private->trimmed;
+    }
+  else
+    {
+      if(gnufdisk_check_memory(private->implementation.get_parameter, 1, 1) != 0)
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL, "device implementation does not support `get_parameter'");
+
+      (*private->implementation.get_parameter)(private->implementation.private, _param, _dest, _size);
+    }
 
   GNUFDISK_LOG((DEVICE, "done perform get_parameter"));
 }
 
+/* the partitions of the committed label, numbered the way the kernel
+ * numbers them */
+struct kernel_partitions {
+  struct object* disklabel;
+  gnufdisk_integer sector_size;
+  struct device_partition* partitions;
+  size_t count;
+  size_t size;
+  int logical; /* number of the next logical partition */
+  int gpt; /* a GUID partition table hides the MBR partitions */
+};
+
+static void free_kernel_partitions(void* _p)
+{
+  struct kernel_partitions* state;
+
+  state = _p;
+
+  free(state->partitions);
+}
+
+static void add_kernel_partition(struct kernel_partitions* _state, int _number, gnufdisk_integer _start, gnufdisk_integer _length)
+{
+  if(_state->count == _state->size)
+    {
+      size_t size;
+      void* partitions;
+
+      size = _state->size > 0 ? _state->size * 2 : 16;
+
+      if((partitions = realloc(_state->partitions, size * sizeof(struct device_partition))) == NULL)
+	THROW_ENOMEM;
+
+      _state->partitions = partitions;
+      _state->size = size;
+    }
+
+  GNUFDISK_LOG((DEVICE, "kernel partition %d: start %" PRId64 ", length %" PRId64, _number, _start, _length));
+
+  _state->partitions[_state->count].number = _number;
+  _state->partitions[_state->count].start = _start;
+  _state->partitions[_state->count].length = _length;
+  _state->count++;
+}
+
+static void collect_kernel_partition(struct object* _partition, void* _data)
+{
+  struct kernel_partitions* state;
+  struct gnufdisk_string* type;
+  struct object* disklabel;
+  gnufdisk_integer start;
+  gnufdisk_integer length;
+  int number;
+
+  state = _data;
+
+  type = (*partition_operations.type)(_partition);
+  gnufdisk_exception_register_unwind_handler(&delete_string, type);
+
+  number = disklabel_partition_number(state->disklabel, _partition);
+  start = object_start(_partition) * state->sector_size;
+  length = (object_end(_partition) - object_start(_partition) + 1) * state->sector_size;
+  disklabel = partition_get_disklabel(_partition);
+
+  if(strcmp(gnufdisk_string_c_string(type), "GUID") == 0)
+    {
+      /* the kernel reads the GPT behind a protective MBR and ignores the MBR */
+      if(disklabel != NULL && state->gpt == 0)
+	{
+	  struct object* parent;
+
+	  state->count = 0;
+	  state->gpt = 1;
+
+	  parent = state->disklabel;
+	  state->disklabel = disklabel;
+	  disklabel_enumerate_partitions(disklabel, NULL, NULL, &collect_kernel_partition, state);
+	  state->disklabel = parent;
+	}
+    }
+  else if(state->gpt)
+    ;
+  else if(strncmp(gnufdisk_string_c_string(type), "EXTENDED", 8) == 0)
+    {
+      gnufdisk_integer head;
+
+      /* the kernel maps only the first 1KiB (or sector) of an extended partition */
+      head = state->sector_size > 1024 ? state->sector_size : 1024;
+
+      add_kernel_partition(state, number, start, length < head ? length : head);
+
+      if(disklabel != NULL)
+	{
+	  struct object* parent;
+
+	  parent = state->disklabel;
+	  state->disklabel = disklabel;
+	  disklabel_enumerate_partitions(disklabel, NULL, NULL, &collect_kernel_partition, state);
+	  state->disklabel = parent;
+	}
+    }
+  else if(strcmp(gnufdisk_string_c_string(type), "LOGICAL") == 0)
+    add_kernel_partition(state, state->logical++, start, length);
+  else
+    add_kernel_partition(state, number, start, length);
+
+  gnufdisk_exception_unregister_unwind_handler(&delete_string, type);
+  gnufdisk_string_delete(type);
+}
+
+/* tell the kernel about the committed partitions */
+static void device_update_partitions(void* _object)
+{
+  struct device_private* private;
+  struct kernel_partitions state;
+
+  GNUFDISK_LOG((DEVICE, "perform update_partitions on struct object* %p", _object));
+
+  private = object_private(_object, OBJECT_TYPE_DEVICE);
+
+  memset(&state, 0, sizeof(state));
+  state.disklabel = private->disklabel;
+  state.sector_size = device_sector_size(_object);
+  state.logical = 5;
+
+  gnufdisk_exception_register_unwind_handler(&free_kernel_partitions, &state);
+
+  disklabel_enumerate_partitions(private->disklabel, NULL, NULL, &collect_kernel_partition, &state);
+
+  (*private->implementation.update_partitions)(private->implementation.private, state.partitions, state.count);
+
+  gnufdisk_exception_unregister_unwind_handler(&free_kernel_partitions, &state);
+
+  free(state.partitions);
+
+  GNUFDISK_LOG((DEVICE, "done perform update_partitions"));
+}
+
 static void device_commit(void* _object)
 {
   struct device_private* private;
+  unsigned long long start;
 
   GNUFDISK_LOG((DEVICE, "perform commit on struct object* %p", _object));
 
+  start = gnufdisk_stats_clock();
+
   private = object_private(_object, OBJECT_TYPE_DEVICE);
 
-  if(gnufdisk_check_memory(private->implementation.commit, 1, 1) == 0)
-    (*private->implementation.commit)(private->implementation.private);
+  if(private->options.cache_dir)
+    {
+      char identity[128];
+
+      /* whatever we write, the cached probe no longer describes the device */
+      device_identity(_object, identity, sizeof(identity));
+
+      if(*identity != 0)
+	probe_cache_invalidate(private->options.cache_dir, identity);
+    }
+
+  /* discard and wipe before the new table is written: a label written by
+   * the commit may sit inside a wiped range (EBRs in an extended partition) */
+  device_flush_trims(_object);
 
   if(gnufdisk_check_memory(private->disklabel, 1, 1) == 0)
     disklabel_commit(private->disklabel);
 
+  /* last: the implementation makes durable what the label wrote, and a
+   * failure to do so fails the commit */
+  if(gnufdisk_check_memory(private->implementation.commit, 1, 1) == 0)
+    (*private->implementation.commit)(private->implementation.private);
+
+  if(gnufdisk_check_memory(private->disklabel, 1, 1) == 0
+     && gnufdisk_check_memory(private->implementation.update_partitions, 1, 1) == 0)
+    device_update_partitions(_object);
+
+  gnufdisk_stats_record(GNUFDISK_STATS_DEVICE_COMMIT, start, 0);
+
   GNUFDISK_LOG((DEVICE, "done perform commit"));
 }
 
@@ -401,6 +821,36 @@ static void device_close(void* _object)
   memset(&private->implementation, 0, sizeof(struct device_implementation));
   private->is_open = 0;
 
+  if(private->ntrims > 0)
+    GNUFDISK_LOG((DEVICE, "drop %zu uncommitted discard/wipe ranges", private->ntrims));
+
+  free(private->trims);
+  private->trims = NULL;
+  private->ntrims = 0;
+  private->trimmed = 0;
+
+  if(private->disklabel && arena_exported(private->arena) == 0)
+    {
+      /* nothing outside the device points into the label tree: drop the
+       * arena slabs in one step instead of deleting object by object. The
+       * top disklabel held a reference on the device */
+      GNUFDISK_LOG((DEVICE, "release disklabel arena"));
+
+      arena_clear(private->arena);
+      private->disklabel = NULL;
+
+      object_delete(_object);
+    }
+  else if(private->disklabel)
+    {
+      /* the frontend still holds part of the tree: the last reference
+       * frees it */
+      GNUFDISK_LOG((DEVICE, "release disklabel"));
+
+      object_delete(private->disklabel);
+      private->disklabel = NULL;
+    }
+
   GNUFDISK_LOG((DEVICE, "done perform close"));
 }
 
@@ -439,9 +889,12 @@ gnufdisk_integer device_seek(void* _object, gnufdisk_integer _lba, gnufdisk_inte
 {
   struct device_private* private;
   gnufdisk_integer ret;
+  unsigned long long start;
 
   GNUFDISK_LOG((DEVICE, "perform seek on struct object* %p", _object));
 
+  start = gnufdisk_stats_clock();
+
   private = object_private(_object, OBJECT_TYPE_DEVICE);
 
   if(gnufdisk_check_memory(private->implementation.seek, 1, 1) != 0)
@@ -449,6 +902,10 @@ gnufdisk_integer device_seek(void* _object, gnufdisk_integer _lba, gnufdisk_inte
  
   ret = (*private->implementation.seek)(private->implementation.private, _lba, _offset, _whence);
 
+  private->position = ret;
+
+  gnufdisk_stats_record(GNUFDISK_STATS_DEVICE_SEEK, start, 0);
+
   GNUFDISK_LOG((DEVICE, "done perform seek, result: %" PRId64, ret));
 
   return ret;
@@ -458,15 +915,37 @@ gnufdisk_integer device_read(void* _object, void* _buf, size_t _size)
 {
   struct device_private* private;
   gnufdisk_integer ret;
+  unsigned long long start;
 
   GNUFDISK_LOG((DEVICE, "perform read on struct object* %p", _object));
 
+  start = gnufdisk_stats_clock();
+
   private = object_private(_object, OBJECT_TYPE_DEVICE);
 
   if(gnufdisk_check_memory(private->implementation.read, 1, 1) != 0)
     GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL, "device_implementation does not support `read'");
   
-  ret = (*private->implementation.read)(private->implementation.private, _buf, _size);
+  if(private->cache && probe_cache_lookup(private->cache, private->position, _buf, _size) == 0)
+    {
+      /* keep the file offset where a real read would have left it */
+      if((*private->implementation.seek)(private->implementation.private, 0, private->position + _size, SEEK_SET) == -1)
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not seek device");
+
+      ret = _size;
+    }
+  else
+    {
+      ret = (*private->implementation.read)(private->implementation.private, _buf, _size);
+
+      if(private->cache && ret == _size)
+	probe_cache_record(private->cache, private->position, _buf, _size);
+    }
+
+  if(ret > 0)
+    private->position += ret;
+
+  gnufdisk_stats_record(GNUFDISK_STATS_DEVICE_READ, start, ret > 0 ? ret : 0);
 
   GNUFDISK_LOG((DEVICE, "done perform read, result: %" PRId64, ret));
 
@@ -477,21 +956,488 @@ gnufdisk_integer device_write(void* _object, const void* _buf, size_t _size)
 {
   struct device_private* private;
   gnufdisk_integer ret;
+  unsigned long long start;
 
   GNUFDISK_LOG((DEVICE, "perform write on struct object* %p", _object));
 
+  start = gnufdisk_stats_clock();
+
   private = object_private(_object, OBJECT_TYPE_DEVICE);
 
   if(gnufdisk_check_memory(private->implementation.write, 1, 1) != 0)
     GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL, "device_implementation does not support `write'");
+
+  if(private->ntrims > 0 && _size > 0)
+    {
+      gnufdisk_integer sector_size;
+      gnufdisk_integer position;
+
+      /* pending ranges must not erase data written after they were
+       * scheduled. The discards of removed partitions wait for the commit,
+       * the old disklabel may still list them: drop the written sectors
+       * from them. A wipe of a new partition is run now */
+      position = private->position;
+      sector_size = device_sector_size(_object);
+
+      device_cancel_discard(_object, position / sector_size, (position + _size - 1) / sector_size);
+      device_flush_wipes(_object, position / sector_size, (position + _size - 1) / sector_size);
+
+      if(private->position != position
+	 && device_seek(_object, 0, position, SEEK_SET) == -1)
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not seek device");
+    }
   
   ret = (*private->implementation.write)(private->implementation.private, _buf, _size);
 
+  if(ret > 0)
+    private->position += ret;
+
+  gnufdisk_stats_record(GNUFDISK_STATS_DEVICE_WRITE, start, ret > 0 ? ret : 0);
+
   GNUFDISK_LOG((DEVICE, "done perform write, result: %" PRId64, ret));
 
   return ret;
 }
 
+gnufdisk_integer device_pread(void* _object, gnufdisk_integer _lba, void* _buf, size_t _size)
+{
+  struct device_private* private;
+  gnufdisk_integer ret;
+  unsigned long long start;
+
+  GNUFDISK_LOG((DEVICE, "perform pread on struct object* %p", _object));
+
+  start = gnufdisk_stats_clock();
+
+  private = object_private(_object, OBJECT_TYPE_DEVICE);
+
+  /* no fall back to seek and read: callers rely on the file offset being
+   * left alone */
+  if(gnufdisk_check_memory(private->implementation.pread, 1, 1) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOTSUP, NULL, "device_implementation does not support `pread'");
+
+  ret = (*private->implementation.pread)(private->implementation.private, _lba, _buf, _size);
+
+  gnufdisk_stats_record(GNUFDISK_STATS_DEVICE_READ, start, ret > 0 ? ret : 0);
+
+  GNUFDISK_LOG((DEVICE, "done perform pread, result: %" PRId64, ret));
+
+  return ret;
+}
+
+gnufdisk_integer device_seek_data(void* _object, gnufdisk_integer _lba, gnufdisk_integer _end, int _whence)
+{
+  struct device_private* private;
+  gnufdisk_integer ret;
+
+  GNUFDISK_LOG((DEVICE, "perform seek_data on struct object* %p", _object));
+  GNUFDISK_LOG((DEVICE, "lba: %" PRId64 ", end: %" PRId64 ", whence: %d", _lba, _end, _whence));
+
+  private = object_private(_object, OBJECT_TYPE_DEVICE);
+
+  /* a device that can not tell holes from data is all data */
+  if(gnufdisk_check_memory(private->implementation.seek_data, 1, 1) != 0)
+    ret = _whence == SEEK_DATA ? _lba : _end;
+  else if((ret = (*private->implementation.seek_data)(private->implementation.private, _lba, _whence)) == -1)
+    {
+      if(errno == ENXIO)
+	ret = _end;
+      else if(errno == EINVAL || errno == EOPNOTSUPP)
+	ret = _whence == SEEK_DATA ? _lba : _end;
+      else
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not seek %s: %s", 
+		       _whence == SEEK_DATA ? "data" : "hole", strerror(errno));
+    }
+
+  if(ret > _end)
+    ret = _end;
+
+  GNUFDISK_LOG((DEVICE, "done perform seek_data, result: %" PRId64, ret));
+
+  return ret;
+}
+
+#define ZERO_BUFFER_SIZE 1048576
+
+void device_zero(void* _object, gnufdisk_integer _lba, gnufdisk_integer _count)
+{
+  struct device_private* private;
+  gnufdisk_integer sector_size;
+  gnufdisk_integer chunk;
+  void* buf;
+
+  GNUFDISK_LOG((DEVICE, "perform zero on struct object* %p", _object));
+  GNUFDISK_LOG((DEVICE, "lba: %" PRId64 ", count: %" PRId64, _lba, _count));
+
+  private = object_private(_object, OBJECT_TYPE_DEVICE);
+
+  if(gnufdisk_check_memory(private->implementation.zero, 1, 1) == 0)
+    {
+      if((*private->implementation.zero)(private->implementation.private, _lba, _count) == 0)
+	{
+	  GNUFDISK_LOG((DEVICE, "done perform zero"));
+	  return;
+	}
+      else if(errno != EOPNOTSUPP)
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not zero device: %s", strerror(errno));
+    }
+
+  GNUFDISK_LOG((DEVICE, "fall back to writing zeros"));
+
+  sector_size = device_sector_size(_object);
+  chunk = ZERO_BUFFER_SIZE / sector_size > 0 ? ZERO_BUFFER_SIZE / sector_size : 1;
+
+  if((buf = calloc(chunk, sector_size)) == NULL)
+    THROW_ENOMEM;
+
+  gnufdisk_exception_register_unwind_handler(&free, buf);
+
+  if(device_seek(_object, _lba, 0, SEEK_SET) == -1)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not seek device");
+
+  while(_count > 0)
+    {
+      gnufdisk_integer n;
+
+      n = _count < chunk ? _count : chunk;
+
+      if(device_write(_object, buf, n * sector_size) != n * sector_size)
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not write zeros");
+
+      _count -= n;
+    }
+
+  gnufdisk_exception_unregister_unwind_handler(&free, buf);
+  free(buf);
+
+  GNUFDISK_LOG((DEVICE, "done perform zero"));
+}
+
+#ifdef GNUFDISK_DEBUG
+static const char* trim_action_name[] = {
+  [DEVICE_TRIM_DISCARD] = "discard",
+  [DEVICE_TRIM_ZEROOUT] = "zeroout",
+  [DEVICE_TRIM_SECDISCARD] = "secdiscard"
+};
+#endif /* GNUFDISK_DEBUG */
+
+static void device_schedule(void* _object, gnufdisk_integer _start, gnufdisk_integer _end, enum device_trim_action _action)
+{
+  struct device_private* private;
+  struct device_trim* trims;
+
+  GNUFDISK_LOG((DEVICE, "schedule %s of sectors %" PRId64 "-%" PRId64, trim_action_name[_action], _start, _end));
+
+  private = object_private(_object, OBJECT_TYPE_DEVICE);
+
+  if(_end < _start)
+    return;
+
+  if((trims = realloc(private->trims, (private->ntrims + 1) * sizeof(struct device_trim))) == NULL)
+    THROW_ENOMEM;
+
+  trims[private->ntrims].lba = _start;
+  trims[private->ntrims].count = _end - _start + 1;
+  trims[private->ntrims].action = _action;
+
+  private->trims = trims;
+  private->ntrims++;
+}
+
+void device_schedule_discard(void* _object, gnufdisk_integer _start, gnufdisk_integer _end)
+{
+  struct device_private* private;
+
+  private = object_private(_object, OBJECT_TYPE_DEVICE);
+
+  if(private->options.discard)
+    device_schedule(_object, _start, _end, DEVICE_TRIM_DISCARD);
+}
+
+void device_schedule_wipe(void* _object, gnufdisk_integer _start, gnufdisk_integer _end)
+{
+  struct device_private* private;
+
+  private = object_private(_object, OBJECT_TYPE_DEVICE);
+
+  if(private->options.wipe == WIPE_ZEROOUT)
+    device_schedule(_object, _start, _end, DEVICE_TRIM_ZEROOUT);
+  else if(private->options.wipe == WIPE_SECDISCARD)
+    device_schedule(_object, _start, _end, DEVICE_TRIM_SECDISCARD);
+}
+
+/* A partition created over the range of a removed one keeps its data: drop
+ * the part of every pending discard inside [_start, _end]. Wipes stay, they
+ * were asked for the partitions being created. */
+void device_cancel_discard(void* _object, gnufdisk_integer _start, gnufdisk_integer _end)
+{
+  struct device_private* private;
+  size_t iter;
+
+  private = object_private(_object, OBJECT_TYPE_DEVICE);
+
+  iter = 0;
+
+  while(iter < private->ntrims)
+    {
+      struct device_trim* trim;
+      gnufdisk_integer first;
+      gnufdisk_integer last;
+
+      trim = &private->trims[iter];
+      first = trim->lba;
+      last = trim->lba + trim->count - 1;
+
+      if(trim->action != DEVICE_TRIM_DISCARD || last < _start || first > _end)
+	{
+	  iter++;
+	  continue;
+	}
+
+      GNUFDISK_LOG((DEVICE, "cancel discard of sectors %" PRId64 "-%" PRId64 " inside %" PRId64 "-%" PRId64,
+		    first, last, _start, _end));
+
+      if(first < _start && last > _end)
+	{
+	  struct device_trim* trims;
+
+	  /* split: the tail becomes a new entry, visited later by the loop */
+	  if((trims = realloc(private->trims, (private->ntrims + 1) * sizeof(struct device_trim))) == NULL)
+	    THROW_ENOMEM;
+
+	  private->trims = trims;
+	  trim = &trims[iter];
+
+	  trims[private->ntrims].lba = _end + 1;
+	  trims[private->ntrims].count = last - _end;
+	  trims[private->ntrims].action = DEVICE_TRIM_DISCARD;
+	  private->ntrims++;
+
+	  trim->count = _start - first;
+	}
+      else if(first < _start)
+	trim->count = _start - first;
+      else if(last > _end)
+	{
+	  trim->lba = _end + 1;
+	  trim->count = last - _end;
+	}
+      else
+	{
+	  memmove(trim, trim + 1, (private->ntrims - iter - 1) * sizeof(struct device_trim));
+	  private->ntrims--;
+	  continue;
+	}
+
+      iter++;
+    }
+}
+
+#define DISCARD_CHUNK_SIZE 1073741824 /* bytes per discard request */
+
+/* Discard the part of the range aligned to the discard granularity; the
+ * device ignores (or rejects) partial units, so the unaligned head and tail
+ * are left to the caller. Return -1 when the device can not discard. */
+static int device_discard(void* _object, 
+			  gnufdisk_integer _lba, 
+			  gnufdisk_integer _count, 
+			  int _secure, 
+			  gnufdisk_integer* _head, 
+			  gnufdisk_integer* _tail)
+{
+  struct device_private* private;
+  gnufdisk_integer sector_size;
+  gnufdisk_integer grain;
+  gnufdisk_integer chunk;
+  gnufdisk_integer first;
+  gnufdisk_integer last;
+  gnufdisk_integer lba;
+
+  GNUFDISK_LOG((DEVICE, "perform discard on struct object* %p", _object));
+  GNUFDISK_LOG((DEVICE, "lba: %" PRId64 ", count: %" PRId64 ", secure: %d", _lba, _count, _secure));
+
+  private = object_private(_object, OBJECT_TYPE_DEVICE);
+
+  if(gnufdisk_check_memory(private->implementation.discard, 1, 1) != 0)
+    {
+      GNUFDISK_LOG((DEVICE, "device implementation does not support `discard'"));
+      return -1;
+    }
+
+  sector_size = device_sector_size(_object);
+  grain = 1;
+
+  if(gnufdisk_check_memory(private->implementation.discard_granularity, 1, 1) == 0)
+    grain = (*private->implementation.discard_granularity)(private->implementation.private) / sector_size;
+
+  if(grain < 1)
+    grain = 1;
+
+  first = math_round_up(_lba, grain);
+  last = math_round_down(_lba + _count, grain);
+
+  if(last <= first)
+    {
+      GNUFDISK_LOG((DEVICE, "range smaller than discard granularity %" PRId64, grain));
+
+      *_head = _count;
+      *_tail = 0;
+
+      return 0;
+    }
+
+  *_head = first - _lba;
+  *_tail = _lba + _count - last;
+
+  chunk = math_round_down(DISCARD_CHUNK_SIZE / sector_size, grain);
+
+  if(chunk < grain)
+    chunk = grain;
+
+  for(lba = first; lba < last; lba += chunk)
+    {
+      gnufdisk_integer n;
+
+      n = last - lba < chunk ? last - lba : chunk;
+
+      if((*private->implementation.discard)(private->implementation.private, lba, n, _secure) != 0)
+	{
+	  if(errno == EOPNOTSUPP && lba == first)
+	    {
+	      GNUFDISK_LOG((DEVICE, "device can not discard"));
+	      return -1;
+	    }
+
+	  GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not discard device: %s", strerror(errno));
+	}
+    }
+
+  GNUFDISK_LOG((DEVICE, "done perform discard, head: %" PRId64 ", tail: %" PRId64, *_head, *_tail));
+
+  return 0;
+}
+
+static void device_trim_run(void* _object, struct device_trim* _trim)
+{
+  gnufdisk_integer head;
+  gnufdisk_integer tail;
+
+  GNUFDISK_LOG((DEVICE, "%s sectors %" PRId64 "-%" PRId64, 
+		trim_action_name[_trim->action], _trim->lba, _trim->lba + _trim->count - 1));
+
+  switch(_trim->action)
+    {
+    case DEVICE_TRIM_DISCARD:
+      /* the data of a removed partition is garbage: when the device can
+       * not discard there is nothing worth writing */
+      if(device_discard(_object, _trim->lba, _trim->count, 0, &head, &tail) != 0)
+	GNUFDISK_LOG((DEVICE, "discard not supported, skip"));
+      break;
+    case DEVICE_TRIM_ZEROOUT:
+      device_zero(_object, _trim->lba, _trim->count);
+      break;
+    case DEVICE_TRIM_SECDISCARD:
+      if(device_discard(_object, _trim->lba, _trim->count, 1, &head, &tail) != 0)
+	{
+	  GNUFDISK_LOG((DEVICE, "secure discard not supported, zero out"));
+	  device_zero(_object, _trim->lba, _trim->count);
+	}
+      else
+	{
+	  if(head > 0)
+	    device_zero(_object, _trim->lba, head);
+
+	  if(tail > 0)
+	    device_zero(_object, _trim->lba + _trim->count - tail, tail);
+	}
+      break;
+    }
+}
+
+static void device_flush_trims(void* _object)
+{
+  struct device_private* private;
+  struct device_trim* trims;
+  size_t ntrims;
+  size_t iter;
+
+  private = object_private(_object, OBJECT_TYPE_DEVICE);
+
+  if(private->ntrims == 0)
+    return;
+
+  GNUFDISK_LOG((DEVICE, "perform flush_trims on struct object* %p", _object));
+
+  /* detach the list: the writes issued below must not flush it again */
+  trims = private->trims;
+  ntrims = private->ntrims;
+
+  private->trims = NULL;
+  private->ntrims = 0;
+
+  gnufdisk_exception_register_unwind_handler(&free, trims);
+
+  /* counted before: a failure may leave any part of the range erased */
+  for(iter = 0; iter < ntrims; iter++)
+    {
+      private->trimmed += trims[iter].count;
+      device_trim_run(_object, &trims[iter]);
+    }
+
+  gnufdisk_exception_unregister_unwind_handler(&free, trims);
+  free(trims);
+
+  GNUFDISK_LOG((DEVICE, "done perform flush_trims"));
+}
+
+/* Run now the wipes overlapping [_start, _end], leave the rest to the commit */
+static void device_flush_wipes(void* _object, gnufdisk_integer _start, gnufdisk_integer _end)
+{
+  struct device_private* private;
+  struct device_trim* wipes;
+  size_t nwipes;
+  size_t iter;
+
+  private = object_private(_object, OBJECT_TYPE_DEVICE);
+
+  if((wipes = malloc(private->ntrims * sizeof(struct device_trim))) == NULL)
+    THROW_ENOMEM;
+
+  /* detach them: the writes issued below must not run them again */
+  for(iter = 0, nwipes = 0; iter < private->ntrims; )
+    {
+      struct device_trim* trim;
+
+      trim = &private->trims[iter];
+
+      if(trim->action == DEVICE_TRIM_DISCARD
+	 || trim->lba + trim->count - 1 < _start
+	 || trim->lba > _end)
+	{
+	  iter++;
+	  continue;
+	}
+
+      wipes[nwipes++] = *trim;
+      memmove(trim, trim + 1, (private->ntrims - iter - 1) * sizeof(struct device_trim));
+      private->ntrims--;
+    }
+
+  if(nwipes > 0)
+    GNUFDISK_LOG((DEVICE, "write overlaps %zu pending wipes, run them", nwipes));
+
+  gnufdisk_exception_register_unwind_handler(&free, wipes);
+
+  for(iter = 0; iter < nwipes; iter++)
+    {
+      private->trimmed += wipes[iter].count;
+      device_trim_run(_object, &wipes[iter]);
+    }
+
+  gnufdisk_exception_unregister_unwind_handler(&free, wipes);
+  free(wipes);
+}
+
 gnufdisk_integer device_sector_size(void* _object)
 {
   struct device_private* private;
@@ -549,6 +1495,16 @@ gnufdisk_integer device_optimal_alignment(void* _object)
   return ret;
 }
 
+struct arena* device_arena(void* _object)
+{
+  struct device_private* private;
+
+  private = object_private(_object, OBJECT_TYPE_DEVICE);
+
+  device_private_check(private);
+
+  return private->arena;
+}
 
 /* main module entry point */
 void module_register(struct gnufdisk_string* _options,
@@ -568,12 +1524,16 @@ void module_register(struct gnufdisk_string* _options,
   memset(dev, 0, sizeof(struct device_private));
 
   parse_module_options(gnufdisk_string_c_string(_options), &dev->options);
+
+  dev->arena = arena_new();
+  gnufdisk_exception_register_unwind_handler(&delete_arena, dev->arena);
   
-  object = object_new(OBJECT_TYPE_DEVICE, &device_private_operations, dev);
+  object = object_new(NULL, OBJECT_TYPE_DEVICE, &device_private_operations, dev);
 
   memcpy(_ops, &device_operations, sizeof(struct gnufdisk_device_operations));
   *_spec = object;
 
+  gnufdisk_exception_unregister_unwind_handler(&delete_arena, dev->arena);
   gnufdisk_exception_unregister_unwind_handler(&free, dev);
 
   GNUFDISK_LOG((DEVICE, "new device object allocated at %p", object));
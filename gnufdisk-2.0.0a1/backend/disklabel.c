@@ -87,7 +87,7 @@ static void disklabel_private_delete(void* _private)
 
   memset(private, 0, sizeof(struct disklabel_private));
 
-  free(private);
+  arena_free(private);
 
   GNUFDISK_LOG((DISKLABEL, "done perform delete"));
 }
@@ -103,9 +103,12 @@ static struct object_private_operations disklabel_private_operations = {
 void disklabel_commit(struct object* _object)
 {
   struct disklabel_private* private;
+  unsigned long long start;
 
   GNUFDISK_LOG((DISKLABEL, "perform commit on struct object* %p", _object));
 
+  start = gnufdisk_stats_clock();
+
   private = object_private(_object, OBJECT_TYPE_DISKLABEL);
 
   disklabel_private_check(private);
@@ -115,6 +118,8 @@ void disklabel_commit(struct object* _object)
 
   (*private->implementation.commit)(private->implementation.private);
 
+  gnufdisk_stats_record(GNUFDISK_STATS_DISKLABEL_COMMIT, start, 0);
+
   GNUFDISK_LOG((DISKLABEL, "done perform commit"));
 }
 
@@ -161,34 +166,79 @@ int disklabel_partition_number(void* _object, struct object* _partition)
   return ret;
 }
 
+/* the boundary nearest to the middle of _range on the first of the _ngrains
+ * grains having one inside it, on single sectors if none has. An end is the
+ * sector before a boundary, so that the next partition can start aligned
+ * right after it. The grain used goes to _grain when not NULL. */
+gnufdisk_integer disklabel_align(struct gnufdisk_geometry* _range,
+				 const gnufdisk_integer* _grains,
+				 int _ngrains,
+				 int _end,
+				 gnufdisk_integer* _grain)
+{
+  gnufdisk_integer middle;
+  gnufdisk_integer grain;
+  gnufdisk_integer ret;
+  int iter;
+
+  middle = gnufdisk_geometry_start(_range) + gnufdisk_geometry_length(_range) / 2 + (_end ? 1 : 0);
+
+  for(iter = 0; ; iter++)
+    {
+      grain = iter < _ngrains && _grains[iter] > 0 ? _grains[iter] : 1;
+      ret = math_round(middle, grain) - (_end ? 1 : 0);
+
+      if(iter >= _ngrains
+	 || (ret >= gnufdisk_geometry_start(_range) && ret <= gnufdisk_geometry_end(_range)))
+	break;
+    }
+
+  GNUFDISK_LOG((DISKLABEL, "aligned %" PRId64 " on %" PRId64 " sectors: %" PRId64, middle, grain, ret));
+
+  if(_grain)
+    *_grain = grain;
+
+  return ret;
+}
+
 struct object* disklabel_probe(struct object* _parent)
 {
   struct disklabel_private* private;
   struct object* ret;
+  unsigned long long start;
   int err;
 
   GNUFDISK_LOG((DISKLABEL, "probe disklabel using struct object* %p", _parent));
 
-  if((private = malloc(sizeof(struct disklabel_private))) == NULL)
-    THROW_ENOMEM;
+  private = arena_alloc(object_arena(_parent), sizeof(struct disklabel_private));
   
-  gnufdisk_exception_register_unwind_handler(&free, private);
+  gnufdisk_exception_register_unwind_handler(&arena_free, private);
 
-  ret = object_new(OBJECT_TYPE_DISKLABEL, &disklabel_private_operations, private);
+  ret = object_new(object_arena(_parent), OBJECT_TYPE_DISKLABEL, &disklabel_private_operations, private);
   gnufdisk_exception_register_unwind_handler(&delete_object, ret);
 
-  gnufdisk_exception_unregister_unwind_handler(&free, private); /* avoid double free */
+  gnufdisk_exception_unregister_unwind_handler(&arena_free, private); /* avoid double free */
 
   object_ref(_parent);
   private->parent = _parent;
 
   err = 0;
 
-  if(mbr_probe(ret, &private->implementation) != 0
-     && gpt_probe(ret, &private->implementation) != 0)
+  start = gnufdisk_stats_clock();
+
+  if(mbr_probe(ret, &private->implementation) != 0)
     {
-      err = 1;
+      gnufdisk_stats_record(GNUFDISK_STATS_PROBE_MBR, start, 0);
+
+      start = gnufdisk_stats_clock();
+
+      if(gpt_probe(ret, &private->implementation) != 0)
+	err = 1;
+
+      gnufdisk_stats_record(GNUFDISK_STATS_PROBE_GPT, start, 0);
     }
+  else
+    gnufdisk_stats_record(GNUFDISK_STATS_PROBE_MBR, start, 0);
   
   gnufdisk_exception_unregister_unwind_handler(&delete_object, ret);
 
@@ -210,15 +260,14 @@ struct object* disklabel_new_with_implementation(struct object* _parent, struct
 
   GNUFDISK_LOG((DISKLABEL, "create new disklabel using struct object* %p as parent", _parent));
 
-  if((private = malloc(sizeof(struct disklabel_private))) == NULL)
-    THROW_ENOMEM;
+  private = arena_alloc(object_arena(_parent), sizeof(struct disklabel_private));
   
-  gnufdisk_exception_register_unwind_handler(&free, private);
+  gnufdisk_exception_register_unwind_handler(&arena_free, private);
 
-  ret = object_new(OBJECT_TYPE_DISKLABEL, &disklabel_private_operations, private);
+  ret = object_new(object_arena(_parent), OBJECT_TYPE_DISKLABEL, &disklabel_private_operations, private);
   gnufdisk_exception_register_unwind_handler(&delete_object, ret);
 
-  gnufdisk_exception_unregister_unwind_handler(&free, private); /* avoid double free */
+  gnufdisk_exception_unregister_unwind_handler(&arena_free, private); /* avoid double free */
 
   object_ref(_parent);
   private->parent = _parent;
@@ -241,15 +290,17 @@ struct object* disklabel_new(struct object* _parent, struct gnufdisk_string* _sy
 
   GNUFDISK_LOG((DISKLABEL, "create new disklabel using struct object* %p as parent", _parent));
 
-  if((private = malloc(sizeof(struct disklabel_private))) == NULL)
-    THROW_ENOMEM;
+  private = arena_alloc(object_arena(_parent), sizeof(struct disklabel_private));
 
-  gnufdisk_exception_register_unwind_handler(&free, private);
+  gnufdisk_exception_register_unwind_handler(&arena_free, private);
 
-  ret = object_new(OBJECT_TYPE_DISKLABEL, &disklabel_private_operations, private);
+  ret = object_new(object_arena(_parent), OBJECT_TYPE_DISKLABEL, &disklabel_private_operations, private);
 
   gnufdisk_exception_register_unwind_handler(&delete_object, ret);
-  gnufdisk_exception_unregister_unwind_handler(&free, private);
+  gnufdisk_exception_unregister_unwind_handler(&arena_free, private);
+
+  object_ref(_parent);
+  private->parent = _parent;
 
   system = NULL;
 
@@ -353,7 +404,7 @@ static void disklabel_partition(void* _object, size_t _number, struct gnufdisk_p
 
   object = (*private->implementation.partition)(private->implementation.private, _number);
 
-  object_ref(object);
+  object_export(object);
 
   memcpy(_operations, &partition_operations, sizeof(struct gnufdisk_partition_operations));
   *_specific = object;
@@ -405,6 +456,21 @@ static void disklabel_create_partition(void* _object,
 							  _end_range,
 							  _type);
 
+  /* the disklabel keeps its own reference, this one goes to the frontend */
+  object_export(partition);
+
+  /* containers are not wiped: their partitions are, one by one. Nor are
+   * their free ranges kept from the discard of a removed partition */
+  if(!(*partition_operations.have_disklabel)(partition))
+    {
+      struct object* device;
+
+      device = object_cast(partition, OBJECT_TYPE_DEVICE);
+
+      device_cancel_discard(device, object_start(partition), object_end(partition));
+      device_schedule_wipe(device, object_start(partition), object_end(partition));
+    }
+
   memcpy(_operations, &partition_operations, sizeof(struct gnufdisk_partition_operations));
   *_specific = partition;
 
@@ -414,6 +480,10 @@ static void disklabel_create_partition(void* _object,
 static void disklabel_remove_partition(void* _object, size_t _number)
 {
   struct disklabel_private* private;
+  struct object* partition;
+  struct object* device;
+  gnufdisk_integer start;
+  gnufdisk_integer end;
 
   GNUFDISK_LOG((DISKLABEL, "perform remove_partition on struct object* %p", _object));
 
@@ -424,8 +494,16 @@ static void disklabel_remove_partition(void* _object, size_t _number)
   if(gnufdisk_check_memory(private->implementation.remove_partition, 1, 1) != 0)
     GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL, "disklabel implementation does not support `remove_partition'");
 
+  /* the partition object may not survive its removal */
+  partition = (*private->implementation.partition)(private->implementation.private, _number);
+  device = object_cast(partition, OBJECT_TYPE_DEVICE);
+  start = object_start(partition);
+  end = object_end(partition);
+
   (*private->implementation.remove_partition)(private->implementation.private, _number);
 
+  device_schedule_discard(device, start, end);
+
   GNUFDISK_LOG((DISKLABEL, "done perform remove_partition"));
 }
 
@@ -465,11 +543,156 @@ static void disklabel_get_parameter(void* _object, struct gnufdisk_string* _para
   GNUFDISK_LOG((DISKLABEL, "done perform get_parameter"));
 }
 
+struct snapshot_state {
+  struct object* disklabel;
+  struct disklabel_private* private;
+  struct gnufdisk_partition_record* records;
+  struct content_partition* contents;
+  size_t nrecords;
+  size_t size;
+};
+
+static void free_snapshot_state(void* _p)
+{
+  struct snapshot_state* state;
+
+  state = _p;
+
+  if(state->records)
+    free(state->records);
+
+  if(state->contents)
+    free(state->contents);
+}
+
+static const struct {
+  const char* name;
+  enum gnufdisk_partition_type_id id;
+} snapshot_types[] = {
+  {"PRIMARY", GNUFDISK_PARTITION_TYPE_PRIMARY},
+  {"EXTENDED", GNUFDISK_PARTITION_TYPE_EXTENDED},
+  {"EXTENDED LBA", GNUFDISK_PARTITION_TYPE_EXTENDED_LBA},
+  {"LOGICAL", GNUFDISK_PARTITION_TYPE_LOGICAL},
+  {"GUID", GNUFDISK_PARTITION_TYPE_GUID}
+};
+
+static void snapshot_partition(struct object* _partition, void* _data)
+{
+  struct snapshot_state* state;
+  struct gnufdisk_partition_record* record;
+  struct gnufdisk_string* type;
+  size_t iter;
+
+  state = _data;
+
+  if(state->nrecords == state->size)
+    {
+      size_t size;
+      void* records;
+
+      size = state->size > 0 ? state->size * 2 : 16;
+
+      if((records = realloc(state->records, size * sizeof(struct gnufdisk_partition_record))) == NULL)
+	THROW_ENOMEM;
+
+      state->records = records;
+
+      if((records = realloc(state->contents, size * sizeof(struct content_partition))) == NULL)
+	THROW_ENOMEM;
+
+      state->contents = records;
+      state->size = size;
+    }
+
+  record = &state->records[state->nrecords];
+  memset(record, 0, sizeof(struct gnufdisk_partition_record));
+
+  record->number = disklabel_partition_number(state->disklabel, _partition);
+  record->start = object_start(_partition);
+  record->length = object_end(_partition) - record->start + 1;
+
+  type = (*partition_operations.type)(_partition);
+
+  for(iter = 0; iter < sizeof(snapshot_types) / sizeof(snapshot_types[0]); iter++)
+    if(strcmp(gnufdisk_string_c_string(type), snapshot_types[iter].name) == 0)
+      record->type = snapshot_types[iter].id;
+
+  gnufdisk_string_delete(type);
+
+  /* sectors for now, content_probe() wants bytes */
+  state->contents[state->nrecords].start = record->start;
+  state->contents[state->nrecords].length = record->length;
+
+  if((*partition_operations.have_disklabel)(_partition))
+    record->flags |= GNUFDISK_PARTITION_HAVE_DISKLABEL;
+
+  /* a partition holding a disklabel is a container, not a file system */
+  if(partition_get_disklabel(_partition) != NULL)
+    state->contents[state->nrecords].length = 0;
+
+  if(state->private->implementation.partition_guid != NULL
+     && (*state->private->implementation.partition_guid)(state->private->implementation.private,
+							  _partition, record->guid) == 0)
+    record->flags |= GNUFDISK_PARTITION_HAVE_GUID;
+
+  state->nrecords++;
+}
+
+static void disklabel_snapshot(void* _object, struct gnufdisk_partition_record** _records, size_t* _nrecords)
+{
+  struct snapshot_state state;
+
+  GNUFDISK_LOG((DISKLABEL, "perform snapshot on struct object* %p", _object));
+
+  memset(&state, 0, sizeof(state));
+
+  state.disklabel = _object;
+  state.private = object_private(_object, OBJECT_TYPE_DISKLABEL);
+  disklabel_private_check(state.private);
+
+  if(gnufdisk_exception_register_unwind_handler(&free_snapshot_state, &state) != 0)
+    GNUFDISK_WARNING("gnufdisk_exception_register_unwind_handler failed. Missing GNUFDISK_TRY?");
+
+  disklabel_enumerate_partitions(_object, NULL, NULL, &snapshot_partition, &state);
+
+  if(state.nrecords > 0)
+    {
+      struct object* device;
+      gnufdisk_integer sector_size;
+      size_t iter;
+
+      /* what every partition holds, in one batch of reads */
+      device = object_cast(_object, OBJECT_TYPE_DEVICE);
+      sector_size = device_sector_size(device);
+
+      for(iter = 0; iter < state.nrecords; iter++)
+	{
+	  state.contents[iter].start *= sector_size;
+	  state.contents[iter].length *= sector_size;
+	}
+
+      content_probe(device, state.contents, state.nrecords);
+
+      for(iter = 0; iter < state.nrecords; iter++)
+	memcpy(state.records[iter].content, state.contents[iter].name, GNUFDISK_PARTITION_CONTENT_SIZE);
+    }
+
+  if(gnufdisk_exception_unregister_unwind_handler(&free_snapshot_state, &state) != 0)
+    GNUFDISK_WARNING("gnufdisk_exception_unregister_unwind_handler failed. Missing GNUFDISK_TRY?");
+
+  free(state.contents);
+
+  *_records = state.records;
+  *_nrecords = state.nrecords;
+
+  GNUFDISK_LOG((DISKLABEL, "done perform snapshot, result: %zu records", state.nrecords));
+}
+
 static void disklabel_delete(void* _object)
 {
   GNUFDISK_LOG((DISKLABEL, "perform delete on struct object* %p", _object));
 
-  object_delete(_object);
+  object_unexport(_object);
 
   GNUFDISK_LOG((DISKLABEL, "done perform delete"));
 }
@@ -483,6 +706,7 @@ struct gnufdisk_disklabel_operations disklabel_operations = {
   remove_partition: &disklabel_remove_partition,
   set_parameter: &disklabel_set_parameter,
   get_parameter: &disklabel_get_parameter,
+  snapshot: &disklabel_snapshot,
   delete: &disklabel_delete
 };
 
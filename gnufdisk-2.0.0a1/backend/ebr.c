@@ -33,13 +33,13 @@ static void delete_string(void* _p)
 static void delete_ebr_chain(void* _p)
 {
   GNUFDISK_LOG((DISKLABEL, "delete struct ebr_chain* %p", _p));
-  free(_p);
+  arena_free(_p);
 }
 
-static void delete_list(void* _p)
+static void delete_vector(void* _p)
 {
-  GNUFDISK_LOG((DISKLABEL, "delete struct list* %p", _p));
-  list_delete(_p, &delete_ebr_chain);
+  GNUFDISK_LOG((DISKLABEL, "delete struct vector* %p", _p));
+  vector_delete(_p, &delete_ebr_chain);
 }
 
 static void delete_object(void* _p)
@@ -169,7 +169,7 @@ struct ebr_chain {
 
 struct ebr_private {
   struct object* parent;
-  struct list* chain;
+  struct vector* chain;
   int lba;
 };
 
@@ -213,7 +213,8 @@ static int partition_overlap(struct ebr_partition* _part, struct object* _device
 static void ebr_private_raw(void* _private, void** _dest, size_t* _size)
 {
   struct ebr_private* private;
-  struct list* iter;
+  size_t iter;
+  size_t count;
   size_t offset;
   void* buf;
 
@@ -222,29 +223,31 @@ static void ebr_private_raw(void* _private, void** _dest, size_t* _size)
   ebr_private_check(_private);
 
   private = _private;
+  count = vector_length(private->chain);
+  buf = NULL;
 
-  for(iter = list_first(private->chain), offset = 0, buf = NULL; iter != NULL; iter = list_next(iter), offset += sizeof(struct ebr))
+  if(count > 0)
     {
-      void* tmp;
-      struct ebr_chain* entry;
+      if((buf = malloc(count * sizeof(struct ebr))) == NULL)
+	THROW_ENOMEM;
 
-      if((tmp = buf == NULL ? malloc(sizeof(struct ebr)) : realloc(buf, offset + sizeof(struct ebr))) == NULL)
-	{
-	  if(buf)
-	    free(buf);
+      gnufdisk_exception_register_unwind_handler(&free, buf);
+    }
 
-	  THROW_ENOMEM;
-	}
+  for(iter = 0, offset = 0; iter < count; iter++, offset += sizeof(struct ebr))
+    {
+      struct ebr_chain* entry;
 
-      entry = list_data(iter);
+      entry = vector_get(private->chain, iter);
 
       ebr_chain_check(entry);
 
-      memcpy(tmp + offset, &entry->data, sizeof(struct ebr));
-
-      buf = tmp;
+      memcpy(buf + offset, &entry->data, sizeof(struct ebr));
     }
 
+  if(buf)
+    gnufdisk_exception_unregister_unwind_handler(&free, buf);
+
   *_dest = buf;
   *_size = offset;
 
@@ -274,8 +277,6 @@ static struct object* ebr_private_partition(void* _private, size_t _number)
 {
   struct ebr_private* private;
   GNUFDISK_RETRY rp0;
-  struct list* iter;
-  int count;
   struct object* ret;
 
   GNUFDISK_LOG((DISKLABEL, "perform partition on struct ebr_private* %p", _private));
@@ -288,19 +289,15 @@ static struct object* ebr_private_partition(void* _private, size_t _number)
 
   GNUFDISK_RETRY_SET(rp0);
 
-  for(count = 1, iter = list_first(private->chain); iter != NULL; iter = list_next(iter), count++)
+  if(_number >= 1 && _number <= vector_length(private->chain))
     {
-      if(count == _number)
-	{
-	  struct ebr_chain* data;
+      struct ebr_chain* data;
 
-	  data = list_data(iter);
+      data = vector_get(private->chain, _number - 1);
 
-	  ebr_chain_check(data);
+      ebr_chain_check(data);
 
-	  ret = data->partition;
-	  break;
-	}
+      ret = data->partition;
     }
   
   if(ret == NULL)
@@ -324,7 +321,6 @@ static struct object* ebr_private_partition(void* _private, size_t _number)
 static int ebr_private_count_partitions(void* _private)
 {
   struct ebr_private* private;
-  struct list* iter;
   int ret;
 
   GNUFDISK_LOG((DISKLABEL, "perform count_partitions on struct ebr_private* %p", _private));
@@ -333,8 +329,7 @@ static int ebr_private_count_partitions(void* _private)
 
   private = _private;
 
-  for(iter = list_first(private->chain), ret = 0; iter != NULL; iter = list_next(iter), ret++)
-    ;
+  ret = vector_length(private->chain);
 
   GNUFDISK_LOG((DISKLABEL, "done perform count_partitions, result: %d", ret));
 
@@ -352,14 +347,15 @@ static struct object* ebr_private_create_partition(void* _private,
   char* system;
   gnufdisk_integer sectors;
   gnufdisk_integer sector_size;
+  gnufdisk_integer grains[3];
+  gnufdisk_integer grain;
   gnufdisk_integer base;
   gnufdisk_integer start;
   gnufdisk_integer end;
   GNUFDISK_RETRY rp0;
-  struct list* iter;
+  size_t iter;
   GNUFDISK_RETRY rp1;
   struct object* ret;
-  struct list* last_node;
   struct ebr_chain* last_entry;
 
   param = NULL;
@@ -371,7 +367,8 @@ static struct object* ebr_private_create_partition(void* _private,
 
   private = _private;
 
-  /* aligns the beginning and the end  of the partition on cylinder  boundary */
+  /* aligns the beginning and the end of the partition on a track boundary
+   * when the range holds one, otherwise on the device alignment */
   device = object_cast(private->parent, OBJECT_TYPE_DEVICE);
 
   if((param = gnufdisk_string_new("SECTORS")) == NULL)
@@ -386,11 +383,16 @@ static struct object* ebr_private_create_partition(void* _private,
   
   device_get_parameter(device, param, &sector_size, sizeof(gnufdisk_integer));
 
+  grains[0] = sectors;
+  grains[1] = device_optimal_alignment(device) / sector_size;
+  grains[2] = device_minimum_alignment(device) / sector_size;
+
   GNUFDISK_RETRY_SET(rp0);
 
-  base = math_round(gnufdisk_geometry_start(_start_range) + gnufdisk_geometry_length(_start_range) / 2, sectors);
-  start = math_round_up(base + 1, sectors);
-  end = math_round(gnufdisk_geometry_end(_end_range) - gnufdisk_geometry_length(_end_range) / 2, sectors);
+  /* the EBR on the boundary, the partition on the next one */
+  base = disklabel_align(_start_range, grains, 3, 0, &grain);
+  start = math_round_up(base + 1, grain);
+  end = disklabel_align(_end_range, grains, 3, 1, NULL);
 
   GNUFDISK_LOG((DISKLABEL, "aligned base: %"PRId64, base));
   GNUFDISK_LOG((DISKLABEL, "aligned start: %" PRId64, start));
@@ -400,7 +402,7 @@ static struct object* ebr_private_create_partition(void* _private,
     GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL, "unable to calculate geometry");
 
   /* check that  the values remain within  the ranges indicated */
-  if(base < gnufdisk_geometry_start(_start_range) || base >= gnufdisk_geometry_end(_start_range) || base < object_start(private->parent))
+  if(base < gnufdisk_geometry_start(_start_range) || base > gnufdisk_geometry_end(_start_range) || base < object_start(private->parent))
     {
       union gnufdisk_device_exception_data data;
 
@@ -426,13 +428,13 @@ static struct object* ebr_private_create_partition(void* _private,
     }
 
   /* check whether the partition will overwrite other partitions */
-  for(iter = private->chain; iter != NULL; iter = list_next(iter))
+  for(iter = 0; iter < vector_length(private->chain); iter++)
     {
       struct ebr_chain* entry;
       int mode;
       union gnufdisk_device_exception_data data;
 
-      entry = list_data(iter);
+      entry = vector_get(private->chain, iter);
 
       ebr_chain_check(entry);
 
@@ -509,8 +511,7 @@ static struct object* ebr_private_create_partition(void* _private,
 
   gnufdisk_exception_register_unwind_handler(&delete_object, ret);
 
-  last_node = list_last(private->chain);
-  last_entry = list_data(last_node);
+  last_entry = vector_last(private->chain);
 
   ebr_chain_check(last_entry);
   
@@ -551,10 +552,9 @@ static struct object* ebr_private_create_partition(void* _private,
       last_entry->data.partitions[1].sectors = CPU_TO_LE32(end - base + 1);
 
       /* create new entry */
-      if((new_entry = malloc(sizeof(struct ebr_chain))) == NULL)
-	THROW_ENOMEM;
+      new_entry = arena_alloc(object_arena(private->parent), sizeof(struct ebr_chain));
 
-      gnufdisk_exception_register_unwind_handler(&free, new_entry);
+      gnufdisk_exception_register_unwind_handler(&arena_free, new_entry);
 
       memset(new_entry, 0, sizeof(struct ebr_chain));
       
@@ -569,9 +569,9 @@ static struct object* ebr_private_create_partition(void* _private,
       new_entry->start = base;
       new_entry->partition = ret;
       
-      private->chain = list_append(private->chain, new_entry);
+      vector_append(private->chain, new_entry);
   
-      gnufdisk_exception_unregister_unwind_handler(&free, new_entry);
+      gnufdisk_exception_unregister_unwind_handler(&arena_free, new_entry);
     }
 
   gnufdisk_exception_unregister_unwind_handler(&delete_object, ret);
@@ -615,13 +615,13 @@ static void ebr_private_commit(void* _private)
 
   if(private->chain)
     {
-      struct list* iter;
+      size_t iter;
 
-      for(iter = list_first(private->chain); iter != NULL; iter = list_next(iter))
+      for(iter = 0; iter < vector_length(private->chain); iter++)
 	{
 	  struct ebr_chain* entry;
 
-	  entry = list_data(iter);
+	  entry = vector_get(private->chain, iter);
 
 	  ebr_chain_check(entry);
 
@@ -649,7 +649,58 @@ static void ebr_private_enumerate_partitions(void* _private,
 					     void (*_callback)(struct object*, void*),
 					     void* _callback_data)
 {
+  struct ebr_private* private;
+  size_t iter;
+
+  GNUFDISK_LOG((DISKLABEL, "perform enumerate_partitions on struct ebr_private* %p", _private));
+
+  ebr_private_check(_private);
+
+  private = _private;
+
+  for(iter = 0; iter < vector_length(private->chain); iter++)
+    {
+      struct ebr_chain* entry;
+
+      entry = vector_get(private->chain, iter);
+
+      if(gnufdisk_check_memory(entry->partition, 1, 1) != 0)
+	continue;
+
+      if(gnufdisk_check_memory(_filter, 1, 1) == 0
+	 && (*_filter)(entry->partition, _filter_data) == 0)
+	continue;
+
+      if(gnufdisk_check_memory(_callback, 1, 1) == 0)
+	(*_callback)(entry->partition, _callback_data);
+    }
+
+  GNUFDISK_LOG((DISKLABEL, "done perform enumerate_partitions"));
+}
+
+/* same numbering as ebr_private_partition */
+static int ebr_private_partition_number(void* _private, struct object* _partition)
+{
+  struct ebr_private* private;
+  size_t iter;
+  int ret;
+
+  GNUFDISK_LOG((DISKLABEL, "perform partition_number on struct ebr_private* %p", _private));
+
+  ebr_private_check(_private);
+
+  private = _private;
+
+  for(ret = -1, iter = 0; iter < vector_length(private->chain); iter++)
+    if(((struct ebr_chain*) vector_get(private->chain, iter))->partition == _partition)
+      {
+	ret = iter + 1;
+	break;
+      }
+
+  GNUFDISK_LOG((DISKLABEL, "done perform partition_number, result: %d", ret));
 
+  return ret;
 }
 
 static void ebr_private_delete(void* _private)
@@ -665,10 +716,10 @@ static void ebr_private_delete(void* _private)
   object_delete(private->parent);
   
   if(private->chain)
-    list_delete(private->chain, &delete_ebr_chain);
+    vector_delete(private->chain, &delete_ebr_chain);
 
   memset(private, 0, sizeof(struct ebr_private));
-  free(private);
+  arena_free(private);
 
   GNUFDISK_LOG((DISKLABEL, "done perform delete"));
 }
@@ -685,6 +736,7 @@ static struct disklabel_implementation ebr_implementation = {
   get_parameter: &ebr_private_get_parameter,
   commit: &ebr_private_commit,
   enumerate_partitions: &ebr_private_enumerate_partitions,
+  partition_number: &ebr_private_partition_number,
   delete: &ebr_private_delete
 };
 
@@ -710,10 +762,9 @@ static struct ebr_chain* read_ebr(struct object* _parent, gnufdisk_integer _star
   if(tmp.data.magic[0] != 0x55 || tmp.data.magic[1] != 0xAA)
     return NULL;
 
-  if((ret = malloc(sizeof(struct ebr_chain))) == NULL)
-    THROW_ENOMEM;
+  ret = arena_alloc(object_arena(_parent), sizeof(struct ebr_chain));
 
-  gnufdisk_exception_register_unwind_handler(&free, ret);
+  gnufdisk_exception_register_unwind_handler(&arena_free, ret);
 
   if(tmp.data.partitions[0].type != EMPTY)
     {
@@ -758,16 +809,16 @@ static struct ebr_chain* read_ebr(struct object* _parent, gnufdisk_integer _star
 
   memcpy(ret, &tmp, sizeof(struct ebr_chain));
   
-  gnufdisk_exception_unregister_unwind_handler(&free, ret);
+  gnufdisk_exception_unregister_unwind_handler(&arena_free, ret);
 
   GNUFDISK_LOG((DISKLABEL, "done read EBR, result: %p", ret));
 
   return ret; 
 }
 
-static struct list* read_ebr_chain(struct object* _parent, int _lba)
+static struct vector* read_ebr_chain(struct object* _parent, int _lba)
 {
-  struct list* ret;
+  struct vector* ret;
   struct ebr_chain* entry;
   gnufdisk_integer start;
   gnufdisk_integer offset;
@@ -775,9 +826,11 @@ static struct list* read_ebr_chain(struct object* _parent, int _lba)
   GNUFDISK_LOG((DISKLABEL, "read EBR chain using struct object* %p as parent", _parent));
   GNUFDISK_LOG((DISKLABEL, "lba: %d", _lba));
 
-  ret = NULL;
+  ret = vector_new(object_arena(_parent));
   entry = NULL;
 
+  gnufdisk_exception_register_unwind_handler(&delete_vector, ret);
+
   start = object_start(_parent);
 
   while(3)
@@ -835,10 +888,19 @@ static struct list* read_ebr_chain(struct object* _parent, int _lba)
 
 	  GNUFDISK_LOG((DISKLABEL, "try read EBR at offset %"PRId64, start));
 
-	  entry = read_ebr(_parent, offset, _lba);
+	  if((entry = read_ebr(_parent, offset, _lba)) == NULL)
+	    break;
 	}
 
-      ret = list_append(ret, entry);
+      vector_append(ret, entry);
+    }
+
+  gnufdisk_exception_unregister_unwind_handler(&delete_vector, ret);
+
+  if(vector_length(ret) == 0)
+    {
+      vector_delete(ret, NULL);
+      ret = NULL;
     }
 
   return ret;
@@ -851,20 +913,19 @@ int ebr_probe(struct object* _parent, int _lba, struct disklabel_implementation*
 
   GNUFDISK_LOG((DISKLABEL, "probe EBR disklabel with struct object* %p", _parent));
 
-  if((private = malloc(sizeof(struct ebr_private))) == NULL)
-    THROW_ENOMEM;
+  private = arena_alloc(object_arena(_parent), sizeof(struct ebr_private));
 
-  gnufdisk_exception_register_unwind_handler(&free, private);
+  gnufdisk_exception_register_unwind_handler(&arena_free, private);
 
   if((private->chain = read_ebr_chain(_parent, _lba)) == NULL)
     {
-      gnufdisk_exception_unregister_unwind_handler(&free, private);
-      free(private);
+      gnufdisk_exception_unregister_unwind_handler(&arena_free, private);
+      arena_free(private);
       ret = -1;
     }
   else
     {
-      gnufdisk_exception_register_unwind_handler(&delete_list, private->chain);
+      gnufdisk_exception_register_unwind_handler(&delete_vector, private->chain);
 
       object_ref(_parent);
       private->parent = _parent;
@@ -874,8 +935,8 @@ int ebr_probe(struct object* _parent, int _lba, struct disklabel_implementation*
       memcpy(_implementation, &ebr_implementation, sizeof(struct disklabel_implementation));
       _implementation->private = private;
 
-      gnufdisk_exception_unregister_unwind_handler(&free, private);
-      gnufdisk_exception_unregister_unwind_handler(&delete_list, private->chain);
+      gnufdisk_exception_unregister_unwind_handler(&arena_free, private);
+      gnufdisk_exception_unregister_unwind_handler(&delete_vector, private->chain);
 
       ret = 0;
     }
@@ -884,20 +945,19 @@ int ebr_probe(struct object* _parent, int _lba, struct disklabel_implementation*
 
 #if GNUFDISK_DEBUG
   do {
-    struct list* iter;
-    int count;
+    size_t count;
 
-    for(count = 0, iter = private->chain; iter != NULL; iter = list_next(iter), count++)
+    for(count = 0; ret == 0 && count < vector_length(private->chain); count++)
       {
 	struct ebr_chain* entry;
 
-	entry = list_data(iter);
+	entry = vector_get(private->chain, count);
 
 	ebr_chain_check(entry);
 
 	if(entry->partition)
 	  GNUFDISK_LOG((DISKLABEL, 
-			"        > %d - struct ebr* %p, partition: %p (end: %"PRId64")", 
+			"        > %zu - struct ebr* %p, partition: %p (end: %"PRId64")", 
 			count, &entry->data, entry->partition, object_end(entry->partition)));
       }
 
@@ -914,10 +974,9 @@ void ebr_new(struct object* _parent, int _lba, struct disklabel_implementation*
 
   GNUFDISK_LOG((DISKLABEL, "create new MBR disklabel using struct object* %p as parent", _parent));
 
-  if((private = malloc(sizeof(struct ebr_private))) == NULL)
-    THROW_ENOMEM;
+  private = arena_alloc(object_arena(_parent), sizeof(struct ebr_private));
 
-  gnufdisk_exception_register_unwind_handler(&free, private);
+  gnufdisk_exception_register_unwind_handler(&arena_free, private);
 
   memset(private, 0, sizeof(struct ebr_private));
 
@@ -925,10 +984,9 @@ void ebr_new(struct object* _parent, int _lba, struct disklabel_implementation*
   private->parent = _parent;
   private->lba = _lba;
 
-  if((entry = malloc(sizeof(struct ebr_chain))) == NULL)
-    THROW_ENOMEM;
+  entry = arena_alloc(object_arena(_parent), sizeof(struct ebr_chain));
 
-  gnufdisk_exception_register_unwind_handler(&free, entry);
+  gnufdisk_exception_register_unwind_handler(&arena_free, entry);
 
   memset(entry, 0, sizeof(struct ebr_chain));
 
@@ -937,13 +995,18 @@ void ebr_new(struct object* _parent, int _lba, struct disklabel_implementation*
 
   entry->start = object_start(_parent);
   
-  private->chain = list_append(private->chain, entry);
+  private->chain = vector_new(object_arena(_parent));
+
+  gnufdisk_exception_register_unwind_handler(&delete_vector, private->chain);
+
+  vector_append(private->chain, entry);
 
   memcpy(_implementation, &ebr_implementation, sizeof(struct disklabel_implementation));
   _implementation->private = private;
 
-  gnufdisk_exception_unregister_unwind_handler(&free, private);
-  gnufdisk_exception_unregister_unwind_handler(&free, entry);
+  gnufdisk_exception_unregister_unwind_handler(&arena_free, private);
+  gnufdisk_exception_unregister_unwind_handler(&arena_free, entry);
+  gnufdisk_exception_unregister_unwind_handler(&delete_vector, private->chain);
 
   GNUFDISK_LOG((DISKLABEL, "done create MBR disklabel"));
 }
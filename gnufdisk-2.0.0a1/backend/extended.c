@@ -16,8 +16,9 @@ static void delete_object(void* _p)
 
 static void extended_private_check(struct extended_private* _private)
 {
-  if(gnufdisk_check_memory(_private, sizeof(struct extended_private), 0) != 0
-     || gnufdisk_check_memory(_private->disklabel, 1, 1) != 0)
+  /* the disklabel is attached after the EBR has been set up, which already
+   * asks for the partition boundaries */
+  if(gnufdisk_check_memory(_private, sizeof(struct extended_private), 0) != 0)
     GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL, "invalid struct extended_private* %p", _private);
 }
 
@@ -142,7 +143,7 @@ static void extended_private_delete(void* _private)
 
   memset(private, 0, sizeof(struct extended_private));
 
-  free(private);
+  arena_free(private);
 
   GNUFDISK_LOG((PARTITION, "done perform delete"));
 }
@@ -170,16 +171,16 @@ struct object* extended_probe(struct object* _parent, gnufdisk_integer _start, g
   struct object* ret;
   struct disklabel_implementation ebr_implementation; 
   struct object* disklabel;
+  unsigned long long start;
 
   GNUFDISK_LOG((PARTITION, "probe EXTENDED partition with struct object* %p as parent", _parent));
   GNUFDISK_LOG((PARTITION, "start: %" PRId64, _start));
   GNUFDISK_LOG((PARTITION, "end: %" PRId64, _end));
   GNUFDISK_LOG((PARTITION, "lba: %d", _lba));
 
-  if((private = malloc(sizeof(struct extended_private))) == NULL)
-    THROW_ENOMEM;
+  private = arena_alloc(object_arena(_parent), sizeof(struct extended_private));
 
-  gnufdisk_exception_register_unwind_handler(&free, private);
+  gnufdisk_exception_register_unwind_handler(&arena_free, private);
   
   memcpy(&implementation, &extended_implementation, sizeof(struct partition_implementation));
   implementation.private = private;
@@ -189,7 +190,7 @@ struct object* extended_probe(struct object* _parent, gnufdisk_integer _start, g
   GNUFDISK_LOG((PARTITION, "DELETE OBJECT: *** %p ***", &delete_object));
 
   gnufdisk_exception_register_unwind_handler(&delete_object, ret);
-  gnufdisk_exception_unregister_unwind_handler(&free, private);
+  gnufdisk_exception_unregister_unwind_handler(&arena_free, private);
 
   object_ref(_parent);
   private->parent = _parent;
@@ -199,9 +200,13 @@ struct object* extended_probe(struct object* _parent, gnufdisk_integer _start, g
 
   GNUFDISK_LOG((PARTITION, "probe disklabel"));
 
+  start = gnufdisk_stats_clock();
+
   if(ebr_probe(ret, _lba, &ebr_implementation) != 0)
     GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "error probing Extended boot record on sector %" PRId64, object_start(ret));
 
+  gnufdisk_stats_record(GNUFDISK_STATS_PROBE_EBR, start, 0);
+
   disklabel = disklabel_new_with_implementation(ret, &ebr_implementation);
   
   /* avoid cross references */
@@ -227,10 +232,9 @@ struct object* extended_new(struct object* _parent, gnufdisk_integer _start, gnu
   GNUFDISK_LOG((PARTITION, "start: %"PRId64, _start));
   GNUFDISK_LOG((PARTITION, "end: %"PRId64, _end));
 
-  if((private = malloc(sizeof(struct extended_private))) == NULL)
-    THROW_ENOMEM;
+  private = arena_alloc(object_arena(_parent), sizeof(struct extended_private));
 
-  gnufdisk_exception_register_unwind_handler(&free, private);
+  gnufdisk_exception_register_unwind_handler(&arena_free, private);
 
   memcpy(&implementation, &extended_implementation, sizeof(struct partition_implementation));
   implementation.private = private;
@@ -238,7 +242,7 @@ struct object* extended_new(struct object* _parent, gnufdisk_integer _start, gnu
   ret = partition_new(_parent, _start, _end, &implementation);
 
   gnufdisk_exception_register_unwind_handler(&delete_object, ret);
-  gnufdisk_exception_unregister_unwind_handler(&free, private);
+  gnufdisk_exception_unregister_unwind_handler(&arena_free, private);
 
   object_ref(_parent);
   private->parent = _parent;
@@ -116,12 +116,15 @@ efi_crc32(const void *buf, unsigned long len, uint32_t seed)
   unsigned long i;
   register uint32_t crc32val;
   const unsigned char *s = buf;
+  unsigned long long start = gnufdisk_stats_clock();
 
   crc32val = seed;
 
   for (i = 0;  i < len;  i ++)
     crc32val = crc32_tab[(crc32val ^ s[i]) & 0xff] ^ (crc32val >> 8);
 
+  gnufdisk_stats_record(GNUFDISK_STATS_GPT_CRC, start, len);
+
   return crc32val;
 }
 
@@ -153,8 +156,15 @@ struct gpt_header {
   uint32_t partition_crc32;
 };
 
+/* the header as UEFI defines it: struct gpt_header is padded to 96 bytes */
+#define GPT_HEADER_SIZE 92
+
 #define PARTITION_NAME_LEN 72
 
+/* size of the partition array of a new disklabel */
+#define GPT_PARTITIONS 128
+#define GPT_PARTITION_ENTRY_SIZE 128
+
 struct gpt_partition {
   unsigned char guid[16];
   unsigned char id[16];
@@ -228,14 +238,14 @@ static void delete_gpt_private(void* _p)
 
   object_delete(private->parent);
 
-  free(private->header);
-  free(private->partitions);
-  free(private->children);
-  free(private->backup_header);
+  arena_free(private->header);
+  arena_free(private->partitions);
+  arena_free(private->children);
+  arena_free(private->backup_header);
 
   memset(private, 0, sizeof(struct gpt_private));
 
-  free(private);
+  arena_free(private);
 }
 
 static void gpt_private_raw(void* _private, void** _dest, size_t* _size)
@@ -343,7 +353,7 @@ static int gpt_private_count_partitions(void* _private)
 
   private = _private;
 
-  for(iter = 0; iter < LE32_TO_CPU(private->header->npartitions); iter++)
+  for(ret = 0, iter = 0; iter < LE32_TO_CPU(private->header->npartitions); iter++)
     if(gnufdisk_check_memory(private->children[iter], 1, 1) == 0)
       ret++;
 
@@ -359,7 +369,7 @@ static struct object* gpt_private_create_partition(void* _private,
 {
   struct gpt_private* private;
   struct object* device;
-  gnufdisk_integer optimal_alignment;
+  gnufdisk_integer grains[2];
   GNUFDISK_RETRY rp0;
   gnufdisk_integer start;
   gnufdisk_integer end;
@@ -377,14 +387,17 @@ static struct object* gpt_private_create_partition(void* _private,
 
   device = object_cast(private->parent, OBJECT_TYPE_DEVICE);
   
-  optimal_alignment = device_optimal_alignment(device) / device_sector_size(device);
+  /* the coarsest grain having a boundary inside the range */
+  grains[0] = device_optimal_alignment(device) / device_sector_size(device);
+  grains[1] = device_minimum_alignment(device) / device_sector_size(device);
 
-  GNUFDISK_LOG((DISKLABEL, "optimal alignment: %"PRId64" sectors", optimal_alignment));
+  GNUFDISK_LOG((DISKLABEL, "optimal alignment: %"PRId64" sectors", grains[0]));
+  GNUFDISK_LOG((DISKLABEL, "minimum alignment: %"PRId64" sectors", grains[1]));
 
   GNUFDISK_RETRY_SET(rp0);
 
   /* aligns the start and check that it is valid */
-  start = math_round(gnufdisk_geometry_start(_s) + gnufdisk_geometry_length(_s) / 2, optimal_alignment);
+  start = disklabel_align(_s, grains, 2, 0, NULL);
 
   GNUFDISK_LOG((DISKLABEL, "start sector: %"PRId64, start));
 
@@ -404,7 +417,7 @@ static struct object* gpt_private_create_partition(void* _private,
     }
 
   /* aligns the end and check that it is valid */
-  end = math_round(gnufdisk_geometry_start(_e) + gnufdisk_geometry_length(_e) / 2, optimal_alignment);
+  end = disklabel_align(_e, grains, 2, 1, NULL);
 
   GNUFDISK_LOG((DISKLABEL, "end sector: %"PRId64, end));
 
@@ -611,20 +624,68 @@ static void gpt_private_set_parameter(void* _private, struct gnufdisk_string* _p
 
   GNUFDISK_LOG((DISKLABEL, "done erform set_parameter"));
 }
+#endif
 
 static void gpt_private_get_parameter(void* _private, struct gnufdisk_string* _param, void* _data, size_t _size)
 {
   struct gpt_private* private;
+  const char* param;
   
   GNUFDISK_LOG((DISKLABEL, "perform get_parameter on struct gpt_private* %p", _private));
 
   gpt_private_check(_private);
 
   private = _private;
+  param = gnufdisk_string_c_string(_param);
+
+  if(strcasecmp(param, "FIRST-USABLE") == 0 || strcasecmp(param, "LAST-USABLE") == 0)
+    {
+      if(_size != sizeof(gnufdisk_integer))
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETERSIZE, NULL, "invalid parameter size");
+
+      if(strcasecmp(param, "FIRST-USABLE") == 0)
+	*(gnufdisk_integer*) _data = LE64_TO_CPU(private->header->lba_first);
+      else
+	*(gnufdisk_integer*) _data = LE64_TO_CPU(private->header->lba_last);
+    }
+  else
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETER, NULL, "invalid parameter: %s", param);
 
   GNUFDISK_LOG((DISKLABEL, "done perform get_parameter"));
 }
-#endif
+
+static void gpt_write_protective_mbr(struct object* _device, gnufdisk_integer _end, gnufdisk_integer _sector_size)
+{
+  unsigned char* mbr;
+  uint32_t sectors;
+
+  mbr = arena_alloc(object_arena(_device), _sector_size);
+
+  gnufdisk_exception_register_unwind_handler(&arena_free, mbr);
+
+  sectors = _end > 0xFFFFFFFFLL ? 0xFFFFFFFF : _end;
+
+  /* a single 0xEE partition from sector 1, CHS values out of range */
+  mbr[446 + 2] = 0x02;
+  mbr[446 + 4] = 0xEE;
+  memset(mbr + 446 + 5, 0xFF, 3);
+  mbr[446 + 8] = 1;
+  mbr[446 + 12] = sectors;
+  mbr[446 + 13] = sectors >> 8;
+  mbr[446 + 14] = sectors >> 16;
+  mbr[446 + 15] = sectors >> 24;
+  mbr[510] = 0x55;
+  mbr[511] = 0xAA;
+
+  if(device_seek(_device, 0, 0, SEEK_SET) == -1)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not seek device");
+
+  if(device_write(_device, mbr, _sector_size) != _sector_size)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not write protective MBR");
+
+  gnufdisk_exception_unregister_unwind_handler(&arena_free, mbr);
+  arena_free(mbr);
+}
 
 static void gpt_private_commit(void* _private)
 {
@@ -654,15 +715,19 @@ static void gpt_private_commit(void* _private)
     LE32_TO_CPU(private->header->partition_entry_size) *
     LE32_TO_CPU(private->header->npartitions);
   
+  /* protective MBR of a label on the whole device */
+  if(start == 0)
+    gpt_write_protective_mbr(device, end, sector_size);
+
   /* header */
-  if(device_seek(device, start, 0, SEEK_SET) == -1)
+  if(device_seek(device, LE64_TO_CPU(private->header->lba_current), 0, SEEK_SET) == -1)
     GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not seek device");
 
   if(device_write(device, private->header, sector_size) != sector_size)
     GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not write GPT header");
   
   /*entries */
-  if(device_seek(device, start + 1, 0, SEEK_SET) == -1)
+  if(device_seek(device, LE64_TO_CPU(private->header->lba_first_entry), 0, SEEK_SET) == -1)
     GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not seek device");
 
   if(device_write(device, private->partitions, partition_array_size) != partition_array_size)
@@ -712,6 +777,27 @@ static void gpt_private_enumerate_partitions(void* _private,
   GNUFDISK_LOG((DISKLABEL, "done perform enumerate_partitions"));
 }
 
+static int gpt_private_partition_guid(void* _private, struct object* _partition, unsigned char* _guid)
+{
+  struct gpt_private* private;
+  struct gpt_partition* part;
+  int iter;
+
+  gpt_private_check(_private);
+
+  private = _private;
+
+  for(iter = 0; iter < LE32_TO_CPU(private->header->npartitions); iter++)
+    if(private->children[iter] == _partition)
+      {
+	part = private->partitions + LE32_TO_CPU(private->header->partition_entry_size) * iter;
+	memcpy(_guid, part->id, sizeof(part->id));
+	return 0;
+      }
+
+  return -1;
+}
+
 static int gpt_private_partition_number(void* _private, struct object* _partition)
 {
   struct gpt_private* private;
@@ -761,11 +847,11 @@ static struct disklabel_implementation gpt_implementation = {
   remove_partition: &gpt_private_remove_partition,
   set_parameter: NULL, 
   /* set_parameter: &gpt_private_set_parameter, */
-  get_parameter: NULL,
-  /*get_parameter: &gpt_private_get_parameter,*/
+  get_parameter: &gpt_private_get_parameter,
   commit: &gpt_private_commit,
   enumerate_partitions: &gpt_private_enumerate_partitions,
   partition_number: &gpt_private_partition_number,
+  partition_guid: &gpt_private_partition_guid,
   delete: &gpt_private_delete
 };
 
@@ -786,10 +872,9 @@ int gpt_probe(struct object* _parent, struct disklabel_implementation* _implemen
 
   GNUFDISK_LOG((DISKLABEL, "start: %"PRId64, start));
 
-  if((gpt = malloc(sector_size)) == NULL)
-    THROW_ENOMEM;
+  gpt = arena_alloc(object_arena(_parent), sector_size);
 
-  gnufdisk_exception_register_unwind_handler(&free, gpt);
+  gnufdisk_exception_register_unwind_handler(&arena_free, gpt);
 
   if(device_seek(device, start, 0, SEEK_SET) == -1)
     GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "error seek to lba %" PRId64, start);
@@ -815,8 +900,7 @@ int gpt_probe(struct object* _parent, struct disklabel_implementation* _implemen
 
       GNUFDISK_LOG((DISKLABEL, "GPT signature match"));
 
-      if((private = malloc(sizeof(struct gpt_private))) == NULL)
-	THROW_ENOMEM;
+      private = arena_alloc(object_arena(_parent), sizeof(struct gpt_private));
 
       memset(private, 0, sizeof(struct gpt_private));
 
@@ -824,7 +908,7 @@ int gpt_probe(struct object* _parent, struct disklabel_implementation* _implemen
 
       private->header = gpt;
 
-      gnufdisk_exception_unregister_unwind_handler(&free, gpt); /* freed by delete_gpt_private */
+      gnufdisk_exception_unregister_unwind_handler(&arena_free, gpt); /* freed by delete_gpt_private */
       
       object_ref(_parent);
       private->parent = _parent;
@@ -838,8 +922,7 @@ int gpt_probe(struct object* _parent, struct disklabel_implementation* _implemen
 
       GNUFDISK_LOG((DISKLABEL, "array size: %"PRId64, partition_array_size));
 
-      if((private->partitions = malloc(partition_array_size)) == NULL)
-	THROW_ENOMEM;
+      private->partitions = arena_alloc(object_arena(_parent), partition_array_size);
 
       if(device_seek(device, LE64_TO_CPU(gpt->lba_first_entry), 0, SEEK_SET) == -1)
 	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not seek device");
@@ -848,8 +931,7 @@ int gpt_probe(struct object* _parent, struct disklabel_implementation* _implemen
 	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not read partition array");
 
       /* create children */
-      if((private->children = malloc(sizeof(struct object*) * LE32_TO_CPU(gpt->npartitions))) == NULL)
-	THROW_ENOMEM;
+      private->children = arena_alloc(object_arena(_parent), sizeof(struct object*) * LE32_TO_CPU(gpt->npartitions));
 
       memset(private->children, 0, sizeof(struct object*) * LE32_TO_CPU(gpt->npartitions));
 
@@ -871,8 +953,7 @@ int gpt_probe(struct object* _parent, struct disklabel_implementation* _implemen
 
       /* backup header */
 
-      if((private->backup_header = malloc(sector_size)) == NULL)
-	THROW_ENOMEM;
+      private->backup_header = arena_alloc(object_arena(_parent), sector_size);
 
       if(device_seek(device, LE64_TO_CPU(gpt->lba_copy), 0, SEEK_SET) == -1)
 	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not seek device");
@@ -901,8 +982,8 @@ int gpt_probe(struct object* _parent, struct disklabel_implementation* _implemen
   else
     {
       GNUFDISK_LOG((DISKLABEL, "GPT signature does not match"));
-      gnufdisk_exception_unregister_unwind_handler(&free, gpt);
-      free(gpt);
+      gnufdisk_exception_unregister_unwind_handler(&arena_free, gpt);
+      arena_free(gpt);
       ret = -1;
     }
 
@@ -915,8 +996,13 @@ void gpt_new(struct object* _parent, struct disklabel_implementation* _implement
 {
   struct object* device;
   struct gpt_header* header;
+  struct gpt_header* backup_header;
   struct gpt_private* private;
   gnufdisk_integer sector_size;
+  gnufdisk_integer start;
+  gnufdisk_integer end;
+  gnufdisk_integer partition_array_size;
+  gnufdisk_integer partition_array_sectors;
 
   GNUFDISK_LOG((DISKLABEL, "create new GPT disklabel using struct object* %p as parent", _parent));
 
@@ -924,31 +1010,60 @@ void gpt_new(struct object* _parent, struct disklabel_implementation* _implement
 
   sector_size = device_sector_size(device);
 
-  GNUFDISK_LOG((DISKLABEL, "sector size: %" PRId64, sector_size));
+  /* a label on the whole device keeps the first sector for the protective
+   * MBR, as the label nested in an EFI partition would see it */
+  start = object_start(_parent);
+  end = object_end(_parent);
 
-  if((header = malloc(sector_size)) == NULL)
-    THROW_ENOMEM;
+  if(start == 0)
+    start = 1;
 
-  gnufdisk_exception_register_unwind_handler(&free, header);
+  partition_array_size = GPT_PARTITIONS * GPT_PARTITION_ENTRY_SIZE;
+  partition_array_sectors = (partition_array_size + sector_size - 1) / sector_size;
 
-  memset(header, 0, sector_size);
-  memcpy(header->signature, "EFI PART", 8);
+  GNUFDISK_LOG((DISKLABEL, "sector size: %" PRId64, sector_size));
+  GNUFDISK_LOG((DISKLABEL, "header: %" PRId64 ", backup: %" PRId64, start, end));
 
-  if((private = malloc(sizeof(struct gpt_private))) == NULL)
-    THROW_ENOMEM;
+  if(end - start < 2 * partition_array_sectors + 2)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EGEOMETRY, NULL, "no room for a GPT disklabel");
 
-  gnufdisk_exception_register_unwind_handler(&free, private);
+  private = arena_alloc(object_arena(_parent), sizeof(struct gpt_private));
 
-  private->header = header;
+  gnufdisk_exception_register_unwind_handler(&delete_gpt_private, private);
 
   object_ref(_parent);
   private->parent = _parent;
 
+  private->header = header = arena_alloc(object_arena(_parent), sector_size);
+  private->backup_header = backup_header = arena_alloc(object_arena(_parent), sector_size);
+  private->partitions = arena_alloc(object_arena(_parent), partition_array_size);
+  private->children = arena_alloc(object_arena(_parent), sizeof(struct object*) * GPT_PARTITIONS);
+
+  memcpy(header->signature, "EFI PART", 8);
+  header->revision = CPU_TO_LE32(0x00010000);
+  header->size = CPU_TO_LE32(GPT_HEADER_SIZE);
+  header->lba_current = CPU_TO_LE64(start);
+  header->lba_copy = CPU_TO_LE64(end);
+  header->lba_first = CPU_TO_LE64(start + 1 + partition_array_sectors);
+  header->lba_last = CPU_TO_LE64(end - 1 - partition_array_sectors);
+  uuid_generate(header->guid);
+  header->lba_first_entry = CPU_TO_LE64(start + 1);
+  header->npartitions = CPU_TO_LE32(GPT_PARTITIONS);
+  header->partition_entry_size = CPU_TO_LE32(GPT_PARTITION_ENTRY_SIZE);
+  header->partition_crc32 = CPU_TO_LE32(efi_crc32(private->partitions, partition_array_size, ~0L) ^ ~0L);
+  header->header_crc32 = CPU_TO_LE32(efi_crc32(header, GPT_HEADER_SIZE, ~0L) ^ ~0L);
+
+  memcpy(backup_header, header, sizeof(struct gpt_header));
+  backup_header->lba_current = header->lba_copy;
+  backup_header->lba_copy = header->lba_current;
+  backup_header->lba_first_entry = CPU_TO_LE64(end - partition_array_sectors);
+  backup_header->header_crc32 = 0;
+  backup_header->header_crc32 = CPU_TO_LE32(efi_crc32(backup_header, GPT_HEADER_SIZE, ~0L) ^ ~0L);
+
   memcpy(_implementation, &gpt_implementation, sizeof(struct disklabel_implementation));
   _implementation->private = private;
 
-  gnufdisk_exception_unregister_unwind_handler(&free, header);
-  gnufdisk_exception_unregister_unwind_handler(&free, private);
+  gnufdisk_exception_unregister_unwind_handler(&delete_gpt_private, private);
 
   GNUFDISK_LOG((DISKLABEL, "done create new GPT disklabel"));
 }
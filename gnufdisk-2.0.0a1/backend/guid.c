@@ -135,7 +135,7 @@ static void guid_private_delete(void* _private)
   object_delete(private->parent);
   memset(private, 0, sizeof(struct guid_private));
 
-  free(private);
+  arena_free(private);
 
   GNUFDISK_LOG((PARTITION, "done perform delete"));
 }
@@ -168,10 +168,9 @@ struct object* guid_probe(struct object* _parent, gnufdisk_integer _start, gnufd
   GNUFDISK_LOG((PARTITION, "start: %"PRId64, _start));
   GNUFDISK_LOG((PARTITION, "end: %"PRId64, _end));
 
-  if((private = malloc(sizeof(struct guid_private))) == NULL)
-    THROW_ENOMEM;
+  private = arena_alloc(object_arena(_parent), sizeof(struct guid_private));
 
-  gnufdisk_exception_register_unwind_handler(&free, private);
+  gnufdisk_exception_register_unwind_handler(&arena_free, private);
 
   memcpy(&partition_implementation, &guid_implementation, sizeof(struct partition_implementation));
   partition_implementation.private = private;
@@ -179,7 +178,7 @@ struct object* guid_probe(struct object* _parent, gnufdisk_integer _start, gnufd
   ret = partition_new(_parent, _start, _end, &partition_implementation);
 
   gnufdisk_exception_register_unwind_handler(&delete_object, ret);
-  gnufdisk_exception_unregister_unwind_handler(&free, private);
+  gnufdisk_exception_unregister_unwind_handler(&arena_free, private);
 
   object_ref(_parent);
   private->parent = _parent;
@@ -208,10 +207,9 @@ struct object* guid_new(struct object* _parent, gnufdisk_integer _start, gnufdis
   GNUFDISK_LOG((PARTITION, "start: %" PRId64, _start));
   GNUFDISK_LOG((PARTITION, "end: %" PRId64, _end));
 
-  if((private = malloc(sizeof(struct guid_private))) == NULL)
-    THROW_ENOMEM;
+  private = arena_alloc(object_arena(_parent), sizeof(struct guid_private));
 
-  gnufdisk_exception_register_unwind_handler(&free, private);
+  gnufdisk_exception_register_unwind_handler(&arena_free, private);
   
   memcpy(&implementation, &guid_implementation, sizeof(struct partition_implementation));
   implementation.private = private;
@@ -219,7 +217,7 @@ struct object* guid_new(struct object* _parent, gnufdisk_integer _start, gnufdis
   ret = partition_new(_parent, _start, _end, &implementation);
 
   gnufdisk_exception_register_unwind_handler(&delete_object, ret);
-  gnufdisk_exception_unregister_unwind_handler(&free, private);
+  gnufdisk_exception_unregister_unwind_handler(&arena_free, private);
 
   object_ref(_parent);
   private->parent = _parent;
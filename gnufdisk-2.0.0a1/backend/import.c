@@ -0,0 +1,131 @@
+/* gnufdisk-seekable-import: write the seekable compressed image of a device
+ *
+ *   gnufdisk-seekable-import [-m MODULE] [-o OPTIONS] [-b FRAME-SIZE]
+ *                            [-l LEVEL] [-j THREADS] SOURCE IMAGE
+ *
+ * SOURCE is anything the module can open (a disk, a raw file, an nbd
+ * export, a qcow2 image...), opened read-only with OPTIONS. The image can
+ * then be opened in place of the device, see seekable.c. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dlfcn.h>
+
+#include <gnufdisk-common.h>
+#include <gnufdisk-debug.h>
+#include <gnufdisk-exception.h>
+#include <gnufdisk-device.h>
+
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#define IMPORT_MODULE "gnufdisk-backend"
+
+typedef void (*module_seekable_import_t)(const char* _options,
+					 const char* _source,
+					 const char* _dest,
+					 gnufdisk_integer _frame_size,
+					 int _level,
+					 int _threads);
+
+static void print_help(const char* _program)
+{
+  fprintf(stderr,
+	  "USAGE:\n"
+	  "  %s [-m MODULE] [-o OPTIONS] [-b FRAME-SIZE] [-l LEVEL] [-j THREADS] SOURCE IMAGE\n"
+	  "\n"
+	  "  -m MODULE      device module (default: " IMPORT_MODULE ")\n"
+	  "  -o OPTIONS     module options used to open SOURCE\n"
+	  "  -b FRAME-SIZE  bytes compressed together, a power of two (default: 65536)\n"
+	  "  -l LEVEL       deflate level, 0 to 9\n"
+	  "  -j THREADS     compression threads (default: one per CPU)\n"
+	  "\n"
+	  "Report bugs to %s\n"
+	  "\n",
+	  _program, PACKAGE_BUGREPORT);
+}
+
+int main(int _argc, char** _argv)
+{
+  module_seekable_import_t import;
+  const char* module_name;
+  const char* module_options;
+  char library[PATH_MAX];
+  gnufdisk_integer frame_size;
+  void* handle;
+  int threads;
+  int level;
+  int ret;
+  int opt;
+
+  module_name = IMPORT_MODULE;
+  module_options = "";
+  frame_size = 0;
+  level = -1;
+  threads = 0;
+
+  while((opt = getopt(_argc, _argv, "m:o:b:l:j:h")) != -1)
+    switch(opt)
+      {
+      case 'm':
+	module_name = optarg;
+	break;
+      case 'o':
+	module_options = optarg;
+	break;
+      case 'b':
+	frame_size = strtoll(optarg, NULL, 0);
+	break;
+      case 'l':
+	level = atoi(optarg);
+	break;
+      case 'j':
+	threads = atoi(optarg);
+	break;
+      default:
+	print_help(_argv[0]);
+	return EXIT_FAILURE;
+      }
+
+  if(optind != _argc - 2)
+    {
+      print_help(_argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  snprintf(library, sizeof(library), "%s.so", module_name);
+
+  if((handle = dlopen(library, RTLD_NOW)) == NULL)
+    {
+      fprintf(stderr, "%s: cannot open module: %s\n", _argv[0], dlerror());
+      return EXIT_FAILURE;
+    }
+
+  if((import = (module_seekable_import_t) dlsym(handle, "module_seekable_import")) == NULL)
+    {
+      fprintf(stderr, "%s: module `%s' can not write seekable images\n", _argv[0], library);
+      dlclose(handle);
+      return EXIT_FAILURE;
+    }
+
+  GNUFDISK_TRY(NULL, NULL)
+    {
+      (*import)(module_options, _argv[optind], _argv[optind + 1], frame_size, level, threads);
+      ret = 0;
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      fprintf(stderr, "%s: %s\n", _argv[0], exception_info.message);
+      ret = -1;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  dlclose(handle);
+
+  return ret != 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,8 +1,17 @@
+#define _GNU_SOURCE
+
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/sysmacros.h>
 #include <linux/hdreg.h>
+#include <linux/fs.h>
+#include <linux/blkpg.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <blkid/blkid.h>
+#include <stdio.h>
+#include <limits.h>
+#include <zlib.h>
 
 #include "common.h"
 
@@ -97,8 +106,70 @@ struct linux_device_private {
   gnufdisk_integer minimal_io;
   gnufdisk_integer optimal_io;
   gnufdisk_integer size;
+  gnufdisk_integer discard_granularity;
+  struct stat info;
+  char identity[128]; /* stable name of the device, used as probe cache key, empty if none */
 };
 
+static gnufdisk_integer get_label_stamp(struct linux_device_private* _private);
+
+static int read_sysfs_attribute(struct stat* _info, const char* _attribute, char* _dest, size_t _size)
+{
+  char path[PATH_MAX];
+  FILE* file;
+  char* end;
+
+  snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s", major(_info->st_rdev), minor(_info->st_rdev), _attribute);
+
+  if((file = fopen(path, "r")) == NULL)
+    return -1;
+
+  if(fgets(_dest, _size, file) == NULL)
+    {
+      fclose(file);
+      return -1;
+    }
+
+  fclose(file);
+
+  for(end = _dest + strlen(_dest); end > _dest && (end[-1] == '\n' || end[-1] == ' '); end--)
+    end[-1] = 0;
+
+  return *_dest != 0 ? 0 : -1;
+}
+
+static void get_device_identity(struct stat* _info, char* _dest, size_t _size)
+{
+  char buf[96];
+
+  if(S_ISREG(_info->st_mode))
+    snprintf(_dest, _size, "file-%" PRIx64 "-%" PRIx64, (uint64_t) _info->st_dev, (uint64_t) _info->st_ino);
+  else if(read_sysfs_attribute(_info, "device/wwid", buf, sizeof(buf)) == 0)
+    snprintf(_dest, _size, "wwn-%s", buf);
+  else if(read_sysfs_attribute(_info, "device/serial", buf, sizeof(buf)) == 0)
+    snprintf(_dest, _size, "serial-%s", buf);
+  else
+    *_dest = 0; /* major and minor change across reboots and hotplug */
+
+  GNUFDISK_LOG((DEVICE, "device identity: %s", _dest));
+}
+
+static gnufdisk_integer get_discard_granularity(struct stat* _info)
+{
+  char buf[32];
+  gnufdisk_integer ret;
+
+  /* hole punching works on file system blocks */
+  if(S_ISREG(_info->st_mode))
+    return _info->st_blksize;
+
+  if(read_sysfs_attribute(_info, "queue/discard_granularity", buf, sizeof(buf)) != 0
+     || sscanf(buf, "%lld", &ret) != 1)
+    ret = 0;
+
+  return ret;
+}
+
 static void linux_device_private_check(struct linux_device_private* _private)
 {
   if(gnufdisk_check_memory(_private, sizeof(struct linux_device_private), 0) != 0)
@@ -137,7 +208,7 @@ static gnufdisk_integer linux_device_end(void* _private)
 
   private = _private;
 
-  ret = private->size / private->sector_size;
+  ret = private->size / private->sector_size - 1;
 
   GNUFDISK_LOG((DEVICE, "done perform end, result: %" PRId64, ret));
 
@@ -203,6 +274,165 @@ static gnufdisk_integer linux_device_write(void* _private, const void* _buf, siz
   return ret;
 }
 
+static gnufdisk_integer linux_device_pread(void* _private, gnufdisk_integer _lba, void* _buf, size_t _size)
+{
+  struct linux_device_private* private;
+  gnufdisk_integer ret;
+
+  GNUFDISK_LOG((DEVICE, "perform pread on struct linux_device_private* %p", _private));
+
+  linux_device_private_check(_private);
+
+  private = _private;
+
+  ret = pread(private->fd, _buf, _size, _lba * private->sector_size);
+
+  GNUFDISK_LOG((DEVICE, "done perform pread, result: %" PRId64, ret));
+
+  return ret;
+}
+
+static gnufdisk_integer linux_device_seek_data(void* _private, gnufdisk_integer _lba, int _whence)
+{
+  struct linux_device_private* private;
+  gnufdisk_integer ret;
+
+  GNUFDISK_LOG((DEVICE, "perform seek_data on struct linux_device_private* %p", _private));
+
+  linux_device_private_check(_private);
+
+  private = _private;
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+  {
+    off_t position;
+    off_t offset;
+    int error;
+
+    position = lseek(private->fd, 0, SEEK_CUR);
+    offset = lseek(private->fd, _lba * private->sector_size, _whence);
+    error = errno;
+
+    if(lseek(private->fd, position, SEEK_SET) == -1)
+      GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not restore file offset");
+
+    errno = error;
+
+    if(offset == -1)
+      ret = -1;
+    else if(_whence == SEEK_DATA)
+      ret = offset / private->sector_size;
+    else
+      ret = (offset + private->sector_size - 1) / private->sector_size;
+  }
+#else
+  errno = EOPNOTSUPP;
+  ret = -1;
+#endif
+
+  GNUFDISK_LOG((DEVICE, "done perform seek_data, result: %" PRId64, ret));
+
+  return ret;
+}
+
+static int linux_device_zero(void* _private, gnufdisk_integer _lba, gnufdisk_integer _count)
+{
+  struct linux_device_private* private;
+  int ret;
+
+  GNUFDISK_LOG((DEVICE, "perform zero on struct linux_device_private* %p", _private));
+
+  linux_device_private_check(_private);
+
+  private = _private;
+
+  errno = EOPNOTSUPP;
+  ret = -1;
+
+  if(private->type == DEVICE_TYPE_FILE)
+    {
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+      ret = fallocate(private->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 
+		      _lba * private->sector_size, _count * private->sector_size);
+#endif
+    }
+  else
+    {
+#ifdef BLKZEROOUT
+      uint64_t range[2];
+
+      range[0] = _lba * private->sector_size;
+      range[1] = _count * private->sector_size;
+
+      if((ret = ioctl(private->fd, BLKZEROOUT, range)) == -1 && errno == ENOTTY)
+	errno = EOPNOTSUPP;
+#endif
+    }
+
+  GNUFDISK_LOG((DEVICE, "done perform zero, result: %d", ret));
+
+  return ret;
+}
+
+static int linux_device_discard(void* _private, gnufdisk_integer _lba, gnufdisk_integer _count, int _secure)
+{
+  struct linux_device_private* private;
+  int ret;
+
+  GNUFDISK_LOG((DEVICE, "perform discard on struct linux_device_private* %p", _private));
+
+  linux_device_private_check(_private);
+
+  private = _private;
+
+  errno = EOPNOTSUPP;
+  ret = -1;
+
+  if(private->type == DEVICE_TYPE_FILE)
+    {
+      /* a punched hole is not a secure erase */
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+      if(!_secure)
+	ret = fallocate(private->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 
+			_lba * private->sector_size, _count * private->sector_size);
+#endif
+    }
+  else
+    {
+#if defined(BLKDISCARD) && defined(BLKSECDISCARD)
+      uint64_t range[2];
+
+      range[0] = _lba * private->sector_size;
+      range[1] = _count * private->sector_size;
+
+      if((ret = ioctl(private->fd, _secure ? BLKSECDISCARD : BLKDISCARD, range)) == -1 && errno == ENOTTY)
+	errno = EOPNOTSUPP;
+#endif
+    }
+
+  GNUFDISK_LOG((DEVICE, "done perform discard, result: %d", ret));
+
+  return ret;
+}
+
+static gnufdisk_integer linux_device_discard_granularity(void* _private)
+{
+  struct linux_device_private* private;
+  gnufdisk_integer ret;
+
+  GNUFDISK_LOG((DEVICE, "perform discard_granularity on struct linux_device_private* %p", _private));
+
+  linux_device_private_check(_private);
+
+  private = _private;
+
+  ret = private->discard_granularity;
+
+  GNUFDISK_LOG((DEVICE, "done perform discard_granularity, result: %" PRId64, ret));
+
+  return ret;
+}
+
 static gnufdisk_integer linux_device_sector_size(void* _private)
 {
   struct linux_device_private* private;
@@ -232,7 +462,7 @@ static gnufdisk_integer linux_device_minimum_alignment(void* _private)
 
   private = _private;
 
-  ret = private->sector_size;
+  ret = private->minimal_io > private->sector_size ? private->minimal_io : private->sector_size;
 
   GNUFDISK_LOG((DEVICE, "done perform minimum_alignment, result: %" PRId64, ret));
 
@@ -250,7 +480,11 @@ static gnufdisk_integer linux_device_optimal_alignment(void* _private)
 
   private = _private;
 
-  ret = private->sector_size;
+  /* the stripe width of an array, 0 when the device does not report one */
+  if(private->optimal_io > 0 && private->optimal_io % private->sector_size == 0)
+    ret = private->optimal_io;
+  else
+    ret = private->minimal_io > private->sector_size ? private->minimal_io : private->sector_size;
 
   GNUFDISK_LOG((DEVICE, "done perform optimal_alignment, result: %" PRId64, ret));
 
@@ -425,6 +659,20 @@ static void linux_device_get_parameter(void *_private, struct gnufdisk_string* _
 
       *((gnufdisk_integer*) _dest) = private->sector_size;
     }
+  else if(strcasecmp(param, "IDENTITY") == 0)
+    {
+      if(_size <= strlen(private->identity))
+       GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETERSIZE, NULL, "invalid parameter size");
+
+      strcpy(_dest, private->identity);
+    }
+  else if(strcasecmp(param, "LABEL-STAMP") == 0)
+    {
+      if(_size != sizeof(gnufdisk_integer))
+       GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETERSIZE, NULL, "invalid parameter size");
+
+      *((gnufdisk_integer*) _dest) = get_label_stamp(private);
+    }
   else
    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETER, NULL, "invalid parameter: %s", param);
 
@@ -448,6 +696,245 @@ static void linux_device_commit(void* _private)
   GNUFDISK_LOG((DEVICE, "done perform linux_device_commit"));
 }
 
+#ifndef BLKPG_RESIZE_PARTITION
+# define BLKPG_RESIZE_PARTITION 3
+#endif
+
+static void free_pointer(void* _p)
+{
+  free(*((void**) _p));
+}
+
+/* the partitions the kernel has now for the disk, from sysfs */
+static struct device_partition* read_kernel_partitions(struct stat* _info, size_t* _count)
+{
+  char path[PATH_MAX];
+  struct device_partition* ret;
+  struct dirent* entry;
+  size_t size;
+  DIR* dir;
+
+  snprintf(path, sizeof(path), "/sys/dev/block/%u:%u", major(_info->st_rdev), minor(_info->st_rdev));
+
+  ret = NULL;
+  size = 0;
+  *_count = 0;
+
+  if((dir = opendir(path)) == NULL)
+    {
+      GNUFDISK_LOG((DEVICE, "can not open %s: %s", path, strerror(errno)));
+      return NULL;
+    }
+
+  while((entry = readdir(dir)) != NULL)
+    {
+      char attribute[NAME_MAX + 16];
+      char buf[32];
+      int number;
+      long long start;
+      long long length;
+
+      if(entry->d_name[0] == '.')
+	continue;
+
+      snprintf(attribute, sizeof(attribute), "%s/partition", entry->d_name);
+
+      if(read_sysfs_attribute(_info, attribute, buf, sizeof(buf)) != 0 || sscanf(buf, "%d", &number) != 1)
+	continue;
+
+      snprintf(attribute, sizeof(attribute), "%s/start", entry->d_name);
+
+      if(read_sysfs_attribute(_info, attribute, buf, sizeof(buf)) != 0 || sscanf(buf, "%lld", &start) != 1)
+	continue;
+
+      snprintf(attribute, sizeof(attribute), "%s/size", entry->d_name);
+
+      if(read_sysfs_attribute(_info, attribute, buf, sizeof(buf)) != 0 || sscanf(buf, "%lld", &length) != 1)
+	continue;
+
+      if(*_count == size)
+	{
+	  void* partitions;
+
+	  size = size > 0 ? size * 2 : 16;
+
+	  if((partitions = realloc(ret, size * sizeof(struct device_partition))) == NULL)
+	    {
+	      closedir(dir);
+	      free(ret);
+	      THROW_ENOMEM;
+	    }
+
+	  ret = partitions;
+	}
+
+      /* sysfs counts 512 byte sectors whatever the device sector size */
+      ret[*_count].number = number;
+      ret[*_count].start = start * 512;
+      ret[*_count].length = length * 512;
+      (*_count)++;
+    }
+
+  closedir(dir);
+
+  return ret;
+}
+
+/* Changes when the disklabel may have changed beyond its first sectors (an
+ * EBR, the backup GPT), without reading them: the size and modification
+ * time of an image, the partitions the kernel knows of a disk. 0 if there
+ * is nothing to tell. */
+static gnufdisk_integer get_label_stamp(struct linux_device_private* _private)
+{
+  struct device_partition* partitions;
+  size_t npartitions;
+  int64_t data[3];
+  char buf[32];
+  uint64_t ret;
+  size_t iter;
+
+  if(S_ISREG(_private->info.st_mode))
+    return probe_cache_file_stamp(_private->fd);
+  else if(!S_ISBLK(_private->info.st_mode))
+    return 0;
+
+  /* no partitions and no sysfs look the same below */
+  if(read_sysfs_attribute(&_private->info, "size", buf, sizeof(buf)) != 0)
+    return 0;
+
+  partitions = read_kernel_partitions(&_private->info, &npartitions);
+
+  /* sysfs lists the partitions in no particular order: add them up */
+  for(ret = (uint64_t) npartitions << 32, iter = 0; iter < npartitions; iter++)
+    {
+      data[0] = partitions[iter].number;
+      data[1] = partitions[iter].start;
+      data[2] = partitions[iter].length;
+
+      ret += crc32(0, (const Bytef*) data, sizeof(data));
+    }
+
+  free(partitions);
+
+  GNUFDISK_LOG((DEVICE, "label stamp: %" PRIx64, ret));
+
+  return ret != 0 ? (gnufdisk_integer) ret : 1;
+}
+
+static const struct device_partition* find_partition(const struct device_partition* _partitions, size_t _count, int _number)
+{
+  size_t iter;
+
+  for(iter = 0; iter < _count; iter++)
+    if(_partitions[iter].number == _number)
+      return &_partitions[iter];
+
+  return NULL;
+}
+
+static int blkpg_partition(struct linux_device_private* _private, int _op, const struct device_partition* _partition)
+{
+  static const char* operations[] = {
+    [BLKPG_ADD_PARTITION] = "add",
+    [BLKPG_DEL_PARTITION] = "remove",
+    [BLKPG_RESIZE_PARTITION] = "resize"
+  };
+  struct blkpg_ioctl_arg arg;
+  struct blkpg_partition partition;
+
+  GNUFDISK_LOG((DEVICE, "%s kernel partition %d: start %" PRId64 ", length %" PRId64,
+		operations[_op], _partition->number, _partition->start, _partition->length));
+
+  memset(&partition, 0, sizeof(partition));
+  partition.pno = _partition->number;
+  partition.start = _partition->start;
+  partition.length = _partition->length;
+
+  memset(&arg, 0, sizeof(arg));
+  arg.op = _op;
+  arg.datalen = sizeof(partition);
+  arg.data = &partition;
+
+  /* a busy partition keeps its old geometry until it is released, the
+   * table on disk is already written */
+  if(ioctl(_private->fd, BLKPG, &arg) != 0)
+    {
+      GNUFDISK_WARNING("the kernel can not %s partition %d: %s",
+		       operations[_op], _partition->number, strerror(errno));
+      return -1;
+    }
+
+  return 0;
+}
+
+static void linux_device_update_partitions(void* _private, const struct device_partition* _partitions, size_t _count)
+{
+  struct linux_device_private* private;
+  struct device_partition* kernel;
+  size_t nkernel;
+  size_t iter;
+  int shrink;
+
+  GNUFDISK_LOG((DEVICE, "perform update_partitions on struct linux_device_private* %p", _private));
+
+  linux_device_private_check(_private);
+
+  private = _private;
+
+  if(!S_ISBLK(private->info.st_mode))
+    {
+      GNUFDISK_LOG((DEVICE, "not a block device"));
+      return;
+    }
+
+  kernel = read_kernel_partitions(&private->info, &nkernel);
+
+  gnufdisk_exception_register_unwind_handler(&free_pointer, &kernel);
+
+  /* removed and moved partitions go first so that nothing added or grown
+   * overlaps them, then shrunk partitions make room for grown ones */
+  for(iter = 0; iter < nkernel; iter++)
+    {
+      const struct device_partition* partition;
+
+      partition = find_partition(_partitions, _count, kernel[iter].number);
+
+      /* no partition is numbered 0 */
+      if((partition == NULL || partition->start != kernel[iter].start)
+	 && blkpg_partition(private, BLKPG_DEL_PARTITION, &kernel[iter]) == 0)
+	kernel[iter].number = 0;
+    }
+
+  for(shrink = 1; shrink >= 0; shrink--)
+    for(iter = 0; iter < _count; iter++)
+      {
+	const struct device_partition* partition;
+
+	partition = find_partition(kernel, nkernel, _partitions[iter].number);
+
+	if(partition != NULL
+	   && partition->start == _partitions[iter].start
+	   && (shrink ? _partitions[iter].length < partition->length : _partitions[iter].length > partition->length))
+	  blkpg_partition(private, BLKPG_RESIZE_PARTITION, &_partitions[iter]);
+      }
+
+  for(iter = 0; iter < _count; iter++)
+    {
+      const struct device_partition* partition;
+
+      partition = find_partition(kernel, nkernel, _partitions[iter].number);
+
+      /* a busy partition that could not be removed is left alone */
+      if(partition == NULL)
+	blkpg_partition(private, BLKPG_ADD_PARTITION, &_partitions[iter]);
+    }
+
+  gnufdisk_exception_unregister_unwind_handler(&free_pointer, &kernel);
+
+  free(kernel);
+
+  GNUFDISK_LOG((DEVICE, "done perform update_partitions"));
+}
 
 static void linux_device_delete(void* _private)
 {
@@ -482,7 +969,13 @@ static struct device_implementation linux_device_implementation = {
     &linux_device_set_parameter,
     &linux_device_get_parameter,
     &linux_device_commit,
-    &linux_device_delete
+    &linux_device_delete,
+    &linux_device_seek_data,
+    &linux_device_zero,
+    &linux_device_discard,
+    &linux_device_discard_granularity,
+    &linux_device_pread,
+    &linux_device_update_partitions
 };
 
 int linux_device_probe(const char* _path, struct module_options* _options, struct device_implementation* _implementation)
@@ -492,6 +985,7 @@ int linux_device_probe(const char* _path, struct module_options* _options, struc
   struct hd_geometry geometry;
   blkid_probe probe;
   blkid_topology topology;
+  unsigned long long size;
 
   GNUFDISK_LOG((DEVICE, "perform linux_device_probe on %s", _path));
 
@@ -521,6 +1015,14 @@ int linux_device_probe(const char* _path, struct module_options* _options, struc
       GNUFDISK_LOG((DEVICE, "error open %s: %s", _path, strerror(errno)));
       goto lb_failure;
     }
+
+  /* probe size */
+  if(private->type == DEVICE_TYPE_FILE)
+    private->size = info.st_size;
+  else if(ioctl(private->fd, BLKGETSIZE64, &size) == 0)
+    private->size = size;
+  else
+    GNUFDISK_LOG((DEVICE, "error BLKGETSIZE64"));
  
   /* probe geometry */
   if(ioctl(private->fd, HDIO_GETGEO, &geometry) != 0)
@@ -548,12 +1050,17 @@ int linux_device_probe(const char* _path, struct module_options* _options, struc
       private->optimal_io = blkid_topology_get_optimal_io_size(topology);
     }
 
+  memcpy(&private->info, &info, sizeof(struct stat));
+  get_device_identity(&info, private->identity, sizeof(private->identity));
+  private->discard_granularity = get_discard_granularity(&info);
+
   GNUFDISK_LOG((DEVICE, "device geometry:"));
   GNUFDISK_LOG((DEVICE, "\tcylinders    : %" PRId64, private->cylinders));
   GNUFDISK_LOG((DEVICE, "\theads        : %" PRId64, private->heads));
   GNUFDISK_LOG((DEVICE, "\tsectors      : %" PRId64, private->sectors));
   GNUFDISK_LOG((DEVICE, "\tsector_size  : %" PRId64, private->sector_size));
   GNUFDISK_LOG((DEVICE, "\tfile size    : %" PRId64, private->size));
+  GNUFDISK_LOG((DEVICE, "\tdiscard gran.: %" PRId64, private->discard_granularity));
 
   memcpy(_implementation, &linux_device_implementation, sizeof(struct device_implementation));
   _implementation->private = private;
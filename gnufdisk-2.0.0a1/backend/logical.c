@@ -100,7 +100,7 @@ static int logical_private_read(void* _private, gnufdisk_integer _sector, void*
 
   GNUFDISK_LOG((PARTITION, "real_sector: %"PRId64, real_sector));
   
-  if(device_seek(device, real_sector, 0, SEEK_SET) != real_sector)
+  if(device_seek(device, real_sector, 0, SEEK_SET) == -1)
     GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not seek device");
 
   ret = device_read(device, _buf, _size);
@@ -129,7 +129,7 @@ static int logical_private_write(void* _private, gnufdisk_integer _sector, const
 
   GNUFDISK_LOG((PARTITION, "real_sector: %"PRId64, real_sector));
   
-  if(device_seek(device, real_sector, 0, SEEK_SET) != real_sector)
+  if(device_seek(device, real_sector, 0, SEEK_SET) == -1)
     GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not seek device");
 
   ret = device_write(device, _buf, _size);
@@ -160,7 +160,7 @@ static void logical_private_delete(void* _private)
 
   memset(private, 0, sizeof(struct logical_private));
 
-  free(private);
+  arena_free(private);
 
   GNUFDISK_LOG((PARTITION, "done perform delete"));
 }
@@ -191,10 +191,9 @@ struct object* logical_new(struct object* _parent, gnufdisk_integer _start, gnuf
   GNUFDISK_LOG((PARTITION, "start: %" PRId64, _start));
   GNUFDISK_LOG((PARTITION, "end: %" PRId64, _end));
 
-  if((private = malloc(sizeof(struct logical_private))) == NULL)
-    THROW_ENOMEM;
+  private = arena_alloc(object_arena(_parent), sizeof(struct logical_private));
 
-  gnufdisk_exception_register_unwind_handler(&free, private);
+  gnufdisk_exception_register_unwind_handler(&arena_free, private);
   
   memcpy(&implementation, &logical_implementation, sizeof(struct partition_implementation));
   implementation.private = private;
@@ -202,7 +201,7 @@ struct object* logical_new(struct object* _parent, gnufdisk_integer _start, gnuf
   ret = partition_new(_parent, _start, _end, &implementation);
 
   gnufdisk_exception_register_unwind_handler(&delete_object, ret);
-  gnufdisk_exception_unregister_unwind_handler(&free, private);
+  gnufdisk_exception_unregister_unwind_handler(&arena_free, private);
 
   object_ref(_parent);
   private->parent = _parent;
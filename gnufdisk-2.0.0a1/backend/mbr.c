@@ -268,7 +268,7 @@ static int mbr_private_count_partitions(void* _private)
 
   private = _private;
 
-  for(iter = 0; iter < 4; iter++)
+  for(ret = 0, iter = 0; iter < 4; iter++)
     if(private->data.partitions[iter].type != EMPTY)
       ret++; 
 
@@ -288,6 +288,7 @@ struct object* mbr_private_create_partition(void* _private,
   char* system;
   gnufdisk_integer sectors;
   gnufdisk_integer sector_size;
+  gnufdisk_integer grains[3];
   gnufdisk_integer start;
   gnufdisk_integer end;
   GNUFDISK_RETRY rp0;
@@ -305,7 +306,8 @@ struct object* mbr_private_create_partition(void* _private,
 
   private = _private;
 
-  /* aligns the beginning and the end  of the partition on cylinder  boundary */
+  /* aligns the beginning and the end of the partition on a track boundary
+   * when the range holds one, otherwise on the device alignment */
   device = object_cast(private->parent, OBJECT_TYPE_DEVICE);
 
   if((param = gnufdisk_string_new("SECTORS")) == NULL)
@@ -320,16 +322,20 @@ struct object* mbr_private_create_partition(void* _private,
   
   device_get_parameter(device, param, &sector_size, sizeof(gnufdisk_integer));
 
+  grains[0] = sectors;
+  grains[1] = device_optimal_alignment(device) / sector_size;
+  grains[2] = device_minimum_alignment(device) / sector_size;
+
   GNUFDISK_RETRY_SET(rp0);
 
-  start = math_round(gnufdisk_geometry_start(_start_range) + gnufdisk_geometry_length(_start_range) / 2, sectors);
-  end = math_round(gnufdisk_geometry_end(_end_range) - gnufdisk_geometry_length(_end_range) / 2, sectors);
+  start = disklabel_align(_start_range, grains, 3, 0, NULL);
+  end = disklabel_align(_end_range, grains, 3, 1, NULL);
 
   GNUFDISK_LOG((DISKLABEL, "aligned start: %" PRId64, start));
   GNUFDISK_LOG((DISKLABEL, "aligned end: %" PRId64, end));
 
   /* check that  the values remain within  the ranges indicated */
-  if(start < gnufdisk_geometry_start(_start_range) || start >= gnufdisk_geometry_end(_start_range) || start < object_start(private->parent))
+  if(start < gnufdisk_geometry_start(_start_range) || start > gnufdisk_geometry_end(_start_range) || start < object_start(private->parent))
     {
       union gnufdisk_device_exception_data data;
 
@@ -457,6 +463,7 @@ struct object* mbr_private_create_partition(void* _private,
   private->data.partitions[slot].last_sector = chs_from_lba(end, device);
   private->data.partitions[slot].first_lba = CPU_TO_LE32(start);
   private->data.partitions[slot].sectors = CPU_TO_LE32(end - start + 1);
+  private->children[slot] = ret;
 
   gnufdisk_exception_unregister_unwind_handler(&delete_string, param);
   gnufdisk_string_delete(param);
@@ -519,14 +526,30 @@ static void mbr_private_set_parameter(void* _private, struct gnufdisk_string* _p
 static void mbr_private_get_parameter(void* _private, struct gnufdisk_string* _param, void* _data, size_t _size)
 {
   struct mbr_private* private;
+  const char* param;
 
   GNUFDISK_LOG((DISKLABEL, "perform get_parameter on struct mbr_private* %p", _private));
 
   mbr_private_check(_private);
 
   private = _private;
+  param = gnufdisk_string_c_string(_param);
 
-  GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETER, NULL, "invalid parameter");
+  /* everything after the table */
+  if(strcasecmp(param, "FIRST-USABLE") == 0 || strcasecmp(param, "LAST-USABLE") == 0)
+    {
+      if(_size != sizeof(gnufdisk_integer))
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETERSIZE, NULL, "invalid parameter size");
+
+      if(strcasecmp(param, "FIRST-USABLE") == 0)
+	*(gnufdisk_integer*) _data = object_start(private->parent) + 1;
+      else
+	*(gnufdisk_integer*) _data = object_end(private->parent);
+    }
+  else
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETER, NULL, "invalid parameter: %s", param);
+
+  GNUFDISK_LOG((DISKLABEL, "done perform get_parameter"));
 }
 
 static void mbr_private_commit(void* _private)
@@ -624,7 +647,7 @@ static void mbr_private_delete(void* _private)
   object_delete(private->parent);
   
   memset(private, 0, sizeof(struct mbr_private));
-  free(private);
+  arena_free(private);
 
   GNUFDISK_LOG((DISKLABEL, "done perform delete"));
 }
@@ -681,10 +704,9 @@ int mbr_probe(struct object* _parent, struct disklabel_implementation* _implemen
 
       device = object_cast(_parent, OBJECT_TYPE_DEVICE);
 
-      if((private = malloc(sizeof(struct mbr_private))) == NULL)
-	THROW_ENOMEM;
+      private = arena_alloc(object_arena(_parent), sizeof(struct mbr_private));
 
-      gnufdisk_exception_register_unwind_handler(&free, private);
+      gnufdisk_exception_register_unwind_handler(&arena_free, private);
       
       memcpy(&private->data, &data, sizeof(struct mbr));
       
@@ -776,7 +798,7 @@ int mbr_probe(struct object* _parent, struct disklabel_implementation* _implemen
 		      private->data.partitions[iter].type,
 		      private->children[iter]));
 #endif /* GNUFDISK_DEBUG */
-      gnufdisk_exception_unregister_unwind_handler(&free, private);
+      gnufdisk_exception_unregister_unwind_handler(&arena_free, private);
 
 
       ret = 0;
@@ -795,10 +817,9 @@ void mbr_new(struct object* _parent, struct disklabel_implementation* _implement
 
   GNUFDISK_LOG((DISKLABEL, "create new MBR disklabel using struct object* %p as parent", _parent));
 
-  if((private = malloc(sizeof(struct mbr_private))) == NULL)
-    THROW_ENOMEM;
+  private = arena_alloc(object_arena(_parent), sizeof(struct mbr_private));
 
-  gnufdisk_exception_register_unwind_handler(&free, private);
+  gnufdisk_exception_register_unwind_handler(&arena_free, private);
 
   memset(private, 0, sizeof(struct mbr_private));
 
@@ -812,7 +833,7 @@ void mbr_new(struct object* _parent, struct disklabel_implementation* _implement
   memcpy(_implementation, &mbr_implementation, sizeof(struct disklabel_implementation));
   _implementation->private = private;
 
-  gnufdisk_exception_unregister_unwind_handler(&free, private);
+  gnufdisk_exception_unregister_unwind_handler(&arena_free, private);
 
   GNUFDISK_LOG((DISKLABEL, "done create MBR disklabel"));
 }
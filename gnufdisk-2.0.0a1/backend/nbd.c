@@ -0,0 +1,1827 @@
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <endian.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#include "common.h"
+
+/* NBD client: the device is an export of a Network Block Device server,
+ * reached over TCP (nbd://host[:port][/export]) or a Unix socket
+ * (nbd+unix:///[export]?socket=path) without the kernel nbd driver.
+ *
+ * Up to NBD_INFLIGHT requests are on the wire at once. Replies may come
+ * back in any order and are matched by handle. Writes do not wait for
+ * their reply: a failed write is reported by the next write or by the
+ * commit. Small reads go through a cache of NBD_CACHE_BLOCK_SIZE blocks
+ * and bring in the next NBD_READ_AHEAD blocks with the same round trip,
+ * which covers the scattered reads of a disklabel probe. Structured
+ * replies let the server send holes instead of zeros, and the
+ * base:allocation context answers seek_data. */
+
+#define NBD_DEFAULT_PORT "10809"
+#define NBD_INFLIGHT 16
+#define NBD_REQUEST_SIZE 262144 /* bytes per read or write request */
+#define NBD_ZERO_SIZE 1073741824 /* bytes per write zeroes or trim request */
+#define NBD_CACHE_BLOCK_SIZE 65536
+#define NBD_CACHE_BLOCKS 32
+#define NBD_READ_AHEAD 4
+
+#define NBD_MAGIC 0x4e42444d41474943ULL
+#define NBD_OPTION_MAGIC 0x49484156454f5054ULL
+#define NBD_OLDSTYLE_MAGIC 0x00420281861253ULL
+#define NBD_OPTION_REPLY_MAGIC 0x3e889045565a9ULL
+#define NBD_REQUEST_MAGIC 0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC 0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
+
+#define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_NO_ZEROES (1 << 1)
+
+#define NBD_FLAG_HAS_FLAGS (1 << 0)
+#define NBD_FLAG_READ_ONLY (1 << 1)
+#define NBD_FLAG_SEND_FLUSH (1 << 2)
+#define NBD_FLAG_SEND_TRIM (1 << 5)
+#define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6)
+
+enum {
+  NBD_OPT_EXPORT_NAME = 1,
+  NBD_OPT_ABORT = 2,
+  NBD_OPT_GO = 7,
+  NBD_OPT_STRUCTURED_REPLY = 8,
+  NBD_OPT_SET_META_CONTEXT = 10
+};
+
+enum {
+  NBD_REP_ACK = 1,
+  NBD_REP_INFO = 3,
+  NBD_REP_META_CONTEXT = 4
+};
+
+#define NBD_REP_ERR_UNSUP 0x80000001
+#define NBD_REP_IS_ERROR(_type) (((_type) & 0x80000000) != 0)
+
+enum {
+  NBD_INFO_EXPORT = 0,
+  NBD_INFO_BLOCK_SIZE = 3
+};
+
+enum {
+  NBD_CMD_READ = 0,
+  NBD_CMD_WRITE = 1,
+  NBD_CMD_DISC = 2,
+  NBD_CMD_FLUSH = 3,
+  NBD_CMD_TRIM = 4,
+  NBD_CMD_WRITE_ZEROES = 6,
+  NBD_CMD_BLOCK_STATUS = 7
+};
+
+#define NBD_REPLY_FLAG_DONE (1 << 0)
+
+enum {
+  NBD_REPLY_TYPE_NONE = 0,
+  NBD_REPLY_TYPE_OFFSET_DATA = 1,
+  NBD_REPLY_TYPE_OFFSET_HOLE = 2,
+  NBD_REPLY_TYPE_BLOCK_STATUS = 5
+};
+
+#define NBD_REPLY_TYPE_IS_ERROR(_type) (((_type) & 0x8000) != 0)
+#define NBD_REPLY_TYPE_ERROR_OFFSET 0x8002
+
+#define NBD_STATE_HOLE (1 << 0)
+
+#define NBD_ALLOCATION_CONTEXT "base:allocation"
+
+struct nbd_extent {
+  uint32_t length;
+  uint32_t flags;
+};
+
+/* requests waited for together; writes share one group that is never
+ * waited for, only checked */
+struct nbd_group {
+  int pending;
+  int error;
+  struct nbd_extent* extents; /* block status reply */
+  size_t nextents;
+};
+
+struct nbd_request {
+  int used;
+  uint64_t handle;
+  int type;
+  uint64_t offset;
+  uint32_t length;
+  unsigned char* dest; /* read data */
+  struct nbd_group* group;
+};
+
+struct nbd_block {
+  uint64_t offset;
+  uint32_t length;
+  unsigned long stamp;
+  int valid;
+  unsigned char* data;
+};
+
+struct nbd_device_private {
+  int fd;
+  pthread_mutex_t mutex;
+  char identity[128];
+  char* export_name;
+  uint64_t size;
+  uint16_t flags; /* transmission flags */
+  uint32_t min_block;
+  uint32_t preferred_block;
+  uint32_t max_block;
+  int no_zeroes;
+  int structured;
+  int allocation; /* base:allocation negotiated */
+  uint32_t allocation_id;
+  int readonly;
+  int broken; /* errno that killed the connection, 0 while it works */
+  uint64_t cookie;
+  struct nbd_request requests[NBD_INFLIGHT];
+  int inflight;
+  struct nbd_group writes;
+  struct nbd_block cache[NBD_CACHE_BLOCKS];
+  unsigned long clock;
+  gnufdisk_integer position;
+  gnufdisk_integer cylinders;
+  gnufdisk_integer heads;
+  gnufdisk_integer sectors;
+  gnufdisk_integer sector_size;
+};
+
+static int nbd_send(struct nbd_device_private* _private, const void* _buf, size_t _size, int _more)
+{
+  const unsigned char* buf;
+
+  buf = _buf;
+
+  while(_size > 0)
+    {
+      ssize_t ret;
+
+      if((ret = send(_private->fd, buf, _size, MSG_NOSIGNAL | (_more ? MSG_MORE : 0))) == -1)
+	{
+	  if(errno == EINTR)
+	    continue;
+
+	  return -1;
+	}
+
+      buf += ret;
+      _size -= ret;
+    }
+
+  return 0;
+}
+
+static int nbd_recv(struct nbd_device_private* _private, void* _buf, size_t _size)
+{
+  unsigned char* buf;
+
+  buf = _buf;
+
+  while(_size > 0)
+    {
+      ssize_t ret;
+
+      if((ret = recv(_private->fd, buf, _size, 0)) == -1)
+	{
+	  if(errno == EINTR)
+	    continue;
+
+	  return -1;
+	}
+      else if(ret == 0)
+	{
+	  errno = ECONNRESET;
+	  return -1;
+	}
+
+      buf += ret;
+      _size -= ret;
+    }
+
+  return 0;
+}
+
+static int nbd_skip(struct nbd_device_private* _private, size_t _size)
+{
+  unsigned char buf[512];
+
+  while(_size > 0)
+    {
+      size_t n;
+
+      n = _size < sizeof(buf) ? _size : sizeof(buf);
+
+      if(nbd_recv(_private, buf, n) != 0)
+	return -1;
+
+      _size -= n;
+    }
+
+  return 0;
+}
+
+/* the connection is unusable: fail everything in flight */
+static void nbd_break(struct nbd_device_private* _private, int _error)
+{
+  int iter;
+
+  GNUFDISK_LOG((DEVICE, "nbd connection broken: %s", strerror(_error)));
+
+  if(_private->broken == 0)
+    _private->broken = _error;
+
+  for(iter = 0; iter < NBD_INFLIGHT; iter++)
+    if(_private->requests[iter].used)
+      {
+	struct nbd_group* group;
+
+	group = _private->requests[iter].group;
+
+	if(group->error == 0)
+	  group->error = _private->broken;
+
+	group->pending--;
+	_private->requests[iter].used = 0;
+      }
+
+  _private->inflight = 0;
+}
+
+static struct nbd_request* nbd_find(struct nbd_device_private* _private, uint64_t _handle)
+{
+  int iter;
+
+  for(iter = 0; iter < NBD_INFLIGHT; iter++)
+    if(_private->requests[iter].used && _private->requests[iter].handle == _handle)
+      return &_private->requests[iter];
+
+  return NULL;
+}
+
+static void nbd_complete(struct nbd_device_private* _private, struct nbd_request* _request, int _error)
+{
+  if(_error != 0 && _request->group->error == 0)
+    _request->group->error = _error;
+
+  _request->group->pending--;
+  _request->used = 0;
+  _private->inflight--;
+}
+
+/* payload of one structured reply chunk, -1 with errno on protocol errors */
+static int nbd_receive_chunk(struct nbd_device_private* _private,
+			     struct nbd_request* _request,
+			     uint16_t _type,
+			     uint32_t _length)
+{
+  uint64_t offset;
+
+  if(_type == NBD_REPLY_TYPE_NONE)
+    return _length == 0 ? 0 : nbd_skip(_private, _length);
+  else if(_type == NBD_REPLY_TYPE_OFFSET_DATA || _type == NBD_REPLY_TYPE_OFFSET_HOLE)
+    {
+      uint32_t size;
+
+      if(_request->type != NBD_CMD_READ
+	 || _length < sizeof(offset) + (_type == NBD_REPLY_TYPE_OFFSET_HOLE ? sizeof(size) : 0)
+	 || nbd_recv(_private, &offset, sizeof(offset)) != 0)
+	goto lb_protocol;
+
+      offset = be64toh(offset);
+
+      if(_type == NBD_REPLY_TYPE_OFFSET_DATA)
+	size = _length - sizeof(offset);
+      else if(nbd_recv(_private, &size, sizeof(size)) != 0)
+	return -1;
+      else
+	size = be32toh(size);
+
+      if(offset < _request->offset || offset + size > _request->offset + _request->length)
+	goto lb_protocol;
+
+      if(_type == NBD_REPLY_TYPE_OFFSET_DATA)
+	return nbd_recv(_private, _request->dest + (offset - _request->offset), size);
+
+      memset(_request->dest + (offset - _request->offset), 0, size);
+
+      return 0;
+    }
+  else if(_type == NBD_REPLY_TYPE_BLOCK_STATUS)
+    {
+      struct nbd_group* group;
+      uint32_t id;
+      size_t iter;
+      size_t n;
+
+      if(_request->type != NBD_CMD_BLOCK_STATUS
+	 || _length < sizeof(id) + sizeof(struct nbd_extent)
+	 || (_length - sizeof(id)) % sizeof(struct nbd_extent) != 0
+	 || nbd_recv(_private, &id, sizeof(id)) != 0)
+	goto lb_protocol;
+
+      if(be32toh(id) != _private->allocation_id)
+	return nbd_skip(_private, _length - sizeof(id));
+
+      group = _request->group;
+      n = (_length - sizeof(id)) / sizeof(struct nbd_extent);
+
+      if((group->extents = realloc(group->extents, (group->nextents + n) * sizeof(struct nbd_extent))) == NULL)
+	{
+	  group->nextents = 0;
+	  return -1;
+	}
+
+      if(nbd_recv(_private, group->extents + group->nextents, n * sizeof(struct nbd_extent)) != 0)
+	return -1;
+
+      for(iter = group->nextents; iter < group->nextents + n; iter++)
+	{
+	  group->extents[iter].length = be32toh(group->extents[iter].length);
+	  group->extents[iter].flags = be32toh(group->extents[iter].flags);
+	}
+
+      group->nextents += n;
+
+      return 0;
+    }
+  else if(NBD_REPLY_TYPE_IS_ERROR(_type))
+    {
+      uint32_t error;
+      uint16_t message;
+
+      if(_length < sizeof(error) + sizeof(message)
+	 || nbd_recv(_private, &error, sizeof(error)) != 0
+	 || nbd_recv(_private, &message, sizeof(message)) != 0)
+	goto lb_protocol;
+
+      error = be32toh(error);
+
+      GNUFDISK_LOG((DEVICE, "nbd error reply %u to handle %" PRIu64, error, _request->handle));
+
+      if(_request->group->error == 0)
+	_request->group->error = error != 0 ? error : EIO;
+
+      return nbd_skip(_private, _length - sizeof(error) - sizeof(message));
+    }
+
+  /* unknown informational chunks can be ignored */
+  return nbd_skip(_private, _length);
+
+lb_protocol:
+
+  errno = EPROTO;
+  return -1;
+}
+
+/* receive one reply (or one chunk of a structured reply), -1 when the
+ * connection broke */
+static int nbd_receive(struct nbd_device_private* _private)
+{
+  struct nbd_request* request;
+  uint32_t magic;
+
+  if(nbd_recv(_private, &magic, sizeof(magic)) != 0)
+    goto lb_broken;
+
+  if(be32toh(magic) == NBD_SIMPLE_REPLY_MAGIC)
+    {
+      struct {
+	uint32_t error;
+	uint64_t handle;
+      } __attribute__((packed)) reply;
+
+      if(nbd_recv(_private, &reply, sizeof(reply)) != 0)
+	goto lb_broken;
+
+      if((request = nbd_find(_private, be64toh(reply.handle))) == NULL)
+	goto lb_protocol;
+
+      reply.error = be32toh(reply.error);
+
+      /* a simple reply to a read carries the data, unless it failed */
+      if(reply.error == 0 && request->type == NBD_CMD_READ
+	 && nbd_recv(_private, request->dest, request->length) != 0)
+	goto lb_broken;
+
+      nbd_complete(_private, request, reply.error);
+    }
+  else if(be32toh(magic) == NBD_STRUCTURED_REPLY_MAGIC && _private->structured)
+    {
+      struct {
+	uint16_t flags;
+	uint16_t type;
+	uint64_t handle;
+	uint32_t length;
+      } __attribute__((packed)) chunk;
+
+      if(nbd_recv(_private, &chunk, sizeof(chunk)) != 0)
+	goto lb_broken;
+
+      if((request = nbd_find(_private, be64toh(chunk.handle))) == NULL)
+	goto lb_protocol;
+
+      if(nbd_receive_chunk(_private, request, be16toh(chunk.type), be32toh(chunk.length)) != 0)
+	goto lb_broken;
+
+      if(be16toh(chunk.flags) & NBD_REPLY_FLAG_DONE)
+	nbd_complete(_private, request, 0);
+    }
+  else
+    goto lb_protocol;
+
+  return 0;
+
+lb_protocol:
+
+  errno = EPROTO;
+
+lb_broken:
+
+  nbd_break(_private, errno);
+
+  return -1;
+}
+
+static struct nbd_request* nbd_submit(struct nbd_device_private* _private,
+				      int _type,
+				      uint64_t _offset,
+				      uint32_t _length,
+				      const void* _data,
+				      void* _dest,
+				      struct nbd_group* _group)
+{
+  struct nbd_request* request;
+  struct {
+    uint32_t magic;
+    uint16_t flags;
+    uint16_t type;
+    uint64_t handle;
+    uint64_t offset;
+    uint32_t length;
+  } __attribute__((packed)) header;
+  int iter;
+
+  while(_private->inflight == NBD_INFLIGHT && _private->broken == 0)
+    nbd_receive(_private);
+
+  if(_private->broken)
+    {
+      if(_group->error == 0)
+	_group->error = _private->broken;
+
+      errno = _private->broken;
+      return NULL;
+    }
+
+  for(iter = 0; _private->requests[iter].used; iter++);
+
+  request = &_private->requests[iter];
+
+  request->used = 1;
+  request->handle = ++_private->cookie;
+  request->type = _type;
+  request->offset = _offset;
+  request->length = _length;
+  request->dest = _dest;
+  request->group = _group;
+
+  _group->pending++;
+  _private->inflight++;
+
+  header.magic = htobe32(NBD_REQUEST_MAGIC);
+  header.flags = 0;
+  header.type = htobe16(_type);
+  header.handle = htobe64(request->handle);
+  header.offset = htobe64(_offset);
+  header.length = htobe32(_length);
+
+  if(nbd_send(_private, &header, sizeof(header), _data != NULL) != 0
+     || (_data != NULL && nbd_send(_private, _data, _length, 0) != 0))
+    {
+      nbd_break(_private, errno);
+      return NULL;
+    }
+
+  return request;
+}
+
+/* wait for every request of _group, return its error (0 on success) */
+static int nbd_wait(struct nbd_device_private* _private, struct nbd_group* _group)
+{
+  while(_group->pending > 0)
+    if(nbd_receive(_private) != 0)
+      break;
+
+  return _group->error;
+}
+
+/* writes complete in any order: wait for those overlapping a range before
+ * reading or writing it again */
+static int nbd_wait_writes(struct nbd_device_private* _private, uint64_t _offset, uint64_t _length)
+{
+  int iter;
+
+  for(iter = 0; iter < NBD_INFLIGHT; iter++)
+    while(_private->requests[iter].used
+	  && _private->requests[iter].group == &_private->writes
+	  && _private->requests[iter].offset < _offset + _length
+	  && _offset < _private->requests[iter].offset + _private->requests[iter].length)
+      if(nbd_receive(_private) != 0)
+	return -1;
+
+  return 0;
+}
+
+/* report (once) a failure of a write that was not waited for */
+static int nbd_write_error(struct nbd_device_private* _private)
+{
+  int error;
+
+  if((error = _private->writes.error) == 0)
+    return 0;
+
+  _private->writes.error = 0;
+  errno = error;
+
+  return -1;
+}
+
+static gnufdisk_integer nbd_read_direct(struct nbd_device_private* _private, uint64_t _offset, void* _buf, size_t _size)
+{
+  struct nbd_group group;
+  uint32_t chunk;
+  size_t done;
+
+  memset(&group, 0, sizeof(group));
+
+  chunk = _private->max_block < NBD_REQUEST_SIZE ? _private->max_block : NBD_REQUEST_SIZE;
+
+  for(done = 0; done < _size; done += chunk)
+    {
+      uint32_t n;
+
+      n = _size - done < chunk ? _size - done : chunk;
+
+      if(nbd_submit(_private, NBD_CMD_READ, _offset + done, n, NULL, (unsigned char*) _buf + done, &group) == NULL)
+	break;
+    }
+
+  if(nbd_wait(_private, &group) != 0)
+    {
+      errno = group.error;
+      return -1;
+    }
+
+  return _size;
+}
+
+static struct nbd_block* nbd_cache_lookup(struct nbd_device_private* _private, uint64_t _offset)
+{
+  int iter;
+
+  for(iter = 0; iter < NBD_CACHE_BLOCKS; iter++)
+    if(_private->cache[iter].valid && _private->cache[iter].offset == _offset)
+      return &_private->cache[iter];
+
+  return NULL;
+}
+
+static void nbd_cache_update(struct nbd_device_private* _private, uint64_t _offset, const void* _buf, size_t _size)
+{
+  int iter;
+
+  for(iter = 0; iter < NBD_CACHE_BLOCKS; iter++)
+    {
+      struct nbd_block* block;
+      uint64_t start;
+      uint64_t end;
+
+      block = &_private->cache[iter];
+
+      if(!block->valid || block->offset >= _offset + _size || _offset >= block->offset + block->length)
+	continue;
+
+      start = _offset > block->offset ? _offset : block->offset;
+      end = _offset + _size < block->offset + block->length ? _offset + _size : block->offset + block->length;
+
+      if(_buf)
+	memcpy(block->data + (start - block->offset), (const unsigned char*) _buf + (start - _offset), end - start);
+      else
+	block->valid = 0;
+    }
+}
+
+static gnufdisk_integer nbd_read_cached(struct nbd_device_private* _private, uint64_t _offset, void* _buf, size_t _size)
+{
+  struct nbd_block* filling[NBD_CACHE_BLOCKS];
+  struct nbd_group group;
+  unsigned long now;
+  uint64_t first;
+  uint64_t last;
+  uint64_t block;
+  int nfilling;
+  int iter;
+  size_t done;
+
+  memset(&group, 0, sizeof(group));
+
+  first = _offset / NBD_CACHE_BLOCK_SIZE;
+  last = (_offset + _size - 1) / NBD_CACHE_BLOCK_SIZE + NBD_READ_AHEAD;
+
+  if(last > (_private->size - 1) / NBD_CACHE_BLOCK_SIZE)
+    last = (_private->size - 1) / NBD_CACHE_BLOCK_SIZE;
+
+  now = ++_private->clock;
+
+  /* first keep the blocks already there, then reuse the oldest ones */
+  for(block = first; block <= last; block++)
+    {
+      struct nbd_block* cached;
+
+      if((cached = nbd_cache_lookup(_private, block * NBD_CACHE_BLOCK_SIZE)) != NULL)
+	cached->stamp = now;
+    }
+
+  nfilling = 0;
+
+  for(block = first; block <= last; block++)
+    {
+      struct nbd_block* victim;
+
+      if(nbd_cache_lookup(_private, block * NBD_CACHE_BLOCK_SIZE) != NULL)
+	continue;
+
+      victim = &_private->cache[0];
+
+      for(iter = 1; iter < NBD_CACHE_BLOCKS; iter++)
+	if(_private->cache[iter].stamp < victim->stamp)
+	  victim = &_private->cache[iter];
+
+      if(victim->data == NULL && (victim->data = malloc(NBD_CACHE_BLOCK_SIZE)) == NULL)
+	{
+	  group.error = ENOMEM;
+	  break;
+	}
+
+      victim->offset = block * NBD_CACHE_BLOCK_SIZE;
+      victim->length = _private->size - victim->offset < NBD_CACHE_BLOCK_SIZE ? _private->size - victim->offset : NBD_CACHE_BLOCK_SIZE;
+      victim->stamp = now;
+      victim->valid = 0;
+
+      filling[nfilling++] = victim;
+
+      if(nbd_submit(_private, NBD_CMD_READ, victim->offset, victim->length, NULL, victim->data, &group) == NULL)
+	break;
+    }
+
+  if(nbd_wait(_private, &group) != 0)
+    {
+      errno = group.error;
+      return -1;
+    }
+
+  for(iter = 0; iter < nfilling; iter++)
+    filling[iter]->valid = 1;
+
+  for(done = 0; done < _size; )
+    {
+      struct nbd_block* cached;
+      uint64_t offset;
+      size_t n;
+
+      offset = _offset + done;
+      cached = nbd_cache_lookup(_private, offset - offset % NBD_CACHE_BLOCK_SIZE);
+
+      n = cached->offset + cached->length - offset;
+
+      if(n > _size - done)
+	n = _size - done;
+
+      memcpy((unsigned char*) _buf + done, cached->data + (offset - cached->offset), n);
+      done += n;
+    }
+
+  return _size;
+}
+
+static gnufdisk_integer nbd_read_at(struct nbd_device_private* _private, uint64_t _offset, void* _buf, size_t _size)
+{
+  if(_offset >= _private->size)
+    return 0;
+
+  if(_size > _private->size - _offset)
+    _size = _private->size - _offset;
+
+  if(_size == 0)
+    return 0;
+
+  if(nbd_wait_writes(_private, _offset, _size) != 0)
+    return -1;
+
+  if(_size > NBD_CACHE_BLOCKS / 2 * NBD_CACHE_BLOCK_SIZE - 2 * NBD_CACHE_BLOCK_SIZE)
+    return nbd_read_direct(_private, _offset, _buf, _size);
+
+  return nbd_read_cached(_private, _offset, _buf, _size);
+}
+
+static gnufdisk_integer nbd_write_at(struct nbd_device_private* _private, uint64_t _offset, const void* _buf, size_t _size)
+{
+  uint32_t chunk;
+  size_t done;
+
+  if(_private->readonly)
+    {
+      errno = EROFS;
+      return -1;
+    }
+
+  if(nbd_write_error(_private) != 0)
+    return -1;
+
+  if(_offset >= _private->size)
+    {
+      errno = ENOSPC;
+      return -1;
+    }
+
+  if(_size > _private->size - _offset)
+    _size = _private->size - _offset;
+
+  if(nbd_wait_writes(_private, _offset, _size) != 0)
+    return -1;
+
+  nbd_cache_update(_private, _offset, _buf, _size);
+
+  chunk = _private->max_block < NBD_REQUEST_SIZE ? _private->max_block : NBD_REQUEST_SIZE;
+
+  for(done = 0; done < _size; done += chunk)
+    {
+      uint32_t n;
+
+      n = _size - done < chunk ? _size - done : chunk;
+
+      if(nbd_submit(_private, NBD_CMD_WRITE, _offset + done, n, (const unsigned char*) _buf + done, NULL, &_private->writes) == NULL)
+	return nbd_write_error(_private);
+    }
+
+  return _size;
+}
+
+/* write zeroes or trim a range and wait for the result */
+static int nbd_clear(struct nbd_device_private* _private, int _type, uint64_t _offset, uint64_t _length)
+{
+  struct nbd_group group;
+  uint64_t done;
+
+  if(_private->readonly)
+    {
+      errno = EROFS;
+      return -1;
+    }
+
+  if(nbd_wait_writes(_private, _offset, _length) != 0)
+    return -1;
+
+  nbd_cache_update(_private, _offset, NULL, _length);
+
+  memset(&group, 0, sizeof(group));
+
+  for(done = 0; done < _length; done += NBD_ZERO_SIZE)
+    if(nbd_submit(_private, _type, _offset + done,
+		  _length - done < NBD_ZERO_SIZE ? _length - done : NBD_ZERO_SIZE,
+		  NULL, NULL, &group) == NULL)
+      break;
+
+  if(nbd_wait(_private, &group) != 0)
+    {
+      errno = group.error;
+      return -1;
+    }
+
+  return 0;
+}
+
+static void nbd_device_private_check(struct nbd_device_private* _private)
+{
+  if(gnufdisk_check_memory(_private, sizeof(struct nbd_device_private), 0) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL, "invalid struct nbd_device_private* %p", _private);
+
+  if(_private->fd < 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL, "invalid socket: %d", _private->fd);
+}
+
+static gnufdisk_integer nbd_device_start(void* _private)
+{
+  GNUFDISK_LOG((DEVICE, "perform start on struct nbd_device_private* %p", _private));
+
+  nbd_device_private_check(_private);
+
+  GNUFDISK_LOG((DEVICE, "done perform start, result: 0"));
+
+  return 0;
+}
+
+static gnufdisk_integer nbd_device_end(void* _private)
+{
+  struct nbd_device_private* private;
+  gnufdisk_integer ret;
+
+  GNUFDISK_LOG((DEVICE, "perform end on struct nbd_device_private* %p", _private));
+
+  nbd_device_private_check(_private);
+
+  private = _private;
+
+  ret = private->size / private->sector_size - 1;
+
+  GNUFDISK_LOG((DEVICE, "done perform end, result: %" PRId64, ret));
+
+  return ret;
+}
+
+static gnufdisk_integer nbd_device_seek(void* _private, gnufdisk_integer _lba, gnufdisk_integer _offset, int _whence)
+{
+  struct nbd_device_private* private;
+  gnufdisk_integer offset;
+  gnufdisk_integer ret;
+
+  GNUFDISK_LOG((DEVICE, "perform seek on struct nbd_device_private* %p", _private));
+
+  nbd_device_private_check(_private);
+
+  private = _private;
+
+  offset = _lba * private->sector_size + _offset;
+
+  if(_whence == SEEK_CUR)
+    offset += private->position;
+  else if(_whence == SEEK_END)
+    offset += private->size;
+  else if(_whence != SEEK_SET)
+    offset = -1;
+
+  if(offset < 0)
+    {
+      errno = EINVAL;
+      ret = -1;
+    }
+  else
+    ret = private->position = offset;
+
+  GNUFDISK_LOG((DEVICE, "done perform seek, result: %" PRId64, ret));
+
+  return ret;
+}
+
+static gnufdisk_integer nbd_device_read(void* _private, void* _buf, size_t _size)
+{
+  struct nbd_device_private* private;
+  gnufdisk_integer ret;
+
+  GNUFDISK_LOG((DEVICE, "perform read on struct nbd_device_private* %p", _private));
+
+  nbd_device_private_check(_private);
+
+  private = _private;
+
+  pthread_mutex_lock(&private->mutex);
+
+  if((ret = nbd_read_at(private, private->position, _buf, _size)) > 0)
+    private->position += ret;
+
+  pthread_mutex_unlock(&private->mutex);
+
+  GNUFDISK_LOG((DEVICE, "done perform read, result: %" PRId64, ret));
+
+  return ret;
+}
+
+static gnufdisk_integer nbd_device_write(void* _private, const void* _buf, size_t _size)
+{
+  struct nbd_device_private* private;
+  gnufdisk_integer ret;
+
+  GNUFDISK_LOG((DEVICE, "perform write on struct nbd_device_private* %p", _private));
+
+  nbd_device_private_check(_private);
+
+  private = _private;
+
+  pthread_mutex_lock(&private->mutex);
+
+  if((ret = nbd_write_at(private, private->position, _buf, _size)) > 0)
+    private->position += ret;
+
+  pthread_mutex_unlock(&private->mutex);
+
+  GNUFDISK_LOG((DEVICE, "done perform write, result: %" PRId64, ret));
+
+  return ret;
+}
+
+static gnufdisk_integer nbd_device_pread(void* _private, gnufdisk_integer _lba, void* _buf, size_t _size)
+{
+  struct nbd_device_private* private;
+  gnufdisk_integer ret;
+
+  GNUFDISK_LOG((DEVICE, "perform pread on struct nbd_device_private* %p", _private));
+
+  nbd_device_private_check(_private);
+
+  private = _private;
+
+  pthread_mutex_lock(&private->mutex);
+
+  ret = nbd_read_at(private, _lba * private->sector_size, _buf, _size);
+
+  pthread_mutex_unlock(&private->mutex);
+
+  GNUFDISK_LOG((DEVICE, "done perform pread, result: %" PRId64, ret));
+
+  return ret;
+}
+
+static gnufdisk_integer nbd_device_seek_data(void* _private, gnufdisk_integer _lba, int _whence)
+{
+  struct nbd_device_private* private;
+  gnufdisk_integer ret;
+  uint64_t offset;
+
+  GNUFDISK_LOG((DEVICE, "perform seek_data on struct nbd_device_private* %p", _private));
+
+  nbd_device_private_check(_private);
+
+  private = _private;
+
+  if(!private->allocation)
+    {
+      errno = EOPNOTSUPP;
+      return -1;
+    }
+
+  pthread_mutex_lock(&private->mutex);
+
+  offset = _lba * private->sector_size;
+  ret = -1;
+  errno = ENXIO;
+
+  while(offset < private->size)
+    {
+      struct nbd_group group;
+      uint64_t length;
+      uint64_t start;
+      size_t iter;
+
+      memset(&group, 0, sizeof(group));
+
+      length = private->size - offset < NBD_ZERO_SIZE ? private->size - offset : NBD_ZERO_SIZE;
+
+      if(nbd_wait_writes(private, offset, length) != 0)
+	break;
+
+      start = offset;
+
+      nbd_submit(private, NBD_CMD_BLOCK_STATUS, offset, length, NULL, NULL, &group);
+
+      if(nbd_wait(private, &group) != 0 || group.nextents == 0)
+	{
+	  errno = group.error != 0 ? group.error : EPROTO;
+	  free(group.extents);
+	  break;
+	}
+
+      for(iter = 0; iter < group.nextents && ret == -1; iter++)
+	{
+	  int hole;
+
+	  hole = (group.extents[iter].flags & NBD_STATE_HOLE) != 0;
+
+	  if(hole == (_whence == SEEK_HOLE))
+	    ret = offset;
+	  else
+	    offset += group.extents[iter].length;
+	}
+
+      free(group.extents);
+
+      if(ret != -1)
+	break;
+      else if(offset == start)
+	{
+	  errno = EPROTO;
+	  break;
+	}
+    }
+
+  /* like lseek, the end of the device is a hole */
+  if(ret == -1 && offset >= private->size && _whence == SEEK_HOLE)
+    ret = private->size;
+
+  pthread_mutex_unlock(&private->mutex);
+
+  if(ret != -1)
+    ret = _whence == SEEK_DATA ? ret / private->sector_size : (ret + private->sector_size - 1) / private->sector_size;
+
+  GNUFDISK_LOG((DEVICE, "done perform seek_data, result: %" PRId64, ret));
+
+  return ret;
+}
+
+static int nbd_device_zero(void* _private, gnufdisk_integer _lba, gnufdisk_integer _count)
+{
+  struct nbd_device_private* private;
+  int ret;
+
+  GNUFDISK_LOG((DEVICE, "perform zero on struct nbd_device_private* %p", _private));
+
+  nbd_device_private_check(_private);
+
+  private = _private;
+
+  if(!(private->flags & NBD_FLAG_SEND_WRITE_ZEROES))
+    {
+      errno = EOPNOTSUPP;
+      return -1;
+    }
+
+  pthread_mutex_lock(&private->mutex);
+
+  ret = nbd_clear(private, NBD_CMD_WRITE_ZEROES, _lba * private->sector_size, _count * private->sector_size);
+
+  pthread_mutex_unlock(&private->mutex);
+
+  GNUFDISK_LOG((DEVICE, "done perform zero, result: %d", ret));
+
+  return ret;
+}
+
+static int nbd_device_discard(void* _private, gnufdisk_integer _lba, gnufdisk_integer _count, int _secure)
+{
+  struct nbd_device_private* private;
+  int ret;
+
+  GNUFDISK_LOG((DEVICE, "perform discard on struct nbd_device_private* %p", _private));
+
+  nbd_device_private_check(_private);
+
+  private = _private;
+
+  /* a trim is only a hint to the server */
+  if(_secure || !(private->flags & NBD_FLAG_SEND_TRIM))
+    {
+      errno = EOPNOTSUPP;
+      return -1;
+    }
+
+  pthread_mutex_lock(&private->mutex);
+
+  ret = nbd_clear(private, NBD_CMD_TRIM, _lba * private->sector_size, _count * private->sector_size);
+
+  pthread_mutex_unlock(&private->mutex);
+
+  GNUFDISK_LOG((DEVICE, "done perform discard, result: %d", ret));
+
+  return ret;
+}
+
+static gnufdisk_integer nbd_device_discard_granularity(void* _private)
+{
+  struct nbd_device_private* private;
+
+  nbd_device_private_check(_private);
+
+  private = _private;
+
+  return private->preferred_block;
+}
+
+static gnufdisk_integer nbd_device_sector_size(void* _private)
+{
+  struct nbd_device_private* private;
+
+  nbd_device_private_check(_private);
+
+  private = _private;
+
+  return private->sector_size;
+}
+
+static gnufdisk_integer nbd_device_minimum_alignment(void* _private)
+{
+  struct nbd_device_private* private;
+
+  nbd_device_private_check(_private);
+
+  private = _private;
+
+  return private->min_block > private->sector_size ? private->min_block : private->sector_size;
+}
+
+static gnufdisk_integer nbd_device_optimal_alignment(void* _private)
+{
+  struct nbd_device_private* private;
+
+  nbd_device_private_check(_private);
+
+  private = _private;
+
+  return private->preferred_block > private->sector_size ? private->preferred_block : private->sector_size;
+}
+
+static void nbd_device_set_parameter(void *_private, struct gnufdisk_string* _param, const void* _data, size_t _size)
+{
+  struct nbd_device_private* private;
+  gnufdisk_integer* dest;
+  char* param;
+
+  GNUFDISK_LOG((DEVICE, "perform set_parameter on struct nbd_device_private* %p", _private));
+
+  nbd_device_private_check(_private);
+
+  private = _private;
+  dest = NULL;
+
+  if((param = gnufdisk_string_c_string_dup(_param)) == NULL)
+    THROW_ENOMEM;
+
+  gnufdisk_exception_register_unwind_handler(&free, param);
+
+  GNUFDISK_LOG((DEVICE, "parameter: %s, size: %u", param, _size));
+
+  if(strcasecmp(param, "CYLINDERS") == 0)
+    dest = &private->cylinders;
+  else if(strcasecmp(param, "HEADS") == 0)
+    dest = &private->heads;
+  else if(strcasecmp(param, "SECTORS") == 0)
+    dest = &private->sectors;
+  else if(strcasecmp(param, "SECTOR-SIZE") == 0)
+    dest = &private->sector_size;
+  else
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETER, NULL, "invalid parameter: %s", param);
+
+  if(_size != sizeof(gnufdisk_integer))
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETERSIZE, NULL, "invalid parameter size");
+
+  *dest = *(const gnufdisk_integer*) _data;
+
+  gnufdisk_exception_unregister_unwind_handler(&free, param);
+
+  free(param);
+
+  GNUFDISK_LOG((DEVICE, "done perform set_parameter"));
+}
+
+static void nbd_device_get_parameter(void *_private, struct gnufdisk_string* _param, void* _dest, size_t _size)
+{
+  struct nbd_device_private* private;
+  char* param;
+
+  GNUFDISK_LOG((DEVICE, "perform get_parameter on struct nbd_device_private* %p", _private));
+
+  nbd_device_private_check(_private);
+
+  private = _private;
+
+  if((param = gnufdisk_string_c_string_dup(_param)) == NULL)
+    THROW_ENOMEM;
+
+  gnufdisk_exception_register_unwind_handler(&free, param);
+
+  GNUFDISK_LOG((DEVICE, "parameter: %s, size: %u", param, _size));
+
+  if(strcasecmp(param, "CYLINDERS") == 0
+     || strcasecmp(param, "HEADS") == 0
+     || strcasecmp(param, "SECTORS") == 0)
+    {
+      union gnufdisk_device_exception_data data;
+      gnufdisk_integer* value;
+      GNUFDISK_RETRY rp0;
+      int error;
+
+      if(_size != sizeof(gnufdisk_integer))
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETERSIZE, NULL, "invalid parameter size");
+
+      /* an export has no geometry of its own: ask for it */
+      if(strcasecmp(param, "CYLINDERS") == 0)
+	{
+	  value = data.ecylinders = &private->cylinders;
+	  error = GNUFDISK_DEVICE_ECYLINDERS;
+	}
+      else if(strcasecmp(param, "HEADS") == 0)
+	{
+	  value = data.eheads = &private->heads;
+	  error = GNUFDISK_DEVICE_EHEADS;
+	}
+      else
+	{
+	  value = data.esectors = &private->sectors;
+	  error = GNUFDISK_DEVICE_ESECTORS;
+	}
+
+      GNUFDISK_RETRY_SET(rp0);
+
+      if(*value == 0)
+	GNUFDISK_THROW(GNUFDISK_EXCEPTION_ALL, &rp0, error, &data, "can not determine device %s", param);
+
+      *((gnufdisk_integer*) _dest) = *value;
+    }
+  else if(strcasecmp(param, "SECTOR-SIZE") == 0)
+    {
+      if(_size != sizeof(gnufdisk_integer))
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETERSIZE, NULL, "invalid parameter size");
+
+      *((gnufdisk_integer*) _dest) = private->sector_size;
+    }
+  else if(strcasecmp(param, "IDENTITY") == 0)
+    {
+      if(_size <= strlen(private->identity))
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETERSIZE, NULL, "invalid parameter size");
+
+      strcpy(_dest, private->identity);
+    }
+  else if(strcasecmp(param, "LABEL-STAMP") == 0)
+    {
+      if(_size != sizeof(gnufdisk_integer))
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETERSIZE, NULL, "invalid parameter size");
+
+      /* the server does not tell when the export changed */
+      *((gnufdisk_integer*) _dest) = 0;
+    }
+  else
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETER, NULL, "invalid parameter: %s", param);
+
+  gnufdisk_exception_unregister_unwind_handler(&free, param);
+
+  free(param);
+
+  GNUFDISK_LOG((DEVICE, "done perform get_parameter"));
+}
+
+static void nbd_device_commit(void* _private)
+{
+  struct nbd_device_private* private;
+  struct nbd_group group;
+  int error;
+
+  GNUFDISK_LOG((DEVICE, "perform commit on struct nbd_device_private* %p", _private));
+
+  nbd_device_private_check(_private);
+
+  private = _private;
+
+  memset(&group, 0, sizeof(group));
+
+  pthread_mutex_lock(&private->mutex);
+
+  nbd_wait(private, &private->writes);
+
+  if((error = private->writes.error) == 0 && (private->flags & NBD_FLAG_SEND_FLUSH))
+    {
+      nbd_submit(private, NBD_CMD_FLUSH, 0, 0, NULL, NULL, &group);
+      error = nbd_wait(private, &group);
+    }
+
+  private->writes.error = 0;
+
+  pthread_mutex_unlock(&private->mutex);
+
+  if(error != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "nbd write failed: %s", strerror(error));
+
+  GNUFDISK_LOG((DEVICE, "done perform commit"));
+}
+
+static void nbd_device_release(struct nbd_device_private* _private)
+{
+  int iter;
+
+  if(_private->fd >= 0)
+    close(_private->fd);
+
+  for(iter = 0; iter < NBD_CACHE_BLOCKS; iter++)
+    free(_private->cache[iter].data);
+
+  free(_private->export_name);
+
+  pthread_mutex_destroy(&_private->mutex);
+
+  memset(_private, 0, sizeof(struct nbd_device_private));
+  free(_private);
+}
+
+static void nbd_device_delete(void* _private)
+{
+  struct nbd_device_private* private;
+  struct nbd_group group;
+
+  GNUFDISK_LOG((DEVICE, "perform delete on struct nbd_device_private* %p", _private));
+
+  nbd_device_private_check(_private);
+
+  private = _private;
+
+  memset(&group, 0, sizeof(group));
+
+  if(nbd_wait(private, &private->writes) != 0)
+    GNUFDISK_WARNING("nbd write failed: %s", strerror(private->writes.error));
+
+  /* a disconnect has no reply */
+  if(nbd_submit(private, NBD_CMD_DISC, 0, 0, NULL, NULL, &group) != NULL)
+    GNUFDISK_LOG((DEVICE, "disconnect from %s", private->identity));
+
+  nbd_device_release(private);
+
+  GNUFDISK_LOG((DEVICE, "done perform delete"));
+}
+
+static struct device_implementation nbd_device_implementation = {
+    NULL, /* private */
+    &nbd_device_start,
+    &nbd_device_end,
+    &nbd_device_seek,
+    &nbd_device_read,
+    &nbd_device_write,
+    &nbd_device_sector_size,
+    &nbd_device_minimum_alignment,
+    &nbd_device_optimal_alignment,
+    &nbd_device_set_parameter,
+    &nbd_device_get_parameter,
+    &nbd_device_commit,
+    &nbd_device_delete,
+    &nbd_device_seek_data,
+    &nbd_device_zero,
+    &nbd_device_discard,
+    &nbd_device_discard_granularity,
+    &nbd_device_pread
+};
+
+static int nbd_connect_unix(const char* _path)
+{
+  struct sockaddr_un address;
+  int fd;
+
+  if(strlen(_path) >= sizeof(address.sun_path))
+    {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, _path);
+
+  if((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+    return -1;
+
+  if(connect(fd, (struct sockaddr*) &address, sizeof(address)) != 0)
+    {
+      close(fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+static int nbd_connect_tcp(const char* _host, const char* _port)
+{
+  struct addrinfo hints;
+  struct addrinfo* addresses;
+  struct addrinfo* iter;
+  int fd;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  if(getaddrinfo(_host, _port, &hints, &addresses) != 0)
+    {
+      errno = EHOSTUNREACH;
+      return -1;
+    }
+
+  fd = -1;
+
+  for(iter = addresses; iter != NULL; iter = iter->ai_next)
+    {
+      int one;
+
+      if((fd = socket(iter->ai_family, iter->ai_socktype | SOCK_CLOEXEC, iter->ai_protocol)) == -1)
+	continue;
+
+      if(connect(fd, iter->ai_addr, iter->ai_addrlen) == 0)
+	{
+	  /* requests are small and pipelined: do not hold them back */
+	  one = 1;
+	  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	  break;
+	}
+
+      close(fd);
+      fd = -1;
+    }
+
+  freeaddrinfo(addresses);
+
+  return fd;
+}
+
+/* connect to the server named by an nbd:// or nbd+unix:// URI, -1 if
+ * _path is not one or the server can not be reached */
+static int nbd_connect(struct nbd_device_private* _private, const char* _path)
+{
+  char* uri;
+  char* export_name;
+  char* socket_path;
+  int fd;
+
+  if(strncmp(_path, "nbd://", 6) == 0)
+    {
+      char* host;
+      char* port;
+
+      if((uri = strdup(_path + 6)) == NULL)
+	return -1;
+
+      if((export_name = strchr(uri, '/')) != NULL)
+	*export_name++ = 0;
+
+      host = uri;
+      port = NULL;
+
+      if(*host == '[' && (port = strchr(host, ']')) != NULL)
+	{
+	  host++;
+	  *port++ = 0;
+	  port = *port == ':' ? port + 1 : NULL;
+	}
+      else if((port = strchr(host, ':')) != NULL)
+	*port++ = 0;
+
+      snprintf(_private->identity, sizeof(_private->identity), "nbd-%s-%s-%s",
+	       host, port ? port : NBD_DEFAULT_PORT, export_name ? export_name : "");
+
+      fd = nbd_connect_tcp(host, port ? port : NBD_DEFAULT_PORT);
+    }
+  else if(strncmp(_path, "nbd+unix://", 11) == 0)
+    {
+      if((uri = strdup(_path + 11)) == NULL)
+	return -1;
+
+      if((socket_path = strstr(uri, "?socket=")) == NULL)
+	{
+	  GNUFDISK_LOG((DEVICE, "missing socket in `%s'", _path));
+	  free(uri);
+	  errno = EINVAL;
+	  return -1;
+	}
+
+      *socket_path = 0;
+      socket_path += 8;
+
+      export_name = *uri == '/' ? uri + 1 : uri;
+
+      snprintf(_private->identity, sizeof(_private->identity), "nbd-unix-%s-%s", socket_path, export_name);
+
+      fd = nbd_connect_unix(socket_path);
+    }
+  else
+    {
+      errno = ENOENT;
+      return -1;
+    }
+
+  if(fd != -1 && (_private->export_name = strdup(export_name ? export_name : "")) == NULL)
+    {
+      close(fd);
+      fd = -1;
+    }
+
+  free(uri);
+
+  if(fd == -1)
+    return -1;
+
+  _private->fd = fd;
+
+  return 0;
+}
+
+static int nbd_send_option(struct nbd_device_private* _private, uint32_t _option, const void* _data, uint32_t _length)
+{
+  struct {
+    uint64_t magic;
+    uint32_t option;
+    uint32_t length;
+  } __attribute__((packed)) header;
+
+  header.magic = htobe64(NBD_OPTION_MAGIC);
+  header.option = htobe32(_option);
+  header.length = htobe32(_length);
+
+  if(nbd_send(_private, &header, sizeof(header), _length > 0) != 0
+     || (_length > 0 && nbd_send(_private, _data, _length, 0) != 0))
+    return -1;
+
+  return 0;
+}
+
+/* read one option reply; the payload goes to _buf (truncated to _size,
+ * the rest is skipped) and its length to _length */
+static int nbd_recv_option(struct nbd_device_private* _private,
+			   uint32_t _option,
+			   uint32_t* _type,
+			   void* _buf,
+			   size_t _size,
+			   uint32_t* _length)
+{
+  struct {
+    uint64_t magic;
+    uint32_t option;
+    uint32_t type;
+    uint32_t length;
+  } __attribute__((packed)) header;
+  size_t n;
+
+  if(nbd_recv(_private, &header, sizeof(header)) != 0)
+    return -1;
+
+  if(be64toh(header.magic) != NBD_OPTION_REPLY_MAGIC || be32toh(header.option) != _option)
+    {
+      errno = EPROTO;
+      return -1;
+    }
+
+  *_type = be32toh(header.type);
+  *_length = be32toh(header.length);
+
+  n = *_length < _size ? *_length : _size;
+
+  if(nbd_recv(_private, _buf, n) != 0 || nbd_skip(_private, *_length - n) != 0)
+    return -1;
+
+  return 0;
+}
+
+static int nbd_negotiate_structured(struct nbd_device_private* _private)
+{
+  unsigned char buf[256];
+  uint32_t type;
+  uint32_t length;
+
+  if(nbd_send_option(_private, NBD_OPT_STRUCTURED_REPLY, NULL, 0) != 0
+     || nbd_recv_option(_private, NBD_OPT_STRUCTURED_REPLY, &type, buf, sizeof(buf), &length) != 0)
+    return -1;
+
+  _private->structured = type == NBD_REP_ACK;
+
+  if(!_private->structured)
+    return 0;
+
+  /* export name, one query: base:allocation */
+  {
+    unsigned char* request;
+    uint32_t name;
+    uint32_t size;
+    uint32_t value;
+
+    name = strlen(_private->export_name);
+    size = 4 + name + 4 + 4 + strlen(NBD_ALLOCATION_CONTEXT);
+
+    if((request = malloc(size)) == NULL)
+      return -1;
+
+    value = htobe32(name);
+    memcpy(request, &value, 4);
+    memcpy(request + 4, _private->export_name, name);
+    value = htobe32(1);
+    memcpy(request + 4 + name, &value, 4);
+    value = htobe32(strlen(NBD_ALLOCATION_CONTEXT));
+    memcpy(request + 8 + name, &value, 4);
+    memcpy(request + 12 + name, NBD_ALLOCATION_CONTEXT, strlen(NBD_ALLOCATION_CONTEXT));
+
+    if(nbd_send_option(_private, NBD_OPT_SET_META_CONTEXT, request, size) != 0)
+      {
+	free(request);
+	return -1;
+      }
+
+    free(request);
+  }
+
+  do
+    {
+      if(nbd_recv_option(_private, NBD_OPT_SET_META_CONTEXT, &type, buf, sizeof(buf), &length) != 0)
+	return -1;
+
+      if(type == NBD_REP_META_CONTEXT && length >= 4
+	 && length - 4 == strlen(NBD_ALLOCATION_CONTEXT)
+	 && memcmp(buf + 4, NBD_ALLOCATION_CONTEXT, length - 4) == 0)
+	{
+	  memcpy(&_private->allocation_id, buf, 4);
+	  _private->allocation_id = be32toh(_private->allocation_id);
+	  _private->allocation = 1;
+	}
+    }
+  while(type != NBD_REP_ACK && !NBD_REP_IS_ERROR(type));
+
+  return 0;
+}
+
+static int nbd_go(struct nbd_device_private* _private)
+{
+  unsigned char buf[256];
+  unsigned char* request;
+  uint32_t type;
+  uint32_t length;
+  uint32_t name;
+  uint32_t value;
+  uint16_t info;
+
+  name = strlen(_private->export_name);
+
+  if((request = malloc(4 + name + 2 + 2)) == NULL)
+    return -1;
+
+  value = htobe32(name);
+  memcpy(request, &value, 4);
+  memcpy(request + 4, _private->export_name, name);
+  info = htobe16(1);
+  memcpy(request + 4 + name, &info, 2);
+  info = htobe16(NBD_INFO_BLOCK_SIZE);
+  memcpy(request + 6 + name, &info, 2);
+
+  if(nbd_send_option(_private, NBD_OPT_GO, request, 8 + name) != 0)
+    {
+      free(request);
+      return -1;
+    }
+
+  free(request);
+
+  do
+    {
+      if(nbd_recv_option(_private, NBD_OPT_GO, &type, buf, sizeof(buf), &length) != 0)
+	return -1;
+
+      if(type == NBD_REP_INFO && length >= 2)
+	{
+	  memcpy(&info, buf, 2);
+
+	  if(be16toh(info) == NBD_INFO_EXPORT && length >= 12)
+	    {
+	      uint64_t size;
+	      uint16_t flags;
+
+	      memcpy(&size, buf + 2, 8);
+	      memcpy(&flags, buf + 10, 2);
+
+	      _private->size = be64toh(size);
+	      _private->flags = be16toh(flags);
+	    }
+	  else if(be16toh(info) == NBD_INFO_BLOCK_SIZE && length >= 14)
+	    {
+	      memcpy(&value, buf + 2, 4);
+	      _private->min_block = be32toh(value);
+	      memcpy(&value, buf + 6, 4);
+	      _private->preferred_block = be32toh(value);
+	      memcpy(&value, buf + 10, 4);
+	      _private->max_block = be32toh(value);
+	    }
+	}
+    }
+  while(type != NBD_REP_ACK && !NBD_REP_IS_ERROR(type));
+
+  if(type == NBD_REP_ERR_UNSUP)
+    {
+      struct {
+	uint64_t size;
+	uint16_t flags;
+      } __attribute__((packed)) reply;
+
+      /* old server: NBD_OPT_EXPORT_NAME has no error reply, it closes */
+      GNUFDISK_LOG((DEVICE, "NBD_OPT_GO not supported, use NBD_OPT_EXPORT_NAME"));
+
+      if(nbd_send_option(_private, NBD_OPT_EXPORT_NAME, _private->export_name, name) != 0
+	 || nbd_recv(_private, &reply, sizeof(reply)) != 0
+	 || (!_private->no_zeroes && nbd_skip(_private, 124) != 0))
+	return -1;
+
+      _private->size = be64toh(reply.size);
+      _private->flags = be16toh(reply.flags);
+    }
+  else if(NBD_REP_IS_ERROR(type))
+    {
+      GNUFDISK_LOG((DEVICE, "export `%s' refused: %.*s", _private->export_name,
+		    (int) (length < sizeof(buf) ? length : sizeof(buf)), buf));
+      errno = ENOENT;
+      return -1;
+    }
+
+  return 0;
+}
+
+static int nbd_handshake(struct nbd_device_private* _private)
+{
+  struct {
+    uint64_t magic;
+    uint64_t option_magic;
+    uint16_t flags;
+  } __attribute__((packed)) greeting;
+  uint32_t flags;
+
+  if(nbd_recv(_private, &greeting, sizeof(greeting)) != 0)
+    return -1;
+
+  if(be64toh(greeting.magic) != NBD_MAGIC
+     || be64toh(greeting.option_magic) != NBD_OPTION_MAGIC
+     || !(be16toh(greeting.flags) & NBD_FLAG_FIXED_NEWSTYLE))
+    {
+      GNUFDISK_LOG((DEVICE, "not a fixed newstyle nbd server"));
+      errno = EPROTO;
+      return -1;
+    }
+
+  flags = NBD_FLAG_FIXED_NEWSTYLE;
+
+  if(be16toh(greeting.flags) & NBD_FLAG_NO_ZEROES)
+    {
+      flags |= NBD_FLAG_NO_ZEROES;
+      _private->no_zeroes = 1;
+    }
+
+  flags = htobe32(flags);
+
+  if(nbd_send(_private, &flags, sizeof(flags), 0) != 0
+     || nbd_negotiate_structured(_private) != 0
+     || nbd_go(_private) != 0)
+    return -1;
+
+  return 0;
+}
+
+int nbd_device_probe(const char* _path, struct module_options* _options, struct device_implementation* _implementation)
+{
+  struct nbd_device_private* private;
+
+  if(strncmp(_path, "nbd://", 6) != 0 && strncmp(_path, "nbd+unix://", 11) != 0)
+    return -1;
+
+  GNUFDISK_LOG((DEVICE, "perform nbd_device_probe on %s", _path));
+
+  if((private = malloc(sizeof(struct nbd_device_private))) == NULL)
+    THROW_ENOMEM;
+
+  memset(private, 0, sizeof(struct nbd_device_private));
+  private->fd = -1;
+  pthread_mutex_init(&private->mutex, NULL);
+
+  if(nbd_connect(private, _path) != 0)
+    {
+      GNUFDISK_LOG((DEVICE, "can not connect to %s: %s", _path, strerror(errno)));
+      nbd_device_release(private);
+      return -1;
+    }
+
+  if(nbd_handshake(private) != 0)
+    {
+      GNUFDISK_LOG((DEVICE, "nbd handshake with %s failed: %s", _path, strerror(errno)));
+      nbd_device_release(private);
+      return -1;
+    }
+
+  if(private->max_block == 0)
+    private->max_block = 33554432;
+
+  private->readonly = _options->readonly || (private->flags & NBD_FLAG_READ_ONLY);
+  private->sector_size = _options->sector_size ? _options->sector_size : 512;
+  private->cylinders = _options->cylinders;
+  private->heads = _options->heads;
+  private->sectors = _options->sectors;
+
+  GNUFDISK_LOG((DEVICE, "nbd export:"));
+  GNUFDISK_LOG((DEVICE, "\tname         : %s", private->export_name));
+  GNUFDISK_LOG((DEVICE, "\tsize         : %" PRIu64, private->size));
+  GNUFDISK_LOG((DEVICE, "\tflags        : 0x%x", private->flags));
+  GNUFDISK_LOG((DEVICE, "\tblock sizes  : %u/%u/%u", private->min_block, private->preferred_block, private->max_block));
+  GNUFDISK_LOG((DEVICE, "\tstructured   : %d", private->structured));
+  GNUFDISK_LOG((DEVICE, "\tallocation   : %d", private->allocation));
+
+  memcpy(_implementation, &nbd_device_implementation, sizeof(struct device_implementation));
+  _implementation->private = private;
+
+  GNUFDISK_LOG((DEVICE, "done nbd_device_probe"));
+
+  return 0;
+}
@@ -1,6 +1,7 @@
 #include "common.h"
 
 struct object {
+  struct arena* arena; /* NULL when allocated from the heap */
   enum object_type type;
   int nref;
   struct object_private_operations operations;
@@ -13,7 +14,8 @@ static void object_check(struct object* _p)
     GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL, "invalid struct object* %p", _p);
 }
 
-struct object* object_new(enum object_type _type, 
+struct object* object_new(struct arena* _arena,
+			  enum object_type _type, 
 			  const struct object_private_operations* _operations,
 			  void* _private)
 {
@@ -27,18 +29,17 @@ struct object* object_new(enum object_type _type,
 		   "invalid struct object_private_operations* %p", 
 		   _operations);
 
-  if((ret = malloc(sizeof(struct object))) == NULL)
+  if(_arena != NULL)
+    ret = arena_alloc(_arena, sizeof(struct object));
+  else if((ret = malloc(sizeof(struct object))) == NULL)
     THROW_ENOMEM;
 
-  gnufdisk_exception_register_unwind_handler(&free, ret);
-
+  ret->arena = _arena;
   ret->type = _type;
   ret->nref = 1;
   memcpy(&ret->operations, _operations, sizeof(struct object_private_operations));
   ret->private = _private;
 
-  gnufdisk_exception_unregister_unwind_handler(&free, ret);
-
   GNUFDISK_LOG((OBJECT, "new struct object* %p (type %d)", ret, _type));
 
   return ret;
@@ -55,6 +56,26 @@ struct object* object_ref(struct object* _o)
   return _o;
 }
 
+/* a reference handed to the frontend: while there is one the label tree
+ * can not be dropped with its arena */
+void object_export(struct object* _o)
+{
+  object_ref(_o);
+
+  if(_o->arena)
+    arena_export(_o->arena, 1);
+}
+
+void object_unexport(struct object* _o)
+{
+  object_check(_o);
+
+  if(_o->arena)
+    arena_export(_o->arena, -1);
+
+  object_delete(_o);
+}
+
 enum object_type object_type(struct object* _o)
 {
   object_check(_o);
@@ -88,7 +109,10 @@ void object_delete(struct object* _o)
 	  if(gnufdisk_check_memory(_o->operations.delete, 1, 1) == 0)
 	    (*_o->operations.delete)(_o->private);
 
-	  free(_o);
+	  if(_o->arena)
+	    arena_free(_o);
+	  else
+	    free(_o);
 	}
     }
   else
@@ -174,4 +198,13 @@ void* object_private(struct object* _o, enum object_type _type)
   return _o->private;
 }
 
+struct arena* object_arena(struct object* _o)
+{
+  object_check(_o);
+
+  if(_o->arena)
+    return _o->arena;
+
+  return device_arena(object_cast(_o, OBJECT_TYPE_DEVICE));
+}
 
@@ -0,0 +1,1045 @@
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#include "common.h"
+
+/* Copy-on-write overlay: the base device is opened read-only and every
+ * sector written goes to a delta file. Reads are served from the delta for
+ * the sectors it holds and from the base for the others, so a whole session
+ * (commit included) can be rehearsed without touching the base. The
+ * "OVERLAY" device parameter merges the delta into the base ("merge") or
+ * drops it ("discard").
+ *
+ * The delta file holds a header, then one slot per written sector in the
+ * order they were first written, then the index: the sector number of
+ * every slot. The index is rewritten on commit and close; the header is
+ * marked dirty before a new slot may overwrite the old index, so a delta
+ * left behind by a crash is refused instead of being read with a stale
+ * index. */
+
+#define OVERLAY_MAGIC "GFDOV001"
+#define OVERLAY_DATA_OFFSET 4096 /* first slot, rounded up to the sector size */
+#define OVERLAY_RADIX_BITS 9
+#define OVERLAY_RADIX_FANOUT (1 << OVERLAY_RADIX_BITS)
+#define OVERLAY_MERGE_SIZE 1048576 /* bytes per merge request */
+
+struct overlay_header {
+  char magic[8];
+  uint32_t sector_size;
+  uint32_t clean;
+  uint64_t sectors;
+  uint64_t nslots;
+  uint64_t index;
+};
+
+/* sector -> slot map: a radix tree as deep as the base device needs. Leaves
+ * hold the slot number plus one, 0 for a sector still on the base. */
+struct overlay_map {
+  void* root;
+  int levels;
+};
+
+struct overlay_device_private {
+  struct device_implementation base;
+  struct module_options options; /* to open the base for writing on merge */
+  char* path; /* base device */
+  char* delta;
+  int fd; /* delta file */
+  char identity[128];
+  gnufdisk_integer sector_size;
+  gnufdisk_integer sectors; /* size of the base */
+  gnufdisk_integer data; /* offset of the first slot */
+  gnufdisk_integer position;
+  uint64_t* slots; /* sector of every slot, the index */
+  uint64_t nslots;
+  uint64_t maxslots;
+  struct overlay_map map;
+  int clean; /* the header on disk describes the slots and the index */
+};
+
+struct overlay_extent {
+  uint64_t lba;
+  uint64_t slot;
+};
+
+static int overlay_map_levels(gnufdisk_integer _sectors)
+{
+  int levels;
+
+  levels = 1;
+
+  if(_sectors > 1)
+    while(levels * OVERLAY_RADIX_BITS < 64
+	  && ((uint64_t) _sectors - 1) >> (levels * OVERLAY_RADIX_BITS) != 0)
+      levels++;
+
+  return levels;
+}
+
+static uint64_t overlay_map_lookup(struct overlay_map* _map, uint64_t _lba)
+{
+  void** node;
+  int level;
+
+  node = _map->root;
+
+  for(level = _map->levels - 1; level > 0 && node != NULL; level--)
+    node = node[(_lba >> (level * OVERLAY_RADIX_BITS)) & (OVERLAY_RADIX_FANOUT - 1)];
+
+  if(node == NULL)
+    return 0;
+
+  return ((uint64_t*) node)[_lba & (OVERLAY_RADIX_FANOUT - 1)];
+}
+
+static void overlay_map_insert(struct overlay_map* _map, uint64_t _lba, uint64_t _value)
+{
+  void** node;
+  int level;
+
+  node = &_map->root;
+
+  for(level = _map->levels - 1; ; level--)
+    {
+      if(*node == NULL
+	 && (*node = calloc(OVERLAY_RADIX_FANOUT, level > 0 ? sizeof(void*) : sizeof(uint64_t))) == NULL)
+	THROW_ENOMEM;
+
+      if(level == 0)
+	break;
+
+      node = &((void**) *node)[(_lba >> (level * OVERLAY_RADIX_BITS)) & (OVERLAY_RADIX_FANOUT - 1)];
+    }
+
+  ((uint64_t*) *node)[_lba & (OVERLAY_RADIX_FANOUT - 1)] = _value;
+}
+
+static void overlay_map_free(void* _node, int _level)
+{
+  int iter;
+
+  if(_node == NULL)
+    return;
+
+  if(_level > 0)
+    for(iter = 0; iter < OVERLAY_RADIX_FANOUT; iter++)
+      overlay_map_free(((void**) _node)[iter], _level - 1);
+
+  free(_node);
+}
+
+static void overlay_device_private_check(struct overlay_device_private* _private)
+{
+  if(gnufdisk_check_memory(_private, sizeof(struct overlay_device_private), 0) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL, "invalid struct overlay_device_private* %p", _private);
+
+  if(_private->fd < 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL, "invalid file descriptor: %d", _private->fd);
+}
+
+static int overlay_write_header(struct overlay_device_private* _private, int _clean, uint64_t _index)
+{
+  struct overlay_header header;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, OVERLAY_MAGIC, sizeof(header.magic));
+
+  header.sector_size = CPU_TO_LE32(_private->sector_size);
+  header.clean = CPU_TO_LE32(_clean);
+  header.sectors = CPU_TO_LE64(_private->sectors);
+  header.nslots = CPU_TO_LE64(_private->nslots);
+  header.index = CPU_TO_LE64(_index);
+
+  if(pwrite(_private->fd, &header, sizeof(header), 0) != sizeof(header)
+     || fdatasync(_private->fd) != 0)
+    return -1;
+
+  _private->clean = _clean;
+
+  return 0;
+}
+
+/* write the index after the last slot and mark the header clean, -1 and
+ * errno on failure */
+static int overlay_flush(struct overlay_device_private* _private)
+{
+  gnufdisk_integer index;
+  size_t size;
+  uint64_t iter;
+  ssize_t ret;
+
+  if(_private->clean)
+    return 0;
+
+  GNUFDISK_LOG((DEVICE, "flush overlay index, %" PRIu64 " slots", _private->nslots));
+
+  index = _private->data + _private->nslots * _private->sector_size;
+  size = _private->nslots * sizeof(uint64_t);
+
+  for(iter = 0; iter < _private->nslots; iter++)
+    _private->slots[iter] = CPU_TO_LE64(_private->slots[iter]);
+
+  ret = size > 0 ? pwrite(_private->fd, _private->slots, size, index) : 0;
+
+  for(iter = 0; iter < _private->nslots; iter++)
+    _private->slots[iter] = LE64_TO_CPU(_private->slots[iter]);
+
+  if(ret != size)
+    {
+      if(ret >= 0)
+	errno = ENOSPC;
+
+      return -1;
+    }
+
+  return overlay_write_header(_private, 1, index);
+}
+
+static void overlay_load(struct overlay_device_private* _private)
+{
+  struct overlay_header header;
+  uint64_t iter;
+
+  GNUFDISK_LOG((DEVICE, "load overlay %s", _private->delta));
+
+  if(pread(_private->fd, &header, sizeof(header), 0) != sizeof(header)
+     || memcmp(header.magic, OVERLAY_MAGIC, sizeof(header.magic)) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "`%s' is not an overlay file", _private->delta);
+  else if(LE32_TO_CPU(header.sector_size) != _private->sector_size)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "overlay `%s' was made for a sector size of %" PRIu32,
+		   _private->delta, LE32_TO_CPU(header.sector_size));
+  else if(LE64_TO_CPU(header.sectors) != _private->sectors)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "overlay `%s' was made for a device of %" PRIu64 " sectors",
+		   _private->delta, LE64_TO_CPU(header.sectors));
+  else if(LE32_TO_CPU(header.clean) != 1)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "overlay `%s' was not closed cleanly", _private->delta);
+
+  _private->nslots = LE64_TO_CPU(header.nslots);
+
+  if(LE64_TO_CPU(header.index) != _private->data + _private->nslots * _private->sector_size)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "overlay `%s' has a bad index", _private->delta);
+
+  if(_private->nslots > 0)
+    {
+      if((_private->slots = malloc(_private->nslots * sizeof(uint64_t))) == NULL)
+	THROW_ENOMEM;
+
+      _private->maxslots = _private->nslots;
+
+      if(pread(_private->fd, _private->slots, _private->nslots * sizeof(uint64_t), LE64_TO_CPU(header.index))
+	 != _private->nslots * sizeof(uint64_t))
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not read overlay `%s' index", _private->delta);
+    }
+
+  for(iter = 0; iter < _private->nslots; iter++)
+    {
+      _private->slots[iter] = LE64_TO_CPU(_private->slots[iter]);
+
+      if(_private->slots[iter] >= _private->sectors
+	 || overlay_map_lookup(&_private->map, _private->slots[iter]) != 0)
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "overlay `%s' has a bad index", _private->delta);
+
+      overlay_map_insert(&_private->map, _private->slots[iter], iter + 1);
+    }
+
+  _private->clean = 1;
+
+  GNUFDISK_LOG((DEVICE, "done load overlay, %" PRIu64 " slots", _private->nslots));
+}
+
+/* give _lba a new slot at the end of the delta, return it plus one */
+static uint64_t overlay_allocate(struct overlay_device_private* _private, uint64_t _lba)
+{
+  if(_private->clean && overlay_write_header(_private, 0, 0) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not write overlay `%s': %s", _private->delta, strerror(errno));
+
+  if(_private->nslots == _private->maxslots)
+    {
+      uint64_t* slots;
+      uint64_t maxslots;
+
+      maxslots = _private->maxslots > 0 ? _private->maxslots * 2 : 1024;
+
+      if((slots = realloc(_private->slots, maxslots * sizeof(uint64_t))) == NULL)
+	THROW_ENOMEM;
+
+      _private->slots = slots;
+      _private->maxslots = maxslots;
+    }
+
+  overlay_map_insert(&_private->map, _lba, _private->nslots + 1);
+  _private->slots[_private->nslots++] = _lba;
+
+  return _private->nslots;
+}
+
+static gnufdisk_integer overlay_read_at(struct overlay_device_private* _private,
+					gnufdisk_integer _offset,
+					void* _buf,
+					size_t _size)
+{
+  unsigned char* buf;
+  unsigned char* sector;
+  gnufdisk_integer ret;
+
+  buf = _buf;
+  sector = NULL;
+  ret = 0;
+
+  while(_size > 0)
+    {
+      gnufdisk_integer lba;
+      gnufdisk_integer count;
+      gnufdisk_integer done;
+      size_t skip;
+      size_t size;
+      uint64_t slot;
+
+      lba = _offset / _private->sector_size;
+      skip = _offset % _private->sector_size;
+
+      if(lba >= _private->sectors)
+	break;
+
+      slot = overlay_map_lookup(&_private->map, lba);
+
+      /* one request for a run of sectors found in the same place: on the
+       * base, or in consecutive slots */
+      for(count = 1;
+	  lba + count < _private->sectors && count * _private->sector_size - skip < _size;
+	  count++)
+	{
+	  uint64_t next;
+
+	  next = overlay_map_lookup(&_private->map, lba + count);
+
+	  if(slot == 0 ? next != 0 : next != slot + count)
+	    break;
+	}
+
+      size = count * _private->sector_size - skip;
+
+      if(size > _size)
+	size = _size;
+
+      if(slot != 0)
+	done = pread(_private->fd, buf, size, _private->data + (slot - 1) * _private->sector_size + skip);
+      else if(skip == 0)
+	done = (*_private->base.pread)(_private->base.private, lba, buf, size);
+      else
+	{
+	  if(sector == NULL)
+	    {
+	      if((sector = malloc(_private->sector_size)) == NULL)
+		THROW_ENOMEM;
+
+	      gnufdisk_exception_register_unwind_handler(&free, sector);
+	    }
+
+	  if(size > _private->sector_size - skip)
+	    size = _private->sector_size - skip;
+
+	  if((done = (*_private->base.pread)(_private->base.private, lba, sector, _private->sector_size))
+	     == _private->sector_size)
+	    {
+	      memcpy(buf, sector + skip, size);
+	      done = size;
+	    }
+	  else if(done >= 0)
+	    done = 0;
+	}
+
+      if(done <= 0)
+	{
+	  if(ret == 0)
+	    ret = done;
+
+	  break;
+	}
+
+      buf += done;
+      _offset += done;
+      _size -= done;
+      ret += done;
+
+      if(done < size)
+	break;
+    }
+
+  if(sector)
+    {
+      gnufdisk_exception_unregister_unwind_handler(&free, sector);
+      free(sector);
+    }
+
+  return ret;
+}
+
+static gnufdisk_integer overlay_write_at(struct overlay_device_private* _private,
+					 gnufdisk_integer _offset,
+					 const void* _buf,
+					 size_t _size)
+{
+  const unsigned char* buf;
+  unsigned char* sector;
+  gnufdisk_integer ret;
+
+  buf = _buf;
+  sector = NULL;
+  ret = 0;
+
+  while(_size > 0)
+    {
+      gnufdisk_integer lba;
+      gnufdisk_integer done;
+      size_t skip;
+      size_t size;
+      uint64_t slot;
+
+      lba = _offset / _private->sector_size;
+      skip = _offset % _private->sector_size;
+
+      if(lba >= _private->sectors)
+	{
+	  if(ret == 0)
+	    {
+	      errno = ENOSPC;
+	      ret = -1;
+	    }
+
+	  break;
+	}
+
+      slot = overlay_map_lookup(&_private->map, lba);
+
+      if(skip != 0 || _size < _private->sector_size)
+	{
+	  /* part of a sector: the rest of it comes from the base */
+	  size = _private->sector_size - skip;
+
+	  if(size > _size)
+	    size = _size;
+
+	  if(slot != 0)
+	    done = pwrite(_private->fd, buf, size, _private->data + (slot - 1) * _private->sector_size + skip);
+	  else
+	    {
+	      if(sector == NULL)
+		{
+		  if((sector = malloc(_private->sector_size)) == NULL)
+		    THROW_ENOMEM;
+
+		  gnufdisk_exception_register_unwind_handler(&free, sector);
+		}
+
+	      if(overlay_read_at(_private, lba * _private->sector_size, sector, _private->sector_size)
+		 != _private->sector_size)
+		GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not read sector %" PRId64, lba);
+
+	      memcpy(sector + skip, buf, size);
+
+	      slot = overlay_allocate(_private, lba);
+
+	      if((done = pwrite(_private->fd, sector, _private->sector_size,
+				_private->data + (slot - 1) * _private->sector_size)) == _private->sector_size)
+		done = size;
+	      else if(done >= 0)
+		done = 0;
+	    }
+	}
+      else
+	{
+	  gnufdisk_integer count;
+
+	  if(slot == 0)
+	    slot = overlay_allocate(_private, lba);
+
+	  /* extend the run while the next sector already follows in the
+	   * delta or gets the next new slot */
+	  for(count = 1;
+	      (count + 1) * _private->sector_size <= _size && lba + count < _private->sectors;
+	      count++)
+	    {
+	      uint64_t next;
+
+	      next = overlay_map_lookup(&_private->map, lba + count);
+
+	      if(next == 0 && _private->nslots == slot + count - 1)
+		next = overlay_allocate(_private, lba + count);
+
+	      if(next != slot + count)
+		break;
+	    }
+
+	  size = count * _private->sector_size;
+
+	  done = pwrite(_private->fd, buf, size, _private->data + (slot - 1) * _private->sector_size);
+	}
+
+      if(done <= 0)
+	{
+	  if(ret == 0)
+	    ret = done;
+
+	  break;
+	}
+
+      buf += done;
+      _offset += done;
+      _size -= done;
+      ret += done;
+
+      if(done < size)
+	break;
+    }
+
+  if(sector)
+    {
+      gnufdisk_exception_unregister_unwind_handler(&free, sector);
+      free(sector);
+    }
+
+  return ret;
+}
+
+static int overlay_extent_compare(const void* _a, const void* _b)
+{
+  const struct overlay_extent* a;
+  const struct overlay_extent* b;
+
+  a = _a;
+  b = _b;
+
+  return a->lba < b->lba ? -1 : a->lba > b->lba;
+}
+
+static void overlay_target_delete(void* _target)
+{
+  struct device_implementation* target;
+
+  target = _target;
+
+  GNUFDISK_LOG((DEVICE, "close merge target"));
+
+  (*target->delete)(target->private);
+}
+
+static void overlay_discard(struct overlay_device_private* _private)
+{
+  GNUFDISK_LOG((DEVICE, "discard overlay %s, %" PRIu64 " slots", _private->delta, _private->nslots));
+
+  if(_private->options.readonly)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOTSUP, NULL, "overlay `%s' is read-only", _private->delta);
+
+  overlay_map_free(_private->map.root, _private->map.levels - 1);
+  _private->map.root = NULL;
+  _private->nslots = 0;
+
+  if(ftruncate(_private->fd, _private->data) != 0
+     || overlay_write_header(_private, 1, _private->data) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not write overlay `%s': %s", _private->delta, strerror(errno));
+
+  GNUFDISK_LOG((DEVICE, "done discard overlay"));
+}
+
+/* write every slot to the base, in sector order, then discard the delta */
+static void overlay_merge(struct overlay_device_private* _private)
+{
+  struct device_implementation target;
+  struct module_options options;
+  struct overlay_extent* extents;
+  unsigned char* buf;
+  gnufdisk_integer chunk;
+  uint64_t iter;
+
+  GNUFDISK_LOG((DEVICE, "merge overlay %s into %s, %" PRIu64 " slots", _private->delta, _private->path, _private->nslots));
+
+  if(_private->options.readonly)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOTSUP, NULL, "overlay `%s' is read-only", _private->delta);
+
+  if((extents = malloc((_private->nslots + 1) * sizeof(struct overlay_extent))) == NULL)
+    THROW_ENOMEM;
+
+  gnufdisk_exception_register_unwind_handler(&free, extents);
+
+  for(iter = 0; iter < _private->nslots; iter++)
+    {
+      extents[iter].lba = _private->slots[iter];
+      extents[iter].slot = iter;
+    }
+
+  qsort(extents, _private->nslots, sizeof(struct overlay_extent), &overlay_extent_compare);
+
+  chunk = OVERLAY_MERGE_SIZE / _private->sector_size;
+
+  if(chunk < 1)
+    chunk = 1;
+
+  if((buf = malloc(chunk * _private->sector_size)) == NULL)
+    THROW_ENOMEM;
+
+  gnufdisk_exception_register_unwind_handler(&free, buf);
+
+  memcpy(&options, &_private->options, sizeof(struct module_options));
+  options.readonly = 0;
+
+  if(device_probe_implementation(_private->path, &options, &target) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not open `%s' for writing", _private->path);
+
+  gnufdisk_exception_register_unwind_handler(&overlay_target_delete, &target);
+
+  for(iter = 0; iter < _private->nslots; )
+    {
+      gnufdisk_integer count;
+      size_t size;
+
+      for(count = 1;
+	  count < chunk && iter + count < _private->nslots
+	    && extents[iter + count].lba == extents[iter].lba + count
+	    && extents[iter + count].slot == extents[iter].slot + count;
+	  count++);
+
+      size = count * _private->sector_size;
+
+      if(pread(_private->fd, buf, size, _private->data + extents[iter].slot * _private->sector_size) != size)
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not read overlay `%s'", _private->delta);
+
+      if((*target.seek)(target.private, extents[iter].lba, 0, SEEK_SET) == -1
+	 || (*target.write)(target.private, buf, size) != size)
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not write `%s' at sector %" PRIu64,
+		       _private->path, extents[iter].lba);
+
+      iter += count;
+    }
+
+  if(gnufdisk_check_memory(target.commit, 1, 1) == 0)
+    (*target.commit)(target.private);
+
+  gnufdisk_exception_unregister_unwind_handler(&overlay_target_delete, &target);
+  overlay_target_delete(&target);
+
+  gnufdisk_exception_unregister_unwind_handler(&free, buf);
+  free(buf);
+
+  gnufdisk_exception_unregister_unwind_handler(&free, extents);
+  free(extents);
+
+  overlay_discard(_private);
+
+  GNUFDISK_LOG((DEVICE, "done merge overlay"));
+}
+
+static gnufdisk_integer overlay_device_start(void* _private)
+{
+  struct overlay_device_private* private;
+  gnufdisk_integer ret;
+
+  GNUFDISK_LOG((DEVICE, "perform start on struct overlay_device_private* %p", _private));
+
+  overlay_device_private_check(_private);
+
+  private = _private;
+
+  ret = (*private->base.start)(private->base.private);
+
+  GNUFDISK_LOG((DEVICE, "done perform start, result: %" PRId64, ret));
+
+  return ret;
+}
+
+static gnufdisk_integer overlay_device_end(void* _private)
+{
+  struct overlay_device_private* private;
+  gnufdisk_integer ret;
+
+  GNUFDISK_LOG((DEVICE, "perform end on struct overlay_device_private* %p", _private));
+
+  overlay_device_private_check(_private);
+
+  private = _private;
+
+  ret = (*private->base.end)(private->base.private);
+
+  GNUFDISK_LOG((DEVICE, "done perform end, result: %" PRId64, ret));
+
+  return ret;
+}
+
+static gnufdisk_integer overlay_device_seek(void* _private, gnufdisk_integer _lba, gnufdisk_integer _offset, int _whence)
+{
+  struct overlay_device_private* private;
+  gnufdisk_integer offset;
+  gnufdisk_integer ret;
+
+  GNUFDISK_LOG((DEVICE, "perform seek on struct overlay_device_private* %p", _private));
+
+  overlay_device_private_check(_private);
+
+  private = _private;
+
+  offset = _lba * private->sector_size + _offset;
+
+  if(_whence == SEEK_CUR)
+    offset += private->position;
+  else if(_whence == SEEK_END)
+    offset += private->sectors * private->sector_size;
+  else if(_whence != SEEK_SET)
+    offset = -1;
+
+  if(offset < 0)
+    {
+      errno = EINVAL;
+      ret = -1;
+    }
+  else
+    ret = private->position = offset;
+
+  GNUFDISK_LOG((DEVICE, "done perform seek, result: %" PRId64, ret));
+
+  return ret;
+}
+
+static gnufdisk_integer overlay_device_read(void* _private, void* _buf, size_t _size)
+{
+  struct overlay_device_private* private;
+  gnufdisk_integer ret;
+
+  GNUFDISK_LOG((DEVICE, "perform read on struct overlay_device_private* %p", _private));
+
+  overlay_device_private_check(_private);
+
+  private = _private;
+
+  if((ret = overlay_read_at(private, private->position, _buf, _size)) > 0)
+    private->position += ret;
+
+  GNUFDISK_LOG((DEVICE, "done perform read, result: %" PRId64, ret));
+
+  return ret;
+}
+
+static gnufdisk_integer overlay_device_write(void* _private, const void* _buf, size_t _size)
+{
+  struct overlay_device_private* private;
+  gnufdisk_integer ret;
+
+  GNUFDISK_LOG((DEVICE, "perform write on struct overlay_device_private* %p", _private));
+
+  overlay_device_private_check(_private);
+
+  private = _private;
+
+  if((ret = overlay_write_at(private, private->position, _buf, _size)) > 0)
+    private->position += ret;
+
+  GNUFDISK_LOG((DEVICE, "done perform write, result: %" PRId64, ret));
+
+  return ret;
+}
+
+static gnufdisk_integer overlay_device_pread(void* _private, gnufdisk_integer _lba, void* _buf, size_t _size)
+{
+  struct overlay_device_private* private;
+  gnufdisk_integer ret;
+
+  GNUFDISK_LOG((DEVICE, "perform pread on struct overlay_device_private* %p", _private));
+
+  overlay_device_private_check(_private);
+
+  private = _private;
+
+  ret = overlay_read_at(private, _lba * private->sector_size, _buf, _size);
+
+  GNUFDISK_LOG((DEVICE, "done perform pread, result: %" PRId64, ret));
+
+  return ret;
+}
+
+static gnufdisk_integer overlay_device_sector_size(void* _private)
+{
+  struct overlay_device_private* private;
+
+  overlay_device_private_check(_private);
+
+  private = _private;
+
+  return private->sector_size;
+}
+
+static gnufdisk_integer overlay_device_minimum_alignment(void* _private)
+{
+  struct overlay_device_private* private;
+
+  overlay_device_private_check(_private);
+
+  private = _private;
+
+  return (*private->base.minimum_alignment)(private->base.private);
+}
+
+static gnufdisk_integer overlay_device_optimal_alignment(void* _private)
+{
+  struct overlay_device_private* private;
+
+  overlay_device_private_check(_private);
+
+  private = _private;
+
+  return (*private->base.optimal_alignment)(private->base.private);
+}
+
+static void overlay_device_set_parameter(void *_private, struct gnufdisk_string* _param, const void* _data, size_t _size)
+{
+  struct overlay_device_private* private;
+  char* param;
+
+  GNUFDISK_LOG((DEVICE, "perform set_parameter on struct overlay_device_private* %p", _private));
+
+  overlay_device_private_check(_private);
+
+  private = _private;
+
+  if((param = gnufdisk_string_c_string_dup(_param)) == NULL)
+    THROW_ENOMEM;
+
+  gnufdisk_exception_register_unwind_handler(&free, param);
+
+  GNUFDISK_LOG((DEVICE, "parameter: %s, size: %u", param, _size));
+
+  if(strcasecmp(param, "OVERLAY") == 0)
+    {
+      char* action;
+
+      /* the action is a struct gnufdisk_string*, as the user interface
+       * passes strings */
+      if(_size != sizeof(struct gnufdisk_string*))
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETERSIZE, NULL, "invalid parameter size");
+
+      if((action = gnufdisk_string_c_string_dup((struct gnufdisk_string*) _data)) == NULL)
+	THROW_ENOMEM;
+
+      gnufdisk_exception_register_unwind_handler(&free, action);
+
+      if(strcasecmp(action, "merge") == 0)
+	overlay_merge(private);
+      else if(strcasecmp(action, "discard") == 0)
+	overlay_discard(private);
+      else
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETERDATA, NULL, "invalid overlay action: %s", action);
+
+      gnufdisk_exception_unregister_unwind_handler(&free, action);
+      free(action);
+    }
+  else
+    (*private->base.set_parameter)(private->base.private, _param, _data, _size);
+
+  gnufdisk_exception_unregister_unwind_handler(&free, param);
+
+  free(param);
+
+  GNUFDISK_LOG((DEVICE, "done perform set_parameter"));
+}
+
+static void overlay_device_get_parameter(void *_private, struct gnufdisk_string* _param, void* _dest, size_t _size)
+{
+  struct overlay_device_private* private;
+  char* param;
+
+  GNUFDISK_LOG((DEVICE, "perform get_parameter on struct overlay_device_private* %p", _private));
+
+  overlay_device_private_check(_private);
+
+  private = _private;
+
+  if((param = gnufdisk_string_c_string_dup(_param)) == NULL)
+    THROW_ENOMEM;
+
+  gnufdisk_exception_register_unwind_handler(&free, param);
+
+  /* the content differs from the base: so must the probe cache entry */
+  if(strcasecmp(param, "IDENTITY") == 0)
+    {
+      if(_size <= strlen(private->identity))
+       GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETERSIZE, NULL, "invalid parameter size");
+
+      strcpy(_dest, private->identity);
+    }
+  else if(strcasecmp(param, "LABEL-STAMP") == 0)
+    {
+      gnufdisk_integer stamp;
+
+      if(_size != sizeof(gnufdisk_integer))
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETERSIZE, NULL, "invalid parameter size");
+
+      /* a change of the base or of the delta changes the label */
+      (*private->base.get_parameter)(private->base.private, _param, &stamp, sizeof(stamp));
+
+      *((gnufdisk_integer*) _dest) = stamp != 0 ? stamp ^ (probe_cache_file_stamp(private->fd) << 32) : 0;
+    }
+  else
+    (*private->base.get_parameter)(private->base.private, _param, _dest, _size);
+
+  gnufdisk_exception_unregister_unwind_handler(&free, param);
+
+  free(param);
+
+  GNUFDISK_LOG((DEVICE, "done perform get_parameter"));
+}
+
+static void overlay_device_commit(void* _private)
+{
+  struct overlay_device_private* private;
+
+  GNUFDISK_LOG((DEVICE, "perform commit on struct overlay_device_private* %p", _private));
+
+  overlay_device_private_check(_private);
+
+  private = _private;
+
+  if(overlay_flush(private) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not write overlay `%s': %s", private->delta, strerror(errno));
+
+  GNUFDISK_LOG((DEVICE, "done perform commit"));
+}
+
+static void overlay_device_release(struct overlay_device_private* _private)
+{
+  if(_private->fd >= 0)
+    close(_private->fd);
+
+  overlay_map_free(_private->map.root, _private->map.levels - 1);
+
+  if(_private->base.private)
+    (*_private->base.delete)(_private->base.private);
+
+  free(_private->slots);
+  free(_private->path);
+  free(_private->delta);
+
+  memset(_private, 0, sizeof(struct overlay_device_private));
+  free(_private);
+}
+
+static void overlay_device_delete(void* _private)
+{
+  struct overlay_device_private* private;
+
+  GNUFDISK_LOG((DEVICE, "perform delete on struct overlay_device_private* %p", _private));
+
+  overlay_device_private_check(_private);
+
+  private = _private;
+
+  /* writes since the last commit; the ones of a commit were flushed by it */
+  if(overlay_flush(private) != 0)
+    GNUFDISK_WARNING("can not write overlay %s: %s", private->delta, strerror(errno));
+
+  overlay_device_release(private);
+
+  GNUFDISK_LOG((DEVICE, "done perform delete"));
+}
+
+static void overlay_probe_failure(void* _private)
+{
+  GNUFDISK_LOG((DEVICE, "release struct overlay_device_private* %p", _private));
+  overlay_device_release(_private);
+}
+
+static struct device_implementation overlay_device_implementation = {
+    NULL, /* private */
+    &overlay_device_start,
+    &overlay_device_end,
+    &overlay_device_seek,
+    &overlay_device_read,
+    &overlay_device_write,
+    &overlay_device_sector_size,
+    &overlay_device_minimum_alignment,
+    &overlay_device_optimal_alignment,
+    &overlay_device_set_parameter,
+    &overlay_device_get_parameter,
+    &overlay_device_commit,
+    &overlay_device_delete,
+    NULL, /* seek_data: everything is data */
+    NULL, /* zero: zeros are written to the delta */
+    NULL, /* discard */
+    NULL, /* discard_granularity */
+    &overlay_device_pread
+};
+
+int overlay_device_probe(const char* _path, struct module_options* _options, struct device_implementation* _implementation)
+{
+  struct overlay_device_private* private;
+  struct module_options options;
+  struct stat info;
+
+  GNUFDISK_LOG((DEVICE, "perform overlay_device_probe on %s, delta: %s", _path, _options->overlay));
+
+  if((private = malloc(sizeof(struct overlay_device_private))) == NULL)
+    THROW_ENOMEM;
+
+  memset(private, 0, sizeof(struct overlay_device_private));
+  private->fd = -1;
+
+  gnufdisk_exception_register_unwind_handler(&overlay_probe_failure, private);
+
+  /* the base is never written through the overlay */
+  memcpy(&options, _options, sizeof(struct module_options));
+  options.readonly = 1;
+  options.overlay = NULL;
+
+  if(device_probe_implementation(_path, &options, &private->base) != 0)
+    {
+      gnufdisk_exception_unregister_unwind_handler(&overlay_probe_failure, private);
+      overlay_device_release(private);
+
+      return -1;
+    }
+
+  if(gnufdisk_check_memory(private->base.pread, 1, 1) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOTSUP, NULL, "device implementation does not support `pread'");
+
+  memcpy(&private->options, _options, sizeof(struct module_options));
+  private->options.cache_dir = NULL;
+  private->options.overlay = NULL;
+
+  if((private->path = strdup(_path)) == NULL
+     || (private->delta = strdup(_options->overlay)) == NULL)
+    THROW_ENOMEM;
+
+  private->sector_size = (*private->base.sector_size)(private->base.private);
+  private->sectors = (*private->base.end)(private->base.private) + 1;
+  private->data = math_round_up(OVERLAY_DATA_OFFSET, private->sector_size);
+  private->map.levels = overlay_map_levels(private->sectors);
+
+  if((private->fd = open(private->delta, _options->readonly ? O_RDONLY : O_RDWR | O_CREAT, 0644)) == -1
+     || fstat(private->fd, &info) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not open overlay `%s': %s", private->delta, strerror(errno));
+
+  snprintf(private->identity, sizeof(private->identity), "overlay-%" PRIx64 "-%" PRIx64,
+	   (uint64_t) info.st_dev, (uint64_t) info.st_ino);
+
+  if(info.st_size > 0)
+    overlay_load(private);
+  else if(_options->readonly)
+    private->clean = 1;
+  else if(overlay_write_header(private, 1, private->data) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not write overlay `%s': %s", private->delta, strerror(errno));
+
+  GNUFDISK_LOG((DEVICE, "overlay:"));
+  GNUFDISK_LOG((DEVICE, "\tsector_size  : %" PRId64, private->sector_size));
+  GNUFDISK_LOG((DEVICE, "\tsectors      : %" PRId64, private->sectors));
+  GNUFDISK_LOG((DEVICE, "\tslots        : %" PRIu64, private->nslots));
+  GNUFDISK_LOG((DEVICE, "\tradix levels : %d", private->map.levels));
+
+  memcpy(_implementation, &overlay_device_implementation, sizeof(struct device_implementation));
+  _implementation->private = private;
+
+  gnufdisk_exception_unregister_unwind_handler(&overlay_probe_failure, private);
+
+  GNUFDISK_LOG((DEVICE, "done overlay_device_probe"));
+
+  return 0;
+}
@@ -94,7 +94,7 @@ static void partition_private_delete(void* _private)
   object_delete(private->parent);
   
   memset(private, 0, sizeof(struct partition_private));
-  free(private);
+  arena_free(private);
 
   GNUFDISK_LOG((PARTITION, "done perform delete"));
 }
@@ -135,11 +135,37 @@ static void partition_get_parameter(void* _object, struct gnufdisk_string* _para
   private = object_private(_object, OBJECT_TYPE_PARTITION);
 
   partition_private_check(private);
-  
-  if(gnufdisk_check_memory(private->implementation.get_parameter, 1, 1) != 0)
-    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL, "partition implementation does not support `get_parameter'");
 
-  (*private->implementation.get_parameter)(private->implementation.private, _param, _data, _size);
+  if(strcasecmp(gnufdisk_string_c_string(_param), "CONTENT") == 0)
+    {
+      struct content_partition content;
+      struct object* device;
+      gnufdisk_integer sector_size;
+
+      if(_size < GNUFDISK_PARTITION_CONTENT_SIZE)
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETERSIZE, NULL, "invalid parameter size");
+
+      device = object_cast(_object, OBJECT_TYPE_DEVICE);
+      sector_size = device_sector_size(device);
+
+      content.start = object_start(_object) * sector_size;
+      content.length = (object_end(_object) - object_start(_object) + 1) * sector_size;
+
+      /* a partition holding a disklabel is a container, not a file system */
+      if(partition_get_disklabel(_object) != NULL)
+	content.length = 0;
+
+      content_probe(device, &content, 1);
+
+      memcpy(_data, content.name, GNUFDISK_PARTITION_CONTENT_SIZE);
+    }
+  else
+    {
+      if(gnufdisk_check_memory(private->implementation.get_parameter, 1, 1) != 0)
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL, "partition implementation does not support `get_parameter'");
+
+      (*private->implementation.get_parameter)(private->implementation.private, _param, _data, _size);
+    }
   
   GNUFDISK_LOG((PARTITION, "done perform get_parameter"));
 }
@@ -258,7 +284,7 @@ static void partition_disklabel(void* _object, struct gnufdisk_disklabel_operati
 
   disklabel = (*private->implementation.disklabel)(private->implementation.private);
 
-  object_ref(disklabel);
+  object_export(disklabel);
 
   memcpy(_operations, &disklabel_operations, sizeof(struct gnufdisk_disklabel_operations));
   *_specific = disklabel;
@@ -344,11 +370,92 @@ static int partition_write(void* _object, gnufdisk_integer _sector, const void*
   return ret;
 }
 
+static gnufdisk_integer partition_seek_data(void* _object, gnufdisk_integer _sector, int _whence)
+{
+  struct partition_private* private;
+  struct object* device;
+  gnufdisk_integer start;
+  gnufdisk_integer end;
+  gnufdisk_integer ret;
+
+  GNUFDISK_LOG((PARTITION, "perform seek_data on struct object* %p", _object));
+
+  private = object_private(_object, OBJECT_TYPE_PARTITION);
+
+  partition_private_check(private);
+
+  start = object_start(_object);
+  end = object_end(_object);
+
+  if(_sector < 0 || start + _sector > end + 1)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "attempt to seek out of partition space");
+
+  device = object_cast(private->parent, OBJECT_TYPE_DEVICE);
+
+  ret = device_seek_data(device, start + _sector, end + 1, _whence) - start;
+
+  GNUFDISK_LOG((PARTITION, "done perform seek_data, result: %" PRId64, ret));
+
+  return ret;
+}
+
+static void partition_zero(void* _object, gnufdisk_integer _sector, gnufdisk_integer _count)
+{
+  struct partition_private* private;
+  struct object* device;
+  gnufdisk_integer start;
+
+  GNUFDISK_LOG((PARTITION, "perform zero on struct object* %p", _object));
+
+  private = object_private(_object, OBJECT_TYPE_PARTITION);
+
+  partition_private_check(private);
+
+  start = object_start(_object);
+
+  if(_sector < 0 || _count < 0 || start + _sector + _count - 1 > object_end(_object))
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "attempt to zero out of partition space");
+
+  device = object_cast(private->parent, OBJECT_TYPE_DEVICE);
+
+  if(_count > 0)
+    device_zero(device, start + _sector, _count);
+
+  GNUFDISK_LOG((PARTITION, "done perform zero"));
+}
+
+static gnufdisk_integer partition_pread(void* _object, gnufdisk_integer _sector, void* _buf, size_t _size)
+{
+  struct partition_private* private;
+  struct object* device;
+  gnufdisk_integer start;
+  gnufdisk_integer ret;
+
+  GNUFDISK_LOG((PARTITION, "perform pread on struct object* %p", _object));
+
+  private = object_private(_object, OBJECT_TYPE_PARTITION);
+
+  partition_private_check(private);
+
+  device = object_cast(private->parent, OBJECT_TYPE_DEVICE);
+  start = object_start(_object);
+
+  if(_sector < 0 
+     || start + _sector + (gnufdisk_integer) (_size / device_sector_size(device)) > object_end(_object) + 1)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "attempt to read out of partition space");
+
+  ret = device_pread(device, start + _sector, _buf, _size);
+
+  GNUFDISK_LOG((PARTITION, "done perform pread, result: %" PRId64, ret));
+
+  return ret;
+}
+
 static void partition_delete(void* _object)
 {
   GNUFDISK_LOG((PARTITION, "perform delete on struct object* %p", _object));
 
-  object_delete(_object);
+  object_unexport(_object);
 
   GNUFDISK_LOG((PARTITION, "done perform delete"));
 }
@@ -366,6 +473,9 @@ struct gnufdisk_partition_operations partition_operations = {
   resize: &partition_resize,
   read: &partition_read,
   write: &partition_write,
+  seek_data: &partition_seek_data,
+  zero: &partition_zero,
+  pread: &partition_pread,
   delete: &partition_delete
 };
 
@@ -381,16 +491,15 @@ struct object* partition_new(struct object* _parent,
   GNUFDISK_LOG((PARTITION, "start: %" PRId64, _start));
   GNUFDISK_LOG((PARTITION, "end: %" PRId64, _end));
 
-  if((private = malloc(sizeof(struct partition_private))) == NULL)
-    THROW_ENOMEM;
+  private = arena_alloc(object_arena(_parent), sizeof(struct partition_private));
 
-  gnufdisk_exception_register_unwind_handler(&free, private);
+  gnufdisk_exception_register_unwind_handler(&arena_free, private);
 
-  ret = object_new(OBJECT_TYPE_PARTITION, &partition_private_operations, private);
+  ret = object_new(object_arena(_parent), OBJECT_TYPE_PARTITION, &partition_private_operations, private);
 
   gnufdisk_exception_register_unwind_handler(&delete_object, ret);
 
-  gnufdisk_exception_unregister_unwind_handler(&free, private);
+  gnufdisk_exception_unregister_unwind_handler(&arena_free, private);
 
   object_ref(_parent);
   private->parent = _parent;
@@ -441,3 +550,26 @@ void partition_set_parent(void* _object, struct object* _parent)
   GNUFDISK_LOG((PARTITION, "done perform set_parent"));
 }
 
+
+struct object* partition_get_disklabel(void* _object)
+{
+  struct partition_private* private;
+  struct object* ret;
+
+  GNUFDISK_LOG((PARTITION, "perform get_disklabel on struct object* %p", _object));
+
+  private = object_private(_object, OBJECT_TYPE_PARTITION);
+
+  partition_private_check(private);
+
+  ret = NULL;
+
+  if(gnufdisk_check_memory(private->implementation.have_disklabel, 1, 1) == 0
+     && gnufdisk_check_memory(private->implementation.disklabel, 1, 1) == 0
+     && (*private->implementation.have_disklabel)(private->implementation.private))
+    ret = (*private->implementation.disklabel)(private->implementation.private);
+
+  GNUFDISK_LOG((PARTITION, "done perform get_disklabel, result: %p", ret));
+
+  return ret;
+}
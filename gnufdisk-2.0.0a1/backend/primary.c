@@ -142,7 +142,7 @@ static int primary_private_read(void* _private, gnufdisk_integer _sector, void*
 
   GNUFDISK_LOG((PARTITION, "real sector: %"PRId64, real_sector));
 
-  if((real_sector + _size / device_sector_size(device)) >= private->end)
+  if(real_sector + (gnufdisk_integer) (_size / device_sector_size(device)) > private->end + 1)
     GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "attempt to read out of partition space");
 
   if(device_seek(device, _sector + private->start, 0, SEEK_SET) == -1)
@@ -176,7 +176,7 @@ static int primary_private_write(void* _private, gnufdisk_integer _sector, const
 
   GNUFDISK_LOG((PARTITION, "real sector: %"PRId64, real_sector));
 
-  if((real_sector + _size / device_sector_size(device)) >= private->end)
+  if(real_sector + (gnufdisk_integer) (_size / device_sector_size(device)) > private->end + 1)
     GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "attempt to write out of partition space");
 
   if(device_seek(device, _sector + private->start, 0, SEEK_SET) == -1)
@@ -210,7 +210,7 @@ static void primary_private_delete(void* _private)
 
   memset(private, 0, sizeof(struct primary_private));
 
-  free(private);
+  arena_free(private);
 
   GNUFDISK_LOG((PARTITION, "done perform delete"));
 }
@@ -241,10 +241,9 @@ struct object* primary_new(struct object* _parent, gnufdisk_integer _start, gnuf
   GNUFDISK_LOG((PARTITION, "start: %" PRId64, _start));
   GNUFDISK_LOG((PARTITION, "end: %" PRId64, _end));
 
-  if((private = malloc(sizeof(struct primary_private))) == NULL)
-    THROW_ENOMEM;
+  private = arena_alloc(object_arena(_parent), sizeof(struct primary_private));
 
-  gnufdisk_exception_register_unwind_handler(&free, private);
+  gnufdisk_exception_register_unwind_handler(&arena_free, private);
   
   memcpy(&implementation, &primary_implementation, sizeof(struct partition_implementation));
   implementation.private = private;
@@ -252,7 +251,7 @@ struct object* primary_new(struct object* _parent, gnufdisk_integer _start, gnuf
   ret = partition_new(_parent, _start, _end, &implementation);
 
   gnufdisk_exception_register_unwind_handler(&delete_object, ret);
-  gnufdisk_exception_unregister_unwind_handler(&free, private);
+  gnufdisk_exception_unregister_unwind_handler(&arena_free, private);
 
   object_ref(_parent);
   private->parent = _parent;
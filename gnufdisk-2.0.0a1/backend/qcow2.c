@@ -0,0 +1,1834 @@
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <zlib.h>
+
+#include "common.h"
+
+/* qcow2 images: guest offsets are mapped through the L1 table (kept in
+ * memory) and the L2 tables (a small LRU cache, written back on eviction
+ * and on commit), so only the clusters a read or write touches are
+ * accessed.
+ *
+ * A write to a cluster the image does not own yet allocates a new one at
+ * the end of the file, copying in the old content (backing file, zero
+ * cluster or compressed cluster) around a partial write. The refcount of
+ * a new cluster is written before anything points to it, and the clusters
+ * given up are released only after the tables stop pointing to them, so a
+ * crash leaks clusters instead of corrupting the image. Space released
+ * inside the file is not reused.
+ *
+ * Clusters the image does not have are read from the backing file, which
+ * is opened read-only with device_probe_implementation and so may be a raw
+ * file, another qcow2 image or an nbd export. Compressed clusters can be
+ * read, and are replaced by normal ones when written. Images with internal
+ * snapshots, encryption, an external data file or extended L2 entries are
+ * not supported for writing (the last three not at all). */
+
+#define QCOW2_MAGIC 0x514649fb
+#define QCOW2_MAX_BACKING_DEPTH 16
+#define QCOW2_L2_CACHE 16 /* tables */
+#define QCOW2_L2_CACHE_SIZE 4194304 /* bytes, fewer tables for large clusters */
+#define QCOW2_WRITE_CLUSTERS 256 /* clusters allocated with one refcount update */
+
+#define QCOW2_OFFSET_MASK 0x00fffffffffffe00ULL
+#define QCOW2_REFCOUNT_MASK 0xfffffffffffffe00ULL
+#define QCOW2_OFLAG_COPIED (1ULL << 63)
+#define QCOW2_OFLAG_COMPRESSED (1ULL << 62)
+#define QCOW2_OFLAG_ZERO 1ULL
+
+#define QCOW2_INCOMPAT_DIRTY (1ULL << 0)
+#define QCOW2_INCOMPAT_CORRUPT (1ULL << 1)
+
+#define QCOW2_HEADER_V2_LENGTH 72
+#define QCOW2_HEADER_AUTOCLEAR 88 /* offset of autoclear_features */
+#define QCOW2_HEADER_REFCOUNT_TABLE 48 /* offset of refcount_table_offset */
+
+struct qcow2_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t backing_file_offset;
+  uint32_t backing_file_size;
+  uint32_t cluster_bits;
+  uint64_t size;
+  uint32_t crypt_method;
+  uint32_t l1_size;
+  uint64_t l1_table_offset;
+  uint64_t refcount_table_offset;
+  uint32_t refcount_table_clusters;
+  uint32_t nb_snapshots;
+  uint64_t snapshots_offset;
+  /* version 3 */
+  uint64_t incompatible_features;
+  uint64_t compatible_features;
+  uint64_t autoclear_features;
+  uint32_t refcount_order;
+  uint32_t header_length;
+} __attribute__((packed));
+
+enum qcow2_cluster_type {
+  QCOW2_UNALLOCATED, /* backing file or zeros */
+  QCOW2_ZERO,
+  QCOW2_NORMAL,
+  QCOW2_COMPRESSED
+};
+
+struct qcow2_l2 {
+  uint64_t offset; /* 0 when the slot is free */
+  unsigned long stamp;
+  int dirty;
+  uint64_t* table; /* host byte order */
+};
+
+/* host clusters to release after the next flush */
+struct qcow2_free {
+  uint64_t cluster;
+  uint64_t count;
+};
+
+struct qcow2_run {
+  uint64_t offset;
+  unsigned char* buf;
+  size_t length;
+};
+
+struct qcow2_device_private {
+  int fd;
+  pthread_mutex_t mutex;
+  char identity[128];
+  int readonly;
+  uint32_t version;
+  int cluster_bits;
+  uint64_t cluster_size;
+  uint64_t l2_entries;
+  uint64_t size; /* guest size */
+  uint64_t* l1; /* host byte order */
+  uint32_t l1_size;
+  uint64_t l1_offset;
+  int l1_dirty;
+  uint64_t* refcount_table; /* host byte order */
+  uint64_t refcount_table_offset;
+  uint32_t refcount_table_clusters;
+  int refcount_bytes;
+  uint64_t refcount_entries; /* per refcount block */
+  uint64_t next_cluster; /* offset of the next allocation: the end of file */
+  struct qcow2_l2 cache[QCOW2_L2_CACHE];
+  int ncache;
+  unsigned long clock;
+  struct qcow2_free* frees;
+  size_t nfrees;
+  size_t maxfrees;
+  unsigned char* cluster; /* copy-on-write and write-back buffer */
+  unsigned char* refcounts; /* part of a refcount block */
+  unsigned char* zeros;
+  unsigned char* compressed; /* last compressed cluster read */
+  uint64_t compressed_entry;
+  struct device_implementation backing;
+  uint64_t backing_size;
+  gnufdisk_integer backing_sector_size;
+  gnufdisk_integer position;
+  gnufdisk_integer cylinders;
+  gnufdisk_integer heads;
+  gnufdisk_integer sectors;
+  gnufdisk_integer sector_size;
+};
+
+static __thread int qcow2_backing_depth;
+
+static int qcow2_pread(struct qcow2_device_private* _private, void* _buf, size_t _size, uint64_t _offset)
+{
+  unsigned char* buf;
+
+  buf = _buf;
+
+  while(_size > 0)
+    {
+      ssize_t ret;
+
+      if((ret = pread(_private->fd, buf, _size, _offset)) == -1)
+	{
+	  if(errno == EINTR)
+	    continue;
+
+	  return -1;
+	}
+      else if(ret == 0)
+	{
+	  /* the image ends before the data it points to */
+	  errno = EIO;
+	  return -1;
+	}
+
+      buf += ret;
+      _size -= ret;
+      _offset += ret;
+    }
+
+  return 0;
+}
+
+static int qcow2_pwrite(struct qcow2_device_private* _private, const void* _buf, size_t _size, uint64_t _offset)
+{
+  const unsigned char* buf;
+
+  buf = _buf;
+
+  while(_size > 0)
+    {
+      ssize_t ret;
+
+      if((ret = pwrite(_private->fd, buf, _size, _offset)) == -1)
+	{
+	  if(errno == EINTR)
+	    continue;
+
+	  return -1;
+	}
+
+      buf += ret;
+      _size -= ret;
+      _offset += ret;
+    }
+
+  return 0;
+}
+
+static uint64_t qcow2_get_be(const unsigned char* _buf, int _bytes)
+{
+  uint64_t value;
+  int iter;
+
+  for(value = 0, iter = 0; iter < _bytes; iter++)
+    value = (value << 8) | _buf[iter];
+
+  return value;
+}
+
+static void qcow2_put_be(unsigned char* _buf, int _bytes, uint64_t _value)
+{
+  int iter;
+
+  for(iter = _bytes - 1; iter >= 0; iter--, _value >>= 8)
+    _buf[iter] = _value & 0xff;
+}
+
+static void qcow2_device_private_check(struct qcow2_device_private* _private)
+{
+  if(gnufdisk_check_memory(_private, sizeof(struct qcow2_device_private), 0) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL, "invalid struct qcow2_device_private* %p", _private);
+
+  if(_private->fd < 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL, "invalid file descriptor: %d", _private->fd);
+}
+
+/* add _addend to the refcount of _count clusters from _first */
+static int qcow2_refcount_update(struct qcow2_device_private* _private, uint64_t _first, uint64_t _count, int _addend)
+{
+  while(_count > 0)
+    {
+      uint64_t table_index;
+      uint64_t block_index;
+      uint64_t block;
+      uint64_t count;
+      uint64_t iter;
+      uint64_t limit;
+
+      table_index = _first / _private->refcount_entries;
+      block_index = _first % _private->refcount_entries;
+      count = _private->refcount_entries - block_index < _count ? _private->refcount_entries - block_index : _count;
+
+      if(table_index >= _private->refcount_table_clusters * _private->cluster_size / 8
+	 || (block = _private->refcount_table[table_index] & QCOW2_REFCOUNT_MASK) == 0)
+	{
+	  GNUFDISK_LOG((DEVICE, "no refcount block for cluster %" PRIu64, _first));
+	  errno = EIO;
+	  return -1;
+	}
+
+      block += block_index * _private->refcount_bytes;
+
+      if(qcow2_pread(_private, _private->refcounts, count * _private->refcount_bytes, block) != 0)
+	return -1;
+
+      limit = _private->refcount_bytes == 8 ? UINT64_MAX : (1ULL << (_private->refcount_bytes * 8)) - 1;
+
+      for(iter = 0; iter < count; iter++)
+	{
+	  unsigned char* entry;
+	  uint64_t value;
+
+	  entry = _private->refcounts + iter * _private->refcount_bytes;
+	  value = qcow2_get_be(entry, _private->refcount_bytes);
+
+	  if((_addend < 0 && value == 0) || (_addend > 0 && value == limit))
+	    {
+	      GNUFDISK_LOG((DEVICE, "refcount of cluster %" PRIu64 " out of range", _first + iter));
+	      errno = EIO;
+	      return -1;
+	    }
+
+	  qcow2_put_be(entry, _private->refcount_bytes, value + _addend);
+	}
+
+      if(qcow2_pwrite(_private, _private->refcounts, count * _private->refcount_bytes, block) != 0)
+	return -1;
+
+      _first += count;
+      _count -= count;
+    }
+
+  return 0;
+}
+
+/* move the refcount table to the end of the file with twice the clusters */
+static int qcow2_refcount_grow(struct qcow2_device_private* _private)
+{
+  struct {
+    uint64_t offset;
+    uint32_t clusters;
+  } __attribute__((packed)) header;
+  uint64_t* table;
+  uint64_t entries;
+  uint64_t offset;
+  uint64_t clusters;
+  uint64_t position;
+  uint64_t old_offset;
+  uint32_t old_clusters;
+  uint64_t iter;
+
+  clusters = (uint64_t) _private->refcount_table_clusters * 2;
+  entries = clusters * _private->cluster_size / 8;
+  offset = _private->next_cluster;
+
+  GNUFDISK_LOG((DEVICE, "grow refcount table to %" PRIu64 " clusters at %" PRIu64, clusters, offset));
+
+  if(clusters > UINT32_MAX || (table = calloc(entries, sizeof(uint64_t))) == NULL)
+    {
+      errno = clusters > UINT32_MAX ? EFBIG : ENOMEM;
+      return -1;
+    }
+
+  memcpy(table, _private->refcount_table, _private->refcount_table_clusters * _private->cluster_size);
+
+  /* new blocks for the table and for themselves go right after the table */
+  position = offset + clusters * _private->cluster_size;
+
+  for(iter = (offset >> _private->cluster_bits) / _private->refcount_entries;
+      iter <= ((position >> _private->cluster_bits) - 1) / _private->refcount_entries;
+      iter++)
+    if(iter >= entries)
+      {
+	errno = EFBIG;
+	goto lb_error;
+      }
+    else if(table[iter] == 0)
+      {
+	if(qcow2_pwrite(_private, _private->zeros, _private->cluster_size, position) != 0)
+	  goto lb_error;
+
+	table[iter] = position;
+	position += _private->cluster_size;
+      }
+
+  for(iter = 0; iter < entries; iter++)
+    table[iter] = htobe64(table[iter]);
+
+  if(qcow2_pwrite(_private, table, clusters * _private->cluster_size, offset) != 0)
+    goto lb_error;
+
+  for(iter = 0; iter < entries; iter++)
+    table[iter] = be64toh(table[iter]);
+
+  old_offset = _private->refcount_table_offset;
+  old_clusters = _private->refcount_table_clusters;
+
+  free(_private->refcount_table);
+  _private->refcount_table = table;
+  _private->refcount_table_offset = offset;
+  _private->refcount_table_clusters = clusters;
+  _private->next_cluster = position;
+
+  if(qcow2_refcount_update(_private, offset >> _private->cluster_bits, (position - offset) >> _private->cluster_bits, 1) != 0
+     || fdatasync(_private->fd) != 0)
+    return -1;
+
+  header.offset = htobe64(offset);
+  header.clusters = htobe32(clusters);
+
+  if(qcow2_pwrite(_private, &header, sizeof(header), QCOW2_HEADER_REFCOUNT_TABLE) != 0
+     || fdatasync(_private->fd) != 0)
+    return -1;
+
+  return qcow2_refcount_update(_private, old_offset >> _private->cluster_bits, old_clusters, -1);
+
+lb_error:
+
+  free(table);
+  return -1;
+}
+
+/* allocate _count contiguous clusters at the end of the file, 0 on error */
+static uint64_t qcow2_allocate(struct qcow2_device_private* _private, uint64_t _count)
+{
+  uint64_t first;
+
+  for(;;)
+    {
+      uint64_t last;
+      uint64_t iter;
+
+      first = _private->next_cluster >> _private->cluster_bits;
+      last = first + _count - 1;
+
+      for(iter = first / _private->refcount_entries; iter <= last / _private->refcount_entries; iter++)
+	if(iter >= _private->refcount_table_clusters * _private->cluster_size / 8
+	   || _private->refcount_table[iter] == 0)
+	  break;
+
+      if(iter > last / _private->refcount_entries)
+	break;
+
+      if(iter >= _private->refcount_table_clusters * _private->cluster_size / 8)
+	{
+	  if(qcow2_refcount_grow(_private) != 0)
+	    return 0;
+	}
+      else
+	{
+	  uint64_t block;
+	  uint64_t entry;
+
+	  /* the new block takes the first cluster: it counts itself, or
+	   * an earlier block does */
+	  block = _private->next_cluster;
+	  entry = htobe64(block);
+
+	  if(qcow2_pwrite(_private, _private->zeros, _private->cluster_size, block) != 0
+	     || qcow2_pwrite(_private, &entry, sizeof(entry), _private->refcount_table_offset + iter * sizeof(entry)) != 0)
+	    return 0;
+
+	  _private->refcount_table[iter] = block;
+	  _private->next_cluster += _private->cluster_size;
+
+	  if(qcow2_refcount_update(_private, block >> _private->cluster_bits, 1, 1) != 0)
+	    return 0;
+	}
+    }
+
+  if(qcow2_refcount_update(_private, first, _count, 1) != 0)
+    return 0;
+
+  _private->next_cluster += _count << _private->cluster_bits;
+
+  return first << _private->cluster_bits;
+}
+
+/* release the host clusters of an L2 entry after the next flush */
+static int qcow2_release(struct qcow2_device_private* _private, uint64_t _entry)
+{
+  uint64_t cluster;
+  uint64_t count;
+
+  if(_entry & QCOW2_OFLAG_COMPRESSED)
+    {
+      int shift;
+      uint64_t offset;
+      uint64_t end;
+
+      shift = 62 - (_private->cluster_bits - 8);
+      offset = _entry & ((1ULL << shift) - 1);
+      end = (offset & ~511ULL) + (((_entry >> shift) & ((1ULL << (_private->cluster_bits - 8)) - 1)) + 1) * 512;
+
+      cluster = offset >> _private->cluster_bits;
+      count = ((end - 1) >> _private->cluster_bits) - cluster + 1;
+    }
+  else if((_entry & QCOW2_OFFSET_MASK) != 0)
+    {
+      cluster = (_entry & QCOW2_OFFSET_MASK) >> _private->cluster_bits;
+      count = 1;
+    }
+  else
+    return 0;
+
+  if(_private->nfrees == _private->maxfrees)
+    {
+      struct qcow2_free* frees;
+      size_t max;
+
+      max = _private->maxfrees ? _private->maxfrees * 2 : 64;
+
+      if((frees = realloc(_private->frees, max * sizeof(struct qcow2_free))) == NULL)
+	return -1;
+
+      _private->frees = frees;
+      _private->maxfrees = max;
+    }
+
+  _private->frees[_private->nfrees].cluster = cluster;
+  _private->frees[_private->nfrees].count = count;
+  _private->nfrees++;
+
+  return 0;
+}
+
+static int qcow2_l2_write(struct qcow2_device_private* _private, struct qcow2_l2* _l2)
+{
+  uint64_t* table;
+  uint64_t iter;
+
+  table = (uint64_t*) _private->cluster;
+
+  for(iter = 0; iter < _private->l2_entries; iter++)
+    table[iter] = htobe64(_l2->table[iter]);
+
+  if(qcow2_pwrite(_private, table, _private->cluster_size, _l2->offset) != 0)
+    return -1;
+
+  _l2->dirty = 0;
+
+  return 0;
+}
+
+/* L2 table of L1 entry _index; with _allocate a missing one is created,
+ * otherwise NULL is returned with errno 0 */
+static struct qcow2_l2* qcow2_l2_get(struct qcow2_device_private* _private, uint64_t _index, int _allocate)
+{
+  struct qcow2_l2* victim;
+  uint64_t offset;
+  int iter;
+
+  offset = _private->l1[_index] & QCOW2_OFFSET_MASK;
+
+  if(offset == 0 && !_allocate)
+    {
+      errno = 0;
+      return NULL;
+    }
+
+  victim = &_private->cache[0];
+
+  for(iter = 0; iter < _private->ncache; iter++)
+    {
+      if(offset != 0 && _private->cache[iter].offset == offset)
+	{
+	  _private->cache[iter].stamp = ++_private->clock;
+	  return &_private->cache[iter];
+	}
+
+      if(_private->cache[iter].stamp < victim->stamp)
+	victim = &_private->cache[iter];
+    }
+
+  if(victim->dirty && qcow2_l2_write(_private, victim) != 0)
+    return NULL;
+
+  victim->offset = 0;
+
+  if(victim->table == NULL && (victim->table = malloc(_private->cluster_size)) == NULL)
+    return NULL;
+
+  if(offset == 0)
+    {
+      if((offset = qcow2_allocate(_private, 1)) == 0)
+	return NULL;
+
+      memset(victim->table, 0, _private->cluster_size);
+      victim->dirty = 1;
+
+      _private->l1[_index] = offset | QCOW2_OFLAG_COPIED;
+      _private->l1_dirty = 1;
+    }
+  else
+    {
+      uint64_t entry;
+
+      if(offset & (_private->cluster_size - 1))
+	{
+	  GNUFDISK_LOG((DEVICE, "misaligned L2 table at %" PRIu64, offset));
+	  errno = EIO;
+	  return NULL;
+	}
+
+      if(qcow2_pread(_private, victim->table, _private->cluster_size, offset) != 0)
+	return NULL;
+
+      for(entry = 0; entry < _private->l2_entries; entry++)
+	victim->table[entry] = be64toh(victim->table[entry]);
+    }
+
+  victim->offset = offset;
+  victim->stamp = ++_private->clock;
+
+  return victim;
+}
+
+/* type and L2 entry of guest cluster _cluster, -1 on error */
+static int qcow2_lookup(struct qcow2_device_private* _private, uint64_t _cluster, uint64_t* _entry)
+{
+  struct qcow2_l2* l2;
+  uint64_t entry;
+
+  *_entry = 0;
+
+  if(_cluster / _private->l2_entries >= _private->l1_size)
+    {
+      errno = EIO;
+      return -1;
+    }
+
+  if((l2 = qcow2_l2_get(_private, _cluster / _private->l2_entries, 0)) == NULL)
+    return errno == 0 ? QCOW2_UNALLOCATED : -1;
+
+  *_entry = entry = l2->table[_cluster % _private->l2_entries];
+
+  if(entry & QCOW2_OFLAG_COMPRESSED)
+    return QCOW2_COMPRESSED;
+  else if(_private->version >= 3 && (entry & QCOW2_OFLAG_ZERO))
+    return QCOW2_ZERO;
+  else if(entry & QCOW2_OFFSET_MASK)
+    {
+      if(entry & (_private->cluster_size - 1) & QCOW2_OFFSET_MASK)
+	{
+	  GNUFDISK_LOG((DEVICE, "misaligned data cluster %" PRIx64, entry));
+	  errno = EIO;
+	  return -1;
+	}
+
+      return QCOW2_NORMAL;
+    }
+
+  return QCOW2_UNALLOCATED;
+}
+
+static int qcow2_set_entry(struct qcow2_device_private* _private, uint64_t _cluster, uint64_t _entry)
+{
+  struct qcow2_l2* l2;
+
+  if((l2 = qcow2_l2_get(_private, _cluster / _private->l2_entries, 1)) == NULL)
+    return -1;
+
+  l2->table[_cluster % _private->l2_entries] = _entry;
+  l2->dirty = 1;
+
+  return 0;
+}
+
+static unsigned char* qcow2_read_compressed(struct qcow2_device_private* _private, uint64_t _entry)
+{
+  unsigned char* input;
+  z_stream stream;
+  uint64_t offset;
+  uint64_t size;
+  ssize_t ret;
+  int shift;
+  int err;
+
+  if(_private->compressed_entry == _entry)
+    return _private->compressed;
+
+  shift = 62 - (_private->cluster_bits - 8);
+  offset = _entry & ((1ULL << shift) - 1);
+  size = (((_entry >> shift) & ((1ULL << (_private->cluster_bits - 8)) - 1)) + 1) * 512 - (offset & 511);
+
+  if((input = malloc(size)) == NULL)
+    return NULL;
+
+  /* the last compressed cluster may end before its last sector */
+  if((ret = pread(_private->fd, input, size, offset)) <= 0)
+    {
+      free(input);
+      errno = ret == 0 ? EIO : errno;
+      return NULL;
+    }
+
+  memset(&stream, 0, sizeof(stream));
+
+  if(inflateInit2(&stream, -12) != Z_OK)
+    {
+      free(input);
+      errno = ENOMEM;
+      return NULL;
+    }
+
+  stream.next_in = input;
+  stream.avail_in = ret;
+  stream.next_out = _private->compressed;
+  stream.avail_out = _private->cluster_size;
+
+  err = inflate(&stream, Z_FINISH);
+
+  inflateEnd(&stream);
+  free(input);
+
+  _private->compressed_entry = 0;
+
+  if((err != Z_STREAM_END && err != Z_BUF_ERROR) || stream.avail_out != 0)
+    {
+      GNUFDISK_LOG((DEVICE, "can not decompress cluster at %" PRIu64 ": %d", offset, err));
+      errno = EIO;
+      return NULL;
+    }
+
+  _private->compressed_entry = _entry;
+
+  return _private->compressed;
+}
+
+/* the backing file seen from guest offset _offset, zeros past its end */
+static int qcow2_read_backing(struct qcow2_device_private* _private, uint64_t _offset, unsigned char* _buf, size_t _size)
+{
+  unsigned char* bounce;
+  uint64_t start;
+  uint64_t end;
+  size_t size;
+
+  size = _offset < _private->backing_size
+    ? (_private->backing_size - _offset < _size ? _private->backing_size - _offset : _size)
+    : 0;
+
+  memset(_buf + size, 0, _size - size);
+
+  if(size == 0)
+    return 0;
+
+  /* math_round_down() never returns less than one grain */
+  start = _offset - _offset % _private->backing_sector_size;
+  end = math_round_up(_offset + size, _private->backing_sector_size);
+
+  if(start == _offset && end == _offset + size)
+    {
+      if((*_private->backing.pread)(_private->backing.private, start / _private->backing_sector_size, _buf, size) != size)
+	return -1;
+
+      return 0;
+    }
+
+  if((bounce = malloc(end - start)) == NULL)
+    return -1;
+
+  if((*_private->backing.pread)(_private->backing.private, start / _private->backing_sector_size, bounce, end - start) != end - start)
+    {
+      free(bounce);
+      return -1;
+    }
+
+  memcpy(_buf, bounce + (_offset - start), size);
+  free(bounce);
+
+  return 0;
+}
+
+/* current content of a whole guest cluster */
+static int qcow2_read_cluster(struct qcow2_device_private* _private, uint64_t _cluster, int _type, uint64_t _entry, unsigned char* _buf)
+{
+  unsigned char* data;
+
+  switch(_type)
+    {
+    case QCOW2_NORMAL:
+      return qcow2_pread(_private, _buf, _private->cluster_size, _entry & QCOW2_OFFSET_MASK);
+    case QCOW2_COMPRESSED:
+      if((data = qcow2_read_compressed(_private, _entry)) == NULL)
+	return -1;
+
+      memcpy(_buf, data, _private->cluster_size);
+      return 0;
+    case QCOW2_UNALLOCATED:
+      if(_private->backing.private)
+	return qcow2_read_backing(_private, _cluster << _private->cluster_bits, _buf, _private->cluster_size);
+      /* fall through */
+    default:
+      memset(_buf, 0, _private->cluster_size);
+      return 0;
+    }
+}
+
+static int qcow2_run_read(struct qcow2_device_private* _private, struct qcow2_run* _run, int _backing)
+{
+  int ret;
+
+  if(_run->length == 0)
+    return 0;
+
+  ret = _backing
+    ? qcow2_read_backing(_private, _run->offset, _run->buf, _run->length)
+    : qcow2_pread(_private, _run->buf, _run->length, _run->offset);
+
+  _run->length = 0;
+
+  return ret;
+}
+
+/* extend _run with _length bytes at _offset, or read it and start a new one */
+static int qcow2_run_add(struct qcow2_device_private* _private,
+			 struct qcow2_run* _run,
+			 int _backing,
+			 uint64_t _offset,
+			 unsigned char* _buf,
+			 size_t _length)
+{
+  if(_run->length > 0
+     && _run->offset + _run->length == _offset
+     && _run->buf + _run->length == _buf)
+    {
+      _run->length += _length;
+      return 0;
+    }
+
+  if(qcow2_run_read(_private, _run, _backing) != 0)
+    return -1;
+
+  _run->offset = _offset;
+  _run->buf = _buf;
+  _run->length = _length;
+
+  return 0;
+}
+
+static gnufdisk_integer qcow2_read_at(struct qcow2_device_private* _private, uint64_t _offset, void* _buf, size_t _size)
+{
+  struct qcow2_run host;
+  struct qcow2_run backing;
+  unsigned char* buf;
+  size_t done;
+
+  if(_offset >= _private->size)
+    return 0;
+
+  if(_size > _private->size - _offset)
+    _size = _private->size - _offset;
+
+  buf = _buf;
+  memset(&host, 0, sizeof(host));
+  memset(&backing, 0, sizeof(backing));
+
+  for(done = 0; done < _size; )
+    {
+      uint64_t offset;
+      uint64_t cluster;
+      uint64_t entry;
+      size_t in;
+      size_t count;
+      unsigned char* data;
+      int type;
+
+      offset = _offset + done;
+      cluster = offset >> _private->cluster_bits;
+      in = offset & (_private->cluster_size - 1);
+      count = _private->cluster_size - in < _size - done ? _private->cluster_size - in : _size - done;
+
+      if((type = qcow2_lookup(_private, cluster, &entry)) == -1)
+	return -1;
+
+      switch(type)
+	{
+	case QCOW2_NORMAL:
+	  if(qcow2_run_add(_private, &host, 0, (entry & QCOW2_OFFSET_MASK) + in, buf + done, count) != 0)
+	    return -1;
+	  break;
+	case QCOW2_UNALLOCATED:
+	  if(_private->backing.private)
+	    {
+	      if(qcow2_run_add(_private, &backing, 1, offset, buf + done, count) != 0)
+		return -1;
+	      break;
+	    }
+	  /* fall through */
+	case QCOW2_ZERO:
+	  memset(buf + done, 0, count);
+	  break;
+	case QCOW2_COMPRESSED:
+	  if((data = qcow2_read_compressed(_private, entry)) == NULL)
+	    return -1;
+
+	  memcpy(buf + done, data + in, count);
+	  break;
+	}
+
+      done += count;
+    }
+
+  if(qcow2_run_read(_private, &host, 0) != 0
+     || qcow2_run_read(_private, &backing, 1) != 0)
+    return -1;
+
+  return _size;
+}
+
+/* whole clusters from _cluster that need a new host cluster, at most _max */
+static int qcow2_count_unowned(struct qcow2_device_private* _private, uint64_t _cluster, uint64_t _max, uint64_t* _count)
+{
+  for(*_count = 1; *_count < _max; (*_count)++)
+    {
+      uint64_t entry;
+      int type;
+
+      if((type = qcow2_lookup(_private, _cluster + *_count, &entry)) == -1)
+	return -1;
+
+      if(type == QCOW2_NORMAL && (entry & QCOW2_OFLAG_COPIED))
+	break;
+    }
+
+  return 0;
+}
+
+/* point _count guest clusters from _cluster to host clusters from _host,
+ * releasing what they pointed to before */
+static int qcow2_map(struct qcow2_device_private* _private, uint64_t _cluster, uint64_t _count, uint64_t _host)
+{
+  uint64_t iter;
+
+  for(iter = 0; iter < _count; iter++)
+    {
+      uint64_t entry;
+
+      if(qcow2_lookup(_private, _cluster + iter, &entry) == -1
+	 || qcow2_set_entry(_private, _cluster + iter, (_host + (iter << _private->cluster_bits)) | QCOW2_OFLAG_COPIED) != 0
+	 || qcow2_release(_private, entry) != 0)
+	return -1;
+    }
+
+  return 0;
+}
+
+static gnufdisk_integer qcow2_write_at(struct qcow2_device_private* _private, uint64_t _offset, const void* _buf, size_t _size)
+{
+  const unsigned char* buf;
+  struct {
+    uint64_t offset;
+    const unsigned char* buf;
+    size_t length;
+  } run;
+  size_t done;
+
+  if(_private->readonly)
+    {
+      errno = EROFS;
+      return -1;
+    }
+
+  if(_offset >= _private->size)
+    {
+      errno = ENOSPC;
+      return -1;
+    }
+
+  if(_size > _private->size - _offset)
+    _size = _private->size - _offset;
+
+  buf = _buf;
+  run.length = 0;
+
+  for(done = 0; done < _size; )
+    {
+      uint64_t offset;
+      uint64_t cluster;
+      uint64_t entry;
+      uint64_t host;
+      size_t in;
+      size_t count;
+      int type;
+
+      offset = _offset + done;
+      cluster = offset >> _private->cluster_bits;
+      in = offset & (_private->cluster_size - 1);
+      count = _private->cluster_size - in < _size - done ? _private->cluster_size - in : _size - done;
+
+      if((type = qcow2_lookup(_private, cluster, &entry)) == -1)
+	return -1;
+
+      /* clusters the image owns are written in place */
+      if(type == QCOW2_NORMAL && (entry & QCOW2_OFLAG_COPIED))
+	{
+	  host = (entry & QCOW2_OFFSET_MASK) + in;
+
+	  if(run.length > 0 && run.offset + run.length == host && run.buf + run.length == buf + done)
+	    run.length += count;
+	  else
+	    {
+	      if(run.length > 0 && qcow2_pwrite(_private, run.buf, run.length, run.offset) != 0)
+		return -1;
+
+	      run.offset = host;
+	      run.buf = buf + done;
+	      run.length = count;
+	    }
+
+	  done += count;
+	  continue;
+	}
+
+      if(count == _private->cluster_size)
+	{
+	  uint64_t clusters;
+
+	  /* a run of whole clusters: one allocation, one write */
+	  if(qcow2_count_unowned(_private, cluster, (_size - done) >> _private->cluster_bits < QCOW2_WRITE_CLUSTERS
+				 ? (_size - done) >> _private->cluster_bits : QCOW2_WRITE_CLUSTERS, &clusters) != 0
+	     || (host = qcow2_allocate(_private, clusters)) == 0
+	     || qcow2_pwrite(_private, buf + done, clusters << _private->cluster_bits, host) != 0
+	     || qcow2_map(_private, cluster, clusters, host) != 0)
+	    return -1;
+
+	  done += clusters << _private->cluster_bits;
+	}
+      else
+	{
+	  if(qcow2_read_cluster(_private, cluster, type, entry, _private->cluster) != 0)
+	    return -1;
+
+	  memcpy(_private->cluster + in, buf + done, count);
+
+	  if((host = qcow2_allocate(_private, 1)) == 0
+	     || qcow2_pwrite(_private, _private->cluster, _private->cluster_size, host) != 0
+	     || qcow2_map(_private, cluster, 1, host) != 0)
+	    return -1;
+
+	  done += count;
+	}
+    }
+
+  if(run.length > 0 && qcow2_pwrite(_private, run.buf, run.length, run.offset) != 0)
+    return -1;
+
+  return _size;
+}
+
+static int qcow2_zero_at(struct qcow2_device_private* _private, uint64_t _offset, uint64_t _size)
+{
+  uint64_t done;
+
+  if(_private->readonly)
+    {
+      errno = EROFS;
+      return -1;
+    }
+
+  for(done = 0; done < _size; )
+    {
+      uint64_t offset;
+      uint64_t cluster;
+      uint64_t entry;
+      size_t in;
+      size_t count;
+      int type;
+
+      offset = _offset + done;
+      cluster = offset >> _private->cluster_bits;
+      in = offset & (_private->cluster_size - 1);
+      count = _private->cluster_size - in < _size - done ? _private->cluster_size - in : _size - done;
+
+      if((type = qcow2_lookup(_private, cluster, &entry)) == -1)
+	return -1;
+
+      if(type == QCOW2_ZERO || (type == QCOW2_UNALLOCATED && _private->backing.private == NULL))
+	;
+      else if(count == _private->cluster_size && (_private->version >= 3 || _private->backing.private == NULL))
+	{
+	  /* a whole cluster only needs its entry changed */
+	  if(qcow2_set_entry(_private, cluster, _private->version >= 3 ? QCOW2_OFLAG_ZERO : 0) != 0
+	     || qcow2_release(_private, entry) != 0)
+	    return -1;
+	}
+      else if(qcow2_write_at(_private, offset, _private->zeros, count) != count)
+	return -1;
+
+      done += count;
+    }
+
+  return 0;
+}
+
+/* write the L2 tables and the L1 table, then release the clusters they
+ * no longer point to */
+static int qcow2_flush(struct qcow2_device_private* _private)
+{
+  int iter;
+
+  if(_private->readonly)
+    return 0;
+
+  for(iter = 0; iter < _private->ncache; iter++)
+    if(_private->cache[iter].dirty && qcow2_l2_write(_private, &_private->cache[iter]) != 0)
+      return -1;
+
+  if(_private->l1_dirty)
+    {
+      uint64_t* table;
+      uint32_t entry;
+
+      if((table = malloc(_private->l1_size * sizeof(uint64_t))) == NULL)
+	return -1;
+
+      for(entry = 0; entry < _private->l1_size; entry++)
+	table[entry] = htobe64(_private->l1[entry]);
+
+      if(qcow2_pwrite(_private, table, _private->l1_size * sizeof(uint64_t), _private->l1_offset) != 0)
+	{
+	  free(table);
+	  return -1;
+	}
+
+      free(table);
+      _private->l1_dirty = 0;
+    }
+
+  if(_private->nfrees > 0)
+    {
+      size_t entry;
+
+      if(fdatasync(_private->fd) != 0)
+	return -1;
+
+      for(entry = 0; entry < _private->nfrees; entry++)
+	if(qcow2_refcount_update(_private, _private->frees[entry].cluster, _private->frees[entry].count, -1) != 0)
+	  return -1;
+
+      _private->nfrees = 0;
+    }
+
+  return fdatasync(_private->fd);
+}
+
+static gnufdisk_integer qcow2_device_start(void* _private)
+{
+  GNUFDISK_LOG((DEVICE, "perform start on struct qcow2_device_private* %p", _private));
+
+  qcow2_device_private_check(_private);
+
+  GNUFDISK_LOG((DEVICE, "done perform start, result: 0"));
+
+  return 0;
+}
+
+static gnufdisk_integer qcow2_device_end(void* _private)
+{
+  struct qcow2_device_private* private;
+  gnufdisk_integer ret;
+
+  GNUFDISK_LOG((DEVICE, "perform end on struct qcow2_device_private* %p", _private));
+
+  qcow2_device_private_check(_private);
+
+  private = _private;
+
+  ret = private->size / private->sector_size - 1;
+
+  GNUFDISK_LOG((DEVICE, "done perform end, result: %" PRId64, ret));
+
+  return ret;
+}
+
+static gnufdisk_integer qcow2_device_seek(void* _private, gnufdisk_integer _lba, gnufdisk_integer _offset, int _whence)
+{
+  struct qcow2_device_private* private;
+  gnufdisk_integer offset;
+  gnufdisk_integer ret;
+
+  GNUFDISK_LOG((DEVICE, "perform seek on struct qcow2_device_private* %p", _private));
+
+  qcow2_device_private_check(_private);
+
+  private = _private;
+
+  offset = _lba * private->sector_size + _offset;
+
+  if(_whence == SEEK_CUR)
+    offset += private->position;
+  else if(_whence == SEEK_END)
+    offset += private->size;
+  else if(_whence != SEEK_SET)
+    offset = -1;
+
+  if(offset < 0)
+    {
+      errno = EINVAL;
+      ret = -1;
+    }
+  else
+    ret = private->position = offset;
+
+  GNUFDISK_LOG((DEVICE, "done perform seek, result: %" PRId64, ret));
+
+  return ret;
+}
+
+static gnufdisk_integer qcow2_device_read(void* _private, void* _buf, size_t _size)
+{
+  struct qcow2_device_private* private;
+  gnufdisk_integer ret;
+
+  GNUFDISK_LOG((DEVICE, "perform read on struct qcow2_device_private* %p", _private));
+
+  qcow2_device_private_check(_private);
+
+  private = _private;
+
+  pthread_mutex_lock(&private->mutex);
+
+  if((ret = qcow2_read_at(private, private->position, _buf, _size)) > 0)
+    private->position += ret;
+
+  pthread_mutex_unlock(&private->mutex);
+
+  GNUFDISK_LOG((DEVICE, "done perform read, result: %" PRId64, ret));
+
+  return ret;
+}
+
+static gnufdisk_integer qcow2_device_write(void* _private, const void* _buf, size_t _size)
+{
+  struct qcow2_device_private* private;
+  gnufdisk_integer ret;
+
+  GNUFDISK_LOG((DEVICE, "perform write on struct qcow2_device_private* %p", _private));
+
+  qcow2_device_private_check(_private);
+
+  private = _private;
+
+  pthread_mutex_lock(&private->mutex);
+
+  if((ret = qcow2_write_at(private, private->position, _buf, _size)) > 0)
+    private->position += ret;
+
+  pthread_mutex_unlock(&private->mutex);
+
+  GNUFDISK_LOG((DEVICE, "done perform write, result: %" PRId64, ret));
+
+  return ret;
+}
+
+static gnufdisk_integer qcow2_device_pread(void* _private, gnufdisk_integer _lba, void* _buf, size_t _size)
+{
+  struct qcow2_device_private* private;
+  gnufdisk_integer ret;
+
+  GNUFDISK_LOG((DEVICE, "perform pread on struct qcow2_device_private* %p", _private));
+
+  qcow2_device_private_check(_private);
+
+  private = _private;
+
+  pthread_mutex_lock(&private->mutex);
+
+  ret = qcow2_read_at(private, _lba * private->sector_size, _buf, _size);
+
+  pthread_mutex_unlock(&private->mutex);
+
+  GNUFDISK_LOG((DEVICE, "done perform pread, result: %" PRId64, ret));
+
+  return ret;
+}
+
+static gnufdisk_integer qcow2_device_seek_data(void* _private, gnufdisk_integer _lba, int _whence)
+{
+  struct qcow2_device_private* private;
+  gnufdisk_integer ret;
+  uint64_t offset;
+
+  GNUFDISK_LOG((DEVICE, "perform seek_data on struct qcow2_device_private* %p", _private));
+
+  qcow2_device_private_check(_private);
+
+  private = _private;
+
+  pthread_mutex_lock(&private->mutex);
+
+  offset = _lba * private->sector_size;
+  ret = -1;
+  errno = ENXIO;
+
+  while(offset < private->size)
+    {
+      uint64_t cluster;
+      uint64_t entry;
+      int type;
+      int data;
+
+      cluster = offset >> private->cluster_bits;
+
+      /* a missing L2 table is a hole as large as the table */
+      if((private->l1[cluster / private->l2_entries] & QCOW2_OFFSET_MASK) == 0
+	 && offset >= private->backing_size)
+	{
+	  if(_whence == SEEK_HOLE)
+	    {
+	      ret = offset;
+	      break;
+	    }
+
+	  offset = ((cluster / private->l2_entries + 1) * private->l2_entries) << private->cluster_bits;
+	  continue;
+	}
+
+      if((type = qcow2_lookup(private, cluster, &entry)) == -1)
+	break;
+
+      /* the backing file is data as far as it goes */
+      data = type == QCOW2_NORMAL
+	|| type == QCOW2_COMPRESSED
+	|| (type == QCOW2_UNALLOCATED && offset < private->backing_size);
+
+      if(data == (_whence == SEEK_DATA))
+	{
+	  ret = offset;
+	  break;
+	}
+
+      offset = (cluster + 1) << private->cluster_bits;
+    }
+
+  if(ret == -1 && offset >= private->size && _whence == SEEK_HOLE)
+    ret = private->size;
+
+  pthread_mutex_unlock(&private->mutex);
+
+  if(ret != -1)
+    ret = _whence == SEEK_DATA ? ret / private->sector_size : (ret + private->sector_size - 1) / private->sector_size;
+
+  GNUFDISK_LOG((DEVICE, "done perform seek_data, result: %" PRId64, ret));
+
+  return ret;
+}
+
+static int qcow2_device_zero(void* _private, gnufdisk_integer _lba, gnufdisk_integer _count)
+{
+  struct qcow2_device_private* private;
+  int ret;
+
+  GNUFDISK_LOG((DEVICE, "perform zero on struct qcow2_device_private* %p", _private));
+
+  qcow2_device_private_check(_private);
+
+  private = _private;
+
+  pthread_mutex_lock(&private->mutex);
+
+  ret = qcow2_zero_at(private, _lba * private->sector_size, _count * private->sector_size);
+
+  pthread_mutex_unlock(&private->mutex);
+
+  GNUFDISK_LOG((DEVICE, "done perform zero, result: %d", ret));
+
+  return ret;
+}
+
+static gnufdisk_integer qcow2_device_sector_size(void* _private)
+{
+  struct qcow2_device_private* private;
+
+  qcow2_device_private_check(_private);
+
+  private = _private;
+
+  return private->sector_size;
+}
+
+static gnufdisk_integer qcow2_device_minimum_alignment(void* _private)
+{
+  struct qcow2_device_private* private;
+
+  qcow2_device_private_check(_private);
+
+  private = _private;
+
+  return private->sector_size;
+}
+
+static gnufdisk_integer qcow2_device_optimal_alignment(void* _private)
+{
+  struct qcow2_device_private* private;
+
+  qcow2_device_private_check(_private);
+
+  private = _private;
+
+  /* partitions on cluster boundaries keep guest writes from splitting
+   * clusters */
+  return private->cluster_size > private->sector_size ? private->cluster_size : private->sector_size;
+}
+
+static void qcow2_device_set_parameter(void *_private, struct gnufdisk_string* _param, const void* _data, size_t _size)
+{
+  struct qcow2_device_private* private;
+  gnufdisk_integer* dest;
+  char* param;
+
+  GNUFDISK_LOG((DEVICE, "perform set_parameter on struct qcow2_device_private* %p", _private));
+
+  qcow2_device_private_check(_private);
+
+  private = _private;
+  dest = NULL;
+
+  if((param = gnufdisk_string_c_string_dup(_param)) == NULL)
+    THROW_ENOMEM;
+
+  gnufdisk_exception_register_unwind_handler(&free, param);
+
+  GNUFDISK_LOG((DEVICE, "parameter: %s, size: %u", param, _size));
+
+  if(strcasecmp(param, "CYLINDERS") == 0)
+    dest = &private->cylinders;
+  else if(strcasecmp(param, "HEADS") == 0)
+    dest = &private->heads;
+  else if(strcasecmp(param, "SECTORS") == 0)
+    dest = &private->sectors;
+  else if(strcasecmp(param, "SECTOR-SIZE") == 0)
+    dest = &private->sector_size;
+  else
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETER, NULL, "invalid parameter: %s", param);
+
+  if(_size != sizeof(gnufdisk_integer))
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETERSIZE, NULL, "invalid parameter size");
+
+  *dest = *(const gnufdisk_integer*) _data;
+
+  gnufdisk_exception_unregister_unwind_handler(&free, param);
+
+  free(param);
+
+  GNUFDISK_LOG((DEVICE, "done perform set_parameter"));
+}
+
+static void qcow2_device_get_parameter(void *_private, struct gnufdisk_string* _param, void* _dest, size_t _size)
+{
+  struct qcow2_device_private* private;
+  char* param;
+
+  GNUFDISK_LOG((DEVICE, "perform get_parameter on struct qcow2_device_private* %p", _private));
+
+  qcow2_device_private_check(_private);
+
+  private = _private;
+
+  if((param = gnufdisk_string_c_string_dup(_param)) == NULL)
+    THROW_ENOMEM;
+
+  gnufdisk_exception_register_unwind_handler(&free, param);
+
+  GNUFDISK_LOG((DEVICE, "parameter: %s, size: %u", param, _size));
+
+  if(strcasecmp(param, "CYLINDERS") == 0
+     || strcasecmp(param, "HEADS") == 0
+     || strcasecmp(param, "SECTORS") == 0)
+    {
+      union gnufdisk_device_exception_data data;
+      gnufdisk_integer* value;
+      GNUFDISK_RETRY rp0;
+      int error;
+
+      if(_size != sizeof(gnufdisk_integer))
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETERSIZE, NULL, "invalid parameter size");
+
+      /* an image has no geometry of its own: ask for it */
+      if(strcasecmp(param, "CYLINDERS") == 0)
+	{
+	  value = data.ecylinders = &private->cylinders;
+	  error = GNUFDISK_DEVICE_ECYLINDERS;
+	}
+      else if(strcasecmp(param, "HEADS") == 0)
+	{
+	  value = data.eheads = &private->heads;
+	  error = GNUFDISK_DEVICE_EHEADS;
+	}
+      else
+	{
+	  value = data.esectors = &private->sectors;
+	  error = GNUFDISK_DEVICE_ESECTORS;
+	}
+
+      GNUFDISK_RETRY_SET(rp0);
+
+      if(*value == 0)
+	GNUFDISK_THROW(GNUFDISK_EXCEPTION_ALL, &rp0, error, &data, "can not determine device %s", param);
+
+      *((gnufdisk_integer*) _dest) = *value;
+    }
+  else if(strcasecmp(param, "SECTOR-SIZE") == 0)
+    {
+      if(_size != sizeof(gnufdisk_integer))
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETERSIZE, NULL, "invalid parameter size");
+
+      *((gnufdisk_integer*) _dest) = private->sector_size;
+    }
+  else if(strcasecmp(param, "IDENTITY") == 0)
+    {
+      if(_size <= strlen(private->identity))
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETERSIZE, NULL, "invalid parameter size");
+
+      strcpy(_dest, private->identity);
+    }
+  else if(strcasecmp(param, "LABEL-STAMP") == 0)
+    {
+      if(_size != sizeof(gnufdisk_integer))
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETERSIZE, NULL, "invalid parameter size");
+
+      *((gnufdisk_integer*) _dest) = probe_cache_file_stamp(private->fd);
+    }
+  else
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETER, NULL, "invalid parameter: %s", param);
+
+  gnufdisk_exception_unregister_unwind_handler(&free, param);
+
+  free(param);
+
+  GNUFDISK_LOG((DEVICE, "done perform get_parameter"));
+}
+
+static void qcow2_device_commit(void* _private)
+{
+  struct qcow2_device_private* private;
+  int ret;
+
+  GNUFDISK_LOG((DEVICE, "perform commit on struct qcow2_device_private* %p", _private));
+
+  qcow2_device_private_check(_private);
+
+  private = _private;
+
+  pthread_mutex_lock(&private->mutex);
+
+  ret = qcow2_flush(private);
+
+  pthread_mutex_unlock(&private->mutex);
+
+  if(ret != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not update qcow2 tables: %s", strerror(errno));
+
+  GNUFDISK_LOG((DEVICE, "done perform commit"));
+}
+
+static void qcow2_device_release(struct qcow2_device_private* _private)
+{
+  int iter;
+
+  if(_private->fd >= 0)
+    close(_private->fd);
+
+  if(_private->backing.private)
+    (*_private->backing.delete)(_private->backing.private);
+
+  for(iter = 0; iter < QCOW2_L2_CACHE; iter++)
+    free(_private->cache[iter].table);
+
+  free(_private->l1);
+  free(_private->refcount_table);
+  free(_private->frees);
+  free(_private->cluster);
+  free(_private->refcounts);
+  free(_private->zeros);
+  free(_private->compressed);
+
+  pthread_mutex_destroy(&_private->mutex);
+
+  memset(_private, 0, sizeof(struct qcow2_device_private));
+  free(_private);
+}
+
+static void qcow2_device_delete(void* _private)
+{
+  struct qcow2_device_private* private;
+
+  GNUFDISK_LOG((DEVICE, "perform delete on struct qcow2_device_private* %p", _private));
+
+  qcow2_device_private_check(_private);
+
+  private = _private;
+
+  /* writes since the last commit; the ones of a commit were flushed by it */
+  if(qcow2_flush(private) != 0)
+    GNUFDISK_WARNING("can not update qcow2 tables: %s", strerror(errno));
+
+  qcow2_device_release(private);
+
+  GNUFDISK_LOG((DEVICE, "done perform delete"));
+}
+
+static void qcow2_probe_failure(void* _private)
+{
+  GNUFDISK_LOG((DEVICE, "release struct qcow2_device_private* %p", _private));
+  qcow2_device_release(_private);
+}
+
+static void qcow2_backing_depth_reset(void* _arg)
+{
+  qcow2_backing_depth--;
+}
+
+static void qcow2_open_backing(struct qcow2_device_private* _private,
+			       const char* _path,
+			       struct module_options* _options,
+			       uint64_t _offset,
+			       uint32_t _size)
+{
+  struct module_options options;
+  char name[1024];
+  char* path;
+  int ret;
+
+  if(_size >= sizeof(name))
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOTSUP, NULL, "backing file name too long in `%s'", _path);
+
+  if(qcow2_pread(_private, name, _size, _offset) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not read `%s': %s", _path, strerror(errno));
+
+  name[_size] = 0;
+
+  /* relative names are relative to the image */
+  if(name[0] == '/' || strstr(name, "://") != NULL)
+    path = strdup(name);
+  else
+    {
+      char* copy;
+
+      if((copy = strdup(_path)) == NULL)
+	THROW_ENOMEM;
+
+      ret = asprintf(&path, "%s/%s", dirname(copy), name);
+      free(copy);
+
+      if(ret == -1)
+	path = NULL;
+    }
+
+  if(path == NULL)
+    THROW_ENOMEM;
+
+  gnufdisk_exception_register_unwind_handler(&free, path);
+
+  if(qcow2_backing_depth >= QCOW2_MAX_BACKING_DEPTH)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOTSUP, NULL, "backing chain of `%s' too long", _path);
+
+  GNUFDISK_LOG((DEVICE, "open backing file %s", path));
+
+  memcpy(&options, _options, sizeof(struct module_options));
+  options.readonly = 1;
+  options.cache_dir = NULL;
+  options.overlay = NULL;
+
+  qcow2_backing_depth++;
+  gnufdisk_exception_register_unwind_handler(&qcow2_backing_depth_reset, NULL);
+
+  ret = device_probe_implementation(path, &options, &_private->backing);
+
+  gnufdisk_exception_unregister_unwind_handler(&qcow2_backing_depth_reset, NULL);
+  qcow2_backing_depth--;
+
+  if(ret != 0)
+    {
+      _private->backing.private = NULL;
+      GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not open backing file `%s' of `%s'", path, _path);
+    }
+
+  if(gnufdisk_check_memory(_private->backing.pread, 1, 1) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOTSUP, NULL, "backing file `%s' does not support `pread'", path);
+
+  _private->backing_sector_size = (*_private->backing.sector_size)(_private->backing.private);
+  _private->backing_size = ((*_private->backing.end)(_private->backing.private) + 1) * _private->backing_sector_size;
+
+  gnufdisk_exception_unregister_unwind_handler(&free, path);
+
+  free(path);
+}
+
+static void qcow2_load(struct qcow2_device_private* _private, const char* _path, struct module_options* _options)
+{
+  struct qcow2_header header;
+  struct stat info;
+  uint64_t incompatible;
+  uint64_t iter;
+  int refcount_order;
+
+  memset(&header, 0, sizeof(header));
+
+  if(qcow2_pread(_private, &header, QCOW2_HEADER_V2_LENGTH, 0) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not read `%s': %s", _path, strerror(errno));
+
+  _private->version = be32toh(header.version);
+
+  if(_private->version != 2 && _private->version != 3)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOTSUP, NULL, "unsupported qcow2 version %u in `%s'", _private->version, _path);
+
+  if(_private->version >= 3
+     && qcow2_pread(_private, (unsigned char*) &header + QCOW2_HEADER_V2_LENGTH,
+		    sizeof(header) - QCOW2_HEADER_V2_LENGTH, QCOW2_HEADER_V2_LENGTH) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not read `%s': %s", _path, strerror(errno));
+
+  incompatible = be64toh(header.incompatible_features);
+  refcount_order = _private->version >= 3 ? be32toh(header.refcount_order) : 4;
+
+  _private->cluster_bits = be32toh(header.cluster_bits);
+  _private->size = be64toh(header.size);
+  _private->l1_size = be32toh(header.l1_size);
+  _private->l1_offset = be64toh(header.l1_table_offset);
+  _private->refcount_table_offset = be64toh(header.refcount_table_offset);
+  _private->refcount_table_clusters = be32toh(header.refcount_table_clusters);
+
+  if(_private->cluster_bits < 9 || _private->cluster_bits > 21 || refcount_order > 6)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOTSUP, NULL, "invalid qcow2 header in `%s'", _path);
+
+  if(be32toh(header.crypt_method) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOTSUP, NULL, "encrypted qcow2 image `%s'", _path);
+
+  if(incompatible & ~(QCOW2_INCOMPAT_DIRTY | QCOW2_INCOMPAT_CORRUPT))
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOTSUP, NULL, "unsupported qcow2 features 0x%" PRIx64 " in `%s'", incompatible, _path);
+
+  if(!_private->readonly)
+    {
+      /* a dirty image has refcounts that must be rebuilt first */
+      if(incompatible & (QCOW2_INCOMPAT_DIRTY | QCOW2_INCOMPAT_CORRUPT))
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOTSUP, NULL, "qcow2 image `%s' needs a repair (qemu-img check -r all)", _path);
+
+      if(be32toh(header.nb_snapshots) != 0)
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOTSUP, NULL, "qcow2 image `%s' has internal snapshots: open it read-only", _path);
+
+      if(refcount_order < 3)
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOTSUP, NULL, "%d bit refcounts in `%s'", 1 << refcount_order, _path);
+    }
+
+  _private->cluster_size = 1ULL << _private->cluster_bits;
+  _private->l2_entries = _private->cluster_size / 8;
+  _private->refcount_bytes = refcount_order >= 3 ? (1 << refcount_order) / 8 : 1;
+  _private->refcount_entries = _private->cluster_size * 8 / (1 << refcount_order);
+
+  if((_private->size + _private->cluster_size - 1) / _private->cluster_size > (uint64_t) _private->l1_size * _private->l2_entries
+     || (_private->l1_offset & (_private->cluster_size - 1))
+     || (_private->refcount_table_offset & (_private->cluster_size - 1))
+     || _private->refcount_table_clusters == 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "corrupt qcow2 tables in `%s'", _path);
+
+  _private->ncache = QCOW2_L2_CACHE_SIZE / _private->cluster_size;
+
+  if(_private->ncache < 2)
+    _private->ncache = 2;
+  else if(_private->ncache > QCOW2_L2_CACHE)
+    _private->ncache = QCOW2_L2_CACHE;
+
+  if((_private->l1 = malloc((_private->l1_size ? _private->l1_size : 1) * sizeof(uint64_t))) == NULL
+     || (_private->refcount_table = malloc(_private->refcount_table_clusters * _private->cluster_size)) == NULL
+     || (_private->cluster = malloc(_private->cluster_size)) == NULL
+     || (_private->refcounts = malloc(_private->cluster_size)) == NULL
+     || (_private->compressed = malloc(_private->cluster_size)) == NULL
+     || (_private->zeros = calloc(1, _private->cluster_size)) == NULL)
+    THROW_ENOMEM;
+
+  if(qcow2_pread(_private, _private->l1, _private->l1_size * sizeof(uint64_t), _private->l1_offset) != 0
+     || qcow2_pread(_private, _private->refcount_table, _private->refcount_table_clusters * _private->cluster_size,
+		    _private->refcount_table_offset) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not read the tables of `%s': %s", _path, strerror(errno));
+
+  for(iter = 0; iter < _private->l1_size; iter++)
+    _private->l1[iter] = be64toh(_private->l1[iter]);
+
+  for(iter = 0; iter < _private->refcount_table_clusters * _private->cluster_size / 8; iter++)
+    _private->refcount_table[iter] = be64toh(_private->refcount_table[iter]);
+
+  if(fstat(_private->fd, &info) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not stat `%s': %s", _path, strerror(errno));
+
+  _private->next_cluster = math_round_up(info.st_size, _private->cluster_size);
+
+  snprintf(_private->identity, sizeof(_private->identity), "qcow2-%" PRIx64 "-%" PRIx64,
+	   (uint64_t) info.st_dev, (uint64_t) info.st_ino);
+
+  /* autoclear features describe data we do not keep up to date */
+  if(!_private->readonly && _private->version >= 3 && header.autoclear_features != 0)
+    {
+      uint64_t none;
+
+      none = 0;
+
+      if(qcow2_pwrite(_private, &none, sizeof(none), QCOW2_HEADER_AUTOCLEAR) != 0)
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not write `%s': %s", _path, strerror(errno));
+    }
+
+  if(be64toh(header.backing_file_offset) != 0)
+    qcow2_open_backing(_private, _path, _options, be64toh(header.backing_file_offset), be32toh(header.backing_file_size));
+}
+
+static struct device_implementation qcow2_device_implementation = {
+    NULL, /* private */
+    &qcow2_device_start,
+    &qcow2_device_end,
+    &qcow2_device_seek,
+    &qcow2_device_read,
+    &qcow2_device_write,
+    &qcow2_device_sector_size,
+    &qcow2_device_minimum_alignment,
+    &qcow2_device_optimal_alignment,
+    &qcow2_device_set_parameter,
+    &qcow2_device_get_parameter,
+    &qcow2_device_commit,
+    &qcow2_device_delete,
+    &qcow2_device_seek_data,
+    &qcow2_device_zero,
+    NULL, /* discard */
+    NULL, /* discard_granularity */
+    &qcow2_device_pread
+};
+
+int qcow2_device_probe(const char* _path, struct module_options* _options, struct device_implementation* _implementation)
+{
+  struct qcow2_device_private* private;
+  struct stat info;
+  uint32_t magic;
+  int fd;
+
+  if(stat(_path, &info) != 0 || !S_ISREG(info.st_mode))
+    return -1;
+
+  if((fd = open(_path, (_options->readonly ? O_RDONLY : O_RDWR) | O_CLOEXEC)) == -1)
+    return -1;
+
+  if(pread(fd, &magic, sizeof(magic), 0) != sizeof(magic) || be32toh(magic) != QCOW2_MAGIC)
+    {
+      close(fd);
+      return -1;
+    }
+
+  GNUFDISK_LOG((DEVICE, "perform qcow2_device_probe on %s", _path));
+
+  if((private = malloc(sizeof(struct qcow2_device_private))) == NULL)
+    {
+      close(fd);
+      THROW_ENOMEM;
+    }
+
+  memset(private, 0, sizeof(struct qcow2_device_private));
+  private->fd = fd;
+  private->readonly = _options->readonly;
+  pthread_mutex_init(&private->mutex, NULL);
+
+  gnufdisk_exception_register_unwind_handler(&qcow2_probe_failure, private);
+
+  qcow2_load(private, _path, _options);
+
+  private->sector_size = _options->sector_size ? _options->sector_size : 512;
+  private->cylinders = _options->cylinders;
+  private->heads = _options->heads;
+  private->sectors = _options->sectors;
+
+  GNUFDISK_LOG((DEVICE, "qcow2 image:"));
+  GNUFDISK_LOG((DEVICE, "\tversion      : %u", private->version));
+  GNUFDISK_LOG((DEVICE, "\tsize         : %" PRIu64, private->size));
+  GNUFDISK_LOG((DEVICE, "\tcluster size : %" PRIu64, private->cluster_size));
+  GNUFDISK_LOG((DEVICE, "\trefcount bits: %d", private->refcount_bytes * 8));
+  GNUFDISK_LOG((DEVICE, "\tbacking size : %" PRIu64, private->backing_size));
+
+  memcpy(_implementation, &qcow2_device_implementation, sizeof(struct device_implementation));
+  _implementation->private = private;
+
+  gnufdisk_exception_unregister_unwind_handler(&qcow2_probe_failure, private);
+
+  GNUFDISK_LOG((DEVICE, "done qcow2_device_probe"));
+
+  return 0;
+}
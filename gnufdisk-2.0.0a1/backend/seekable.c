@@ -0,0 +1,1231 @@
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <zlib.h>
+
+#include "common.h"
+
+/* seekable compressed images: the device is cut in frames of a fixed size
+ * (a power of two) and every frame is compressed on its own, so a read
+ * decompresses only the frames it touches. The frames are followed by an
+ * index with the offset, the compressed length and the CRC-32 of every
+ * frame, and the header points to the index once the image is complete:
+ *
+ *   header (64 bytes) | frame 0 | frame 1 | ... | padding | index
+ *
+ * A frame of length 0 is all zeros and takes no space, a frame as long as
+ * its data is stored as is, any other frame is a raw deflate stream.
+ * Opening an image reads the header and maps the index, so it costs the
+ * same whatever the size of the device. Decompressed frames are kept in a
+ * small LRU cache.
+ *
+ * Images are read-only: open them with the overlay option to change the
+ * partition table. module_seekable_import() writes an image from any
+ * device gnufdisk-backend can open, compressing frames in parallel. */
+
+#define SEEKABLE_MAGIC "GFDSKSZ\n"
+#define SEEKABLE_VERSION 1
+#define SEEKABLE_DEFLATE 1 /* compression */
+#define SEEKABLE_MIN_FRAME_SHIFT 12
+#define SEEKABLE_MAX_FRAME_SHIFT 22
+#define SEEKABLE_DEFAULT_FRAME_SIZE 65536
+#define SEEKABLE_INDEX_ALIGNMENT 4096
+#define SEEKABLE_CACHE 8 /* frames */
+#define SEEKABLE_CACHE_SIZE 8388608 /* bytes, fewer frames when they are large */
+#define SEEKABLE_MAX_THREADS 64
+
+/* all fields little endian */
+struct seekable_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t compression;
+  uint32_t frame_shift;
+  uint32_t sector_size; /* of the device the image was taken from */
+  uint64_t size; /* bytes */
+  uint64_t frames;
+  uint64_t index_offset; /* 0 until the image is complete */
+  unsigned char reserved[16];
+};
+
+struct seekable_frame {
+  uint64_t offset;
+  uint32_t length;
+  uint32_t crc; /* of the decompressed frame */
+};
+
+struct seekable_cache {
+  uint64_t frame; /* UINT64_MAX when unused */
+  unsigned long used;
+  unsigned char* data;
+};
+
+struct seekable_device_private {
+  int fd;
+  pthread_mutex_t mutex;
+  char identity[128];
+  uint64_t size;
+  int frame_shift;
+  uint64_t frame_size;
+  uint64_t frames;
+  uint64_t index_offset;
+  void* map;
+  size_t map_size;
+  const struct seekable_frame* index; /* inside map */
+  struct seekable_cache cache[SEEKABLE_CACHE];
+  int ncache;
+  unsigned long clock;
+  unsigned char* input; /* compressed frame */
+  z_stream stream;
+  int have_stream;
+  gnufdisk_integer image_sector_size;
+  gnufdisk_integer position;
+  gnufdisk_integer cylinders;
+  gnufdisk_integer heads;
+  gnufdisk_integer sectors;
+  gnufdisk_integer sector_size;
+};
+
+static int seekable_pread(int _fd, void* _buf, size_t _size, uint64_t _offset)
+{
+  unsigned char* buf;
+
+  buf = _buf;
+
+  while(_size > 0)
+    {
+      ssize_t ret;
+
+      if((ret = pread(_fd, buf, _size, _offset)) == -1)
+	{
+	  if(errno == EINTR)
+	    continue;
+
+	  return -1;
+	}
+      else if(ret == 0)
+	{
+	  errno = EIO;
+	  return -1;
+	}
+
+      buf += ret;
+      _size -= ret;
+      _offset += ret;
+    }
+
+  return 0;
+}
+
+static int seekable_pwrite(int _fd, const void* _buf, size_t _size, uint64_t _offset)
+{
+  const unsigned char* buf;
+
+  buf = _buf;
+
+  while(_size > 0)
+    {
+      ssize_t ret;
+
+      if((ret = pwrite(_fd, buf, _size, _offset)) == -1)
+	{
+	  if(errno == EINTR)
+	    continue;
+
+	  return -1;
+	}
+
+      buf += ret;
+      _size -= ret;
+      _offset += ret;
+    }
+
+  return 0;
+}
+
+/* bytes of frame _frame, the last one may be short */
+static uint64_t seekable_frame_bytes(uint64_t _size, int _frame_shift, uint64_t _frame)
+{
+  uint64_t start;
+
+  start = _frame << _frame_shift;
+
+  return _size - start < (1ULL << _frame_shift) ? _size - start : 1ULL << _frame_shift;
+}
+
+static void seekable_device_private_check(struct seekable_device_private* _private)
+{
+  if(gnufdisk_check_memory(_private, sizeof(struct seekable_device_private), 0) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL, "invalid struct seekable_device_private* %p", _private);
+
+  if(_private->fd < 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL, "invalid file descriptor: %d", _private->fd);
+}
+
+/* the content of _frame, which is not a zero frame */
+static const unsigned char* seekable_read_frame(struct seekable_device_private* _private, uint64_t _frame)
+{
+  struct seekable_cache* slot;
+  uint64_t offset;
+  uint64_t bytes;
+  uint32_t length;
+  int iter;
+  int err;
+
+  for(iter = 0, slot = &_private->cache[0]; iter < _private->ncache; iter++)
+    {
+      if(_private->cache[iter].frame == _frame)
+	{
+	  _private->cache[iter].used = ++_private->clock;
+	  return _private->cache[iter].data;
+	}
+      else if(_private->cache[iter].used < slot->used)
+	slot = &_private->cache[iter];
+    }
+
+  offset = LE64_TO_CPU(_private->index[_frame].offset);
+  length = LE32_TO_CPU(_private->index[_frame].length);
+  bytes = seekable_frame_bytes(_private->size, _private->frame_shift, _frame);
+
+  if(length > bytes
+     || offset < sizeof(struct seekable_header)
+     || offset > _private->index_offset
+     || length > _private->index_offset - offset)
+    {
+      GNUFDISK_LOG((DEVICE, "bad index entry for frame %" PRIu64, _frame));
+      errno = EIO;
+      return NULL;
+    }
+
+  slot->frame = UINT64_MAX;
+
+  if(length == bytes)
+    {
+      if(seekable_pread(_private->fd, slot->data, bytes, offset) != 0)
+	return NULL;
+    }
+  else
+    {
+      if(seekable_pread(_private->fd, _private->input, length, offset) != 0)
+	return NULL;
+
+      inflateReset(&_private->stream);
+
+      _private->stream.next_in = _private->input;
+      _private->stream.avail_in = length;
+      _private->stream.next_out = slot->data;
+      _private->stream.avail_out = bytes;
+
+      if((err = inflate(&_private->stream, Z_FINISH)) != Z_STREAM_END || _private->stream.avail_out != 0)
+	{
+	  GNUFDISK_LOG((DEVICE, "can not decompress frame %" PRIu64 ": %d", _frame, err));
+	  errno = EIO;
+	  return NULL;
+	}
+    }
+
+  if(crc32(0, slot->data, bytes) != LE32_TO_CPU(_private->index[_frame].crc))
+    {
+      GNUFDISK_LOG((DEVICE, "bad checksum for frame %" PRIu64, _frame));
+      errno = EIO;
+      return NULL;
+    }
+
+  slot->frame = _frame;
+  slot->used = ++_private->clock;
+
+  return slot->data;
+}
+
+static gnufdisk_integer seekable_read_at(struct seekable_device_private* _private, uint64_t _offset, void* _buf, size_t _size)
+{
+  unsigned char* buf;
+  size_t done;
+
+  if(_offset >= _private->size)
+    return 0;
+
+  if(_size > _private->size - _offset)
+    _size = _private->size - _offset;
+
+  buf = _buf;
+
+  for(done = 0; done < _size; )
+    {
+      const unsigned char* data;
+      uint64_t frame;
+      uint64_t skip;
+      size_t length;
+
+      frame = (_offset + done) >> _private->frame_shift;
+      skip = (_offset + done) & (_private->frame_size - 1);
+      length = seekable_frame_bytes(_private->size, _private->frame_shift, frame) - skip;
+
+      if(length > _size - done)
+	length = _size - done;
+
+      if(LE32_TO_CPU(_private->index[frame].length) == 0)
+	memset(buf + done, 0, length);
+      else if((data = seekable_read_frame(_private, frame)) != NULL)
+	memcpy(buf + done, data + skip, length);
+      else
+	return done > 0 ? (gnufdisk_integer) done : -1;
+
+      done += length;
+    }
+
+  return done;
+}
+
+static gnufdisk_integer seekable_device_start(void* _private)
+{
+  GNUFDISK_LOG((DEVICE, "perform start on struct seekable_device_private* %p", _private));
+
+  seekable_device_private_check(_private);
+
+  GNUFDISK_LOG((DEVICE, "done perform start, result: 0"));
+
+  return 0;
+}
+
+static gnufdisk_integer seekable_device_end(void* _private)
+{
+  struct seekable_device_private* private;
+  gnufdisk_integer ret;
+
+  GNUFDISK_LOG((DEVICE, "perform end on struct seekable_device_private* %p", _private));
+
+  seekable_device_private_check(_private);
+
+  private = _private;
+
+  ret = private->size / private->sector_size - 1;
+
+  GNUFDISK_LOG((DEVICE, "done perform end, result: %" PRId64, ret));
+
+  return ret;
+}
+
+static gnufdisk_integer seekable_device_seek(void* _private, gnufdisk_integer _lba, gnufdisk_integer _offset, int _whence)
+{
+  struct seekable_device_private* private;
+  gnufdisk_integer offset;
+  gnufdisk_integer ret;
+
+  GNUFDISK_LOG((DEVICE, "perform seek on struct seekable_device_private* %p", _private));
+
+  seekable_device_private_check(_private);
+
+  private = _private;
+
+  offset = _lba * private->sector_size + _offset;
+
+  if(_whence == SEEK_CUR)
+    offset += private->position;
+  else if(_whence == SEEK_END)
+    offset += private->size;
+  else if(_whence != SEEK_SET)
+    offset = -1;
+
+  if(offset < 0)
+    {
+      errno = EINVAL;
+      ret = -1;
+    }
+  else
+    ret = private->position = offset;
+
+  GNUFDISK_LOG((DEVICE, "done perform seek, result: %" PRId64, ret));
+
+  return ret;
+}
+
+static gnufdisk_integer seekable_device_read(void* _private, void* _buf, size_t _size)
+{
+  struct seekable_device_private* private;
+  gnufdisk_integer ret;
+
+  GNUFDISK_LOG((DEVICE, "perform read on struct seekable_device_private* %p", _private));
+
+  seekable_device_private_check(_private);
+
+  private = _private;
+
+  pthread_mutex_lock(&private->mutex);
+
+  if((ret = seekable_read_at(private, private->position, _buf, _size)) > 0)
+    private->position += ret;
+
+  pthread_mutex_unlock(&private->mutex);
+
+  GNUFDISK_LOG((DEVICE, "done perform read, result: %" PRId64, ret));
+
+  return ret;
+}
+
+static gnufdisk_integer seekable_device_write(void* _private, const void* _buf, size_t _size)
+{
+  GNUFDISK_LOG((DEVICE, "perform write on struct seekable_device_private* %p", _private));
+
+  seekable_device_private_check(_private);
+
+  errno = EROFS;
+
+  GNUFDISK_LOG((DEVICE, "done perform write, result: -1"));
+
+  return -1;
+}
+
+static gnufdisk_integer seekable_device_pread(void* _private, gnufdisk_integer _lba, void* _buf, size_t _size)
+{
+  struct seekable_device_private* private;
+  gnufdisk_integer ret;
+
+  GNUFDISK_LOG((DEVICE, "perform pread on struct seekable_device_private* %p", _private));
+
+  seekable_device_private_check(_private);
+
+  private = _private;
+
+  pthread_mutex_lock(&private->mutex);
+
+  ret = seekable_read_at(private, _lba * private->sector_size, _buf, _size);
+
+  pthread_mutex_unlock(&private->mutex);
+
+  GNUFDISK_LOG((DEVICE, "done perform pread, result: %" PRId64, ret));
+
+  return ret;
+}
+
+static gnufdisk_integer seekable_device_seek_data(void* _private, gnufdisk_integer _lba, int _whence)
+{
+  struct seekable_device_private* private;
+  gnufdisk_integer ret;
+  uint64_t offset;
+  uint64_t frame;
+
+  GNUFDISK_LOG((DEVICE, "perform seek_data on struct seekable_device_private* %p", _private));
+
+  seekable_device_private_check(_private);
+
+  private = _private;
+
+  offset = _lba * private->sector_size;
+  ret = -1;
+  errno = ENXIO;
+
+  /* the index is read-only, no lock needed */
+  for(frame = offset >> private->frame_shift; offset < private->size; frame++)
+    {
+      if((LE32_TO_CPU(private->index[frame].length) != 0) == (_whence == SEEK_DATA))
+	{
+	  ret = offset;
+	  break;
+	}
+
+      offset = (frame + 1) << private->frame_shift;
+    }
+
+  if(ret == -1 && _whence == SEEK_HOLE && _lba * private->sector_size < private->size)
+    ret = private->size;
+
+  if(ret != -1)
+    ret = _whence == SEEK_DATA ? ret / private->sector_size : (ret + private->sector_size - 1) / private->sector_size;
+
+  GNUFDISK_LOG((DEVICE, "done perform seek_data, result: %" PRId64, ret));
+
+  return ret;
+}
+
+static gnufdisk_integer seekable_device_sector_size(void* _private)
+{
+  struct seekable_device_private* private;
+
+  seekable_device_private_check(_private);
+
+  private = _private;
+
+  return private->sector_size;
+}
+
+static gnufdisk_integer seekable_device_minimum_alignment(void* _private)
+{
+  struct seekable_device_private* private;
+
+  seekable_device_private_check(_private);
+
+  private = _private;
+
+  return private->sector_size;
+}
+
+static gnufdisk_integer seekable_device_optimal_alignment(void* _private)
+{
+  struct seekable_device_private* private;
+
+  seekable_device_private_check(_private);
+
+  private = _private;
+
+  return private->sector_size;
+}
+
+static void seekable_device_set_parameter(void *_private, struct gnufdisk_string* _param, const void* _data, size_t _size)
+{
+  struct seekable_device_private* private;
+  gnufdisk_integer* dest;
+  char* param;
+
+  GNUFDISK_LOG((DEVICE, "perform set_parameter on struct seekable_device_private* %p", _private));
+
+  seekable_device_private_check(_private);
+
+  private = _private;
+  dest = NULL;
+
+  if((param = gnufdisk_string_c_string_dup(_param)) == NULL)
+    THROW_ENOMEM;
+
+  gnufdisk_exception_register_unwind_handler(&free, param);
+
+  GNUFDISK_LOG((DEVICE, "parameter: %s, size: %u", param, _size));
+
+  if(strcasecmp(param, "CYLINDERS") == 0)
+    dest = &private->cylinders;
+  else if(strcasecmp(param, "HEADS") == 0)
+    dest = &private->heads;
+  else if(strcasecmp(param, "SECTORS") == 0)
+    dest = &private->sectors;
+  else if(strcasecmp(param, "SECTOR-SIZE") == 0)
+    dest = &private->sector_size;
+  else
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETER, NULL, "invalid parameter: %s", param);
+
+  if(_size != sizeof(gnufdisk_integer))
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETERSIZE, NULL, "invalid parameter size");
+
+  *dest = *(const gnufdisk_integer*) _data;
+
+  gnufdisk_exception_unregister_unwind_handler(&free, param);
+
+  free(param);
+
+  GNUFDISK_LOG((DEVICE, "done perform set_parameter"));
+}
+
+static void seekable_device_get_parameter(void *_private, struct gnufdisk_string* _param, void* _dest, size_t _size)
+{
+  struct seekable_device_private* private;
+  char* param;
+
+  GNUFDISK_LOG((DEVICE, "perform get_parameter on struct seekable_device_private* %p", _private));
+
+  seekable_device_private_check(_private);
+
+  private = _private;
+
+  if((param = gnufdisk_string_c_string_dup(_param)) == NULL)
+    THROW_ENOMEM;
+
+  gnufdisk_exception_register_unwind_handler(&free, param);
+
+  GNUFDISK_LOG((DEVICE, "parameter: %s, size: %u", param, _size));
+
+  if(strcasecmp(param, "CYLINDERS") == 0
+     || strcasecmp(param, "HEADS") == 0
+     || strcasecmp(param, "SECTORS") == 0)
+    {
+      union gnufdisk_device_exception_data data;
+      gnufdisk_integer* value;
+      GNUFDISK_RETRY rp0;
+      int error;
+
+      if(_size != sizeof(gnufdisk_integer))
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETERSIZE, NULL, "invalid parameter size");
+
+      /* an image has no geometry of its own: ask for it */
+      if(strcasecmp(param, "CYLINDERS") == 0)
+	{
+	  value = data.ecylinders = &private->cylinders;
+	  error = GNUFDISK_DEVICE_ECYLINDERS;
+	}
+      else if(strcasecmp(param, "HEADS") == 0)
+	{
+	  value = data.eheads = &private->heads;
+	  error = GNUFDISK_DEVICE_EHEADS;
+	}
+      else
+	{
+	  value = data.esectors = &private->sectors;
+	  error = GNUFDISK_DEVICE_ESECTORS;
+	}
+
+      GNUFDISK_RETRY_SET(rp0);
+
+      if(*value == 0)
+	GNUFDISK_THROW(GNUFDISK_EXCEPTION_ALL, &rp0, error, &data, "can not determine device %s", param);
+
+      *((gnufdisk_integer*) _dest) = *value;
+    }
+  else if(strcasecmp(param, "SECTOR-SIZE") == 0)
+    {
+      if(_size != sizeof(gnufdisk_integer))
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETERSIZE, NULL, "invalid parameter size");
+
+      *((gnufdisk_integer*) _dest) = private->sector_size;
+    }
+  else if(strcasecmp(param, "IDENTITY") == 0)
+    {
+      if(_size <= strlen(private->identity))
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETERSIZE, NULL, "invalid parameter size");
+
+      strcpy(_dest, private->identity);
+    }
+  else if(strcasecmp(param, "LABEL-STAMP") == 0)
+    {
+      if(_size != sizeof(gnufdisk_integer))
+	GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETERSIZE, NULL, "invalid parameter size");
+
+      *((gnufdisk_integer*) _dest) = probe_cache_file_stamp(private->fd);
+    }
+  else
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPARAMETER, NULL, "invalid parameter: %s", param);
+
+  gnufdisk_exception_unregister_unwind_handler(&free, param);
+
+  free(param);
+
+  GNUFDISK_LOG((DEVICE, "done perform get_parameter"));
+}
+
+static void seekable_device_commit(void* _private)
+{
+  GNUFDISK_LOG((DEVICE, "perform commit on struct seekable_device_private* %p", _private));
+
+  seekable_device_private_check(_private);
+
+  GNUFDISK_LOG((DEVICE, "done perform commit"));
+}
+
+static void seekable_device_release(struct seekable_device_private* _private)
+{
+  int iter;
+
+  if(_private->fd >= 0)
+    close(_private->fd);
+
+  if(_private->map)
+    munmap(_private->map, _private->map_size);
+
+  if(_private->have_stream)
+    inflateEnd(&_private->stream);
+
+  for(iter = 0; iter < SEEKABLE_CACHE; iter++)
+    free(_private->cache[iter].data);
+
+  free(_private->input);
+
+  pthread_mutex_destroy(&_private->mutex);
+
+  memset(_private, 0, sizeof(struct seekable_device_private));
+  free(_private);
+}
+
+static void seekable_device_delete(void* _private)
+{
+  GNUFDISK_LOG((DEVICE, "perform delete on struct seekable_device_private* %p", _private));
+
+  seekable_device_private_check(_private);
+
+  seekable_device_release(_private);
+
+  GNUFDISK_LOG((DEVICE, "done perform delete"));
+}
+
+static void seekable_probe_failure(void* _private)
+{
+  GNUFDISK_LOG((DEVICE, "release struct seekable_device_private* %p", _private));
+  seekable_device_release(_private);
+}
+
+static void seekable_load(struct seekable_device_private* _private, const char* _path)
+{
+  struct seekable_header header;
+  struct stat info;
+  uint64_t index_size;
+  long page;
+  int iter;
+
+  if(seekable_pread(_private->fd, &header, sizeof(header), 0) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not read `%s': %s", _path, strerror(errno));
+
+  if(LE32_TO_CPU(header.version) != SEEKABLE_VERSION
+     || LE32_TO_CPU(header.compression) != SEEKABLE_DEFLATE)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOTSUP, NULL, "unsupported seekable image `%s' (version %u, compression %u)",
+		   _path, LE32_TO_CPU(header.version), LE32_TO_CPU(header.compression));
+
+  _private->frame_shift = LE32_TO_CPU(header.frame_shift);
+  _private->size = LE64_TO_CPU(header.size);
+  _private->frames = LE64_TO_CPU(header.frames);
+  _private->index_offset = LE64_TO_CPU(header.index_offset);
+  _private->image_sector_size = LE32_TO_CPU(header.sector_size);
+
+  if(_private->index_offset == 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "incomplete seekable image `%s'", _path);
+
+  if(fstat(_private->fd, &info) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not stat `%s': %s", _path, strerror(errno));
+
+  index_size = _private->frames * sizeof(struct seekable_frame);
+
+  if(_private->frame_shift < SEEKABLE_MIN_FRAME_SHIFT
+     || _private->frame_shift > SEEKABLE_MAX_FRAME_SHIFT
+     || _private->frames != (_private->size + (1ULL << _private->frame_shift) - 1) >> _private->frame_shift
+     || _private->image_sector_size <= 0
+     || _private->index_offset % sizeof(uint64_t) != 0
+     || _private->index_offset < sizeof(header)
+     || _private->index_offset > (uint64_t) info.st_size
+     || index_size > (uint64_t) info.st_size - _private->index_offset)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "corrupt seekable image `%s'", _path);
+
+  _private->frame_size = 1ULL << _private->frame_shift;
+
+  /* the index is paged in as frames are looked up */
+  if(_private->frames > 0)
+    {
+      page = sysconf(_SC_PAGESIZE);
+
+      _private->map_size = index_size + _private->index_offset % page;
+
+      if((_private->map = mmap(NULL, _private->map_size, PROT_READ, MAP_SHARED,
+			       _private->fd, _private->index_offset - _private->index_offset % page)) == MAP_FAILED)
+	{
+	  _private->map = NULL;
+	  GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not map the index of `%s': %s", _path, strerror(errno));
+	}
+
+      _private->index = (const struct seekable_frame*) ((const unsigned char*) _private->map + _private->index_offset % page);
+    }
+
+  _private->ncache = SEEKABLE_CACHE_SIZE >> _private->frame_shift;
+
+  if(_private->ncache < 2)
+    _private->ncache = 2;
+  else if(_private->ncache > SEEKABLE_CACHE)
+    _private->ncache = SEEKABLE_CACHE;
+
+  for(iter = 0; iter < _private->ncache; iter++)
+    {
+      _private->cache[iter].frame = UINT64_MAX;
+
+      if((_private->cache[iter].data = malloc(_private->frame_size)) == NULL)
+	THROW_ENOMEM;
+    }
+
+  if((_private->input = malloc(_private->frame_size)) == NULL)
+    THROW_ENOMEM;
+
+  if(inflateInit2(&_private->stream, -15) != Z_OK)
+    THROW_ENOMEM;
+
+  _private->have_stream = 1;
+
+  snprintf(_private->identity, sizeof(_private->identity), "seekable-%" PRIx64 "-%" PRIx64,
+	   (uint64_t) info.st_dev, (uint64_t) info.st_ino);
+}
+
+static struct device_implementation seekable_device_implementation = {
+    NULL, /* private */
+    &seekable_device_start,
+    &seekable_device_end,
+    &seekable_device_seek,
+    &seekable_device_read,
+    &seekable_device_write,
+    &seekable_device_sector_size,
+    &seekable_device_minimum_alignment,
+    &seekable_device_optimal_alignment,
+    &seekable_device_set_parameter,
+    &seekable_device_get_parameter,
+    &seekable_device_commit,
+    &seekable_device_delete,
+    &seekable_device_seek_data,
+    NULL, /* zero */
+    NULL, /* discard */
+    NULL, /* discard_granularity */
+    &seekable_device_pread
+};
+
+int seekable_device_probe(const char* _path, struct module_options* _options, struct device_implementation* _implementation)
+{
+  struct seekable_device_private* private;
+  struct stat info;
+  char magic[8];
+  int fd;
+
+  if(stat(_path, &info) != 0 || !S_ISREG(info.st_mode))
+    return -1;
+
+  if((fd = open(_path, O_RDONLY | O_CLOEXEC)) == -1)
+    return -1;
+
+  if(pread(fd, magic, sizeof(magic), 0) != sizeof(magic) || memcmp(magic, SEEKABLE_MAGIC, sizeof(magic)) != 0)
+    {
+      close(fd);
+      return -1;
+    }
+
+  GNUFDISK_LOG((DEVICE, "perform seekable_device_probe on %s", _path));
+
+  if((private = malloc(sizeof(struct seekable_device_private))) == NULL)
+    {
+      close(fd);
+      THROW_ENOMEM;
+    }
+
+  memset(private, 0, sizeof(struct seekable_device_private));
+  private->fd = fd;
+  pthread_mutex_init(&private->mutex, NULL);
+
+  gnufdisk_exception_register_unwind_handler(&seekable_probe_failure, private);
+
+  seekable_load(private, _path);
+
+  private->sector_size = _options->sector_size ? _options->sector_size : private->image_sector_size;
+  private->cylinders = _options->cylinders;
+  private->heads = _options->heads;
+  private->sectors = _options->sectors;
+
+  GNUFDISK_LOG((DEVICE, "seekable image:"));
+  GNUFDISK_LOG((DEVICE, "\tsize       : %" PRIu64, private->size));
+  GNUFDISK_LOG((DEVICE, "\tframe size : %" PRIu64, private->frame_size));
+  GNUFDISK_LOG((DEVICE, "\tframes     : %" PRIu64, private->frames));
+  GNUFDISK_LOG((DEVICE, "\tsector size: %" PRId64, private->image_sector_size));
+
+  memcpy(_implementation, &seekable_device_implementation, sizeof(struct device_implementation));
+  _implementation->private = private;
+
+  gnufdisk_exception_unregister_unwind_handler(&seekable_probe_failure, private);
+
+  GNUFDISK_LOG((DEVICE, "done seekable_device_probe"));
+
+  return 0;
+}
+
+/* import: read the source device and compress its frames in parallel.
+ * Workers take frames in order and write them in the same order, so each
+ * waits for the previous frame before appending its own. */
+
+struct seekable_import_job {
+  struct device_implementation* source;
+  pthread_mutex_t source_mutex; /* seek_data, and read without pread */
+  gnufdisk_integer sector_size;
+  uint64_t size;
+  int frame_shift;
+  uint64_t frames;
+  int level;
+  int fd;
+  struct seekable_frame* index;
+  uint64_t next; /* next frame to compress, shared by the workers */
+  uint64_t written; /* next frame to append */
+  uint64_t offset; /* where it goes */
+  int failed;
+  char error[256];
+  pthread_mutex_t mutex; /* protect written, offset and error */
+  pthread_cond_t cond;
+};
+
+struct seekable_import_buffers {
+  unsigned char* data;
+  unsigned char* output;
+  z_stream stream;
+  int have_stream;
+};
+
+static void seekable_import_fail(struct seekable_import_job* _job, const char* _fmt, ...)
+{
+  va_list args;
+
+  pthread_mutex_lock(&_job->mutex);
+
+  if(!_job->failed)
+    {
+      va_start(args, _fmt);
+      vsnprintf(_job->error, sizeof(_job->error), _fmt, args);
+      va_end(args);
+    }
+
+  __atomic_store_n(&_job->failed, 1, __ATOMIC_RELAXED);
+  pthread_cond_broadcast(&_job->cond);
+  pthread_mutex_unlock(&_job->mutex);
+}
+
+static int seekable_is_zero(const unsigned char* _buf, size_t _size)
+{
+  const uint64_t* words;
+  size_t iter;
+
+  /* frames are whole sectors, malloc aligns them */
+  words = (const uint64_t*) _buf;
+
+  for(iter = 0; iter < _size / sizeof(uint64_t); iter++)
+    if(words[iter] != 0)
+      return 0;
+
+  for(iter = _size & ~(sizeof(uint64_t) - 1); iter < _size; iter++)
+    if(_buf[iter] != 0)
+      return 0;
+
+  return 1;
+}
+
+/* 1 when the source has no data in _count sectors from _lba */
+static int seekable_import_hole(struct seekable_import_job* _job, gnufdisk_integer _lba, gnufdisk_integer _count)
+{
+  gnufdisk_integer data;
+
+  if(_job->source->seek_data == NULL)
+    return 0;
+
+  pthread_mutex_lock(&_job->source_mutex);
+
+  data = (*_job->source->seek_data)(_job->source->private, _lba, SEEK_DATA);
+
+  pthread_mutex_unlock(&_job->source_mutex);
+
+  return (data == -1 && errno == ENXIO) || (data != -1 && data >= _lba + _count);
+}
+
+static int seekable_import_read(struct seekable_import_job* _job, gnufdisk_integer _lba, void* _buf, size_t _size)
+{
+  gnufdisk_integer ret;
+
+  if(_job->source->pread)
+    ret = (*_job->source->pread)(_job->source->private, _lba, _buf, _size);
+  else
+    {
+      pthread_mutex_lock(&_job->source_mutex);
+
+      if((ret = (*_job->source->seek)(_job->source->private, _lba, 0, SEEK_SET)) != -1)
+	ret = (*_job->source->read)(_job->source->private, _buf, _size);
+
+      pthread_mutex_unlock(&_job->source_mutex);
+    }
+
+  if(ret != (gnufdisk_integer) _size)
+    {
+      if(ret >= 0)
+	errno = EIO;
+
+      return -1;
+    }
+
+  return 0;
+}
+
+static void seekable_import_frame(struct seekable_import_job* _job, uint64_t _frame, struct seekable_import_buffers* _buffers)
+{
+  const unsigned char* output;
+  gnufdisk_integer lba;
+  uint64_t bytes;
+  uint32_t length;
+  uint32_t crc;
+
+  bytes = seekable_frame_bytes(_job->size, _job->frame_shift, _frame);
+  lba = (_frame << _job->frame_shift) / _job->sector_size;
+
+  output = NULL;
+  length = 0;
+  crc = 0;
+
+  if(!seekable_import_hole(_job, lba, bytes / _job->sector_size))
+    {
+      if(seekable_import_read(_job, lba, _buffers->data, bytes) != 0)
+	{
+	  seekable_import_fail(_job, "can not read %" PRIu64 " bytes at sector %" PRId64 ": %s",
+			       bytes, lba, strerror(errno));
+	  return;
+	}
+
+      if(!seekable_is_zero(_buffers->data, bytes))
+	{
+	  crc = crc32(0, _buffers->data, bytes);
+
+	  deflateReset(&_buffers->stream);
+
+	  _buffers->stream.next_in = _buffers->data;
+	  _buffers->stream.avail_in = bytes;
+	  _buffers->stream.next_out = _buffers->output;
+	  _buffers->stream.avail_out = bytes - 1;
+
+	  /* a frame that does not shrink is stored */
+	  if(deflate(&_buffers->stream, Z_FINISH) == Z_STREAM_END)
+	    {
+	      output = _buffers->output;
+	      length = _buffers->stream.total_out;
+	    }
+	  else
+	    {
+	      output = _buffers->data;
+	      length = bytes;
+	    }
+	}
+    }
+
+  pthread_mutex_lock(&_job->mutex);
+
+  while(_job->written != _frame && !_job->failed)
+    pthread_cond_wait(&_job->cond, &_job->mutex);
+
+  if(!_job->failed)
+    {
+      if(length > 0 && seekable_pwrite(_job->fd, output, length, _job->offset) != 0)
+	{
+	  pthread_mutex_unlock(&_job->mutex);
+	  seekable_import_fail(_job, "can not write frame %" PRIu64 ": %s", _frame, strerror(errno));
+	  return;
+	}
+
+      _job->index[_frame].offset = CPU_TO_LE64(_job->offset);
+      _job->index[_frame].length = CPU_TO_LE32(length);
+      _job->index[_frame].crc = CPU_TO_LE32(crc);
+
+      _job->offset += length;
+      _job->written++;
+
+      pthread_cond_broadcast(&_job->cond);
+    }
+
+  pthread_mutex_unlock(&_job->mutex);
+}
+
+static void* seekable_import_worker(void* _job)
+{
+  struct seekable_import_job* job;
+  struct seekable_import_buffers buffers;
+
+  job = _job;
+
+  memset(&buffers, 0, sizeof(buffers));
+
+  if((buffers.data = malloc(1ULL << job->frame_shift)) == NULL
+     || (buffers.output = malloc(1ULL << job->frame_shift)) == NULL
+     || deflateInit2(&buffers.stream, job->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    seekable_import_fail(job, "can not allocate memory");
+  else
+    {
+      buffers.have_stream = 1;
+
+      GNUFDISK_TRY(NULL, NULL)
+	{
+	  uint64_t frame;
+
+	  while(!__atomic_load_n(&job->failed, __ATOMIC_RELAXED)
+		&& (frame = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->frames)
+	    seekable_import_frame(job, frame, &buffers);
+	}
+      GNUFDISK_CATCH_DEFAULT
+	{
+	  GNUFDISK_LOG((DEVICE, "caught an exception from %s:%d: %s",
+			exception_info.file, exception_info.line, exception_info.message));
+
+	  seekable_import_fail(job, "%s", exception_info.message);
+	}
+      GNUFDISK_EXCEPTION_END;
+    }
+
+  if(buffers.have_stream)
+    deflateEnd(&buffers.stream);
+
+  free(buffers.output);
+  free(buffers.data);
+
+  return NULL;
+}
+
+struct seekable_import_state {
+  struct module_options options;
+  struct device_implementation source;
+  int have_source;
+  const char* dest;
+  int fd;
+  struct seekable_frame* index;
+};
+
+/* on failure nothing is left behind */
+static void seekable_import_release(void* _state)
+{
+  struct seekable_import_state* state;
+
+  state = _state;
+
+  if(state->fd >= 0)
+    {
+      close(state->fd);
+      unlink(state->dest);
+    }
+
+  if(state->have_source)
+    (*state->source.delete)(state->source.private);
+
+  free(state->index);
+  free(state->options.cache_dir);
+  free(state->options.overlay);
+}
+
+/* Write the seekable image of the device at _source to _dest. _options are
+ * the module options used to open _source (always read-only); _frame_size
+ * is a power of two (0 for the default), _level the deflate level (-1 for
+ * the default) and _threads the number of workers (0 for one per CPU). */
+void module_seekable_import(const char* _options,
+			    const char* _source,
+			    const char* _dest,
+			    gnufdisk_integer _frame_size,
+			    int _level,
+			    int _threads)
+{
+  struct seekable_import_state state;
+  struct seekable_import_job job;
+  struct seekable_header header;
+  pthread_t threads[SEEKABLE_MAX_THREADS];
+  uint64_t index_size;
+  int nthreads;
+  int iter;
+
+  GNUFDISK_LOG((DEVICE, "perform seekable import of `%s' to `%s'", _source, _dest));
+
+  memset(&state, 0, sizeof(state));
+  memset(&job, 0, sizeof(job));
+
+  state.fd = -1;
+  state.dest = _dest;
+
+  gnufdisk_exception_register_unwind_handler(&seekable_import_release, &state);
+
+  parse_module_options(_options ? _options : "", &state.options);
+  state.options.readonly = 1;
+
+  if(device_probe_implementation(_source, &state.options, &state.source) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not open `%s'", _source);
+
+  state.have_source = 1;
+
+  job.source = &state.source;
+  job.sector_size = (*state.source.sector_size)(state.source.private);
+  job.size = ((*state.source.end)(state.source.private) - (*state.source.start)(state.source.private) + 1) * job.sector_size;
+  job.level = _level < 0 ? Z_DEFAULT_COMPRESSION : _level;
+
+  if(_frame_size == 0)
+    _frame_size = SEEKABLE_DEFAULT_FRAME_SIZE;
+
+  for(job.frame_shift = SEEKABLE_MIN_FRAME_SHIFT;
+      job.frame_shift < SEEKABLE_MAX_FRAME_SHIFT && (1LL << job.frame_shift) < _frame_size;
+      job.frame_shift++)
+    ;
+
+  if((1LL << job.frame_shift) != _frame_size || _frame_size % job.sector_size != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL,
+		   "invalid frame size %" PRId64 ": must be a power of two between %d and %d and a multiple of the sector size",
+		   _frame_size, 1 << SEEKABLE_MIN_FRAME_SHIFT, 1 << SEEKABLE_MAX_FRAME_SHIFT);
+
+  if(job.level < Z_DEFAULT_COMPRESSION || job.level > Z_BEST_COMPRESSION)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL, "invalid compression level %d", _level);
+
+  job.frames = (job.size + _frame_size - 1) >> job.frame_shift;
+  index_size = job.frames * sizeof(struct seekable_frame);
+
+  if((state.index = malloc(index_size ? index_size : 1)) == NULL)
+    THROW_ENOMEM;
+
+  job.index = state.index;
+
+  if((state.fd = open(_dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) == -1)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not create `%s': %s", _dest, strerror(errno));
+
+  job.fd = state.fd;
+
+  /* the header points to no index until the image is complete */
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SEEKABLE_MAGIC, sizeof(header.magic));
+  header.version = CPU_TO_LE32(SEEKABLE_VERSION);
+  header.compression = CPU_TO_LE32(SEEKABLE_DEFLATE);
+  header.frame_shift = CPU_TO_LE32(job.frame_shift);
+  header.sector_size = CPU_TO_LE32(job.sector_size);
+  header.size = CPU_TO_LE64(job.size);
+  header.frames = CPU_TO_LE64(job.frames);
+
+  if(seekable_pwrite(state.fd, &header, sizeof(header), 0) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not write `%s': %s", _dest, strerror(errno));
+
+  job.offset = sizeof(header);
+
+  if(_threads <= 0)
+    _threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if(_threads > SEEKABLE_MAX_THREADS)
+    _threads = SEEKABLE_MAX_THREADS;
+
+  if(_threads > job.frames)
+    _threads = job.frames;
+
+  GNUFDISK_LOG((DEVICE, "%" PRIu64 " bytes, %" PRIu64 " frames of %" PRId64 " bytes, %d threads",
+		job.size, job.frames, _frame_size, _threads));
+
+  pthread_mutex_init(&job.mutex, NULL);
+  pthread_mutex_init(&job.source_mutex, NULL);
+  pthread_cond_init(&job.cond, NULL);
+
+  /* the calling thread is a worker too */
+  for(nthreads = 0; nthreads < _threads - 1; nthreads++)
+    {
+      int err;
+
+      if((err = pthread_create(&threads[nthreads], NULL, &seekable_import_worker, &job)) != 0)
+	{
+	  GNUFDISK_LOG((DEVICE, "can not start worker %d: %s", nthreads, strerror(err)));
+	  break;
+	}
+    }
+
+  if(job.frames > 0)
+    seekable_import_worker(&job);
+
+  for(iter = 0; iter < nthreads; iter++)
+    pthread_join(threads[iter], NULL);
+
+  pthread_cond_destroy(&job.cond);
+  pthread_mutex_destroy(&job.source_mutex);
+  pthread_mutex_destroy(&job.mutex);
+
+  if(job.failed)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "%s", job.error);
+
+  header.index_offset = CPU_TO_LE64(math_round_up(job.offset, SEEKABLE_INDEX_ALIGNMENT));
+
+  if(seekable_pwrite(state.fd, state.index, index_size, LE64_TO_CPU(header.index_offset)) != 0
+     || ftruncate(state.fd, LE64_TO_CPU(header.index_offset) + index_size) != 0
+     || fdatasync(state.fd) != 0
+     || seekable_pwrite(state.fd, &header, sizeof(header), 0) != 0
+     || fdatasync(state.fd) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not write `%s': %s", _dest, strerror(errno));
+
+  if(close(state.fd) != 0)
+    {
+      state.fd = -1;
+      unlink(_dest);
+      GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not write `%s': %s", _dest, strerror(errno));
+    }
+
+  state.fd = -1;
+
+  gnufdisk_exception_unregister_unwind_handler(&seekable_import_release, &state);
+
+  seekable_import_release(&state);
+
+  GNUFDISK_LOG((DEVICE, "done perform seekable import, %" PRIu64 " bytes in %" PRIu64 " bytes",
+		job.size, LE64_TO_CPU(header.index_offset) + index_size));
+}
@@ -0,0 +1,143 @@
+#include "common.h"
+
+#define VECTOR_INITIAL_CAPACITY 8
+
+struct vector {
+  struct arena* arena; /* NULL when allocated from the heap */
+  void** data;
+  size_t length;
+  size_t capacity;
+};
+
+static void vector_check(struct vector* _v)
+{
+  if(gnufdisk_check_memory(_v, sizeof(struct vector), 0) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL, "invalid struct vector* %p", _v);
+}
+
+static void vector_check_index(struct vector* _v, size_t _index)
+{
+  if(_index >= _v->length)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL,
+		   "index %zu out of range for struct vector* %p (length: %zu)", _index, _v, _v->length);
+}
+
+static void vector_reserve(struct vector* _v, size_t _capacity)
+{
+  void** data;
+
+  if(_capacity <= _v->capacity)
+    return;
+
+  GNUFDISK_LOG((VECTOR, "grow struct vector* %p from %zu to %zu elements", _v, _v->capacity, _capacity));
+
+  if(_v->arena)
+    {
+      data = arena_alloc(_v->arena, _capacity * sizeof(void*));
+
+      if(_v->data)
+	{
+	  memcpy(data, _v->data, _v->length * sizeof(void*));
+	  arena_free(_v->data);
+	}
+    }
+  else if((data = realloc(_v->data, _capacity * sizeof(void*))) == NULL)
+    THROW_ENOMEM;
+
+  _v->data = data;
+  _v->capacity = _capacity;
+}
+
+struct vector* vector_new(struct arena* _arena)
+{
+  struct vector* ret;
+
+  if(_arena != NULL)
+    ret = arena_alloc(_arena, sizeof(struct vector));
+  else if((ret = malloc(sizeof(struct vector))) == NULL)
+    THROW_ENOMEM;
+
+  ret->arena = _arena;
+  ret->data = NULL;
+  ret->length = 0;
+  ret->capacity = 0;
+
+  GNUFDISK_LOG((VECTOR, "new struct vector* %p", ret));
+
+  return ret;
+}
+
+size_t vector_length(struct vector* _v)
+{
+  vector_check(_v);
+  return _v->length;
+}
+
+void* vector_get(struct vector* _v, size_t _index)
+{
+  vector_check(_v);
+  vector_check_index(_v, _index);
+
+  return _v->data[_index];
+}
+
+void* vector_last(struct vector* _v)
+{
+  vector_check(_v);
+
+  if(_v->length == 0)
+    return NULL;
+
+  return _v->data[_v->length - 1];
+}
+
+void vector_append(struct vector* _v, void* _data)
+{
+  vector_check(_v);
+
+  if(_v->length == _v->capacity)
+    vector_reserve(_v, _v->capacity == 0 ? VECTOR_INITIAL_CAPACITY : _v->capacity * 2);
+
+  _v->data[_v->length++] = _data;
+}
+
+void* vector_remove(struct vector* _v, size_t _index)
+{
+  void* ret;
+
+  vector_check(_v);
+  vector_check_index(_v, _index);
+
+  ret = _v->data[_index];
+
+  memmove(&_v->data[_index], &_v->data[_index + 1], (_v->length - _index - 1) * sizeof(void*));
+  _v->length--;
+
+  return ret;
+}
+
+void vector_delete(struct vector* _v, void (*_free)(void*))
+{
+  size_t iter;
+
+  vector_check(_v);
+
+  GNUFDISK_LOG((VECTOR, "delete struct vector* %p", _v));
+
+  if(gnufdisk_check_memory(_free, 1, 1) == 0)
+    for(iter = 0; iter < _v->length; iter++)
+      (*_free)(_v->data[iter]);
+
+  if(_v->arena)
+    {
+      arena_free(_v->data);
+      arena_free(_v);
+    }
+  else
+    {
+      if(_v->data)
+	free(_v->data);
+
+      free(_v);
+    }
+}
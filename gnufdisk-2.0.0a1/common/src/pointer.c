@@ -59,22 +59,25 @@ int gnufdisk_check_memory(void* _p, size_t _len, int _readonly)
 
   if(setjmp(sigsegv_jump) == 0)
     {
-      unsigned char* start;
-      unsigned char* end;
+      volatile unsigned char* start;
+      volatile unsigned char* end;
       unsigned char byte;
 
-      start = (unsigned char*) _p;
-      end = start + _len;
+      /* volatile: the compiler must not drop a read whose value is unused.
+         The write-back stores only if the byte is unchanged, so it never
+         undoes a store of another thread */
+      start = (volatile unsigned char*) _p;
+      end = start + (_len > 0 ? _len - 1 : 0);
 
       byte = *start;
   
       if(!_readonly)
-        *start = byte;
+        __atomic_compare_exchange_n(start, &byte, byte, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
 
       byte = *end;
 
       if(!_readonly)
-        *end = byte;
+        __atomic_compare_exchange_n(end, &byte, byte, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
 
       ret = 0;
       err = 0;
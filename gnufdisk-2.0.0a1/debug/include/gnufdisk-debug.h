@@ -21,6 +21,8 @@
 #ifndef GNUFDISK_DEBUG_H_INCLUDED
 #define GNUFDISK_DEBUG_H_INCLUDED
 
+#include <stdio.h>
+
 extern int gnufdisk_log_implementation(int _category, const char* _file, const int _line, const char* _format, ...);
 extern int gnufdisk_warning_implementation (const char *_file, const int _line, const char *_format, ...);
 
@@ -33,6 +35,65 @@ extern int gnufdisk_warning_implementation (const char *_file, const int _line,
 
 #define GNUFDISK_WARNING(_mp_args...) gnufdisk_warning_implementation(__FILE__, __LINE__, _mp_args)
 
+/* Operation counters, always enabled. Durations are kept in a log2 histogram
+ * of microseconds: bucket N counts operations that took less than 2^N us. */
+
+enum gnufdisk_stats_operation {
+  GNUFDISK_STATS_DEVICE_READ,
+  GNUFDISK_STATS_DEVICE_WRITE,
+  GNUFDISK_STATS_DEVICE_SEEK,
+  GNUFDISK_STATS_DEVICE_COMMIT,
+  GNUFDISK_STATS_DISKLABEL_COMMIT,
+  GNUFDISK_STATS_PROBE_MBR,
+  GNUFDISK_STATS_PROBE_EBR,
+  GNUFDISK_STATS_PROBE_GPT,
+  GNUFDISK_STATS_GPT_CRC,
+  GNUFDISK_STATS_UI_STARTUP,
+  GNUFDISK_STATS_NOPERATIONS
+};
+
+#define GNUFDISK_STATS_BUCKETS 24
+
+struct gnufdisk_stats {
+  const char* name;
+  unsigned long long count;
+  unsigned long long bytes;
+  unsigned long long total_nsec;
+  unsigned long long max_nsec;
+  unsigned long long histogram[GNUFDISK_STATS_BUCKETS];
+};
+
+extern unsigned long long gnufdisk_stats_clock(void);
+extern void gnufdisk_stats_record(enum gnufdisk_stats_operation _op, unsigned long long _start, unsigned long long _bytes);
+extern int gnufdisk_stats_get(enum gnufdisk_stats_operation _op, struct gnufdisk_stats* _dest);
+extern void gnufdisk_stats_reset(void);
+extern int gnufdisk_stats_print_prometheus(FILE* _stream);
+
+/* Binary trace. When the GNUFDISK_TRACE environment variable names a file,
+ * log points and the operations counted above are stored as fixed-size
+ * records in a per-thread ring buffer instead of being formatted on stdout.
+ * The rings are written to that file at exit and rendered offline by the
+ * gnufdisk-trace program. */
+
+enum gnufdisk_trace_event {
+  /* values below GNUFDISK_STATS_NOPERATIONS are enum gnufdisk_stats_operation */
+  GNUFDISK_TRACE_LOG = 0x100
+};
+
+extern int gnufdisk_trace_enabled;
+
+extern void gnufdisk_trace_implementation(unsigned int _event,
+                                          const char* _file,
+                                          const int _line,
+                                          unsigned long long _arg0,
+                                          unsigned long long _arg1,
+                                          unsigned long long _arg2);
+extern int gnufdisk_trace_start(const char* _path);
+extern int gnufdisk_trace_dump(void);
+
+#define GNUFDISK_TRACE(_mp_event, _mp_arg0, _mp_arg1, _mp_arg2) \
+  (gnufdisk_trace_enabled ? gnufdisk_trace_implementation(_mp_event, __FILE__, __LINE__, _mp_arg0, _mp_arg1, _mp_arg2) : (void) 0)
+
 #endif /* GNUFDISK_DEBUG_H_INCLUDED */
 
 
@@ -18,6 +18,7 @@
  * Boston, MA 02111-1307, USA. */
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <pthread.h>
 #include <unistd.h>
@@ -57,7 +58,14 @@ int
 gnufdisk_log_implementation (int _category, const char *_file,
 			     const int _line, const char *_format, ...)
 {
-  if (_category)
+  if (_category && gnufdisk_trace_enabled)
+    {
+      /* keep the format, leave the formatting to gnufdisk-trace */
+      gnufdisk_trace_implementation (GNUFDISK_TRACE_LOG, _file, _line,
+				     (uintptr_t) _format, _category, 0);
+      return 0;
+    }
+  else if (_category)
     {
       int ret;
       va_list args;
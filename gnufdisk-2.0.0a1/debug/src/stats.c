@@ -0,0 +1,200 @@
+/* GNU Fidsk (gnufdisk-debug), a library for debugging.
+ *
+ * Copyright (C) 2011 Free Software Foundation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA. */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <gnufdisk-common.h>
+#include <gnufdisk-debug.h>
+
+/* Counters are updated with relaxed atomic adds and never take a lock, so
+ * that they can stay enabled on production systems. A reader may observe a
+ * count and a histogram that differ by the operations in flight. */
+
+struct stats_counters {
+  unsigned long long count;
+  unsigned long long bytes;
+  unsigned long long total_nsec;
+  unsigned long long max_nsec;
+  unsigned long long histogram[GNUFDISK_STATS_BUCKETS];
+};
+
+static const char* names[] = {
+  [GNUFDISK_STATS_DEVICE_READ] = "device_read",
+  [GNUFDISK_STATS_DEVICE_WRITE] = "device_write",
+  [GNUFDISK_STATS_DEVICE_SEEK] = "device_seek",
+  [GNUFDISK_STATS_DEVICE_COMMIT] = "device_commit",
+  [GNUFDISK_STATS_DISKLABEL_COMMIT] = "disklabel_commit",
+  [GNUFDISK_STATS_PROBE_MBR] = "probe_mbr",
+  [GNUFDISK_STATS_PROBE_EBR] = "probe_ebr",
+  [GNUFDISK_STATS_PROBE_GPT] = "probe_gpt",
+  [GNUFDISK_STATS_GPT_CRC] = "gpt_crc",
+  [GNUFDISK_STATS_UI_STARTUP] = "ui_startup"
+};
+
+static struct stats_counters counters[GNUFDISK_STATS_NOPERATIONS];
+
+static int bucket(unsigned long long _nsec)
+{
+  unsigned long long usec;
+  int ret;
+
+  usec = _nsec / 1000;
+
+  if(usec == 0)
+    return 0;
+
+  ret = 64 - __builtin_clzll(usec);
+
+  return ret < GNUFDISK_STATS_BUCKETS ? ret : GNUFDISK_STATS_BUCKETS - 1;
+}
+
+unsigned long long gnufdisk_stats_clock(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void gnufdisk_stats_record(enum gnufdisk_stats_operation _op,
+                           unsigned long long _start,
+                           unsigned long long _bytes)
+{
+  struct stats_counters* c;
+  unsigned long long elapsed;
+  unsigned long long max;
+
+  if(_op < 0 || _op >= GNUFDISK_STATS_NOPERATIONS)
+    return;
+
+  c = &counters[_op];
+  elapsed = gnufdisk_stats_clock() - _start;
+
+  __atomic_fetch_add(&c->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&c->bytes, _bytes, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&c->total_nsec, elapsed, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&c->histogram[bucket(elapsed)], 1, __ATOMIC_RELAXED);
+
+  max = __atomic_load_n(&c->max_nsec, __ATOMIC_RELAXED);
+
+  while(elapsed > max
+        && !__atomic_compare_exchange_n(&c->max_nsec, &max, elapsed, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+
+  if(gnufdisk_trace_enabled)
+    gnufdisk_trace_implementation(_op, NULL, 0, elapsed, _bytes, 0);
+}
+
+int gnufdisk_stats_get(enum gnufdisk_stats_operation _op, struct gnufdisk_stats* _dest)
+{
+  struct stats_counters* c;
+  int iter;
+
+  if(_op < 0 || _op >= GNUFDISK_STATS_NOPERATIONS)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  c = &counters[_op];
+
+  _dest->name = names[_op];
+  _dest->count = __atomic_load_n(&c->count, __ATOMIC_RELAXED);
+  _dest->bytes = __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+  _dest->total_nsec = __atomic_load_n(&c->total_nsec, __ATOMIC_RELAXED);
+  _dest->max_nsec = __atomic_load_n(&c->max_nsec, __ATOMIC_RELAXED);
+
+  for(iter = 0; iter < GNUFDISK_STATS_BUCKETS; iter++)
+    _dest->histogram[iter] = __atomic_load_n(&c->histogram[iter], __ATOMIC_RELAXED);
+
+  return 0;
+}
+
+void gnufdisk_stats_reset(void)
+{
+  int iter;
+
+  for(iter = 0; iter < GNUFDISK_STATS_NOPERATIONS; iter++)
+    {
+      unsigned long long* p;
+      size_t n;
+
+      /* store word by word: concurrent recorders keep running */
+      for(p = (unsigned long long*) &counters[iter], n = 0;
+          n < sizeof(struct stats_counters) / sizeof(unsigned long long);
+          n++)
+        __atomic_store_n(&p[n], 0, __ATOMIC_RELAXED);
+    }
+}
+
+int gnufdisk_stats_print_prometheus(FILE* _stream)
+{
+  int ret;
+  int op;
+
+  ret = 0;
+
+  ret += fprintf(_stream,
+                 "# HELP gnufdisk_operation_duration_seconds Time spent in device and disklabel operations.\n"
+                 "# TYPE gnufdisk_operation_duration_seconds histogram\n");
+
+  for(op = 0; op < GNUFDISK_STATS_NOPERATIONS; op++)
+    {
+      struct gnufdisk_stats s;
+      unsigned long long cumulative;
+      int iter;
+
+      gnufdisk_stats_get(op, &s);
+
+      for(iter = 0, cumulative = 0; iter < GNUFDISK_STATS_BUCKETS - 1; iter++)
+        {
+          cumulative += s.histogram[iter];
+          ret += fprintf(_stream,
+                         "gnufdisk_operation_duration_seconds_bucket{operation=\"%s\",le=\"%g\"} %llu\n",
+                         s.name, (double) (1ULL << iter) / 1e6, cumulative);
+        }
+
+      ret += fprintf(_stream,
+                     "gnufdisk_operation_duration_seconds_bucket{operation=\"%s\",le=\"+Inf\"} %llu\n"
+                     "gnufdisk_operation_duration_seconds_sum{operation=\"%s\"} %.9f\n"
+                     "gnufdisk_operation_duration_seconds_count{operation=\"%s\"} %llu\n",
+                     s.name, s.count,
+                     s.name, (double) s.total_nsec / 1e9,
+                     s.name, s.count);
+    }
+
+  ret += fprintf(_stream,
+                 "# HELP gnufdisk_operation_bytes_total Bytes transferred by device and disklabel operations.\n"
+                 "# TYPE gnufdisk_operation_bytes_total counter\n");
+
+  for(op = 0; op < GNUFDISK_STATS_NOPERATIONS; op++)
+    {
+      struct gnufdisk_stats s;
+
+      gnufdisk_stats_get(op, &s);
+
+      ret += fprintf(_stream, "gnufdisk_operation_bytes_total{operation=\"%s\"} %llu\n", s.name, s.bytes);
+    }
+
+  return ret;
+}
@@ -0,0 +1,196 @@
+/* GNU Fidsk (gnufdisk-debug), a library for debugging.
+ *
+ * Copyright (C) 2011 Free Software Foundation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA. */
+
+/* gnufdisk-trace: render a trace written by GNUFDISK_TRACE=file as text,
+ * one line per record, all threads merged in timestamp order. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "trace.h"
+
+#define TRACE_LOG 0x100 /* GNUFDISK_TRACE_LOG */
+
+struct name {
+  uint64_t key;
+  char* value;
+};
+
+struct entry {
+  struct trace_record record;
+  uint64_t thread;
+};
+
+static const char* program;
+
+static void die(const char* _path, const char* _what)
+{
+  fprintf(stderr, "%s: %s: %s\n", program, _path, _what);
+  exit(EXIT_FAILURE);
+}
+
+static int read_names(FILE* _file, struct name* _dest, uint32_t _count, int _wide)
+{
+  uint32_t iter;
+
+  for(iter = 0; iter < _count; iter++)
+    {
+      uint32_t key32;
+      uint32_t length;
+
+      if(_wide)
+        {
+          if(fread(&_dest[iter].key, sizeof(uint64_t), 1, _file) != 1)
+            return -1;
+        }
+      else
+        {
+          if(fread(&key32, sizeof(key32), 1, _file) != 1)
+            return -1;
+
+          _dest[iter].key = key32;
+        }
+
+      if(fread(&length, sizeof(length), 1, _file) != 1
+         || (_dest[iter].value = malloc(length + 1)) == NULL
+         || (length > 0 && fread(_dest[iter].value, length, 1, _file) != 1))
+        return -1;
+
+      _dest[iter].value[length] = 0;
+    }
+
+  return 0;
+}
+
+static const char* lookup(struct name* _names, uint32_t _count, uint64_t _key, const char* _default)
+{
+  uint32_t iter;
+
+  for(iter = 0; iter < _count; iter++)
+    if(_names[iter].key == _key)
+      return _names[iter].value;
+
+  return _default;
+}
+
+static int compare_entry(const void* _a, const void* _b)
+{
+  const struct entry* a = _a;
+  const struct entry* b = _b;
+
+  if(a->record.timestamp != b->record.timestamp)
+    return a->record.timestamp < b->record.timestamp ? -1 : 1;
+
+  return 0;
+}
+
+int main(int _argc, char** _argv)
+{
+  struct trace_file_header header;
+  struct name* events;
+  struct name* strings;
+  struct entry* entries;
+  size_t nentries;
+  size_t iter;
+  uint32_t thread;
+  FILE* file;
+
+  program = _argv[0];
+
+  if(_argc != 2)
+    {
+      fprintf(stderr, "usage: %s TRACE-FILE\n", program);
+      return EXIT_FAILURE;
+    }
+
+  if((file = fopen(_argv[1], "rb")) == NULL)
+    die(_argv[1], "can not open file");
+
+  if(fread(&header, sizeof(header), 1, file) != 1
+     || memcmp(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic)) != 0)
+    die(_argv[1], "not a gnufdisk trace");
+
+  if(header.record_size != sizeof(struct trace_record))
+    die(_argv[1], "trace written by an incompatible version");
+
+  if((events = calloc(header.nevents + 1, sizeof(struct name))) == NULL
+     || (strings = calloc(header.nstrings + 1, sizeof(struct name))) == NULL)
+    die(_argv[1], "out of memory");
+
+  if(read_names(file, events, header.nevents, 0) != 0
+     || read_names(file, strings, header.nstrings, 1) != 0)
+    die(_argv[1], "truncated file");
+
+  entries = NULL;
+  nentries = 0;
+
+  for(thread = 0; thread < header.nthreads; thread++)
+    {
+      struct trace_file_thread t;
+      struct entry* e;
+
+      if(fread(&t, sizeof(t), 1, file) != 1)
+        die(_argv[1], "truncated file");
+
+      if(t.lost > 0)
+        printf("# thread %016" PRIx64 ": %" PRIu64 " older records were overwritten\n", t.thread, t.lost);
+
+      if((e = realloc(entries, (nentries + t.nrecords) * sizeof(struct entry))) == NULL)
+        die(_argv[1], "out of memory");
+
+      entries = e;
+
+      for(; t.nrecords > 0; t.nrecords--, nentries++)
+        {
+          if(fread(&entries[nentries].record, sizeof(struct trace_record), 1, file) != 1)
+            die(_argv[1], "truncated file");
+
+          entries[nentries].thread = t.thread;
+        }
+    }
+
+  fclose(file);
+
+  qsort(entries, nentries, sizeof(struct entry), &compare_entry);
+
+  for(iter = 0; iter < nentries; iter++)
+    {
+      struct trace_record* r;
+      uint64_t time;
+
+      r = &entries[iter].record;
+      time = r->timestamp - entries[0].record.timestamp;
+
+      printf("%" PRIu64 ".%09" PRIu64 " %016" PRIx64 " ",
+             time / 1000000000, time % 1000000000, entries[iter].thread);
+
+      if(r->event == TRACE_LOG)
+        printf("%s:%d: %s\n",
+               lookup(strings, header.nstrings, r->file, "?"), r->line,
+               lookup(strings, header.nstrings, r->args[0], "?"));
+      else
+        printf("%s duration=%" PRIu64 "ns bytes=%" PRIu64 "\n",
+               lookup(events, header.nevents, r->event, "unknown"), r->args[0], r->args[1]);
+    }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,312 @@
+/* GNU Fidsk (gnufdisk-debug), a library for debugging.
+ *
+ * Copyright (C) 2011 Free Software Foundation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <gnufdisk-common.h>
+#include <gnufdisk-debug.h>
+
+#include "trace.h"
+
+#define TRACE_RING_SIZE 8192 /* records per thread, power of two */
+
+/* Each thread writes only to its own ring, so recording an event is a clock
+ * read and a 48 byte store. Rings are never freed: the list is walked once,
+ * at exit, when the trace is written. */
+struct trace_ring {
+  struct trace_ring* next;
+  uint64_t thread;
+  uint64_t head; /* records written so far */
+  struct trace_record records[TRACE_RING_SIZE];
+};
+
+struct trace_strings {
+  uint64_t* data;
+  size_t length;
+  size_t capacity;
+};
+
+int gnufdisk_trace_enabled;
+
+static char* trace_path;
+static struct trace_ring* rings;
+static __thread struct trace_ring* ring;
+
+static struct trace_ring* trace_ring_new(void)
+{
+  struct trace_ring* ret;
+  pthread_t thread;
+
+  if((ret = malloc(sizeof(struct trace_ring))) == NULL)
+    return NULL;
+
+  thread = pthread_self();
+
+  ret->thread = 0;
+  memcpy(&ret->thread, &thread, sizeof(thread) < sizeof(ret->thread) ? sizeof(thread) : sizeof(ret->thread));
+  ret->head = 0;
+  ret->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+
+  while(!__atomic_compare_exchange_n(&rings, &ret->next, ret, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+
+  return ret;
+}
+
+void gnufdisk_trace_implementation(unsigned int _event,
+                                   const char* _file,
+                                   const int _line,
+                                   unsigned long long _arg0,
+                                   unsigned long long _arg1,
+                                   unsigned long long _arg2)
+{
+  struct trace_record* record;
+  uint64_t head;
+
+  if(ring == NULL && (ring = trace_ring_new()) == NULL)
+    return;
+
+  head = ring->head;
+  record = &ring->records[head & (TRACE_RING_SIZE - 1)];
+
+  record->timestamp = gnufdisk_stats_clock();
+  record->event = _event;
+  record->line = _line;
+  record->file = (uintptr_t) _file;
+  record->args[0] = _arg0;
+  record->args[1] = _arg1;
+  record->args[2] = _arg2;
+
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static int trace_strings_add(struct trace_strings* _s, uint64_t _address)
+{
+  size_t iter;
+
+  if(_address == 0)
+    return 0;
+
+  for(iter = 0; iter < _s->length; iter++)
+    if(_s->data[iter] == _address)
+      return 0;
+
+  if(_s->length == _s->capacity)
+    {
+      uint64_t* data;
+      size_t capacity;
+
+      capacity = _s->capacity == 0 ? 64 : _s->capacity * 2;
+
+      if((data = realloc(_s->data, capacity * sizeof(uint64_t))) == NULL)
+        return -1;
+
+      _s->data = data;
+      _s->capacity = capacity;
+    }
+
+  _s->data[_s->length++] = _address;
+
+  return 0;
+}
+
+static size_t trace_ring_count(struct trace_ring* _ring, uint64_t* _first)
+{
+  uint64_t head;
+
+  head = __atomic_load_n(&_ring->head, __ATOMIC_ACQUIRE);
+
+  *_first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+  return head - *_first;
+}
+
+static int write_event(FILE* _stream, uint32_t _id, const char* _name)
+{
+  uint32_t length;
+
+  length = strlen(_name);
+
+  return fwrite(&_id, sizeof(_id), 1, _stream) != 1
+    || fwrite(&length, sizeof(length), 1, _stream) != 1
+    || fwrite(_name, length, 1, _stream) != 1 ? -1 : 0;
+}
+
+static int write_string(FILE* _stream, uint64_t _address)
+{
+  const char* string;
+  uint32_t length;
+
+  string = (const char*) (uintptr_t) _address;
+
+  /* the module that owned the string may have been unloaded */
+  if(gnufdisk_check_memory((void*) string, 1, 1) != 0)
+    string = "(unavailable)";
+
+  length = strlen(string);
+
+  return fwrite(&_address, sizeof(_address), 1, _stream) != 1
+    || fwrite(&length, sizeof(length), 1, _stream) != 1
+    || fwrite(string, length, 1, _stream) != 1 ? -1 : 0;
+}
+
+static int trace_write(FILE* _stream)
+{
+  struct trace_file_header header;
+  struct trace_strings strings;
+  struct trace_ring* iter;
+  size_t index;
+  int op;
+
+  memset(&strings, 0, sizeof(strings));
+  memset(&header, 0, sizeof(header));
+
+  memcpy(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic));
+  header.record_size = sizeof(struct trace_record);
+  header.nevents = GNUFDISK_STATS_NOPERATIONS + 1;
+
+  for(iter = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); iter != NULL; iter = iter->next)
+    {
+      uint64_t first;
+      size_t count;
+
+      header.nthreads++;
+
+      for(count = trace_ring_count(iter, &first); count > 0; count--, first++)
+        {
+          struct trace_record* record;
+
+          record = &iter->records[first & (TRACE_RING_SIZE - 1)];
+
+          if(trace_strings_add(&strings, record->file) != 0
+             || (record->event == GNUFDISK_TRACE_LOG && trace_strings_add(&strings, record->args[0]) != 0))
+            goto lb_failure;
+        }
+    }
+
+  header.nstrings = strings.length;
+
+  if(fwrite(&header, sizeof(header), 1, _stream) != 1)
+    goto lb_failure;
+
+  for(op = 0; op < GNUFDISK_STATS_NOPERATIONS; op++)
+    {
+      struct gnufdisk_stats stats;
+
+      gnufdisk_stats_get(op, &stats);
+
+      if(write_event(_stream, op, stats.name) != 0)
+        goto lb_failure;
+    }
+
+  if(write_event(_stream, GNUFDISK_TRACE_LOG, "log") != 0)
+    goto lb_failure;
+
+  for(index = 0; index < strings.length; index++)
+    if(write_string(_stream, strings.data[index]) != 0)
+      goto lb_failure;
+
+  for(iter = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); iter != NULL; iter = iter->next)
+    {
+      struct trace_file_thread thread;
+      uint64_t first;
+
+      memset(&thread, 0, sizeof(thread));
+
+      thread.thread = iter->thread;
+      thread.nrecords = trace_ring_count(iter, &first);
+      thread.lost = first;
+
+      if(fwrite(&thread, sizeof(thread), 1, _stream) != 1)
+        goto lb_failure;
+
+      for(; thread.nrecords > 0; thread.nrecords--, first++)
+        if(fwrite(&iter->records[first & (TRACE_RING_SIZE - 1)], sizeof(struct trace_record), 1, _stream) != 1)
+          goto lb_failure;
+    }
+
+  free(strings.data);
+
+  return 0;
+
+lb_failure:
+
+  free(strings.data);
+
+  return -1;
+}
+
+int gnufdisk_trace_dump(void)
+{
+  FILE* stream;
+  int ret;
+
+  if(trace_path == NULL)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  if((stream = fopen(trace_path, "wb")) == NULL)
+    return -1;
+
+  ret = trace_write(stream);
+
+  if(fclose(stream) != 0)
+    ret = -1;
+
+  return ret;
+}
+
+static void trace_atexit(void)
+{
+  if(gnufdisk_trace_dump() != 0)
+    fprintf(stderr, "can not write trace to %s\n", trace_path);
+}
+
+int gnufdisk_trace_start(const char* _path)
+{
+  char* path;
+
+  if((path = strdup(_path)) == NULL)
+    return -1;
+
+  if(trace_path == NULL)
+    atexit(&trace_atexit);
+  else
+    free(trace_path);
+
+  trace_path = path;
+  gnufdisk_trace_enabled = 1;
+
+  return 0;
+}
+
+static void __attribute__((constructor)) trace_init(void)
+{
+  const char* path;
+
+  if((path = getenv("GNUFDISK_TRACE")) != NULL && *path != 0)
+    gnufdisk_trace_start(path);
+}
@@ -0,0 +1,62 @@
+/* GNU Fidsk (gnufdisk-debug), a library for debugging.
+ *
+ * Copyright (C) 2011 Free Software Foundation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA. */
+
+#ifndef GNUFDISK_TRACE_H_INCLUDED
+#define GNUFDISK_TRACE_H_INCLUDED
+
+#include <stdint.h>
+
+/* Layout of a trace file, shared by the writer in trace.c and by the
+ * gnufdisk-trace decoder. All fields are in host byte order: traces are
+ * meant to be decoded on the machine that produced them.
+ *
+ *   struct trace_file_header
+ *   nevents  x { uint32_t id; uint32_t length; char name[length]; }
+ *   nstrings x { uint64_t address; uint32_t length; char string[length]; }
+ *   nthreads x { struct trace_file_thread; struct trace_record[nrecords]; }
+ *
+ * Strings are the file names and format strings referenced by address
+ * from the records. */
+
+#define TRACE_FILE_MAGIC "GFDTRC01"
+
+struct trace_record {
+  uint64_t timestamp; /* CLOCK_MONOTONIC, nanoseconds */
+  uint32_t event;
+  int32_t line;
+  uint64_t file;
+  uint64_t args[3];
+};
+
+struct trace_file_header {
+  char magic[8];
+  uint32_t record_size;
+  uint32_t nevents;
+  uint32_t nstrings;
+  uint32_t nthreads;
+};
+
+struct trace_file_thread {
+  uint64_t thread;
+  uint64_t lost; /* records overwritten before the dump */
+  uint32_t nrecords;
+  uint32_t reserved;
+};
+
+#endif /* GNUFDISK_TRACE_H_INCLUDED */
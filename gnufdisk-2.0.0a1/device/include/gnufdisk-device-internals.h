@@ -24,6 +24,13 @@
 
 #include <gnufdisk-device.h>
 
+/* visible here so that the device library can wrap a struct gnufdisk_range
+ * on the stack instead of allocating a geometry */
+struct gnufdisk_geometry {
+  gnufdisk_integer start;
+  gnufdisk_integer end;
+};
+
 struct gnufdisk_device_operations;
 struct gnufdisk_disklabel_operations;
 struct gnufdisk_partition_operations;
@@ -51,6 +58,7 @@ struct gnufdisk_disklabel_operations
   void (*remove_partition)(void* _data, size_t _n);
   void (*set_parameter)(void* _data, struct gnufdisk_string* _name, const void* _pdata, size_t _psize);
   void (*get_parameter)(void* _data, struct gnufdisk_string* _name, void* _pdata, size_t _psize);
+  void (*snapshot)(void* _data, struct gnufdisk_partition_record** _records, size_t* _nrecords);
   void (*delete)(void* _data);
 };
 
@@ -68,6 +76,9 @@ struct gnufdisk_partition_operations
   void (*resize)(void* _data, struct gnufdisk_geometry* _e);
   int (*read)(void* _data, gnufdisk_integer _sector, void* _dest, size_t _size);
   int (*write)(void* _data, gnufdisk_integer _sector, const void* _src, size_t _size);
+  gnufdisk_integer (*seek_data)(void* _data, gnufdisk_integer _sector, int _whence);
+  void (*zero)(void* _data, gnufdisk_integer _sector, gnufdisk_integer _count);
+  gnufdisk_integer (*pread)(void* _data, gnufdisk_integer _sector, void* _dest, size_t _size);
   void (*delete)(void* _data);
 };
 
@@ -31,6 +31,55 @@ struct gnufdisk_chs {
   gnufdisk_integer sector;
 };
 
+/* a geometry passed by value, START and END have the same meaning as in
+ * struct gnufdisk_geometry. Ranges are never allocated and never throw. */
+struct gnufdisk_range {
+  gnufdisk_integer start;
+  gnufdisk_integer end;
+};
+
+/* BLAKE3 digest of a partition, see gnufdisk_partition_digest() */
+#define GNUFDISK_DIGEST_SIZE 32
+
+struct gnufdisk_digest {
+  gnufdisk_integer chunk_size; /* bytes, the last chunk may be shorter */
+  size_t nchunks;
+  unsigned char root[GNUFDISK_DIGEST_SIZE]; /* same as b3sum of the partition */
+  unsigned char (*chunks)[GNUFDISK_DIGEST_SIZE]; /* chaining value of each chunk */
+};
+
+/* partition types and flags of struct gnufdisk_partition_record */
+enum gnufdisk_partition_type_id {
+  GNUFDISK_PARTITION_TYPE_UNKNOWN,
+  GNUFDISK_PARTITION_TYPE_PRIMARY,
+  GNUFDISK_PARTITION_TYPE_EXTENDED,
+  GNUFDISK_PARTITION_TYPE_EXTENDED_LBA,
+  GNUFDISK_PARTITION_TYPE_LOGICAL,
+  GNUFDISK_PARTITION_TYPE_GUID
+};
+
+#define GNUFDISK_PARTITION_HAVE_DISKLABEL 0x0001
+#define GNUFDISK_PARTITION_HAVE_GUID 0x0002 /* GPT unique partition GUID */
+
+/* size of the content name: "ext4", "swap", "crypto_LUKS"... as blkid calls it */
+#define GNUFDISK_PARTITION_CONTENT_SIZE 24
+
+/* one partition of a disklabel snapshot, see gnufdisk_disklabel_snapshot() */
+struct gnufdisk_partition_record {
+  gnufdisk_integer start;
+  gnufdisk_integer length;
+  int number;
+  unsigned short type; /* enum gnufdisk_partition_type_id */
+  unsigned short flags;
+  unsigned char guid[16];
+  char content[GNUFDISK_PARTITION_CONTENT_SIZE]; /* empty when not recognized */
+};
+
+struct gnufdisk_disklabel_snapshot {
+  size_t nrecords;
+  struct gnufdisk_partition_record* records; /* contiguous, in disklabel order */
+};
+
 struct gnufdisk_partition;
 struct gnufdisk_label;
 struct gnufdisk_device;
@@ -50,6 +99,11 @@ struct gnufdisk_chs gnufdisk_geometry_end_chs(struct gnufdisk_geometry*);
 gnufdisk_integer gnufdisk_geometry_length(struct gnufdisk_geometry*);
 struct gnufdisk_chs gnufdisk_geometry_length_chs(struct gnufdisk_geometry*);
 void gnufdisk_geometry_delete(struct gnufdisk_geometry* _g);
+struct gnufdisk_geometry* gnufdisk_geometry_new_range(struct gnufdisk_range _r);
+struct gnufdisk_range gnufdisk_geometry_range(struct gnufdisk_geometry* _g);
+
+struct gnufdisk_range gnufdisk_range_make(gnufdisk_integer _start, gnufdisk_integer _length);
+gnufdisk_integer gnufdisk_range_length(struct gnufdisk_range _r);
 
 struct gnufdisk_device* gnufdisk_device_new(struct gnufdisk_string* _module, 
                                             struct gnufdisk_string* _options);
@@ -73,6 +127,10 @@ struct gnufdisk_partition* gnufdisk_disklabel_create_partition(struct gnufdisk_d
 							       struct gnufdisk_geometry* _s,
 							       struct gnufdisk_geometry* _e,
 							       struct gnufdisk_string* _type);
+struct gnufdisk_partition* gnufdisk_disklabel_create_partition_range(struct gnufdisk_disklabel* _d,
+								     struct gnufdisk_range _s,
+								     struct gnufdisk_range _e,
+								     struct gnufdisk_string* _type);
 void gnufdisk_disklabel_remove_partition(struct gnufdisk_disklabel* _d, size_t _n);
 void gnufdisk_disklabel_set_parameter(struct gnufdisk_disklabel* _d,
 				      struct gnufdisk_string* _parameter,
@@ -83,6 +141,9 @@ void gnufdisk_disklabel_get_parameter(struct gnufdisk_disklabel* _d,
 				      void* _data,
 				      size_t _size);
 
+struct gnufdisk_disklabel_snapshot* gnufdisk_disklabel_snapshot(struct gnufdisk_disklabel* _d);
+void gnufdisk_disklabel_snapshot_delete(struct gnufdisk_disklabel_snapshot* _s);
+
 void gnufdisk_partition_ref(struct gnufdisk_partition* _p);
 void gnufdisk_partition_delete(struct gnufdisk_partition* _p);
 void gnufdisk_partition_set_parameter(struct gnufdisk_partition* _p,
@@ -96,6 +157,7 @@ void gnufdisk_partition_get_parameter(struct gnufdisk_partition* _p,
 struct gnufdisk_string* gnufdisk_partition_type(struct gnufdisk_partition* _p);
 gnufdisk_integer gnufdisk_partition_start(struct gnufdisk_partition* _p);
 gnufdisk_integer gnufdisk_partition_length(struct gnufdisk_partition* _p);
+struct gnufdisk_range gnufdisk_partition_range(struct gnufdisk_partition* _p);
 int gnufdisk_partition_have_disklabel(struct gnufdisk_partition* _p);
 struct gnufdisk_disklabel * gnufdisk_partition_disklabel (struct gnufdisk_partition *_p);
 int gnufdisk_partition_number(struct gnufdisk_partition* _p);
@@ -103,6 +165,10 @@ void gnufdisk_partition_move(struct gnufdisk_partition* _p,
 			     struct gnufdisk_geometry* _g);
 void gnufdisk_partition_resize(struct gnufdisk_partition* _p,
 			       struct gnufdisk_geometry* _e);
+void gnufdisk_partition_move_range(struct gnufdisk_partition* _p,
+				   struct gnufdisk_range _g);
+void gnufdisk_partition_resize_range(struct gnufdisk_partition* _p,
+				     struct gnufdisk_range _e);
 int gnufdisk_partition_read(struct gnufdisk_partition* _p,
 			    gnufdisk_integer _sector,
 			    void* _dest,
@@ -111,6 +177,24 @@ int gnufdisk_partition_write(struct gnufdisk_partition* _p,
 			     gnufdisk_integer _sector,
 			     const void* _data,
 			     size_t _size);
+gnufdisk_integer gnufdisk_partition_seek_data(struct gnufdisk_partition* _p,
+					     gnufdisk_integer _sector,
+					     int _whence);
+void gnufdisk_partition_zero(struct gnufdisk_partition* _p,
+			     gnufdisk_integer _sector,
+			     gnufdisk_integer _count);
+void gnufdisk_partition_export(struct gnufdisk_partition* _p,
+			       struct gnufdisk_string* _path);
+void gnufdisk_partition_import(struct gnufdisk_partition* _p,
+			       struct gnufdisk_string* _path);
+gnufdisk_integer gnufdisk_partition_pread(struct gnufdisk_partition* _p,
+					 gnufdisk_integer _sector,
+					 void* _dest,
+					 size_t _size);
+struct gnufdisk_digest* gnufdisk_partition_digest(struct gnufdisk_partition* _p,
+						  gnufdisk_integer _chunk_size,
+						  int _threads);
+void gnufdisk_digest_delete(struct gnufdisk_digest* _d);
 
 enum gnufdisk_device_error {
   GNUFDISK_DEVICE_EMODULEPOINTER = 1000,
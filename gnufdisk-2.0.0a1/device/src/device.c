@@ -24,6 +24,7 @@
 #include <unistd.h>
 #include <limits.h>
 #include <dlfcn.h>
+#include <pthread.h>
 
 #include <gnufdisk-debug.h>
 #include <gnufdisk-exception.h>
@@ -40,9 +41,29 @@ gnufdisk_device_internals__allocate_disklabel (struct gnufdisk_device *_dev,
 extern void gnufdisk_device_internals__disklabel_set_device (struct gnufdisk_disklabel *_d,
 							     struct gnufdisk_device *_dev);
 
-struct gnufdisk_device
+typedef void (*module_register_t) (struct gnufdisk_string * _options,
+				   struct gnufdisk_device_operations * _operations,
+				   void **_private_data);
+
+/* Loaded modules, keyed by name. The first device of a module pays for
+ * dlopen and the module_register lookup; later devices share the entry.
+ * An entry whose last device is gone stays loaded for the next one and
+ * is closed at exit. */
+struct device_module
 {
+  struct device_module *next;
+  char *name;
   void *handle;
+  module_register_t reg;
+  int nref;
+};
+
+static struct device_module *modules = NULL;
+static pthread_mutex_t modules_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct gnufdisk_device
+{
+  struct device_module *module;
   struct gnufdisk_device_operations operations;
   void *implementation_data;
   int is_open;
@@ -65,9 +86,9 @@ check_device (struct gnufdisk_device **_dev)
 		      GNUFDISK_DEVICE_EDEVICEPOINTER, &data,
 		      "invalid struct gnufdisk_device* %p", *_dev);
     }
-  else if (gnufdisk_check_memory((*_dev)->handle, 1, 1) != 0)
+  else if (gnufdisk_check_memory((*_dev)->module, sizeof (struct device_module), 1) != 0)
     {
-      (*_dev)->handle = NULL;
+      (*_dev)->module = NULL;
 
       GNUFDISK_THROW (0, NULL, GNUFDISK_DEVICE_EDEVICE, NULL,
 		      "device is not associated with a valid module");
@@ -106,23 +127,112 @@ free_pointer (void *_p)
 }
 
 static void
-close_dlhandle (void *_p)
+modules_atexit (void)
+{
+  struct device_module *iter;
+
+  /* the trace dump may run after us and reads the file names and log
+     strings of its records out of the modules: leave them mapped */
+  if (gnufdisk_trace_enabled)
+    return;
+
+  pthread_mutex_lock (&modules_mutex);
+
+  for (iter = modules; iter != NULL; iter = iter->next)
+    if (iter->nref == 0 && iter->handle != NULL)
+      {
+	GNUFDISK_LOG ((DEVICE, "close module `%s'", iter->name));
+	dlclose (iter->handle);
+	iter->handle = NULL;
+      }
+
+  pthread_mutex_unlock (&modules_mutex);
+}
+
+/* return a referenced entry for _name, or NULL with the reason in _error */
+static struct device_module *
+module_get (const char *_name, char *_error, size_t _size)
+{
+  struct device_module *ret;
+  char library[PATH_MAX];
+  void *handle;
+  module_register_t reg;
+
+  pthread_mutex_lock (&modules_mutex);
+
+  for (ret = modules; ret != NULL; ret = ret->next)
+    if (strcmp (ret->name, _name) == 0)
+      {
+	ret->nref++;
+	goto lb_out;
+      }
+
+  snprintf (library, sizeof (library), "%s.so", _name);
+
+  GNUFDISK_LOG ((DEVICE, "open module `%s'", library));
+
+  if ((handle = dlopen (library, RTLD_NOW)) == NULL)
+    {
+      snprintf (_error, _size, "cannot open module: %s", dlerror ());
+      goto lb_out;
+    }
+  else if ((reg = (module_register_t) dlsym (handle, "module_register")) == NULL)
+    {
+      snprintf (_error, _size, "error register module `%s': %s", library, dlerror ());
+      dlclose (handle);
+      goto lb_out;
+    }
+
+  if ((ret = malloc (sizeof (struct device_module))) == NULL
+      || (ret->name = strdup (_name)) == NULL)
+    {
+      snprintf (_error, _size, "cannot allocate memory");
+      free (ret);
+      ret = NULL;
+      dlclose (handle);
+      goto lb_out;
+    }
+
+  if (modules == NULL)
+    atexit (&modules_atexit);
+
+  ret->handle = handle;
+  ret->reg = reg;
+  ret->nref = 1;
+  ret->next = modules;
+  modules = ret;
+
+lb_out:
+
+  pthread_mutex_unlock (&modules_mutex);
+
+  return ret;
+}
+
+static void
+module_put (void *_p)
 {
-  GNUFDISK_LOG ((DEVICE, "close dlhandle %p", _p));
-  dlclose (_p);
+  struct device_module *module;
+
+  module = _p;
+
+  pthread_mutex_lock (&modules_mutex);
+
+  module->nref--;
+
+  GNUFDISK_LOG ((DEVICE, "module `%s' has now %d references", module->name, module->nref));
+
+  pthread_mutex_unlock (&modules_mutex);
 }
 
 struct gnufdisk_device *
 gnufdisk_device_new (struct gnufdisk_string *_module, struct gnufdisk_string *_options)
 {
-  char library[PATH_MAX];
+  char error[PATH_MAX + 128];
 
   GNUFDISK_RETRY rp0;
 
   struct gnufdisk_device *dev;
-  void (*reg) (struct gnufdisk_string * _options,
-	       struct gnufdisk_device_operations * _operations,
-	       void **_private_data);
 
   if((dev = malloc (sizeof (struct gnufdisk_device))) == NULL)
     GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOMEM, NULL, "cannot allocate memory");
@@ -144,45 +254,28 @@ gnufdisk_device_new (struct gnufdisk_string *_module, struct gnufdisk_string *_o
 		      &data, "invalid struct gnufdisk_string* %p", _module);
     }
 
-  snprintf (library, sizeof (library), "%s.so",
-	    gnufdisk_string_c_string (_module));
-
-  GNUFDISK_LOG ((DEVICE, "open module `%s'", library));
-
-  if ((dev->handle = dlopen (library, RTLD_NOW)) == NULL)
-    {
-      union gnufdisk_device_exception_data data;
-
-      data.emodule = _module;
-
-      GNUFDISK_THROW (GNUFDISK_EXCEPTION_ALL, &rp0, GNUFDISK_DEVICE_EMODULE,
-		      &data, "cannot open module: %s", dlerror ());
-    }
-  else if ((reg = dlsym (dev->handle, "module_register")) == NULL)
+  if ((dev->module = module_get (gnufdisk_string_c_string (_module),
+				  error, sizeof (error))) == NULL)
     {
       union gnufdisk_device_exception_data data;
 
-      dlclose (dev->handle);	/* close module */
-      dev->handle = NULL;
-
       data.emodule = _module;
 
       GNUFDISK_THROW (GNUFDISK_EXCEPTION_ALL, &rp0, GNUFDISK_DEVICE_EMODULE,
-		      &data, "error register module `%s': %s", library,
-		      dlerror ());
+		      &data, "%s", error);
     }
 
-  /* so if `reg' throw an exception handle is closed */
-  if(gnufdisk_exception_register_unwind_handler (&close_dlhandle, dev->handle) != 0)
+  /* so if `reg' throw an exception the reference is released */
+  if(gnufdisk_exception_register_unwind_handler (&module_put, dev->module) != 0)
     GNUFDISK_WARNING("gnufdisk_exception_register_unwind_handler failed. Missing GNUFDISK_TRY?");
 
-  (*reg) (_options, &dev->operations, &dev->implementation_data);
+  (*dev->module->reg) (_options, &dev->operations, &dev->implementation_data);
 
   dev->nref = 1;
 
   GNUFDISK_LOG ((DEVICE, "new struct gnufdisk_device* %p", dev));
 
-  if(gnufdisk_exception_unregister_unwind_handler(&close_dlhandle, dev->handle) != 0)
+  if(gnufdisk_exception_unregister_unwind_handler(&module_put, dev->module) != 0)
     GNUFDISK_WARNING("gnufdisk_exception_unregister_unwind_handler failed. Missing GNUFDISK_TRY?");
 
   if(gnufdisk_exception_unregister_unwind_handler(&free_pointer, dev) != 0)
@@ -210,10 +303,10 @@ gnufdisk_device_delete (struct gnufdisk_device *_d)
 	  (*_d->operations.delete) (data);
 	}
 
-      if (_d->handle)
+      if (_d->module)
 	{
-	  dlclose (_d->handle);
-	  _d->handle = NULL;
+	  module_put (_d->module);
+	  _d->module = NULL;
 	}
 
       free (_d);
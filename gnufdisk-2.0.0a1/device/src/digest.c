@@ -0,0 +1,555 @@
+/* GNU fdisk, (gnufdisk-device) a library to manage a device
+ * Copyright (C) 2011 Free Software Foundation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA. */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <gnufdisk-common.h>
+#include <gnufdisk-debug.h>
+#include <gnufdisk-exception.h>
+#include <gnufdisk-device.h>
+#include <gnufdisk-device-internals.h>
+
+struct gnufdisk_device*
+gnufdisk_device_internals__partition_get_device(struct gnufdisk_partition* _p);
+
+#define DIGEST 1
+
+/* The partition is hashed with BLAKE3, so the root equals the output of
+ * b3sum over the partition content. Chunks are whole BLAKE3 subtrees
+ * (a power of two of 1 KiB leaves): each worker reduces a chunk to its
+ * chaining value, the chunk digest, and the main thread folds the chunk
+ * digests into the root. Digests of two partitions taken with the same
+ * chunk size can be compared chunk by chunk. */
+#define DIGEST_DEFAULT_CHUNK_SIZE 4194304
+#define DIGEST_MAX_THREADS 64
+
+/* BLAKE3 */
+
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_MAX_DEPTH 54
+
+enum {
+  BLAKE3_CHUNK_START = 1 << 0,
+  BLAKE3_CHUNK_END = 1 << 1,
+  BLAKE3_PARENT = 1 << 2,
+  BLAKE3_ROOT = 1 << 3
+};
+
+static const uint32_t blake3_iv[8] = {
+  0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+  0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const uint8_t blake3_schedule[7][16] = {
+  {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+  {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+  {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+  {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+  {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+  {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+  {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13}
+};
+
+/* the last compression of a node, kept open until we know whether the
+ * node is the root */
+struct blake3_output {
+  uint32_t cv[8];
+  uint32_t block[16];
+  uint64_t counter;
+  uint32_t length;
+  uint32_t flags;
+};
+
+static inline uint32_t rotr32(uint32_t _w, int _c)
+{
+  return (_w >> _c) | (_w << (32 - _c));
+}
+
+static inline uint32_t load32(const unsigned char* _p)
+{
+  return (uint32_t) _p[0] | ((uint32_t) _p[1] << 8) | ((uint32_t) _p[2] << 16) | ((uint32_t) _p[3] << 24);
+}
+
+static inline void store32(unsigned char* _p, uint32_t _w)
+{
+  _p[0] = _w;
+  _p[1] = _w >> 8;
+  _p[2] = _w >> 16;
+  _p[3] = _w >> 24;
+}
+
+#define G(_s, _a, _b, _c, _d, _x, _y)                 \
+  do {                                                \
+    _s[_a] = _s[_a] + _s[_b] + (_x);                  \
+    _s[_d] = rotr32(_s[_d] ^ _s[_a], 16);             \
+    _s[_c] = _s[_c] + _s[_d];                         \
+    _s[_b] = rotr32(_s[_b] ^ _s[_c], 12);             \
+    _s[_a] = _s[_a] + _s[_b] + (_y);                  \
+    _s[_d] = rotr32(_s[_d] ^ _s[_a], 8);              \
+    _s[_c] = _s[_c] + _s[_d];                         \
+    _s[_b] = rotr32(_s[_b] ^ _s[_c], 7);              \
+  } while(0)
+
+static void blake3_compress(const uint32_t _cv[8],
+			    const uint32_t _block[16],
+			    uint64_t _counter,
+			    uint32_t _length,
+			    uint32_t _flags,
+			    uint32_t _out[16])
+{
+  uint32_t s[16];
+  int round;
+  int iter;
+
+  memcpy(s, _cv, 8 * sizeof(uint32_t));
+  memcpy(s + 8, blake3_iv, 4 * sizeof(uint32_t));
+
+  s[12] = (uint32_t) _counter;
+  s[13] = (uint32_t) (_counter >> 32);
+  s[14] = _length;
+  s[15] = _flags;
+
+  for(round = 0; round < 7; round++)
+    {
+      const uint8_t* m;
+
+      m = blake3_schedule[round];
+
+      G(s, 0, 4, 8, 12, _block[m[0]], _block[m[1]]);
+      G(s, 1, 5, 9, 13, _block[m[2]], _block[m[3]]);
+      G(s, 2, 6, 10, 14, _block[m[4]], _block[m[5]]);
+      G(s, 3, 7, 11, 15, _block[m[6]], _block[m[7]]);
+      G(s, 0, 5, 10, 15, _block[m[8]], _block[m[9]]);
+      G(s, 1, 6, 11, 12, _block[m[10]], _block[m[11]]);
+      G(s, 2, 7, 8, 13, _block[m[12]], _block[m[13]]);
+      G(s, 3, 4, 9, 14, _block[m[14]], _block[m[15]]);
+    }
+
+  for(iter = 0; iter < 8; iter++)
+    {
+      _out[iter] = s[iter] ^ s[iter + 8];
+      _out[iter + 8] = s[iter + 8] ^ _cv[iter];
+    }
+}
+
+static void blake3_output_cv(const struct blake3_output* _o, uint32_t _cv[8])
+{
+  uint32_t out[16];
+
+  blake3_compress(_o->cv, _o->block, _o->counter, _o->length, _o->flags, out);
+  memcpy(_cv, out, 8 * sizeof(uint32_t));
+}
+
+static void blake3_output_root(const struct blake3_output* _o, unsigned char _dest[GNUFDISK_DIGEST_SIZE])
+{
+  uint32_t out[16];
+  int iter;
+
+  blake3_compress(_o->cv, _o->block, 0, _o->length, _o->flags | BLAKE3_ROOT, out);
+
+  for(iter = 0; iter < 8; iter++)
+    store32(_dest + 4 * iter, out[iter]);
+}
+
+static void blake3_parent(const uint32_t _left[8], const uint32_t _right[8], struct blake3_output* _dest)
+{
+  memcpy(_dest->cv, blake3_iv, sizeof(blake3_iv));
+  memcpy(_dest->block, _left, 8 * sizeof(uint32_t));
+  memcpy(_dest->block + 8, _right, 8 * sizeof(uint32_t));
+  _dest->counter = 0;
+  _dest->length = BLAKE3_BLOCK_LEN;
+  _dest->flags = BLAKE3_PARENT;
+}
+
+/* one 1 KiB leaf, _size may be shorter only for the last leaf of the input */
+static void blake3_leaf(const unsigned char* _data, size_t _size, uint64_t _counter, struct blake3_output* _dest)
+{
+  uint32_t cv[8];
+  size_t nblocks;
+  size_t block;
+
+  memcpy(cv, blake3_iv, sizeof(blake3_iv));
+
+  nblocks = _size > 0 ? (_size + BLAKE3_BLOCK_LEN - 1) / BLAKE3_BLOCK_LEN : 1;
+
+  for(block = 0; block < nblocks; block++)
+    {
+      unsigned char buf[BLAKE3_BLOCK_LEN];
+      uint32_t words[16];
+      uint32_t flags;
+      size_t length;
+      int iter;
+
+      length = _size - block * BLAKE3_BLOCK_LEN;
+
+      if(length > BLAKE3_BLOCK_LEN)
+	length = BLAKE3_BLOCK_LEN;
+
+      memset(buf, 0, sizeof(buf));
+      memcpy(buf, _data + block * BLAKE3_BLOCK_LEN, length);
+
+      for(iter = 0; iter < 16; iter++)
+	words[iter] = load32(buf + 4 * iter);
+
+      flags = (block == 0 ? BLAKE3_CHUNK_START : 0) | (block == nblocks - 1 ? BLAKE3_CHUNK_END : 0);
+
+      if(block == nblocks - 1)
+	{
+	  memcpy(_dest->cv, cv, sizeof(cv));
+	  memcpy(_dest->block, words, sizeof(words));
+	  _dest->counter = _counter;
+	  _dest->length = length;
+	  _dest->flags = flags;
+	}
+      else
+	{
+	  uint32_t out[16];
+
+	  blake3_compress(cv, words, _counter, BLAKE3_BLOCK_LEN, flags, out);
+	  memcpy(cv, out, sizeof(cv));
+	}
+    }
+}
+
+/* Push the chaining value of the _count-th complete subtree (counted from
+ * one) and merge every pair of subtrees of the same size. */
+static void blake3_push(uint32_t _stack[][8], size_t* _depth, const uint32_t _cv[8], uint64_t _count)
+{
+  uint32_t cv[8];
+
+  memcpy(cv, _cv, sizeof(cv));
+
+  for(; (_count & 1) == 0; _count >>= 1)
+    {
+      struct blake3_output parent;
+
+      blake3_parent(_stack[--*_depth], cv, &parent);
+      blake3_output_cv(&parent, cv);
+    }
+
+  memcpy(_stack[(*_depth)++], cv, sizeof(cv));
+}
+
+/* fold the stack into the last node: the result is the root node when the
+ * stack describes the whole input */
+static void blake3_fold(uint32_t _stack[][8], size_t _depth, struct blake3_output* _output)
+{
+  while(_depth > 0)
+    {
+      uint32_t cv[8];
+
+      blake3_output_cv(_output, cv);
+      blake3_parent(_stack[--_depth], cv, _output);
+    }
+}
+
+/* the partition */
+
+struct digest_job {
+  struct gnufdisk_partition* partition;
+  gnufdisk_integer sector_size;
+  gnufdisk_integer length; /* partition sectors */
+  gnufdisk_integer chunk_sectors;
+  size_t nchunks;
+  size_t next; /* next chunk to hash, shared by the workers */
+  struct gnufdisk_digest* digest;
+  struct blake3_output last; /* open node of the last chunk */
+  int failed;
+  char error[256];
+  pthread_mutex_t mutex; /* protect error */
+};
+
+static void digest_chunk(struct digest_job* _job, size_t _index, unsigned char* _buf)
+{
+  uint32_t stack[BLAKE3_MAX_DEPTH][8];
+  struct blake3_output output;
+  gnufdisk_integer sectors;
+  uint64_t counter;
+  size_t depth;
+  size_t size;
+  size_t leaf;
+  size_t nleaves;
+
+  sectors = _job->length - _index * _job->chunk_sectors;
+
+  if(sectors > _job->chunk_sectors)
+    sectors = _job->chunk_sectors;
+
+  size = sectors * _job->sector_size;
+
+  if(gnufdisk_partition_pread(_job->partition, _index * _job->chunk_sectors, _buf, size) != (gnufdisk_integer) size)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL,
+		   "can not read %zu bytes at sector %" PRId64 ": %s",
+		   size, (gnufdisk_integer) (_index * _job->chunk_sectors), strerror(errno));
+
+  counter = (uint64_t) _index * (_job->chunk_sectors * _job->sector_size / BLAKE3_CHUNK_LEN);
+  nleaves = (size + BLAKE3_CHUNK_LEN - 1) / BLAKE3_CHUNK_LEN;
+  depth = 0;
+
+  for(leaf = 0; leaf < nleaves; leaf++)
+    {
+      size_t length;
+
+      length = size - leaf * BLAKE3_CHUNK_LEN;
+
+      if(length > BLAKE3_CHUNK_LEN)
+	length = BLAKE3_CHUNK_LEN;
+
+      blake3_leaf(_buf + leaf * BLAKE3_CHUNK_LEN, length, counter + leaf, &output);
+
+      if(leaf < nleaves - 1)
+	{
+	  uint32_t cv[8];
+
+	  blake3_output_cv(&output, cv);
+	  blake3_push(stack, &depth, cv, leaf + 1);
+	}
+    }
+
+  blake3_fold(stack, depth, &output);
+
+  if(_index == _job->nchunks - 1)
+    memcpy(&_job->last, &output, sizeof(output));
+
+  {
+    uint32_t cv[8];
+    int iter;
+
+    blake3_output_cv(&output, cv);
+
+    for(iter = 0; iter < 8; iter++)
+      store32(_job->digest->chunks[_index] + 4 * iter, cv[iter]);
+  }
+}
+
+static void* digest_worker(void* _job)
+{
+  struct digest_job* job;
+  unsigned char* buf;
+
+  job = _job;
+
+  if(posix_memalign((void**) &buf, 4096, job->chunk_sectors * job->sector_size) != 0)
+    {
+      pthread_mutex_lock(&job->mutex);
+
+      if(!job->failed)
+	snprintf(job->error, sizeof(job->error), "can not allocate memory");
+
+      job->failed = 1;
+      pthread_mutex_unlock(&job->mutex);
+
+      return NULL;
+    }
+
+  GNUFDISK_TRY(NULL, NULL)
+    {
+      size_t index;
+
+      while(!__atomic_load_n(&job->failed, __ATOMIC_RELAXED)
+	    && (index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nchunks)
+	digest_chunk(job, index, buf);
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      GNUFDISK_LOG((DIGEST, "caught an exception from %s:%d: %s",
+		    exception_info.file, exception_info.line, exception_info.message));
+
+      pthread_mutex_lock(&job->mutex);
+
+      if(!job->failed)
+	snprintf(job->error, sizeof(job->error), "%s", exception_info.message);
+
+      __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&job->mutex);
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  free(buf);
+
+  return NULL;
+}
+
+static void delete_string(void* _p)
+{
+  gnufdisk_string_delete(_p);
+}
+
+static void delete_digest(void* _p)
+{
+  gnufdisk_digest_delete(_p);
+}
+
+static gnufdisk_integer partition_sector_size(struct gnufdisk_partition* _p)
+{
+  struct gnufdisk_device* device;
+  struct gnufdisk_string* param;
+  gnufdisk_integer ret;
+
+  device = gnufdisk_device_internals__partition_get_device(_p);
+
+  if((param = gnufdisk_string_new("SECTOR-SIZE")) == NULL)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOMEM, NULL, "can not allocate memory");
+
+  gnufdisk_exception_register_unwind_handler(&delete_string, param);
+
+  gnufdisk_device_get_parameter(device, param, &ret, sizeof(gnufdisk_integer));
+
+  gnufdisk_exception_unregister_unwind_handler(&delete_string, param);
+  gnufdisk_string_delete(param);
+
+  if(ret <= 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ESECTORSIZE, NULL, "invalid sector size %" PRId64, ret);
+
+  return ret;
+}
+
+struct gnufdisk_digest* gnufdisk_partition_digest(struct gnufdisk_partition* _p,
+						  gnufdisk_integer _chunk_size,
+						  int _threads)
+{
+  struct digest_job job;
+  struct gnufdisk_digest* ret;
+  pthread_t threads[DIGEST_MAX_THREADS];
+  uint32_t stack[BLAKE3_MAX_DEPTH][8];
+  size_t depth;
+  size_t index;
+  int nthreads;
+  int iter;
+
+  GNUFDISK_LOG((DIGEST, "perform digest on struct gnufdisk_partition* %p", _p));
+
+  memset(&job, 0, sizeof(job));
+
+  job.partition = _p;
+  job.length = gnufdisk_partition_length(_p);
+  job.sector_size = partition_sector_size(_p);
+
+  if(_chunk_size == 0)
+    _chunk_size = DIGEST_DEFAULT_CHUNK_SIZE;
+
+  /* a chunk must be a whole BLAKE3 subtree made of whole sectors */
+  if(_chunk_size < BLAKE3_CHUNK_LEN
+     || (_chunk_size & (_chunk_size - 1)) != 0
+     || _chunk_size % job.sector_size != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL,
+		   "invalid chunk size %" PRId64 ": must be a power of two multiple of 1024 and of the sector size",
+		   _chunk_size);
+
+  job.chunk_sectors = _chunk_size / job.sector_size;
+  job.nchunks = (job.length + job.chunk_sectors - 1) / job.chunk_sectors;
+
+  if((ret = malloc(sizeof(struct gnufdisk_digest))) == NULL)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOMEM, NULL, "can not allocate memory");
+
+  memset(ret, 0, sizeof(struct gnufdisk_digest));
+
+  gnufdisk_exception_register_unwind_handler(&delete_digest, ret);
+
+  ret->chunk_size = _chunk_size;
+  ret->nchunks = job.nchunks;
+
+  if(job.nchunks > 0
+     && (ret->chunks = malloc(job.nchunks * GNUFDISK_DIGEST_SIZE)) == NULL)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOMEM, NULL, "can not allocate memory");
+
+  job.digest = ret;
+
+  if(_threads <= 0
+     && (_threads = sysconf(_SC_NPROCESSORS_ONLN)) <= 0)
+    _threads = 1;
+
+  if(_threads > DIGEST_MAX_THREADS)
+    _threads = DIGEST_MAX_THREADS;
+
+  if((size_t) _threads > job.nchunks)
+    _threads = job.nchunks;
+
+  GNUFDISK_LOG((DIGEST, "%" PRId64 " sectors of %" PRId64 " bytes, %zu chunks, %d threads",
+		job.length, job.sector_size, job.nchunks, _threads));
+
+  pthread_mutex_init(&job.mutex, NULL);
+
+  /* the calling thread is a worker too */
+  for(nthreads = 0; nthreads < _threads - 1; nthreads++)
+    {
+      int err;
+
+      if((err = pthread_create(&threads[nthreads], NULL, &digest_worker, &job)) != 0)
+	{
+	  GNUFDISK_LOG((DIGEST, "can not start worker %d: %s", nthreads, strerror(err)));
+	  break;
+	}
+    }
+
+  if(job.nchunks > 0)
+    digest_worker(&job);
+
+  for(iter = 0; iter < nthreads; iter++)
+    pthread_join(threads[iter], NULL);
+
+  pthread_mutex_destroy(&job.mutex);
+
+  if(job.failed)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "%s", job.error);
+
+  if(job.nchunks == 0)
+    blake3_leaf((const unsigned char*) "", 0, 0, &job.last);
+
+  depth = 0;
+
+  for(index = 0; index + 1 < job.nchunks; index++)
+    {
+      uint32_t cv[8];
+      int word;
+
+      for(word = 0; word < 8; word++)
+	cv[word] = load32(ret->chunks[index] + 4 * word);
+
+      blake3_push(stack, &depth, cv, index + 1);
+    }
+
+  blake3_fold(stack, depth, &job.last);
+  blake3_output_root(&job.last, ret->root);
+
+  gnufdisk_exception_unregister_unwind_handler(&delete_digest, ret);
+
+  GNUFDISK_LOG((DIGEST, "done perform digest, result: %p", ret));
+
+  return ret;
+}
+
+void gnufdisk_digest_delete(struct gnufdisk_digest* _d)
+{
+  GNUFDISK_LOG((DIGEST, "delete struct gnufdisk_digest* %p", _d));
+
+  if(_d->chunks)
+    free(_d->chunks);
+
+  free(_d);
+}
@@ -298,6 +298,22 @@ struct gnufdisk_partition* gnufdisk_disklabel_create_partition(struct gnufdisk_d
   return gnufdisk_device_internals__allocate_partition(_d, &operations, implementation_data);
 }
 
+struct gnufdisk_partition* gnufdisk_disklabel_create_partition_range(struct gnufdisk_disklabel* _d,
+								     struct gnufdisk_range _s,
+								     struct gnufdisk_range _e,
+								     struct gnufdisk_string* _type)
+{
+  struct gnufdisk_geometry s;
+  struct gnufdisk_geometry e;
+
+  s.start = _s.start;
+  s.end = _s.end;
+  e.start = _e.start;
+  e.end = _e.end;
+
+  return gnufdisk_disklabel_create_partition(_d, &s, &e, _type);
+}
+
 
 void gnufdisk_disklabel_remove_partition(struct gnufdisk_disklabel* _d, size_t _n)
 {
@@ -326,6 +342,41 @@ void gnufdisk_disklabel_set_parameter(struct gnufdisk_disklabel* _d,
   (*_d->operations.set_parameter)(_d->implementation_data, _parameter, _data, _size);
 }
 
+struct gnufdisk_disklabel_snapshot* gnufdisk_disklabel_snapshot(struct gnufdisk_disklabel* _d)
+{
+  struct gnufdisk_disklabel_snapshot* ret;
+
+  check_disklabel(&_d);
+
+  if(_d->operations.snapshot == NULL)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOTSUP, NULL, "operation not supported `snapshot'");
+
+  if((ret = malloc(sizeof(struct gnufdisk_disklabel_snapshot))) == NULL)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOMEM, NULL, "cannot allocate memory");
+
+  if(gnufdisk_exception_register_unwind_handler (&free_pointer, ret) != 0)
+    GNUFDISK_WARNING("gnufdisk_exception_register_unwind_handler failed. Missing GNUFDISK_TRY?");
+
+  memset(ret, 0, sizeof(struct gnufdisk_disklabel_snapshot));
+
+  (*_d->operations.snapshot)(_d->implementation_data, &ret->records, &ret->nrecords);
+
+  if(gnufdisk_exception_unregister_unwind_handler (&free_pointer, ret) != 0)
+    GNUFDISK_WARNING("gnufdisk_exception_unregister_unwind_handler failed. Missing GNUFDISK_TRY?");
+
+  return ret;
+}
+
+void gnufdisk_disklabel_snapshot_delete(struct gnufdisk_disklabel_snapshot* _s)
+{
+  GNUFDISK_LOG((DISKLABEL, "delete struct gnufdisk_disklabel_snapshot* %p", _s));
+
+  if(_s->records)
+    free(_s->records);
+
+  free(_s);
+}
+
 void gnufdisk_disklabel_get_parameter(struct gnufdisk_disklabel* _d,
 				      struct gnufdisk_string* _parameter,
 				      void* _data,
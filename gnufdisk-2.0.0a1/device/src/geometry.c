@@ -22,14 +22,10 @@
 #include <gnufdisk-debug.h>
 #include <gnufdisk-exception.h>
 #include <gnufdisk-device.h>
+#include <gnufdisk-device-internals.h>
 
 #define GEOMETRY (getenv("GNUFDISK_GEOMETRY") != NULL)
 
-struct gnufdisk_geometry {
-  gnufdisk_integer start;
-  gnufdisk_integer end;
-};
-
 static void
 check_geometry (struct gnufdisk_geometry **_g)
 {
@@ -156,3 +152,46 @@ gnufdisk_geometry_delete (struct gnufdisk_geometry *_g)
   free (_g);
 }
 
+
+struct gnufdisk_geometry *
+gnufdisk_geometry_new_range (struct gnufdisk_range _r)
+{
+  struct gnufdisk_geometry *g;
+
+  g = gnufdisk_geometry_new (0, 0);
+
+  g->start = _r.start;
+  g->end = _r.end;
+
+  return g;
+}
+
+struct gnufdisk_range
+gnufdisk_geometry_range (struct gnufdisk_geometry *_g)
+{
+  struct gnufdisk_range r;
+
+  check_geometry (&_g);
+
+  r.start = _g->start;
+  r.end = _g->end;
+
+  return r;
+}
+
+struct gnufdisk_range
+gnufdisk_range_make (gnufdisk_integer _start, gnufdisk_integer _length)
+{
+  struct gnufdisk_range r;
+
+  r.start = _start;
+  r.end = _start + _length;
+
+  return r;
+}
+
+gnufdisk_integer
+gnufdisk_range_length (struct gnufdisk_range _r)
+{
+  return (_r.end - _r.start) + 1;
+}
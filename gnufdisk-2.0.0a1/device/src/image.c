@@ -0,0 +1,483 @@
+/* GNU fdisk, (gnufdisk-device) a library to manage a device
+ * Copyright (C) 2011 Free Software Foundation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA. */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <gnufdisk-common.h>
+#include <gnufdisk-debug.h>
+#include <gnufdisk-exception.h>
+#include <gnufdisk-device.h>
+#include <gnufdisk-device-internals.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# include <immintrin.h>
+# define IMAGE_HAVE_X86 1
+#endif
+
+struct gnufdisk_device*
+gnufdisk_device_internals__partition_get_device(struct gnufdisk_partition* _p);
+
+#define IMAGE 1
+
+/* Partitions are copied IMAGE_CHUNK_SIZE bytes at a time; inside a chunk,
+ * zeros are detected in IMAGE_BLOCK_SIZE units, which is the smallest hole
+ * left in (or punched into) the destination. */
+#define IMAGE_CHUNK_SIZE 1048576
+#define IMAGE_BLOCK_SIZE 65536
+
+struct image {
+  struct gnufdisk_partition* partition;
+  gnufdisk_integer sector_size;
+  gnufdisk_integer length; /* partition sectors */
+  size_t block; /* bytes, multiple of sector_size */
+  size_t chunk; /* bytes, multiple of block */
+  unsigned char* buf;
+  char* path;
+  int fd;
+  /* import: zero run not yet sent to the partition */
+  gnufdisk_integer zero_start;
+  gnufdisk_integer zero_count;
+};
+
+/* zero detection */
+
+static int is_zero_scalar(const unsigned char* _buf, size_t _size)
+{
+  const unsigned char* end;
+  uint64_t acc;
+
+  end = _buf + _size;
+  acc = 0;
+
+  for(; _buf < end && ((uintptr_t) _buf & 7) != 0; _buf++)
+    acc |= *_buf;
+
+  for(; _buf + 64 <= end && acc == 0; _buf += 64)
+    {
+      const uint64_t* w = (const uint64_t*) _buf;
+
+      acc = w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7];
+    }
+
+  for(; _buf < end && acc == 0; _buf++)
+    acc |= *_buf;
+
+  return acc == 0;
+}
+
+#ifdef IMAGE_HAVE_X86
+
+static int __attribute__((target("sse2"))) is_zero_sse2(const unsigned char* _buf, size_t _size)
+{
+  const __m128i zero = _mm_setzero_si128();
+  size_t iter;
+
+  for(iter = 0; iter + 64 <= _size; iter += 64)
+    {
+      __m128i acc;
+
+      acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i*) (_buf + iter)),
+                                      _mm_loadu_si128((const __m128i*) (_buf + iter + 16))),
+                         _mm_or_si128(_mm_loadu_si128((const __m128i*) (_buf + iter + 32)),
+                                      _mm_loadu_si128((const __m128i*) (_buf + iter + 48))));
+
+      if(_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF)
+        return 0;
+    }
+
+  return is_zero_scalar(_buf + iter, _size - iter);
+}
+
+static int __attribute__((target("avx2"))) is_zero_avx2(const unsigned char* _buf, size_t _size)
+{
+  size_t iter;
+
+  for(iter = 0; iter + 128 <= _size; iter += 128)
+    {
+      __m256i acc;
+
+      acc = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256((const __m256i*) (_buf + iter)),
+                                            _mm256_loadu_si256((const __m256i*) (_buf + iter + 32))),
+                            _mm256_or_si256(_mm256_loadu_si256((const __m256i*) (_buf + iter + 64)),
+                                            _mm256_loadu_si256((const __m256i*) (_buf + iter + 96))));
+
+      if(!_mm256_testz_si256(acc, acc))
+        return 0;
+    }
+
+  return is_zero_scalar(_buf + iter, _size - iter);
+}
+
+#endif /* IMAGE_HAVE_X86 */
+
+static int (*is_zero_implementation)(const unsigned char* _buf, size_t _size);
+
+static int is_zero(const unsigned char* _buf, size_t _size)
+{
+  if(is_zero_implementation == NULL)
+    {
+#ifdef IMAGE_HAVE_X86
+      __builtin_cpu_init();
+
+      if(__builtin_cpu_supports("avx2"))
+        is_zero_implementation = &is_zero_avx2;
+      else if(__builtin_cpu_supports("sse2"))
+        is_zero_implementation = &is_zero_sse2;
+      else
+#endif
+        is_zero_implementation = &is_zero_scalar;
+    }
+
+  return (*is_zero_implementation)(_buf, _size);
+}
+
+/* shared setup */
+
+static void delete_string(void* _p)
+{
+  gnufdisk_string_delete(_p);
+}
+
+static void image_close(void* _image)
+{
+  struct image* image;
+
+  image = _image;
+
+  GNUFDISK_LOG((IMAGE, "release image %s", image->path ? image->path : "(null)"));
+
+  if(image->fd != -1)
+    close(image->fd);
+
+  free(image->buf);
+  free(image->path);
+}
+
+static void image_open(struct image* _image, struct gnufdisk_partition* _p, struct gnufdisk_string* _path, int _flags)
+{
+  struct gnufdisk_device* device;
+  struct gnufdisk_string* param;
+
+  memset(_image, 0, sizeof(struct image));
+  _image->fd = -1;
+
+  gnufdisk_exception_register_unwind_handler(&image_close, _image);
+
+  _image->partition = _p;
+  _image->length = gnufdisk_partition_length(_p);
+
+  device = gnufdisk_device_internals__partition_get_device(_p);
+
+  if((param = gnufdisk_string_new("SECTOR-SIZE")) == NULL)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOMEM, NULL, "can not allocate memory");
+
+  gnufdisk_exception_register_unwind_handler(&delete_string, param);
+
+  gnufdisk_device_get_parameter(device, param, &_image->sector_size, sizeof(gnufdisk_integer));
+
+  gnufdisk_exception_unregister_unwind_handler(&delete_string, param);
+  gnufdisk_string_delete(param);
+
+  if(_image->sector_size <= 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ESECTORSIZE, NULL, "invalid sector size %" PRId64, _image->sector_size);
+
+  _image->block = IMAGE_BLOCK_SIZE % _image->sector_size == 0 ? IMAGE_BLOCK_SIZE : _image->sector_size;
+  _image->chunk = IMAGE_CHUNK_SIZE > _image->block ? IMAGE_CHUNK_SIZE - IMAGE_CHUNK_SIZE % _image->block : _image->block;
+
+  if(posix_memalign((void**) &_image->buf, 4096, _image->chunk) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOMEM, NULL, "can not allocate memory");
+
+  if(gnufdisk_check_memory(_path, 1, 1) != 0
+     || (_image->path = gnufdisk_string_c_string_dup(_path)) == NULL)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPATHPOINTER, NULL, "invalid image path");
+
+  if((_image->fd = open(_image->path, _flags, 0644)) == -1)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EPATH, NULL, "can not open %s: %s", _image->path, strerror(errno));
+
+  GNUFDISK_LOG((IMAGE, "image %s: %" PRId64 " sectors of %" PRId64 " bytes",
+                _image->path, _image->length, _image->sector_size));
+}
+
+static void image_finish(struct image* _image)
+{
+  int fd;
+
+  fd = _image->fd;
+  _image->fd = -1;
+
+  if(close(fd) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not write %s: %s", _image->path, strerror(errno));
+
+  gnufdisk_exception_unregister_unwind_handler(&image_close, _image);
+  image_close(_image);
+}
+
+/* export: partition -> sparse file */
+
+static void export_chunk(struct image* _image, off_t _offset, size_t _size)
+{
+  size_t iter;
+
+  for(iter = 0; iter < _size; )
+    {
+      size_t run;
+
+      if(is_zero(_image->buf + iter, _image->block < _size - iter ? _image->block : _size - iter))
+        {
+          iter += _image->block;
+          continue;
+        }
+
+      /* coalesce consecutive data blocks into one write */
+      for(run = _image->block;
+          iter + run < _size && !is_zero(_image->buf + iter + run, _image->block < _size - iter - run ? _image->block : _size - iter - run);
+          run += _image->block)
+        ;
+
+      if(run > _size - iter)
+        run = _size - iter;
+
+      if(pwrite(_image->fd, _image->buf + iter, run, _offset + iter) != (ssize_t) run)
+        GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not write %s: %s", _image->path, strerror(errno));
+
+      iter += run;
+    }
+}
+
+void gnufdisk_partition_export(struct gnufdisk_partition* _p, struct gnufdisk_string* _path)
+{
+  struct image image;
+  gnufdisk_integer sector;
+  gnufdisk_integer copied;
+
+  GNUFDISK_LOG((IMAGE, "perform export on struct gnufdisk_partition* %p", _p));
+
+  image_open(&image, _p, _path, O_WRONLY | O_CREAT | O_TRUNC);
+
+  /* the image starts as one hole, only data is written */
+  if(ftruncate(image.fd, image.length * image.sector_size) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not resize %s: %s", image.path, strerror(errno));
+
+  for(sector = 0, copied = 0; sector < image.length; )
+    {
+      gnufdisk_integer data;
+      gnufdisk_integer hole;
+
+      if((data = gnufdisk_partition_seek_data(_p, sector, SEEK_DATA)) >= image.length)
+        break;
+
+      if((hole = gnufdisk_partition_seek_data(_p, data, SEEK_HOLE)) > image.length || hole <= data)
+        hole = image.length;
+
+      GNUFDISK_LOG((IMAGE, "data between sector %" PRId64 " and %" PRId64, data, hole));
+
+      for(sector = data; sector < hole; )
+        {
+          gnufdisk_integer count;
+          size_t size;
+
+          count = (gnufdisk_integer) image.chunk / image.sector_size;
+
+          if(count > hole - sector)
+            count = hole - sector;
+
+          size = count * image.sector_size;
+
+          if(gnufdisk_partition_read(_p, sector, image.buf, size) != (int) size)
+            GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not read partition at sector %" PRId64, sector);
+
+          export_chunk(&image, (off_t) sector * image.sector_size, size);
+
+          sector += count;
+          copied += count;
+        }
+    }
+
+  GNUFDISK_LOG((IMAGE, "read %" PRId64 " of %" PRId64 " sectors", copied, image.length));
+
+  if(fsync(image.fd) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not write %s: %s", image.path, strerror(errno));
+
+  image_finish(&image);
+
+  GNUFDISK_LOG((IMAGE, "done perform export"));
+}
+
+/* import: sparse file -> partition */
+
+static void import_flush_zero(struct image* _image)
+{
+  if(_image->zero_count > 0)
+    {
+      GNUFDISK_LOG((IMAGE, "zero %" PRId64 " sectors at %" PRId64, _image->zero_count, _image->zero_start));
+
+      gnufdisk_partition_zero(_image->partition, _image->zero_start, _image->zero_count);
+    }
+
+  _image->zero_count = 0;
+}
+
+static void import_zero(struct image* _image, gnufdisk_integer _sector, gnufdisk_integer _count)
+{
+  if(_image->zero_count > 0 && _image->zero_start + _image->zero_count != _sector)
+    import_flush_zero(_image);
+
+  if(_image->zero_count == 0)
+    _image->zero_start = _sector;
+
+  _image->zero_count += _count;
+}
+
+static void import_chunk(struct image* _image, gnufdisk_integer _sector, size_t _size)
+{
+  size_t iter;
+
+  for(iter = 0; iter < _size; )
+    {
+      size_t block;
+      size_t run;
+
+      block = _image->block < _size - iter ? _image->block : _size - iter;
+
+      if(is_zero(_image->buf + iter, block))
+        {
+          import_zero(_image, _sector + iter / _image->sector_size, block / _image->sector_size);
+          iter += block;
+          continue;
+        }
+
+      for(run = block;
+          iter + run < _size && !is_zero(_image->buf + iter + run, _image->block < _size - iter - run ? _image->block : _size - iter - run);
+          run += _image->block)
+        ;
+
+      if(run > _size - iter)
+        run = _size - iter;
+
+      import_flush_zero(_image);
+
+      if(gnufdisk_partition_write(_image->partition, _sector + iter / _image->sector_size, _image->buf + iter, run) != (int) run)
+        GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not write partition at sector %" PRId64,
+                       _sector + (gnufdisk_integer) (iter / _image->sector_size));
+
+      iter += run;
+    }
+}
+
+static gnufdisk_integer import_seek(struct image* _image, gnufdisk_integer _sector, gnufdisk_integer _end, int _whence)
+{
+  off_t offset;
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+  if((offset = lseek(_image->fd, (off_t) _sector * _image->sector_size, _whence)) == -1)
+    {
+      if(errno == ENXIO)
+        return _end;
+      else if(errno != EINVAL && errno != EOPNOTSUPP)
+        GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not seek %s: %s", _image->path, strerror(errno));
+
+      return _whence == SEEK_DATA ? _sector : _end;
+    }
+#else
+  return _whence == SEEK_DATA ? _sector : _end;
+#endif
+
+  if(_whence == SEEK_DATA)
+    offset = offset / _image->sector_size;
+  else
+    offset = (offset + _image->sector_size - 1) / _image->sector_size;
+
+  return offset < _end ? offset : _end;
+}
+
+void gnufdisk_partition_import(struct gnufdisk_partition* _p, struct gnufdisk_string* _path)
+{
+  struct image image;
+  struct stat info;
+  gnufdisk_integer sectors;
+  gnufdisk_integer sector;
+
+  GNUFDISK_LOG((IMAGE, "perform import on struct gnufdisk_partition* %p", _p));
+
+  image_open(&image, _p, _path, O_RDONLY);
+
+  if(fstat(image.fd, &info) != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not stat %s: %s", image.path, strerror(errno));
+
+  if(info.st_size % image.sector_size != 0)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "size of %s is not a multiple of %" PRId64 " bytes",
+                   image.path, image.sector_size);
+
+  if((sectors = info.st_size / image.sector_size) > image.length)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "%s is larger than the partition (%" PRId64 " > %" PRId64 " sectors)",
+                   image.path, sectors, image.length);
+
+  for(sector = 0; sector < sectors; )
+    {
+      gnufdisk_integer data;
+      gnufdisk_integer hole;
+
+      /* holes in the image become zeroed ranges of the partition */
+      data = import_seek(&image, sector, sectors, SEEK_DATA);
+
+      if(data > sector)
+        import_zero(&image, sector, data - sector);
+
+      if(data >= sectors)
+        break;
+
+      if((hole = import_seek(&image, data, sectors, SEEK_HOLE)) <= data)
+        hole = sectors;
+
+      for(sector = data; sector < hole; )
+        {
+          gnufdisk_integer count;
+          size_t size;
+
+          count = (gnufdisk_integer) image.chunk / image.sector_size;
+
+          if(count > hole - sector)
+            count = hole - sector;
+
+          size = count * image.sector_size;
+
+          if(pread(image.fd, image.buf, size, (off_t) sector * image.sector_size) != (ssize_t) size)
+            GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EIO, NULL, "can not read %s: %s", image.path, strerror(errno));
+
+          import_chunk(&image, sector, size);
+
+          sector += count;
+        }
+    }
+
+  import_flush_zero(&image);
+
+  image_finish(&image);
+
+  GNUFDISK_LOG((IMAGE, "done perform import"));
+}
@@ -16,6 +16,8 @@
  * Foundation, Inc., 59 Temple Place - Suite 330,
  * Boston, MA 02111-1307, USA. */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -203,6 +205,23 @@ gnufdisk_integer gnufdisk_partition_length(struct gnufdisk_partition* _p)
   return (*_p->operations.length)(_p->implementation_data);
 }
 
+struct gnufdisk_range gnufdisk_partition_range(struct gnufdisk_partition* _p)
+{
+  struct gnufdisk_range r;
+
+  check_partition(&_p);
+
+  if(_p->operations.start == NULL)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOTSUP, NULL, "operation not supported `start'");
+  else if(_p->operations.length == NULL)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOTSUP, NULL, "operation not supported `length'");
+
+  r.start = (*_p->operations.start)(_p->implementation_data);
+  r.end = r.start + (*_p->operations.length)(_p->implementation_data);
+
+  return r;
+}
+
 int gnufdisk_partition_number(struct gnufdisk_partition* _p)
 {
   check_partition(&_p);
@@ -292,6 +311,28 @@ void gnufdisk_partition_resize(struct gnufdisk_partition* _p,
   (*_p->operations.resize)(_p->implementation_data, _e);
 }
 
+void gnufdisk_partition_move_range(struct gnufdisk_partition* _p,
+				   struct gnufdisk_range _g)
+{
+  struct gnufdisk_geometry g;
+
+  g.start = _g.start;
+  g.end = _g.end;
+
+  gnufdisk_partition_move(_p, &g);
+}
+
+void gnufdisk_partition_resize_range(struct gnufdisk_partition* _p,
+				     struct gnufdisk_range _e)
+{
+  struct gnufdisk_geometry e;
+
+  e.start = _e.start;
+  e.end = _e.end;
+
+  gnufdisk_partition_resize(_p, &e);
+}
+
 int gnufdisk_partition_read(struct gnufdisk_partition* _p,
 			    gnufdisk_integer _sector,
 			    void* _dest,
@@ -344,3 +385,52 @@ int gnufdisk_partition_write(struct gnufdisk_partition* _p,
   return (*_p->operations.write)(_p->implementation_data, _sector, _data, _size);
 }
 
+gnufdisk_integer gnufdisk_partition_seek_data(struct gnufdisk_partition* _p,
+					     gnufdisk_integer _sector,
+					     int _whence)
+{
+  check_partition(&_p);
+
+  if(_whence != SEEK_DATA && _whence != SEEK_HOLE)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_EINTERNAL, NULL, "invalid whence %d", _whence);
+
+  /* modules that can not find holes report the whole partition as data */
+  if(_p->operations.seek_data == NULL)
+    return _whence == SEEK_DATA ? _sector : gnufdisk_partition_length(_p);
+
+  return (*_p->operations.seek_data)(_p->implementation_data, _sector, _whence);
+}
+
+void gnufdisk_partition_zero(struct gnufdisk_partition* _p,
+			     gnufdisk_integer _sector,
+			     gnufdisk_integer _count)
+{
+  check_partition(&_p);
+
+  if(_p->operations.zero == NULL)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOTSUP, NULL, "operation not supported `zero'");
+
+  (*_p->operations.zero)(_p->implementation_data, _sector, _count);
+}
+
+gnufdisk_integer gnufdisk_partition_pread(struct gnufdisk_partition* _p,
+					 gnufdisk_integer _sector,
+					 void* _dest,
+					 size_t _size)
+{
+  check_partition(&_p);
+
+  if(_p->operations.pread == NULL)
+    GNUFDISK_THROW(0, NULL, GNUFDISK_DEVICE_ENOTSUP, NULL, "operation not supported `pread'");
+
+  return (*_p->operations.pread)(_p->implementation_data, _sector, _dest, _size);
+}
+
+struct gnufdisk_device*
+gnufdisk_device_internals__partition_get_device(struct gnufdisk_partition* _p)
+{
+  check_partition(&_p);
+
+  return gnufdisk_device_internals__disklabel_get_device(_p->disklabel);
+}
+
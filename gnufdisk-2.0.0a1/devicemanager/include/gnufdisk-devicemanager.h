@@ -20,6 +20,7 @@
 #define GNUFDISK_DEVICEMANAGER_H_INCLUDED
 
 #include <gnufdisk-common.h>
+#include <gnufdisk-debug.h>
 #include <gnufdisk-exception.h>
 #include <gnufdisk-device.h>
 
@@ -153,6 +154,13 @@ struct gnufdisk_partition
 						      struct gnufdisk_string
 						      *_type);
 
+struct gnufdisk_partition*
+gnufdisk_devicemanager_disklabel_create_partition_range(struct gnufdisk_devicemanager* _dm,
+                                                        struct gnufdisk_disklabel* _disk,
+                                                        struct gnufdisk_range _start,
+                                                        struct gnufdisk_range _end,
+                                                        struct gnufdisk_string* _type);
+
 int gnufdisk_devicemanager_disklabel_remove_partition (struct
 						       gnufdisk_devicemanager
 						       *_dm,
@@ -217,6 +225,11 @@ gnufdisk_integer
 gnufdisk_devicemanager_partition_length(struct gnufdisk_devicemanager* _dm,
                                         struct gnufdisk_partition* _part);
 
+/* start and length of _part in one call, both fields are -1 on error */
+struct gnufdisk_range
+gnufdisk_devicemanager_partition_range(struct gnufdisk_devicemanager* _dm,
+                                       struct gnufdisk_partition* _part);
+
 int gnufdisk_devicemanager_partition_number (struct gnufdisk_devicemanager
 					     *_dm,
 					     struct gnufdisk_partition
@@ -239,6 +252,16 @@ int gnufdisk_devicemanager_partition_resize (struct gnufdisk_devicemanager
 					     struct gnufdisk_geometry
 					     *_range);
 
+/* the _range variants take the geometry by value, no struct gnufdisk_geometry
+ * has to be created or deleted around them */
+int gnufdisk_devicemanager_partition_move_range(struct gnufdisk_devicemanager* _dm,
+                                                struct gnufdisk_partition* _part,
+                                                struct gnufdisk_range _range);
+
+int gnufdisk_devicemanager_partition_resize_range(struct gnufdisk_devicemanager* _dm,
+                                                  struct gnufdisk_partition* _part,
+                                                  struct gnufdisk_range _range);
+
 int gnufdisk_devicemanager_partition_read (struct gnufdisk_devicemanager *_dm,
 					   struct gnufdisk_partition *_part,
 					   gnufdisk_integer _start,
@@ -250,8 +273,215 @@ int gnufdisk_devicemanager_partition_write (struct gnufdisk_devicemanager
 					    gnufdisk_integer _start,
 					    const void *_buf, size_t _size);
 
+int gnufdisk_devicemanager_partition_export(struct gnufdisk_devicemanager* _dm,
+                                            struct gnufdisk_partition* _part,
+                                            struct gnufdisk_string* _path);
+
+int gnufdisk_devicemanager_partition_import(struct gnufdisk_devicemanager* _dm,
+                                            struct gnufdisk_partition* _part,
+                                            struct gnufdisk_string* _path);
+
+struct gnufdisk_disklabel_snapshot*
+gnufdisk_devicemanager_disklabel_snapshot(struct gnufdisk_devicemanager* _dm,
+                                          struct gnufdisk_disklabel* _disk);
+
+struct gnufdisk_digest*
+gnufdisk_devicemanager_partition_digest(struct gnufdisk_devicemanager* _dm,
+                                        struct gnufdisk_partition* _part,
+                                        gnufdisk_integer _chunk_size,
+                                        int _threads);
+
 int gnufdisk_devicemanager_partition_delete(struct gnufdisk_devicemanager* _dm,
                                             struct gnufdisk_partition* _part);
 
+enum gnufdisk_devicemanager_batch_operation {
+  GNUFDISK_DEVICEMANAGER_BATCH_DISKLABEL_COUNT_PARTITIONS,
+  GNUFDISK_DEVICEMANAGER_BATCH_DISKLABEL_PARTITION,
+  GNUFDISK_DEVICEMANAGER_BATCH_PARTITION_START,
+  GNUFDISK_DEVICEMANAGER_BATCH_PARTITION_LENGTH,
+  GNUFDISK_DEVICEMANAGER_BATCH_PARTITION_TYPE,
+  GNUFDISK_DEVICEMANAGER_BATCH_PARTITION_NUMBER,
+  GNUFDISK_DEVICEMANAGER_BATCH_PARTITION_DELETE,
+  GNUFDISK_DEVICEMANAGER_BATCH_GEOMETRY_START,
+  GNUFDISK_DEVICEMANAGER_BATCH_GEOMETRY_END,
+  GNUFDISK_DEVICEMANAGER_BATCH_GEOMETRY_LENGTH
+};
+
+/* One recorded operation. The operand is `object', or the partition
+ * returned by command `source' when `source' is not negative. 
+ * `number' is the index for DISKLABEL_PARTITION. */
+struct gnufdisk_devicemanager_batch_command {
+  enum gnufdisk_devicemanager_batch_operation operation;
+  void* object;
+  int source;
+  size_t number;
+  union {
+    gnufdisk_integer integer;
+    struct gnufdisk_partition* partition;
+    struct gnufdisk_string* string;
+  } result;
+};
+
+/* Execute _commands in order under a single exception context. Return
+ * the number of commands completed; less than _ncommands means the next
+ * one failed and the error has been reported to the userinterface. */
+int gnufdisk_devicemanager_batch(struct gnufdisk_devicemanager* _dm,
+                                 struct gnufdisk_devicemanager_batch_command* _commands,
+                                 size_t _ncommands);
+
+/* One partition of a layout for gnufdisk_devicemanager_apply(). */
+struct gnufdisk_devicemanager_layout_partition {
+  gnufdisk_integer start; /* sector, -1: after the previous partition of the same disklabel */
+  gnufdisk_integer length;
+  int length_shift; /* length is in bytes << length_shift, 0: in sectors */
+  const char* type;
+  int parent; /* index of the partition holding this one, -1: the device disklabel */
+};
+
+struct gnufdisk_devicemanager_layout {
+  const char* module;
+  const char* options;
+  const char* system; /* disklabel created on every device */
+  gnufdisk_integer alignment; /* bytes, 0: 1 MiB */
+  size_t npartitions;
+  const struct gnufdisk_devicemanager_layout_partition* partitions;
+};
+
+enum gnufdisk_devicemanager_apply_result {
+  GNUFDISK_DEVICEMANAGER_APPLY_PENDING,
+  GNUFDISK_DEVICEMANAGER_APPLY_DONE,
+  GNUFDISK_DEVICEMANAGER_APPLY_NOT_WRITTEN, /* failed before the commit, nothing was written */
+  GNUFDISK_DEVICEMANAGER_APPLY_ROLLED_BACK, /* failed, the device holds its previous disklabel */
+  GNUFDISK_DEVICEMANAGER_APPLY_COMMIT_FAILED /* failed while writing, the previous disklabel could not be restored
+                                               * or partitions were already discarded or wiped */
+};
+
+struct gnufdisk_devicemanager_apply_target {
+  const char* path;
+  const char* controller; /* targets naming the same controller share its limit, NULL: none */
+  enum gnufdisk_devicemanager_apply_result result;
+  int error;
+  char message[256];
+};
+
+/* Write _layout on every target using up to _nworkers threads, with at
+ * most _per_controller devices of the same controller in progress at
+ * once (0: no limit). Each target gets its own result; the failures are
+ * also reported to the userinterface once all the workers are done.
+ * Return the number of targets written, -1 on invalid arguments. */
+int gnufdisk_devicemanager_apply(struct gnufdisk_devicemanager* _dm,
+                                 const struct gnufdisk_devicemanager_layout* _layout,
+                                 struct gnufdisk_devicemanager_apply_target* _targets,
+                                 size_t _ntargets,
+                                 size_t _nworkers,
+                                 size_t _per_controller);
+
+/* Boundaries a planned partition starts and ends on. */
+enum gnufdisk_devicemanager_plan_alignment {
+  GNUFDISK_DEVICEMANAGER_PLAN_ALIGN_DEFAULT, /* 1 MiB, or a multiple of it matching the optimal alignment */
+  GNUFDISK_DEVICEMANAGER_PLAN_ALIGN_OPTIMAL, /* the OPTIMAL-ALIGNMENT of the device, a stripe for arrays */
+  GNUFDISK_DEVICEMANAGER_PLAN_ALIGN_MINIMUM, /* the MINIMUM-ALIGNMENT of the device */
+  GNUFDISK_DEVICEMANAGER_PLAN_ALIGN_SECTOR
+};
+
+/* One partition for gnufdisk_devicemanager_device_plan(). Sizes are in
+ * bytes, `start' and `length' are set by the planner, in sectors. */
+struct gnufdisk_devicemanager_plan_request {
+  gnufdisk_integer size; /* 0: `percent' of the free space left by the sized requests */
+  int percent;
+  gnufdisk_integer min; /* 0: no limit */
+  gnufdisk_integer max; /* 0: no limit */
+  enum gnufdisk_devicemanager_plan_alignment alignment;
+  int order; /* placed by increasing order, then in array order */
+  const char* type;
+  gnufdisk_integer start;
+  gnufdisk_integer length;
+};
+
+/* Place _requests in the free space of the disklabel of _dev, first fit
+ * in placement order on the boundaries of their alignment. With _commit
+ * the partitions are created and the device committed at once, the
+ * disklabel is left as it was if any of them fails. Return 0, -1 on
+ * error, reported to the userinterface. */
+int gnufdisk_devicemanager_device_plan(struct gnufdisk_devicemanager* _dm,
+                                       struct gnufdisk_device* _dev,
+                                       struct gnufdisk_devicemanager_plan_request* _requests,
+                                       size_t _nrequests,
+                                       int _commit);
+
+enum gnufdisk_devicemanager_watch_change {
+  GNUFDISK_DEVICEMANAGER_WATCH_ADDED,
+  GNUFDISK_DEVICEMANAGER_WATCH_REMOVED,
+  GNUFDISK_DEVICEMANAGER_WATCH_CHANGED
+};
+
+/* One partition that differs from the previous probe of `path'. */
+struct gnufdisk_devicemanager_watch_event {
+  const char* path;
+  enum gnufdisk_devicemanager_watch_change change;
+  int parent; /* number of the partition holding the disklabel, 0: the device disklabel */
+  const struct gnufdisk_partition_record* previous; /* NULL when added */
+  const struct gnufdisk_partition_record* current; /* NULL when removed */
+};
+
+typedef void (*gnufdisk_devicemanager_watch_callback)(void* _data,
+                                                      const struct gnufdisk_devicemanager_watch_event* _event);
+
+struct gnufdisk_devicemanager_watch;
+
+/* Watch the disklabels of _paths, opened with _module and _options. The
+ * targets start out pending: the first update reports every partition as
+ * added. The callback is only called from update and run. */
+struct gnufdisk_devicemanager_watch*
+gnufdisk_devicemanager_watch_new(struct gnufdisk_devicemanager* _dm,
+                                 const char* _module,
+                                 const char* _options,
+                                 const char* const* _paths,
+                                 size_t _npaths,
+                                 gnufdisk_devicemanager_watch_callback _callback,
+                                 void* _data);
+
+int gnufdisk_devicemanager_watch_delete(struct gnufdisk_devicemanager_watch* _watch);
+
+/* Event sources: mark the targets named by a kernel uevent (the text of
+ * one NETLINK_KOBJECT_UEVENT message) or by their path as pending.
+ * Return the number of targets marked, -1 on error. */
+int gnufdisk_devicemanager_watch_uevent(struct gnufdisk_devicemanager_watch* _watch,
+                                        const char* _message,
+                                        size_t _size);
+
+int gnufdisk_devicemanager_watch_notify(struct gnufdisk_devicemanager_watch* _watch,
+                                        const char* _path);
+
+/* Probe the pending targets again and report the differences. Return the
+ * number of events, -1 on error. A target that can not be probed is
+ * reported to the userinterface and has no partitions. */
+int gnufdisk_devicemanager_watch_update(struct gnufdisk_devicemanager_watch* _watch);
+
+/* Keep a copy of every label tree in the POSIX shared memory segment
+ * _name (see gnufdisk-shm.h), rewritten by each update that changes
+ * something. Targets not probed yet have error EAGAIN. The segment is
+ * marked closed and unlinked by delete. Return 0 on success, -1 on error. */
+int gnufdisk_devicemanager_watch_publish(struct gnufdisk_devicemanager_watch* _watch,
+                                         const char* _name);
+
+/* Wait for block uevents and for writes to the image files, then update
+ * the targets once _settle milliseconds have passed since the first
+ * event. Return 0 after gnufdisk_devicemanager_watch_stop(), -1 on error. */
+int gnufdisk_devicemanager_watch_run(struct gnufdisk_devicemanager_watch* _watch,
+                                     int _settle);
+
+/* Make run return. Async-signal-safe. */
+void gnufdisk_devicemanager_watch_stop(struct gnufdisk_devicemanager_watch* _watch);
+
+int gnufdisk_devicemanager_stats(struct gnufdisk_devicemanager* _dm,
+                                 int _operation,
+                                 struct gnufdisk_stats* _dest);
+
+int gnufdisk_devicemanager_stats_reset(struct gnufdisk_devicemanager* _dm);
+
+struct gnufdisk_string* 
+gnufdisk_devicemanager_stats_prometheus(struct gnufdisk_devicemanager* _dm);
+
 #endif /* GNUFDISK_DEVICEMANAGER_H_INCLUDED */
 
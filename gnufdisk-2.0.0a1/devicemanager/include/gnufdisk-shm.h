@@ -0,0 +1,101 @@
+/* GNU Fidsk (gnufdisk-shm), read the disklabels published by a watch.
+ *
+ * Copyright (C) 2011 Free Software Foundation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA. */
+#ifndef GNUFDISK_SHM_H_INCLUDED
+#define GNUFDISK_SHM_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Layout of the POSIX shared memory segment written by
+ * gnufdisk_devicemanager_watch_publish(). The segment never leaves the
+ * host, every field is native endian. The header is followed by the
+ * device table, the records and the paths. */
+
+#define GNUFDISK_SHM_MAGIC "GFDSHM01"
+
+/* the publisher is gone, a new one publishes under the same name in a
+ * new segment */
+#define GNUFDISK_SHM_CLOSED 0x0001
+
+struct gnufdisk_shm_header {
+  char magic[8];
+  uint64_t sequence; /* odd while the publisher writes */
+  uint64_t generation; /* incremented by every change */
+  uint64_t size; /* bytes in use, the segment only grows */
+  uint32_t ndevices;
+  uint32_t nrecords;
+  uint32_t devices; /* offset of the device table */
+  uint32_t records; /* offset of the records */
+  uint32_t flags;
+  uint32_t reserved;
+};
+
+struct gnufdisk_shm_device {
+  uint32_t path; /* offset of the path, NUL terminated */
+  uint32_t first; /* index of its first record */
+  uint32_t nrecords;
+  int32_t error; /* of the last probe, errno or GNUFDISK_DEVICE_*, 0: the records are current */
+  uint32_t sector_size;
+  uint32_t reserved;
+  uint64_t generation; /* of its last change */
+};
+
+/* one partition, type and flags as in struct gnufdisk_partition_record */
+struct gnufdisk_shm_record {
+  int64_t start; /* sectors */
+  int64_t length;
+  int32_t number;
+  int32_t parent; /* number of the partition holding its disklabel, 0: the device disklabel */
+  uint16_t type;
+  uint16_t flags;
+  uint32_t reserved;
+  uint8_t guid[16];
+  char content[24];
+};
+
+struct gnufdisk_shm;
+
+/* A consistent copy of the segment, valid until the next call to
+ * gnufdisk_shm_view() or gnufdisk_shm_close() on the same handle. */
+struct gnufdisk_shm_view {
+  uint64_t generation;
+  size_t ndevices;
+  const struct gnufdisk_shm_device* devices;
+  const struct gnufdisk_shm_record* records;
+  const char* base; /* what the offsets are relative to */
+};
+
+/* Map the segment _name read-only. NULL with errno set on error. */
+struct gnufdisk_shm* gnufdisk_shm_open(const char* _name);
+void gnufdisk_shm_close(struct gnufdisk_shm* _shm);
+
+/* The generation being published, without copying anything. */
+uint64_t gnufdisk_shm_generation(struct gnufdisk_shm* _shm);
+
+/* Fill _view. Nothing is copied when the segment has not changed since
+ * the previous view, and no system call is made unless the segment grew
+ * or the publisher is in the middle of an update. -1 with errno EAGAIN
+ * when the publisher does not finish its update, ESTALE when it is gone
+ * (open the segment again), EPROTO when the segment is not valid. */
+int gnufdisk_shm_view(struct gnufdisk_shm* _shm, struct gnufdisk_shm_view* _view);
+
+const struct gnufdisk_shm_device* gnufdisk_shm_find(const struct gnufdisk_shm_view* _view, const char* _path);
+const char* gnufdisk_shm_device_path(const struct gnufdisk_shm_view* _view, const struct gnufdisk_shm_device* _device);
+
+#endif /* GNUFDISK_SHM_H_INCLUDED */
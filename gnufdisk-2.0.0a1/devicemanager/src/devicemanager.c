@@ -16,12 +16,25 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 59 Temple Place - Suite 330,
  * Boston, MA 02111-1307, USA. */
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/socket.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <linux/netlink.h>
 
 #include <gnufdisk-common.h>
 #include <gnufdisk-debug.h>
@@ -30,6 +43,7 @@
 
 #include <gnufdisk-userinterface.h>
 #include <gnufdisk-devicemanager.h>
+#include <gnufdisk-shm.h>
 
 #define DEVICEMANAGER 1
 
@@ -1422,6 +1436,38 @@ gnufdisk_devicemanager_disklabel_create_partition(struct gnufdisk_devicemanager*
   return ret;
 }
 
+struct gnufdisk_partition* 
+gnufdisk_devicemanager_disklabel_create_partition_range(struct gnufdisk_devicemanager* _dm,
+                                                        struct gnufdisk_disklabel* _disk,
+                                                        struct gnufdisk_range _start,
+                                                        struct gnufdisk_range _end,
+                                                        struct gnufdisk_string* _type)
+{
+  struct gnufdisk_partition* ret;
+
+  ret = NULL;
+
+  GNUFDISK_TRY(&disklabel_create_partition_throw_handler, _dm)
+    {
+      if(gnufdisk_check_memory(_dm, sizeof(struct gnufdisk_devicemanager), 0) != 0)
+        GNUFDISK_THROW(0, NULL, EFAULT, NULL, "invalid struct gnufdisk_devicemanager* %p", _dm);
+
+      ret = gnufdisk_disklabel_create_partition_range(_disk, _start, _end, _type);
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      GNUFDISK_LOG((DEVICEMANAGER, 
+                    "caught an exception from %s:%d: %s", 
+                    exception_info.file,
+                    exception_info.line,
+                    exception_info.message));
+      ret = NULL;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  return ret;
+}
+
 static int disklabel_remove_partition_throw_handler(void* _data, struct gnufdisk_exception_info* _info, void *_edata)
 {
   struct gnufdisk_devicemanager* dm;
@@ -1834,6 +1880,43 @@ gnufdisk_devicemanager_partition_length(struct gnufdisk_devicemanager* _dm,
   return ret;
 }
 
+static int partition_range_throw_handler(void* _data, struct gnufdisk_exception_info* _info, void* _edata)
+{
+  return -1;
+}
+
+struct gnufdisk_range
+gnufdisk_devicemanager_partition_range(struct gnufdisk_devicemanager* _dm,
+                                       struct gnufdisk_partition* _part)
+{
+  struct gnufdisk_range ret;
+  
+  ret.start = 0;
+  ret.end = 0;
+
+  GNUFDISK_TRY(&partition_range_throw_handler, _dm)
+    {
+      if(gnufdisk_check_memory(_dm, sizeof(struct gnufdisk_devicemanager), 0) != 0)
+        GNUFDISK_THROW(0, NULL, EFAULT, NULL, "invalid struct gnufdisk_devicemanager* %p", _dm);
+
+      ret = gnufdisk_partition_range(_part);
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      GNUFDISK_LOG((DEVICEMANAGER,
+                    "caught an exception from %s:%d: %s",
+                    exception_info.file,
+                    exception_info.line,
+                    exception_info.message));
+      gnufdisk_userinterface_error(_dm->userinterface, "can not get partition range: %s", exception_info.message);
+      ret.start = -1;
+      ret.end = -1;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  return ret;
+}
+
 static int partition_number_throw_handler(void* _data, struct gnufdisk_exception_info* _info, void* _edata)
 {
   return -1;
@@ -1974,6 +2057,38 @@ int gnufdisk_devicemanager_partition_move(struct gnufdisk_devicemanager* _dm,
   return ret;
 }
 
+int gnufdisk_devicemanager_partition_move_range(struct gnufdisk_devicemanager* _dm,
+                                                struct gnufdisk_partition* _part,
+                                                struct gnufdisk_range _range)
+{
+  int ret;
+
+  ret = 0;
+
+  GNUFDISK_TRY(&partition_move_throw_handler, _dm)
+    {
+      if(gnufdisk_check_memory(_dm, sizeof(struct gnufdisk_devicemanager), 0) != 0)
+        GNUFDISK_THROW(0, NULL, EFAULT, NULL, "invalid struct gnufdisk_devicemanager* %p", _dm);
+
+      gnufdisk_partition_move_range(_part, _range);
+
+      ret = 0;
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      GNUFDISK_LOG((DEVICEMANAGER,
+                    "caught an exception from %s:%d: %s",
+                    exception_info.file,
+                    exception_info.line,
+                    exception_info.message));
+      gnufdisk_userinterface_error(_dm->userinterface, "can not move partition: %s", exception_info.message);
+      ret = -1;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  return ret;
+}
+
 static int partition_resize_throw_handler(void* _data, struct gnufdisk_exception_info* _info, void* _edata)
 {
   return -1;
@@ -2011,6 +2126,38 @@ int gnufdisk_devicemanager_partition_resize(struct gnufdisk_devicemanager* _dm,
   return ret;
 }
 
+int gnufdisk_devicemanager_partition_resize_range(struct gnufdisk_devicemanager* _dm,
+                                                  struct gnufdisk_partition* _part,
+                                                  struct gnufdisk_range _range)
+{
+  int ret;
+
+  ret = 0;
+
+  GNUFDISK_TRY(&partition_resize_throw_handler, _dm)
+    {
+      if(gnufdisk_check_memory(_dm, sizeof(struct gnufdisk_devicemanager), 0) != 0)
+        GNUFDISK_THROW(0, NULL, EFAULT, NULL, "invalid struct gnufdisk_devicemanager* %p", _dm);
+
+      gnufdisk_partition_resize_range(_part, _range);
+
+      ret = 0;
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      GNUFDISK_LOG((DEVICEMANAGER,
+                    "caught an exception from %s:%d: %s",
+                    exception_info.file,
+                    exception_info.line,
+                    exception_info.message));
+      gnufdisk_userinterface_error(_dm->userinterface, "can not resize partition: %s", exception_info.message);
+      ret = -1;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  return ret;
+}
+
 static int partition_read_throw_handler(void* _data, struct gnufdisk_exception_info* _info, void* _edata)
 {
   return -1;
@@ -2085,6 +2232,148 @@ int gnufdisk_devicemanager_partition_write(struct gnufdisk_devicemanager* _dm,
   return ret;
 }
 
+static int partition_export_throw_handler(void* _data, struct gnufdisk_exception_info* _info, void* _edata)
+{
+  return -1;
+}
+
+int gnufdisk_devicemanager_partition_export(struct gnufdisk_devicemanager* _dm,
+                                            struct gnufdisk_partition* _part,
+                                            struct gnufdisk_string* _path)
+{
+  int ret;
+
+  ret = 0;
+
+  GNUFDISK_TRY(&partition_export_throw_handler, _dm)
+    {
+      if(gnufdisk_check_memory(_dm, sizeof(struct gnufdisk_devicemanager), 0) != 0)
+        GNUFDISK_THROW(0, NULL, EFAULT, NULL, "invalid struct gnufdisk_devicemanager* %p", _dm);
+
+      gnufdisk_partition_export(_part, _path);
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      GNUFDISK_LOG((DEVICEMANAGER,
+                    "caught an exception from %s:%d: %s",
+                    exception_info.file,
+                    exception_info.line,
+                    exception_info.message));
+      gnufdisk_userinterface_error(_dm->userinterface, "can not export partition: %s", exception_info.message);
+      ret = -1;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  return ret;
+}
+
+static int partition_import_throw_handler(void* _data, struct gnufdisk_exception_info* _info, void* _edata)
+{
+  return -1;
+}
+
+int gnufdisk_devicemanager_partition_import(struct gnufdisk_devicemanager* _dm,
+                                            struct gnufdisk_partition* _part,
+                                            struct gnufdisk_string* _path)
+{
+  int ret;
+
+  ret = 0;
+
+  GNUFDISK_TRY(&partition_import_throw_handler, _dm)
+    {
+      if(gnufdisk_check_memory(_dm, sizeof(struct gnufdisk_devicemanager), 0) != 0)
+        GNUFDISK_THROW(0, NULL, EFAULT, NULL, "invalid struct gnufdisk_devicemanager* %p", _dm);
+
+      gnufdisk_partition_import(_part, _path);
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      GNUFDISK_LOG((DEVICEMANAGER,
+                    "caught an exception from %s:%d: %s",
+                    exception_info.file,
+                    exception_info.line,
+                    exception_info.message));
+      gnufdisk_userinterface_error(_dm->userinterface, "can not import partition: %s", exception_info.message);
+      ret = -1;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  return ret;
+}
+
+static int disklabel_snapshot_throw_handler(void* _data, struct gnufdisk_exception_info* _info, void* _edata)
+{
+  return -1;
+}
+
+struct gnufdisk_disklabel_snapshot*
+gnufdisk_devicemanager_disklabel_snapshot(struct gnufdisk_devicemanager* _dm,
+                                          struct gnufdisk_disklabel* _disk)
+{
+  struct gnufdisk_disklabel_snapshot* ret;
+
+  ret = NULL;
+
+  GNUFDISK_TRY(&disklabel_snapshot_throw_handler, _dm)
+    {
+      if(gnufdisk_check_memory(_dm, sizeof(struct gnufdisk_devicemanager), 0) != 0)
+        GNUFDISK_THROW(0, NULL, EFAULT, NULL, "invalid struct gnufdisk_devicemanager* %p", _dm);
+
+      ret = gnufdisk_disklabel_snapshot(_disk);
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      GNUFDISK_LOG((DEVICEMANAGER,
+                    "caught an exception from %s:%d: %s",
+                    exception_info.file,
+                    exception_info.line,
+                    exception_info.message));
+      gnufdisk_userinterface_error(_dm->userinterface, "can not snapshot disklabel: %s", exception_info.message);
+      ret = NULL;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  return ret;
+}
+
+static int partition_digest_throw_handler(void* _data, struct gnufdisk_exception_info* _info, void* _edata)
+{
+  return -1;
+}
+
+struct gnufdisk_digest*
+gnufdisk_devicemanager_partition_digest(struct gnufdisk_devicemanager* _dm,
+                                        struct gnufdisk_partition* _part,
+                                        gnufdisk_integer _chunk_size,
+                                        int _threads)
+{
+  struct gnufdisk_digest* ret;
+
+  ret = NULL;
+
+  GNUFDISK_TRY(&partition_digest_throw_handler, _dm)
+    {
+      if(gnufdisk_check_memory(_dm, sizeof(struct gnufdisk_devicemanager), 0) != 0)
+        GNUFDISK_THROW(0, NULL, EFAULT, NULL, "invalid struct gnufdisk_devicemanager* %p", _dm);
+
+      ret = gnufdisk_partition_digest(_part, _chunk_size, _threads);
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      GNUFDISK_LOG((DEVICEMANAGER,
+                    "caught an exception from %s:%d: %s",
+                    exception_info.file,
+                    exception_info.line,
+                    exception_info.message));
+      gnufdisk_userinterface_error(_dm->userinterface, "can not digest partition: %s", exception_info.message);
+      ret = NULL;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  return ret;
+}
+
 static int partition_delete_throw_handler(void* _data, struct gnufdisk_exception_info* _info, void* _edata)
 {
   return -1;
@@ -2121,3 +2410,2591 @@ int gnufdisk_devicemanager_partition_delete(struct gnufdisk_devicemanager* _dm,
   return ret;
 }
 
+static int batch_throw_handler(void* _data, struct gnufdisk_exception_info* _info, void* _edata)
+{
+  return -1;
+}
+
+static void* batch_operand(struct gnufdisk_devicemanager_batch_command* _commands, size_t _index)
+{
+  struct gnufdisk_devicemanager_batch_command* source;
+
+  if(_commands[_index].source < 0)
+    return _commands[_index].object;
+
+  if((size_t) _commands[_index].source >= _index)
+    GNUFDISK_THROW(0, NULL, EINVAL, NULL, 
+                   "command %zu refers to command %d, which did not run yet", 
+                   _index, _commands[_index].source);
+
+  source = &_commands[_commands[_index].source];
+
+  if(source->operation != GNUFDISK_DEVICEMANAGER_BATCH_DISKLABEL_PARTITION)
+    GNUFDISK_THROW(0, NULL, EINVAL, NULL, 
+                   "command %zu refers to command %d, which does not return a partition", 
+                   _index, _commands[_index].source);
+
+  return source->result.partition;
+}
+
+static void batch_execute(struct gnufdisk_devicemanager_batch_command* _commands, size_t _index)
+{
+  struct gnufdisk_devicemanager_batch_command* cmd;
+  void* operand;
+
+  cmd = &_commands[_index];
+  operand = batch_operand(_commands, _index);
+
+  switch(cmd->operation)
+    {
+      case GNUFDISK_DEVICEMANAGER_BATCH_DISKLABEL_COUNT_PARTITIONS:
+        cmd->result.integer = gnufdisk_disklabel_count_partitions(operand);
+        break;
+      case GNUFDISK_DEVICEMANAGER_BATCH_DISKLABEL_PARTITION:
+        cmd->result.partition = gnufdisk_disklabel_partition(operand, cmd->number);
+        break;
+      case GNUFDISK_DEVICEMANAGER_BATCH_PARTITION_START:
+        cmd->result.integer = gnufdisk_partition_start(operand);
+        break;
+      case GNUFDISK_DEVICEMANAGER_BATCH_PARTITION_LENGTH:
+        cmd->result.integer = gnufdisk_partition_length(operand);
+        break;
+      case GNUFDISK_DEVICEMANAGER_BATCH_PARTITION_TYPE:
+        cmd->result.string = gnufdisk_partition_type(operand);
+        break;
+      case GNUFDISK_DEVICEMANAGER_BATCH_PARTITION_NUMBER:
+        cmd->result.integer = gnufdisk_partition_number(operand);
+        break;
+      case GNUFDISK_DEVICEMANAGER_BATCH_PARTITION_DELETE:
+        gnufdisk_partition_delete(operand);
+        if(cmd->source >= 0)
+          _commands[cmd->source].result.partition = NULL;
+        break;
+      case GNUFDISK_DEVICEMANAGER_BATCH_GEOMETRY_START:
+        cmd->result.integer = gnufdisk_geometry_start(operand);
+        break;
+      case GNUFDISK_DEVICEMANAGER_BATCH_GEOMETRY_END:
+        cmd->result.integer = gnufdisk_geometry_end(operand);
+        break;
+      case GNUFDISK_DEVICEMANAGER_BATCH_GEOMETRY_LENGTH:
+        cmd->result.integer = gnufdisk_geometry_length(operand);
+        break;
+      default:
+        GNUFDISK_THROW(0, NULL, EINVAL, NULL, "invalid operation %d in command %zu", 
+                       cmd->operation, _index);
+    }
+}
+
+int gnufdisk_devicemanager_batch(struct gnufdisk_devicemanager* _dm,
+                                 struct gnufdisk_devicemanager_batch_command* _commands,
+                                 size_t _ncommands)
+{
+  volatile size_t done;
+
+  GNUFDISK_LOG((DEVICEMANAGER, "perform gnufdisk_devicemanager_batch of %zu commands", _ncommands));
+
+  done = 0;
+
+  GNUFDISK_TRY(&batch_throw_handler, _dm)
+    {
+      if(gnufdisk_check_memory(_dm, sizeof(struct gnufdisk_devicemanager), 0) != 0)
+        GNUFDISK_THROW(0, NULL, EFAULT, NULL, "invalid struct gnufdisk_devicemanager* %p", _dm);
+
+      if(_ncommands > 0 
+         && gnufdisk_check_memory(_commands, 
+                                  sizeof(struct gnufdisk_devicemanager_batch_command) * _ncommands, 
+                                  0) != 0)
+        GNUFDISK_THROW(0, NULL, EFAULT, NULL, "invalid command buffer %p", _commands);
+
+      for(; done < _ncommands; done++)
+        batch_execute(_commands, done);
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      GNUFDISK_LOG((DEVICEMANAGER,
+                    "caught an exception from %s:%d: %s",
+                    exception_info.file,
+                    exception_info.line,
+                    exception_info.message));
+      gnufdisk_userinterface_error(_dm->userinterface, "batch command %zu failed: %s", 
+                                   done, exception_info.message);
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  GNUFDISK_LOG((DEVICEMANAGER, "done perform gnufdisk_devicemanager_batch, result: %zu", done));
+
+  return done;
+}
+
+/* gnufdisk_devicemanager_apply(): the workers run without the
+ * userinterface, which is not thread safe; every error goes into the
+ * result of its target and is reported by the calling thread. */
+
+struct apply_controller {
+  const char* name;
+  size_t active;
+};
+
+struct apply_state {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  const struct gnufdisk_devicemanager_layout* layout;
+  struct gnufdisk_devicemanager_apply_target* targets;
+  size_t ntargets;
+  size_t* controller; /* controller index of every target */
+  char* taken; /* targets already picked by a worker */
+  struct apply_controller* controllers;
+  size_t ncontrollers;
+  size_t per_controller;
+};
+
+/* the disklabels of a device being written: 0 is the device disklabel,
+ * N + 1 the disklabel of layout partition N */
+struct apply_labels {
+  struct gnufdisk_disklabel** labels;
+  gnufdisk_integer* next; /* first free sector of every disklabel */
+  size_t nlabels;
+};
+
+static void apply_labels_delete(void* _p)
+{
+  struct apply_labels* l;
+  size_t iter;
+
+  l = _p;
+
+  for(iter = 0; iter < l->nlabels; iter++)
+    if(l->labels[iter])
+      gnufdisk_disklabel_delete(l->labels[iter]);
+
+  free(l->labels);
+  free(l->next);
+  free(l);
+}
+
+static void apply_string_delete(void* _p)
+{
+  gnufdisk_string_delete(_p);
+}
+
+static void apply_partition_delete(void* _p)
+{
+  gnufdisk_partition_delete(_p);
+}
+
+static void apply_device_delete(void* _p)
+{
+  gnufdisk_device_delete(_p);
+}
+
+static struct gnufdisk_string* apply_string_new(const char* _s)
+{
+  struct gnufdisk_string* ret;
+
+  if((ret = gnufdisk_string_new("%s", _s)) == NULL)
+    GNUFDISK_THROW(0, NULL, ENOMEM, NULL, "cannot allocate memory");
+
+  if(gnufdisk_exception_register_unwind_handler(&apply_string_delete, ret) != 0)
+    GNUFDISK_WARNING("gnufdisk_exception_register_unwind_handler failed.");
+
+  return ret;
+}
+
+static void apply_string_release(struct gnufdisk_string* _s)
+{
+  if(gnufdisk_exception_unregister_unwind_handler(&apply_string_delete, _s) != 0)
+    GNUFDISK_WARNING("gnufdisk_exception_unregister_unwind_handler failed.");
+
+  gnufdisk_string_delete(_s);
+}
+
+static int apply_throw_handler(void* _data, struct gnufdisk_exception_info* _info, void* _edata)
+{
+  return -1;
+}
+
+static gnufdisk_integer apply_sector_size(struct gnufdisk_device* _dev)
+{
+  struct gnufdisk_string* param;
+  gnufdisk_integer ret;
+
+  param = apply_string_new("SECTOR-SIZE");
+
+  ret = 0;
+  gnufdisk_device_get_parameter(_dev, param, &ret, sizeof(ret));
+
+  apply_string_release(param);
+
+  if(ret <= 0)
+    GNUFDISK_THROW(0, NULL, EINVAL, NULL, "invalid sector size: %lld", ret);
+
+  return ret;
+}
+
+/* sectors the device discarded or wiped, the data there is gone even if
+ * the old disklabel is written back */
+static gnufdisk_integer apply_trimmed(struct gnufdisk_device* _dev)
+{
+  volatile gnufdisk_integer ret;
+
+  ret = 0;
+
+  GNUFDISK_TRY(&apply_throw_handler, NULL)
+    {
+      struct gnufdisk_string* param;
+      gnufdisk_integer trimmed;
+
+      param = apply_string_new("TRIMMED");
+
+      trimmed = 0;
+      gnufdisk_device_get_parameter(_dev, param, &trimmed, sizeof(trimmed));
+      ret = trimmed;
+
+      apply_string_release(param);
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      ;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  return ret;
+}
+
+/* same placement as gnufdisk-batch: a partition without a start follows
+ * the previous one of its disklabel on the next alignment boundary, and
+ * the disklabel may move the boundaries by half the alignment */
+static void apply_partition(struct apply_labels* _labels,
+                            const struct gnufdisk_devicemanager_layout* _layout,
+                            size_t _n,
+                            gnufdisk_integer _ssize,
+                            gnufdisk_integer _tolerance)
+{
+  const struct gnufdisk_devicemanager_layout_partition* p;
+  struct gnufdisk_partition* part;
+  struct gnufdisk_string* type;
+  struct gnufdisk_range range;
+  gnufdisk_integer start;
+  gnufdisk_integer length;
+  gnufdisk_integer half;
+  size_t label;
+
+  p = &_layout->partitions[_n];
+
+  if(p->parent < -1 || p->parent >= (int) _n)
+    GNUFDISK_THROW(0, NULL, EINVAL, NULL, "partition %zu: invalid parent %d", _n, p->parent);
+
+  label = p->parent + 1;
+
+  if(_labels->labels[label] == NULL)
+    GNUFDISK_THROW(0, NULL, EINVAL, NULL, "partition %zu: partition %d has no disklabel", _n, p->parent);
+
+  if(p->length <= 0
+     || p->length_shift < 0
+     || p->length_shift > 62
+     || p->length > (LLONG_MAX - _ssize) >> p->length_shift)
+    GNUFDISK_THROW(0, NULL, EINVAL, NULL, "partition %zu: invalid length", _n);
+
+  if(p->length_shift)
+    length = ((p->length << p->length_shift) + _ssize - 1) / _ssize;
+  else
+    length = p->length;
+
+  if(p->start >= 0)
+    start = p->start;
+  else
+    start = (_labels->next[label] + _tolerance - 1) / _tolerance * _tolerance;
+
+  half = _tolerance / 2;
+
+  type = apply_string_new(p->type);
+
+  part = gnufdisk_disklabel_create_partition_range(_labels->labels[label],
+                                                   gnufdisk_range_make(start > half ? start - half : 0, 
+                                                                       (start > half ? half : start) + half),
+                                                   gnufdisk_range_make(start + length - 1 - half, 2 * half),
+                                                   type);
+
+  apply_string_release(type);
+
+  if(gnufdisk_exception_register_unwind_handler(&apply_partition_delete, part) != 0)
+    GNUFDISK_WARNING("gnufdisk_exception_register_unwind_handler failed.");
+
+  range = gnufdisk_partition_range(part);
+  _labels->next[label] = range.end;
+
+  if(gnufdisk_partition_have_disklabel(part))
+    {
+      _labels->labels[_n + 1] = gnufdisk_partition_disklabel(part);
+      _labels->next[_n + 1] = range.start;
+    }
+
+  if(gnufdisk_exception_unregister_unwind_handler(&apply_partition_delete, part) != 0)
+    GNUFDISK_WARNING("gnufdisk_exception_unregister_unwind_handler failed.");
+
+  gnufdisk_partition_delete(part);
+}
+
+static void apply_layout(struct gnufdisk_device* _dev,
+                         const struct gnufdisk_devicemanager_layout* _layout)
+{
+  struct apply_labels* labels;
+  struct gnufdisk_string* system;
+  gnufdisk_integer ssize;
+  gnufdisk_integer tolerance;
+  size_t iter;
+
+  ssize = apply_sector_size(_dev);
+  tolerance = (_layout->alignment > 0 ? _layout->alignment : 1024 * 1024) / ssize;
+
+  if(tolerance <= 0)
+    tolerance = 1;
+
+  if((labels = malloc(sizeof(struct apply_labels))) == NULL)
+    GNUFDISK_THROW(0, NULL, ENOMEM, NULL, "cannot allocate memory");
+
+  memset(labels, 0, sizeof(struct apply_labels));
+
+  if(gnufdisk_exception_register_unwind_handler(&apply_labels_delete, labels) != 0)
+    GNUFDISK_WARNING("gnufdisk_exception_register_unwind_handler failed.");
+
+  if((labels->labels = calloc(_layout->npartitions + 1, sizeof(struct gnufdisk_disklabel*))) == NULL
+     || (labels->next = calloc(_layout->npartitions + 1, sizeof(gnufdisk_integer))) == NULL)
+    GNUFDISK_THROW(0, NULL, ENOMEM, NULL, "cannot allocate memory");
+
+  labels->nlabels = _layout->npartitions + 1;
+
+  system = apply_string_new(_layout->system);
+
+  labels->labels[0] = gnufdisk_device_create_disklabel(_dev, system);
+  labels->next[0] = tolerance;
+
+  apply_string_release(system);
+
+  for(iter = 0; iter < _layout->npartitions; iter++)
+    apply_partition(labels, _layout, iter, ssize, tolerance);
+
+  if(gnufdisk_exception_unregister_unwind_handler(&apply_labels_delete, labels) != 0)
+    GNUFDISK_WARNING("gnufdisk_exception_unregister_unwind_handler failed.");
+
+  apply_labels_delete(labels);
+}
+
+static struct gnufdisk_device* apply_device_new(const struct gnufdisk_devicemanager_layout* _layout,
+                                                const char* _path)
+{
+  struct gnufdisk_string* module;
+  struct gnufdisk_string* options;
+  struct gnufdisk_string* path;
+  struct gnufdisk_device* ret;
+
+  module = apply_string_new(_layout->module);
+  options = apply_string_new(_layout->options ? _layout->options : "");
+  path = apply_string_new(_path);
+
+  ret = gnufdisk_device_new(module, options);
+
+  if(gnufdisk_exception_register_unwind_handler(&apply_device_delete, ret) != 0)
+    GNUFDISK_WARNING("gnufdisk_exception_register_unwind_handler failed.");
+
+  gnufdisk_device_open(ret, path);
+
+  if(gnufdisk_exception_unregister_unwind_handler(&apply_device_delete, ret) != 0)
+    GNUFDISK_WARNING("gnufdisk_exception_unregister_unwind_handler failed.");
+
+  apply_string_release(path);
+  apply_string_release(options);
+  apply_string_release(module);
+
+  return ret;
+}
+
+static int apply_release(struct gnufdisk_device* _dev, int _commit)
+{
+  int ret;
+
+  ret = 0;
+
+  GNUFDISK_TRY(&apply_throw_handler, NULL)
+    {
+      if(_commit)
+        gnufdisk_device_commit(_dev);
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      ret = -1;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  GNUFDISK_TRY(&apply_throw_handler, NULL)
+    {
+      gnufdisk_device_close(_dev);
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      ;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  GNUFDISK_TRY(&apply_throw_handler, NULL)
+    {
+      gnufdisk_device_delete(_dev);
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      ;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  return ret;
+}
+
+/* a second handle on the target holding its current disklabel, committed
+ * again if writing the new one fails. NULL if there is nothing to restore. */
+static struct gnufdisk_device* apply_backup(const struct gnufdisk_devicemanager_layout* _layout,
+                                            const char* _path)
+{
+  struct gnufdisk_device* ret;
+  volatile int restore;
+
+  ret = apply_device_new(_layout, _path);
+  restore = 1;
+
+  GNUFDISK_TRY(&apply_throw_handler, NULL)
+    {
+      gnufdisk_disklabel_delete(gnufdisk_device_disklabel(ret));
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      GNUFDISK_LOG((DEVICEMANAGER, "no disklabel to restore on %s: %s", _path, exception_info.message));
+      restore = 0;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  if(!restore)
+    {
+      apply_release(ret, 0);
+      ret = NULL;
+    }
+
+  return ret;
+}
+
+static void apply_target(const struct gnufdisk_devicemanager_layout* _layout,
+                         struct gnufdisk_devicemanager_apply_target* _target)
+{
+  struct gnufdisk_device* volatile dev;
+  struct gnufdisk_device* volatile backup;
+  volatile int committing;
+  gnufdisk_integer trimmed;
+
+  GNUFDISK_LOG((DEVICEMANAGER, "perform apply on %s", _target->path));
+
+  dev = NULL;
+  backup = NULL;
+  committing = 0;
+  trimmed = 0;
+
+  GNUFDISK_TRY(&apply_throw_handler, NULL)
+    {
+      dev = apply_device_new(_layout, _target->path);
+      backup = apply_backup(_layout, _target->path);
+
+      apply_layout(dev, _layout);
+
+      committing = 1;
+      gnufdisk_device_commit(dev);
+
+      _target->result = GNUFDISK_DEVICEMANAGER_APPLY_DONE;
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      GNUFDISK_LOG((DEVICEMANAGER,
+                    "caught an exception from %s:%d: %s",
+                    exception_info.file,
+                    exception_info.line,
+                    exception_info.message));
+
+      _target->error = exception_info.error;
+      snprintf(_target->message, sizeof(_target->message), "%s", exception_info.message);
+
+      /* nothing reaches the device before the commit */
+      _target->result = committing ? GNUFDISK_DEVICEMANAGER_APPLY_COMMIT_FAILED
+                                   : GNUFDISK_DEVICEMANAGER_APPLY_NOT_WRITTEN;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  if(dev)
+    {
+      if(_target->result == GNUFDISK_DEVICEMANAGER_APPLY_COMMIT_FAILED)
+        trimmed = apply_trimmed(dev);
+
+      apply_release(dev, 0);
+    }
+
+  if(trimmed > 0)
+    {
+      size_t length;
+
+      length = strlen(_target->message);
+      snprintf(_target->message + length, sizeof(_target->message) - length,
+               ", %lld sectors already discarded or wiped", (long long) trimmed);
+    }
+
+  if(backup)
+    {
+      int restore;
+
+      restore = _target->result == GNUFDISK_DEVICEMANAGER_APPLY_COMMIT_FAILED;
+
+      /* the old disklabel is still worth having, but not its lost data */
+      if(apply_release(backup, restore) == 0 && restore && trimmed == 0)
+        _target->result = GNUFDISK_DEVICEMANAGER_APPLY_ROLLED_BACK;
+    }
+
+  GNUFDISK_LOG((DEVICEMANAGER, "done perform apply on %s, result: %d", _target->path, _target->result));
+}
+
+/* the next target whose controller has a free slot, -1 once every target
+ * has been taken */
+static ssize_t apply_next(struct apply_state* _state)
+{
+  ssize_t ret;
+  size_t iter;
+  int pending;
+
+  pthread_mutex_lock(&_state->mutex);
+
+  for(;;)
+    {
+      ret = -1;
+      pending = 0;
+
+      for(iter = 0; iter < _state->ntargets; iter++)
+        {
+          struct apply_controller* c;
+
+          if(_state->taken[iter])
+            continue;
+
+          pending = 1;
+          c = &_state->controllers[_state->controller[iter]];
+
+          if(c->name == NULL || _state->per_controller == 0 || c->active < _state->per_controller)
+            {
+              _state->taken[iter] = 1;
+              c->active++;
+              ret = iter;
+              break;
+            }
+        }
+
+      if(ret != -1 || !pending)
+        break;
+
+      pthread_cond_wait(&_state->cond, &_state->mutex);
+    }
+
+  pthread_mutex_unlock(&_state->mutex);
+
+  return ret;
+}
+
+static void apply_done(struct apply_state* _state, size_t _target)
+{
+  pthread_mutex_lock(&_state->mutex);
+
+  _state->controllers[_state->controller[_target]].active--;
+  pthread_cond_broadcast(&_state->cond);
+
+  pthread_mutex_unlock(&_state->mutex);
+}
+
+static void* apply_worker(void* _p)
+{
+  struct apply_state* state;
+  ssize_t target;
+
+  state = _p;
+
+  while((target = apply_next(state)) != -1)
+    {
+      apply_target(state->layout, &state->targets[target]);
+      apply_done(state, target);
+    }
+
+  return NULL;
+}
+
+/* group the targets by controller, targets without one get a slot of
+ * their own with a NULL name */
+static void apply_controllers(struct apply_state* _state)
+{
+  size_t iter;
+
+  if((_state->controller = calloc(_state->ntargets, sizeof(size_t))) == NULL
+     || (_state->taken = calloc(_state->ntargets, 1)) == NULL
+     || (_state->controllers = calloc(_state->ntargets, sizeof(struct apply_controller))) == NULL)
+    GNUFDISK_THROW(0, NULL, ENOMEM, NULL, "cannot allocate memory");
+
+  for(iter = 0; iter < _state->ntargets; iter++)
+    {
+      const char* name;
+      size_t c;
+
+      name = _state->targets[iter].controller;
+
+      for(c = 0; c < _state->ncontrollers; c++)
+        if(name && _state->controllers[c].name && strcmp(name, _state->controllers[c].name) == 0)
+          break;
+
+      if(c == _state->ncontrollers)
+        _state->controllers[_state->ncontrollers++].name = name;
+
+      _state->controller[iter] = c;
+    }
+}
+
+static void apply_state_delete(void* _p)
+{
+  struct apply_state* state;
+
+  state = _p;
+
+  free(state->controller);
+  free(state->taken);
+  free(state->controllers);
+}
+
+static int apply_check_throw_handler(void* _data, struct gnufdisk_exception_info* _info, void* _edata)
+{
+  return -1;
+}
+
+int gnufdisk_devicemanager_apply(struct gnufdisk_devicemanager* _dm,
+                                 const struct gnufdisk_devicemanager_layout* _layout,
+                                 struct gnufdisk_devicemanager_apply_target* _targets,
+                                 size_t _ntargets,
+                                 size_t _nworkers,
+                                 size_t _per_controller)
+{
+  struct apply_state state;
+  pthread_t* workers;
+  size_t nworkers;
+  size_t iter;
+  int ret;
+
+  GNUFDISK_LOG((DEVICEMANAGER, "perform gnufdisk_devicemanager_apply on %zu targets", _ntargets));
+
+  memset(&state, 0, sizeof(state));
+  workers = NULL;
+  ret = 0;
+
+  GNUFDISK_TRY(&apply_check_throw_handler, _dm)
+    {
+      if(gnufdisk_check_memory(_dm, sizeof(struct gnufdisk_devicemanager), 0) != 0)
+        GNUFDISK_THROW(0, NULL, EFAULT, NULL, "invalid struct gnufdisk_devicemanager* %p", _dm);
+      else if(gnufdisk_check_memory((void*) _layout, sizeof(struct gnufdisk_devicemanager_layout), 1) != 0)
+        GNUFDISK_THROW(0, NULL, EFAULT, NULL, "invalid struct gnufdisk_devicemanager_layout* %p", _layout);
+      else if(_layout->module == NULL || _layout->system == NULL)
+        GNUFDISK_THROW(0, NULL, EINVAL, NULL, "the layout needs a module and a disklabel system");
+      else if(_layout->npartitions > 0
+              && gnufdisk_check_memory((void*) _layout->partitions,
+                                       sizeof(struct gnufdisk_devicemanager_layout_partition) * _layout->npartitions,
+                                       1) != 0)
+        GNUFDISK_THROW(0, NULL, EFAULT, NULL, "invalid layout partitions %p", _layout->partitions);
+      else if(_ntargets > 0
+              && gnufdisk_check_memory(_targets, sizeof(struct gnufdisk_devicemanager_apply_target) * _ntargets, 0) != 0)
+        GNUFDISK_THROW(0, NULL, EFAULT, NULL, "invalid targets %p", _targets);
+
+      state.layout = _layout;
+      state.targets = _targets;
+      state.ntargets = _ntargets;
+      state.per_controller = _per_controller;
+
+      if(gnufdisk_exception_register_unwind_handler(&apply_state_delete, &state) != 0)
+        GNUFDISK_WARNING("gnufdisk_exception_register_unwind_handler failed.");
+
+      apply_controllers(&state);
+
+      if(gnufdisk_exception_unregister_unwind_handler(&apply_state_delete, &state) != 0)
+        GNUFDISK_WARNING("gnufdisk_exception_unregister_unwind_handler failed.");
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      GNUFDISK_LOG((DEVICEMANAGER,
+                    "caught an exception from %s:%d: %s",
+                    exception_info.file,
+                    exception_info.line,
+                    exception_info.message));
+      gnufdisk_userinterface_error(_dm->userinterface, "can not apply layout: %s", exception_info.message);
+      ret = -1;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  if(ret == -1)
+    return -1;
+
+  for(iter = 0; iter < _ntargets; iter++)
+    {
+      _targets[iter].result = GNUFDISK_DEVICEMANAGER_APPLY_PENDING;
+      _targets[iter].error = 0;
+      _targets[iter].message[0] = '\0';
+    }
+
+  pthread_mutex_init(&state.mutex, NULL);
+  pthread_cond_init(&state.cond, NULL);
+
+  nworkers = _nworkers > 0 && _nworkers < _ntargets ? _nworkers : _ntargets;
+
+  /* the calling thread is one of the workers */
+  if(nworkers > 1 && (workers = calloc(nworkers - 1, sizeof(pthread_t))) != NULL)
+    {
+      for(iter = 0; iter < nworkers - 1; iter++)
+        if(pthread_create(&workers[iter], NULL, &apply_worker, &state) != 0)
+          break;
+
+      nworkers = iter + 1;
+    }
+
+  apply_worker(&state);
+
+  for(iter = 0; iter + 1 < nworkers; iter++)
+    pthread_join(workers[iter], NULL);
+
+  free(workers);
+  pthread_cond_destroy(&state.cond);
+  pthread_mutex_destroy(&state.mutex);
+  apply_state_delete(&state);
+
+  for(iter = 0; iter < _ntargets; iter++)
+    if(_targets[iter].result == GNUFDISK_DEVICEMANAGER_APPLY_DONE)
+      ret++;
+    else
+      gnufdisk_userinterface_error(_dm->userinterface, "%s: %s%s",
+                                   _targets[iter].path,
+                                   _targets[iter].message,
+                                   _targets[iter].result == GNUFDISK_DEVICEMANAGER_APPLY_NOT_WRITTEN
+                                   ? " (not written)"
+                                   : _targets[iter].result == GNUFDISK_DEVICEMANAGER_APPLY_ROLLED_BACK
+                                   ? " (rolled back)" : " (the device may be inconsistent)");
+
+  GNUFDISK_LOG((DEVICEMANAGER, "done perform gnufdisk_devicemanager_apply, result: %d", ret));
+
+  return ret;
+}
+
+/* gnufdisk_devicemanager_device_plan(): every request is sized and placed
+ * before the disklabel is touched, then the partitions are created and
+ * committed together. Sectors everywhere but in the requests. */
+
+struct plan_extent {
+  gnufdisk_integer next; /* first sector still free */
+  gnufdisk_integer end; /* last free sector */
+};
+
+struct plan_state {
+  struct gnufdisk_disklabel* disklabel;
+  struct gnufdisk_disklabel_snapshot* snapshot;
+  struct plan_extent* extents;
+  size_t nextents;
+  size_t* order; /* request indexes in placement order */
+  gnufdisk_integer* grains;
+  gnufdisk_integer* minimums;
+  int* created; /* numbers of the partitions created so far */
+  size_t ncreated;
+};
+
+static void plan_state_delete(void* _p)
+{
+  struct plan_state* state;
+
+  state = _p;
+
+  if(state->snapshot)
+    gnufdisk_disklabel_snapshot_delete(state->snapshot);
+
+  if(state->disklabel)
+    gnufdisk_disklabel_delete(state->disklabel);
+
+  free(state->extents);
+  free(state->order);
+  free(state->grains);
+  free(state->minimums);
+  free(state->created);
+}
+
+/* the disklabel as it was before the plan, the partitions come out in
+ * reverse order */
+static void plan_rollback(void* _p)
+{
+  struct plan_state* state;
+
+  state = _p;
+
+  while(state->ncreated > 0)
+    {
+      int number;
+
+      number = state->created[--state->ncreated];
+
+      GNUFDISK_TRY(&apply_throw_handler, NULL)
+        {
+          gnufdisk_disklabel_remove_partition(state->disklabel, number);
+        }
+      GNUFDISK_CATCH_DEFAULT
+        {
+          GNUFDISK_LOG((DEVICEMANAGER, "can not remove partition %d: %s", number, exception_info.message));
+        }
+      GNUFDISK_EXCEPTION_END;
+    }
+}
+
+/* a parameter of the device, _default if it does not have it */
+static gnufdisk_integer plan_device_parameter(struct gnufdisk_device* _dev, const char* _name, gnufdisk_integer _default)
+{
+  volatile gnufdisk_integer ret;
+
+  ret = _default;
+
+  GNUFDISK_TRY(&apply_throw_handler, NULL)
+    {
+      struct gnufdisk_string* param;
+      gnufdisk_integer value;
+
+      param = apply_string_new(_name);
+
+      value = 0;
+      gnufdisk_device_get_parameter(_dev, param, &value, sizeof(value));
+
+      apply_string_release(param);
+
+      if(value > 0)
+        ret = value;
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      GNUFDISK_LOG((DEVICEMANAGER, "no %s: %s", _name, exception_info.message));
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  return ret;
+}
+
+static gnufdisk_integer plan_disklabel_parameter(struct gnufdisk_disklabel* _disk, const char* _name)
+{
+  struct gnufdisk_string* param;
+  gnufdisk_integer ret;
+
+  param = apply_string_new(_name);
+
+  ret = 0;
+  gnufdisk_disklabel_get_parameter(_disk, param, &ret, sizeof(ret));
+
+  apply_string_release(param);
+
+  return ret;
+}
+
+static gnufdisk_integer plan_gcd(gnufdisk_integer _a, gnufdisk_integer _b)
+{
+  while(_b != 0)
+    {
+      gnufdisk_integer t;
+
+      t = _a % _b;
+      _a = _b;
+      _b = t;
+    }
+
+  return _a;
+}
+
+static gnufdisk_integer plan_round_up(gnufdisk_integer _value, gnufdisk_integer _grain)
+{
+  return (_value + _grain - 1) / _grain * _grain;
+}
+
+static gnufdisk_integer plan_round_down(gnufdisk_integer _value, gnufdisk_integer _grain)
+{
+  return _value / _grain * _grain;
+}
+
+/* the disklabel of _dev, or the GPT behind its protective MBR */
+static void plan_disklabel(struct plan_state* _state, struct gnufdisk_device* _dev)
+{
+  struct gnufdisk_disklabel_snapshot* snapshot;
+
+  _state->disklabel = gnufdisk_device_disklabel(_dev);
+  _state->snapshot = snapshot = gnufdisk_disklabel_snapshot(_state->disklabel);
+
+  if(snapshot->nrecords == 1
+     && snapshot->records[0].type == GNUFDISK_PARTITION_TYPE_GUID
+     && (snapshot->records[0].flags & GNUFDISK_PARTITION_HAVE_DISKLABEL))
+    {
+      struct gnufdisk_partition* part;
+      struct gnufdisk_disklabel* gpt;
+
+      part = gnufdisk_disklabel_partition(_state->disklabel, snapshot->records[0].number);
+
+      if(gnufdisk_exception_register_unwind_handler(&apply_partition_delete, part) != 0)
+        GNUFDISK_WARNING("gnufdisk_exception_register_unwind_handler failed.");
+
+      gpt = gnufdisk_partition_disklabel(part);
+
+      if(gnufdisk_exception_unregister_unwind_handler(&apply_partition_delete, part) != 0)
+        GNUFDISK_WARNING("gnufdisk_exception_unregister_unwind_handler failed.");
+
+      gnufdisk_partition_delete(part);
+
+      gnufdisk_disklabel_delete(_state->disklabel);
+      _state->disklabel = gpt;
+
+      _state->snapshot = NULL;
+      gnufdisk_disklabel_snapshot_delete(snapshot);
+      _state->snapshot = gnufdisk_disklabel_snapshot(_state->disklabel);
+    }
+}
+
+/* the holes between the partitions of the disklabel */
+static void plan_extents(struct plan_state* _state)
+{
+  struct gnufdisk_partition_record* records;
+  gnufdisk_integer first;
+  gnufdisk_integer last;
+  gnufdisk_integer next;
+  size_t nrecords;
+  size_t iter;
+
+  first = plan_disklabel_parameter(_state->disklabel, "FIRST-USABLE");
+  last = plan_disklabel_parameter(_state->disklabel, "LAST-USABLE");
+
+  records = _state->snapshot->records;
+  nrecords = _state->snapshot->nrecords;
+
+  if((_state->extents = calloc(nrecords + 1, sizeof(struct plan_extent))) == NULL)
+    GNUFDISK_THROW(0, NULL, ENOMEM, NULL, "cannot allocate memory");
+
+  /* by start, insertion sort: a disklabel holds a handful of partitions */
+  for(iter = 1; iter < nrecords; iter++)
+    {
+      struct gnufdisk_partition_record record;
+      size_t j;
+
+      record = records[iter];
+
+      for(j = iter; j > 0 && records[j - 1].start > record.start; j--)
+        records[j] = records[j - 1];
+
+      records[j] = record;
+    }
+
+  for(next = first, iter = 0; iter <= nrecords; iter++)
+    {
+      gnufdisk_integer end;
+
+      end = iter < nrecords ? records[iter].start - 1 : last;
+
+      if(end > last)
+        end = last;
+
+      if(end >= next)
+        {
+          _state->extents[_state->nextents].next = next;
+          _state->extents[_state->nextents].end = end;
+          _state->nextents++;
+        }
+
+      if(iter < nrecords && records[iter].start + records[iter].length > next)
+        next = records[iter].start + records[iter].length;
+    }
+}
+
+/* lengths and boundaries of every request, in sectors */
+static void plan_sizes(struct plan_state* _state,
+                       struct gnufdisk_devicemanager_plan_request* _requests,
+                       size_t _nrequests,
+                       gnufdisk_integer _ssize,
+                       gnufdisk_integer _minimum,
+                       gnufdisk_integer _optimal)
+{
+  gnufdisk_integer free_sectors;
+  gnufdisk_integer fixed;
+  int percent;
+  size_t iter;
+
+  if((_state->grains = calloc(_nrequests, sizeof(gnufdisk_integer))) == NULL
+     || (_state->minimums = calloc(_nrequests, sizeof(gnufdisk_integer))) == NULL)
+    GNUFDISK_THROW(0, NULL, ENOMEM, NULL, "cannot allocate memory");
+
+  for(free_sectors = 0, iter = 0; iter < _state->nextents; iter++)
+    free_sectors += _state->extents[iter].end - _state->extents[iter].next + 1;
+
+  for(fixed = 0, percent = 0, iter = 0; iter < _nrequests; iter++)
+    {
+      struct gnufdisk_devicemanager_plan_request* r;
+      gnufdisk_integer grain;
+
+      r = &_requests[iter];
+
+      if(r->size < 0 || r->min < 0 || r->max < 0 || r->percent < 0 || r->percent > 100)
+        GNUFDISK_THROW(0, NULL, EINVAL, NULL, "request %zu: invalid size", iter);
+      else if(r->size == 0 && r->percent == 0)
+        GNUFDISK_THROW(0, NULL, EINVAL, NULL, "request %zu: no size", iter);
+      else if(r->max > 0 && r->max < r->min)
+        GNUFDISK_THROW(0, NULL, EINVAL, NULL, "request %zu: max is below min", iter);
+      else if(r->type == NULL)
+        GNUFDISK_THROW(0, NULL, EINVAL, NULL, "request %zu: no type", iter);
+
+      grain = 1;
+
+      switch(r->alignment)
+        {
+        case GNUFDISK_DEVICEMANAGER_PLAN_ALIGN_DEFAULT:
+          grain = (1024 * 1024 + _ssize - 1) / _ssize;
+          grain = grain / plan_gcd(grain, _optimal / _ssize) * (_optimal / _ssize);
+          break;
+        case GNUFDISK_DEVICEMANAGER_PLAN_ALIGN_OPTIMAL:
+          grain = _optimal / _ssize;
+          break;
+        case GNUFDISK_DEVICEMANAGER_PLAN_ALIGN_MINIMUM:
+          grain = _minimum / _ssize;
+          break;
+        case GNUFDISK_DEVICEMANAGER_PLAN_ALIGN_SECTOR:
+          grain = 1;
+          break;
+        default:
+          GNUFDISK_THROW(0, NULL, EINVAL, NULL, "request %zu: invalid alignment %d", iter, r->alignment);
+        }
+
+      _state->grains[iter] = grain > 0 ? grain : 1;
+
+      /* sized requests get at least what they asked for */
+      if(r->size > 0)
+        {
+          r->length = plan_round_up((r->size + _ssize - 1) / _ssize, _state->grains[iter]);
+          fixed += r->length;
+        }
+      else
+        percent += r->percent;
+    }
+
+  if(percent > 100)
+    GNUFDISK_THROW(0, NULL, EINVAL, NULL, "the requests take %d%% of the free space", percent);
+
+  for(iter = 0; iter < _nrequests; iter++)
+    {
+      struct gnufdisk_devicemanager_plan_request* r;
+      gnufdisk_integer grain;
+      gnufdisk_integer min;
+
+      r = &_requests[iter];
+      grain = _state->grains[iter];
+
+      if(r->size == 0)
+        r->length = plan_round_down(free_sectors > fixed ? (free_sectors - fixed) * r->percent / 100 : 0, grain);
+
+      min = plan_round_up((r->min + _ssize - 1) / _ssize, grain);
+
+      if(min < grain)
+        min = grain;
+
+      if(r->length < min)
+        r->length = min;
+
+      if(r->max > 0 && r->length > r->max / _ssize)
+        r->length = plan_round_down(r->max / _ssize, grain);
+
+      if(r->length < min)
+        GNUFDISK_THROW(0, NULL, EINVAL, NULL, "request %zu: max is below one alignment boundary", iter);
+
+      _state->minimums[iter] = min;
+      r->start = -1;
+    }
+}
+
+/* first fit, in placement order. A percentage that does not fit takes the
+ * largest hole still holding its minimum. */
+static void plan_place(struct plan_state* _state,
+                       struct gnufdisk_devicemanager_plan_request* _requests,
+                       size_t _nrequests)
+{
+  size_t iter;
+
+  if((_state->order = calloc(_nrequests, sizeof(size_t))) == NULL)
+    GNUFDISK_THROW(0, NULL, ENOMEM, NULL, "cannot allocate memory");
+
+  for(iter = 0; iter < _nrequests; iter++)
+    {
+      size_t j;
+
+      for(j = iter; j > 0 && _requests[_state->order[j - 1]].order > _requests[iter].order; j--)
+        _state->order[j] = _state->order[j - 1];
+
+      _state->order[j] = iter;
+    }
+
+  for(iter = 0; iter < _nrequests; iter++)
+    {
+      struct gnufdisk_devicemanager_plan_request* r;
+      struct plan_extent* best;
+      gnufdisk_integer best_length;
+      gnufdisk_integer grain;
+      size_t n;
+      size_t e;
+
+      n = _state->order[iter];
+      r = &_requests[n];
+      grain = _state->grains[n];
+      best = NULL;
+      best_length = 0;
+
+      for(e = 0; e < _state->nextents; e++)
+        {
+          gnufdisk_integer start;
+          gnufdisk_integer length;
+
+          start = plan_round_up(_state->extents[e].next, grain);
+          length = plan_round_down(_state->extents[e].end + 1 - start, grain);
+
+          if(start > _state->extents[e].end)
+            continue;
+
+          if(length >= r->length)
+            {
+              best = &_state->extents[e];
+              best_length = r->length;
+              break;
+            }
+          else if(r->size == 0 && length >= _state->minimums[n] && length > best_length)
+            {
+              best = &_state->extents[e];
+              best_length = length;
+            }
+        }
+
+      if(best == NULL)
+        GNUFDISK_THROW(0, NULL, ENOSPC, NULL, "request %zu: no free space for %lld sectors", n, r->length);
+
+      r->start = plan_round_up(best->next, grain);
+      r->length = best_length;
+      best->next = r->start + r->length;
+
+      GNUFDISK_LOG((DEVICEMANAGER, "request %zu: start %lld, length %lld, grain %lld",
+                    n, r->start, r->length, grain));
+    }
+}
+
+/* one-sector windows: a disklabel that would round onto a coarser grain
+ * (the MBR track) has no boundary of it inside and keeps the planned one */
+static void plan_create(struct plan_state* _state,
+                        struct gnufdisk_devicemanager_plan_request* _requests,
+                        size_t _nrequests)
+{
+  size_t iter;
+
+  if((_state->created = calloc(_nrequests, sizeof(int))) == NULL)
+    GNUFDISK_THROW(0, NULL, ENOMEM, NULL, "cannot allocate memory");
+
+  for(iter = 0; iter < _nrequests; iter++)
+    {
+      struct gnufdisk_devicemanager_plan_request* r;
+      struct gnufdisk_partition* part;
+      struct gnufdisk_string* type;
+      struct gnufdisk_range range;
+      gnufdisk_integer end;
+      size_t n;
+
+      n = _state->order[iter];
+      r = &_requests[n];
+      end = r->start + r->length - 1;
+
+      type = apply_string_new(r->type);
+
+      part = gnufdisk_disklabel_create_partition_range(_state->disklabel,
+                                                       gnufdisk_range_make(r->start, 0),
+                                                       gnufdisk_range_make(end, 0),
+                                                       type);
+
+      apply_string_release(type);
+
+      if(gnufdisk_exception_register_unwind_handler(&apply_partition_delete, part) != 0)
+        GNUFDISK_WARNING("gnufdisk_exception_register_unwind_handler failed.");
+
+      _state->created[_state->ncreated++] = gnufdisk_partition_number(part);
+
+      /* where the disklabel did put it */
+      range = gnufdisk_partition_range(part);
+      r->start = range.start;
+      r->length = range.end - range.start;
+
+      if(gnufdisk_exception_unregister_unwind_handler(&apply_partition_delete, part) != 0)
+        GNUFDISK_WARNING("gnufdisk_exception_unregister_unwind_handler failed.");
+
+      gnufdisk_partition_delete(part);
+    }
+}
+
+static int device_plan_throw_handler(void* _data, struct gnufdisk_exception_info* _info, void* _edata)
+{
+  return -1;
+}
+
+int gnufdisk_devicemanager_device_plan(struct gnufdisk_devicemanager* _dm,
+                                       struct gnufdisk_device* _dev,
+                                       struct gnufdisk_devicemanager_plan_request* _requests,
+                                       size_t _nrequests,
+                                       int _commit)
+{
+  struct plan_state state;
+  int ret;
+
+  GNUFDISK_LOG((DEVICEMANAGER, "perform device_plan of %zu requests on struct gnufdisk_device* %p", _nrequests, _dev));
+
+  memset(&state, 0, sizeof(state));
+  ret = 0;
+
+  GNUFDISK_TRY(&device_plan_throw_handler, _dm)
+    {
+      gnufdisk_integer ssize;
+      gnufdisk_integer minimum;
+      gnufdisk_integer optimal;
+
+      if(gnufdisk_check_memory(_dm, sizeof(struct gnufdisk_devicemanager), 0) != 0)
+        GNUFDISK_THROW(0, NULL, EFAULT, NULL, "invalid struct gnufdisk_devicemanager* %p", _dm);
+      else if(_nrequests > 0
+              && gnufdisk_check_memory(_requests, sizeof(struct gnufdisk_devicemanager_plan_request) * _nrequests, 0) != 0)
+        GNUFDISK_THROW(0, NULL, EFAULT, NULL, "invalid requests %p", _requests);
+
+      if(gnufdisk_exception_register_unwind_handler(&plan_state_delete, &state) != 0)
+        GNUFDISK_WARNING("gnufdisk_exception_register_unwind_handler failed.");
+
+      ssize = apply_sector_size(_dev);
+      minimum = plan_device_parameter(_dev, "MINIMUM-ALIGNMENT", ssize);
+      optimal = plan_device_parameter(_dev, "OPTIMAL-ALIGNMENT", minimum);
+
+      GNUFDISK_LOG((DEVICEMANAGER, "sector size: %lld, minimum alignment: %lld, optimal alignment: %lld",
+                    ssize, minimum, optimal));
+
+      plan_disklabel(&state, _dev);
+      plan_extents(&state);
+      plan_sizes(&state, _requests, _nrequests, ssize, minimum, optimal);
+      plan_place(&state, _requests, _nrequests);
+
+      if(_commit)
+        {
+          if(gnufdisk_exception_register_unwind_handler(&plan_rollback, &state) != 0)
+            GNUFDISK_WARNING("gnufdisk_exception_register_unwind_handler failed.");
+
+          plan_create(&state, _requests, _nrequests);
+          gnufdisk_device_commit(_dev);
+
+          if(gnufdisk_exception_unregister_unwind_handler(&plan_rollback, &state) != 0)
+            GNUFDISK_WARNING("gnufdisk_exception_unregister_unwind_handler failed.");
+        }
+
+      if(gnufdisk_exception_unregister_unwind_handler(&plan_state_delete, &state) != 0)
+        GNUFDISK_WARNING("gnufdisk_exception_unregister_unwind_handler failed.");
+
+      plan_state_delete(&state);
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      GNUFDISK_LOG((DEVICEMANAGER,
+                    "caught an exception from %s:%d: %s",
+                    exception_info.file,
+                    exception_info.line,
+                    exception_info.message));
+      gnufdisk_userinterface_error(_dm->userinterface, "can not plan layout: %s", exception_info.message);
+      ret = -1;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  GNUFDISK_LOG((DEVICEMANAGER, "done perform device_plan, result: %d", ret));
+
+  return ret;
+}
+
+/* gnufdisk_devicemanager_watch_*(): the records of every target are kept
+ * between probes. An event only marks its targets pending; once the
+ * events settle the pending targets are opened again, their label
+ * sectors read, and the records that differ are reported. Nothing is
+ * read while no event comes. */
+
+#define WATCH_UEVENT_SIZE 8192
+#define WATCH_INOTIFY_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+struct watch_record {
+  int parent;
+  struct gnufdisk_partition_record record;
+};
+
+struct watch_target {
+  char* path;
+  char* devpath; /* DEVPATH of a block device, NULL for anything else */
+  int wd; /* inotify watch of an image file, -1: none */
+  int pending;
+  int error; /* of the last probe */
+  gnufdisk_integer sector_size;
+  uint64_t generation; /* of the last change */
+  struct watch_record* records; /* sorted by parent and number */
+  size_t nrecords;
+};
+
+struct gnufdisk_devicemanager_watch {
+  struct gnufdisk_devicemanager* dm;
+  struct gnufdisk_device* device; /* opened on one target at a time */
+  gnufdisk_devicemanager_watch_callback callback;
+  void* data;
+  struct watch_target* targets;
+  size_t ntargets;
+  size_t npending;
+  long long deadline; /* of the next update, CLOCK_MONOTONIC milliseconds */
+  int settle;
+  int uevent; /* kernel uevent socket, -1: none */
+  int inotify;
+  int stop[2];
+  volatile sig_atomic_t stopped;
+  uint64_t generation;
+  char* name; /* of the published segment */
+  int shm;
+  char* segment;
+  size_t length;
+};
+
+struct watch_probe {
+  struct watch_record* records;
+  size_t nrecords;
+  size_t size;
+};
+
+static int watch_throw_handler(void* _data, struct gnufdisk_exception_info* _info, void* _edata)
+{
+  return -1;
+}
+
+/* the seqlock of the writer: readers retry while the sequence is odd or
+ * has moved while they copied */
+static void watch_segment_begin(struct gnufdisk_shm_header* _header)
+{
+  __atomic_store_n(&_header->sequence, _header->sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void watch_segment_end(struct gnufdisk_shm_header* _header)
+{
+  __atomic_store_n(&_header->sequence, _header->sequence + 1, __ATOMIC_RELEASE);
+}
+
+static void watch_segment_close(struct gnufdisk_shm_header* _header)
+{
+  watch_segment_begin(_header);
+  _header->flags |= GNUFDISK_SHM_CLOSED;
+  watch_segment_end(_header);
+}
+
+static void watch_free(void* _p)
+{
+  struct gnufdisk_devicemanager_watch* watch;
+  size_t iter;
+
+  watch = _p;
+
+  for(iter = 0; iter < watch->ntargets; iter++)
+    {
+      free(watch->targets[iter].path);
+      free(watch->targets[iter].devpath);
+      free(watch->targets[iter].records);
+    }
+
+  free(watch->targets);
+
+  if(watch->device)
+    gnufdisk_device_delete(watch->device);
+
+  if(watch->uevent != -1)
+    close(watch->uevent);
+
+  if(watch->inotify != -1)
+    close(watch->inotify);
+
+  if(watch->stop[0] != -1)
+    {
+      close(watch->stop[0]);
+      close(watch->stop[1]);
+    }
+
+  /* readers keep what they mapped, and learn that it is closed */
+  if(watch->segment)
+    {
+      watch_segment_close((struct gnufdisk_shm_header*) watch->segment);
+      munmap(watch->segment, watch->length);
+    }
+
+  if(watch->shm != -1)
+    {
+      close(watch->shm);
+      shm_unlink(watch->name);
+    }
+
+  free(watch->name);
+  free(watch);
+}
+
+static void watch_probe_delete(void* _p)
+{
+  struct watch_probe* probe;
+
+  probe = _p;
+
+  free(probe->records);
+  memset(probe, 0, sizeof(struct watch_probe));
+}
+
+static void watch_snapshot_delete(void* _p)
+{
+  gnufdisk_disklabel_snapshot_delete(_p);
+}
+
+static void watch_disklabel_delete(void* _p)
+{
+  gnufdisk_disklabel_delete(_p);
+}
+
+static void watch_device_close(void* _p)
+{
+  GNUFDISK_TRY(&watch_throw_handler, NULL)
+    {
+      gnufdisk_device_close(_p);
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      GNUFDISK_LOG((DEVICEMANAGER, "can not close device: %s", exception_info.message));
+    }
+  GNUFDISK_EXCEPTION_END;
+}
+
+static long long watch_now(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+static void watch_mark(struct gnufdisk_devicemanager_watch* _watch, struct watch_target* _target)
+{
+  if(_target->pending)
+    return;
+
+  GNUFDISK_LOG((DEVICEMANAGER, "%s is pending", _target->path));
+
+  _target->pending = 1;
+
+  /* a burst of events is one update, however long it lasts */
+  if(_watch->npending++ == 0)
+    _watch->deadline = watch_now() + _watch->settle;
+}
+
+/* the events that name _target from now on: uevents for a block device,
+ * inotify for an image file */
+static void watch_attach(struct gnufdisk_devicemanager_watch* _watch, struct watch_target* _target)
+{
+  struct stat st;
+
+  if(stat(_target->path, &st) != 0)
+    return;
+
+  if(S_ISBLK(st.st_mode) && _target->devpath == NULL)
+    {
+      char link[64];
+      char devpath[PATH_MAX];
+
+      snprintf(link, sizeof(link), "/sys/dev/block/%u:%u", major(st.st_rdev), minor(st.st_rdev));
+
+      if(realpath(link, devpath) != NULL && strncmp(devpath, "/sys/", 5) == 0
+         && (_target->devpath = strdup(devpath + 4)) == NULL)
+        GNUFDISK_THROW(0, NULL, ENOMEM, NULL, "cannot allocate memory");
+    }
+  else if(S_ISREG(st.st_mode) && _target->wd == -1 && _watch->inotify != -1)
+    _target->wd = inotify_add_watch(_watch->inotify, _target->path, WATCH_INOTIFY_MASK);
+
+  GNUFDISK_LOG((DEVICEMANAGER, "%s: devpath %s, inotify watch %d",
+                _target->path, _target->devpath ? _target->devpath : "-", _target->wd));
+}
+
+static int watch_uevent_socket(void)
+{
+  struct sockaddr_nl addr;
+  int ret;
+
+  if((ret = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT)) == -1)
+    return -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = 1; /* the kernel, udev rebroadcasts on 2 in its own format */
+
+  if(bind(ret, (struct sockaddr*) &addr, sizeof(addr)) != 0)
+    {
+      close(ret);
+      return -1;
+    }
+
+  return ret;
+}
+
+/* a block uevent names a disk, or one of its partitions below it */
+static int watch_uevent_mark(struct gnufdisk_devicemanager_watch* _watch, const char* _message, size_t _size)
+{
+  const char* subsystem;
+  const char* devpath;
+  const char* iter;
+  const char* end;
+  size_t target;
+  int ret;
+
+  subsystem = NULL;
+  devpath = NULL;
+  end = _message + _size;
+
+  for(iter = _message; iter < end; iter += strnlen(iter, end - iter) + 1)
+    if(strncmp(iter, "SUBSYSTEM=", 10) == 0)
+      subsystem = iter + 10;
+    else if(strncmp(iter, "DEVPATH=", 8) == 0)
+      devpath = iter + 8;
+
+  /* the last field may not be terminated */
+  if(_size == 0 || _message[_size - 1] != '\0'
+     || subsystem == NULL || devpath == NULL || strcmp(subsystem, "block") != 0)
+    return 0;
+
+  ret = 0;
+
+  for(target = 0; target < _watch->ntargets; target++)
+    {
+      struct watch_target* t;
+      size_t length;
+
+      t = &_watch->targets[target];
+
+      if(t->devpath == NULL)
+        continue;
+
+      length = strlen(t->devpath);
+
+      if(strncmp(devpath, t->devpath, length) == 0 && (devpath[length] == '\0' || devpath[length] == '/'))
+        {
+          watch_mark(_watch, t);
+          ret++;
+        }
+    }
+
+  return ret;
+}
+
+static void watch_read_uevents(struct gnufdisk_devicemanager_watch* _watch)
+{
+  char buf[WATCH_UEVENT_SIZE];
+
+  for(;;)
+    {
+      struct sockaddr_nl addr;
+      socklen_t length;
+      ssize_t n;
+
+      length = sizeof(addr);
+
+      if((n = recvfrom(_watch->uevent, buf, sizeof(buf), 0, (struct sockaddr*) &addr, &length)) < 0)
+        {
+          /* the socket overflowed: whatever was lost may be ours */
+          if(errno == ENOBUFS)
+            {
+              size_t iter;
+
+              for(iter = 0; iter < _watch->ntargets; iter++)
+                if(_watch->targets[iter].devpath)
+                  watch_mark(_watch, &_watch->targets[iter]);
+
+              continue;
+            }
+
+          break;
+        }
+
+      if(length == sizeof(addr) && addr.nl_pid == 0)
+        watch_uevent_mark(_watch, buf, n);
+    }
+}
+
+static void watch_read_inotify(struct gnufdisk_devicemanager_watch* _watch)
+{
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  ssize_t n;
+
+  while((n = read(_watch->inotify, buf, sizeof(buf))) > 0)
+    {
+      const struct inotify_event* event;
+      char* iter;
+
+      for(iter = buf; iter < buf + n; iter += sizeof(struct inotify_event) + event->len)
+        {
+          size_t target;
+
+          event = (const struct inotify_event*) iter;
+
+          for(target = 0; target < _watch->ntargets; target++)
+            {
+              struct watch_target* t;
+
+              t = &_watch->targets[target];
+
+              if(event->mask & IN_Q_OVERFLOW)
+                {
+                  if(t->wd != -1)
+                    watch_mark(_watch, t);
+                }
+              else if(t->wd == event->wd)
+                {
+                  watch_mark(_watch, t);
+
+                  /* replaced or removed, watched again by the next update */
+                  if(event->mask & IN_IGNORED)
+                    t->wd = -1;
+                }
+            }
+        }
+    }
+}
+
+static int watch_record_compare(const void* _a, const void* _b)
+{
+  const struct watch_record* a;
+  const struct watch_record* b;
+
+  a = _a;
+  b = _b;
+
+  if(a->parent != b->parent)
+    return a->parent < b->parent ? -1 : 1;
+
+  return a->record.number < b->record.number ? -1 : a->record.number > b->record.number ? 1 : 0;
+}
+
+static int watch_record_equal(const struct gnufdisk_partition_record* _a, const struct gnufdisk_partition_record* _b)
+{
+  return _a->start == _b->start
+    && _a->length == _b->length
+    && _a->type == _b->type
+    && _a->flags == _b->flags
+    && memcmp(_a->guid, _b->guid, sizeof(_a->guid)) == 0
+    && strncmp(_a->content, _b->content, sizeof(_a->content)) == 0;
+}
+
+/* the records of _disk and of the disklabels inside its partitions */
+static void watch_collect(struct gnufdisk_disklabel* _disk, int _parent, struct watch_probe* _probe)
+{
+  struct gnufdisk_disklabel_snapshot* snapshot;
+  size_t iter;
+
+  snapshot = gnufdisk_disklabel_snapshot(_disk);
+
+  if(gnufdisk_exception_register_unwind_handler(&watch_snapshot_delete, snapshot) != 0)
+    GNUFDISK_WARNING("gnufdisk_exception_register_unwind_handler failed.");
+
+  if(_probe->nrecords + snapshot->nrecords > _probe->size)
+    {
+      struct watch_record* records;
+      size_t size;
+
+      size = _probe->nrecords + snapshot->nrecords + 8;
+
+      if((records = realloc(_probe->records, size * sizeof(struct watch_record))) == NULL)
+        GNUFDISK_THROW(0, NULL, ENOMEM, NULL, "cannot allocate memory");
+
+      _probe->records = records;
+      _probe->size = size;
+    }
+
+  for(iter = 0; iter < snapshot->nrecords; iter++)
+    {
+      _probe->records[_probe->nrecords].parent = _parent;
+      memcpy(&_probe->records[_probe->nrecords].record, &snapshot->records[iter], sizeof(struct gnufdisk_partition_record));
+      _probe->nrecords++;
+    }
+
+  for(iter = 0; iter < snapshot->nrecords; iter++)
+    if(snapshot->records[iter].flags & GNUFDISK_PARTITION_HAVE_DISKLABEL)
+      {
+        struct gnufdisk_partition* part;
+        struct gnufdisk_disklabel* inner;
+
+        part = gnufdisk_disklabel_partition(_disk, snapshot->records[iter].number);
+
+        if(gnufdisk_exception_register_unwind_handler(&apply_partition_delete, part) != 0)
+          GNUFDISK_WARNING("gnufdisk_exception_register_unwind_handler failed.");
+
+        inner = gnufdisk_partition_disklabel(part);
+
+        if(gnufdisk_exception_register_unwind_handler(&watch_disklabel_delete, inner) != 0)
+          GNUFDISK_WARNING("gnufdisk_exception_register_unwind_handler failed.");
+
+        watch_collect(inner, snapshot->records[iter].number, _probe);
+
+        if(gnufdisk_exception_unregister_unwind_handler(&watch_disklabel_delete, inner) != 0)
+          GNUFDISK_WARNING("gnufdisk_exception_unregister_unwind_handler failed.");
+
+        gnufdisk_disklabel_delete(inner);
+
+        if(gnufdisk_exception_unregister_unwind_handler(&apply_partition_delete, part) != 0)
+          GNUFDISK_WARNING("gnufdisk_exception_unregister_unwind_handler failed.");
+
+        gnufdisk_partition_delete(part);
+      }
+
+  if(gnufdisk_exception_unregister_unwind_handler(&watch_snapshot_delete, snapshot) != 0)
+    GNUFDISK_WARNING("gnufdisk_exception_unregister_unwind_handler failed.");
+
+  gnufdisk_disklabel_snapshot_delete(snapshot);
+}
+
+/* open the target again: the probe reads the label sectors, not the
+ * disklabel kept from the previous open */
+static void watch_probe_target(struct gnufdisk_devicemanager_watch* _watch,
+                               struct watch_target* _target,
+                               struct watch_probe* _probe)
+{
+  struct gnufdisk_string* path;
+  struct gnufdisk_disklabel* disk;
+
+  path = apply_string_new(_target->path);
+
+  gnufdisk_device_open(_watch->device, path);
+
+  apply_string_release(path);
+
+  if(gnufdisk_exception_register_unwind_handler(&watch_device_close, _watch->device) != 0)
+    GNUFDISK_WARNING("gnufdisk_exception_register_unwind_handler failed.");
+
+  _target->sector_size = apply_sector_size(_watch->device);
+
+  disk = gnufdisk_device_disklabel(_watch->device);
+
+  if(gnufdisk_exception_register_unwind_handler(&watch_disklabel_delete, disk) != 0)
+    GNUFDISK_WARNING("gnufdisk_exception_register_unwind_handler failed.");
+
+  watch_collect(disk, 0, _probe);
+
+  if(gnufdisk_exception_unregister_unwind_handler(&watch_disklabel_delete, disk) != 0)
+    GNUFDISK_WARNING("gnufdisk_exception_unregister_unwind_handler failed.");
+
+  gnufdisk_disklabel_delete(disk);
+
+  if(gnufdisk_exception_unregister_unwind_handler(&watch_device_close, _watch->device) != 0)
+    GNUFDISK_WARNING("gnufdisk_exception_unregister_unwind_handler failed.");
+
+  /* an open image file or disk costs nothing to a watch, but holds it busy */
+  watch_device_close(_watch->device);
+}
+
+static void watch_event(struct gnufdisk_devicemanager_watch* _watch,
+                        struct watch_target* _target,
+                        enum gnufdisk_devicemanager_watch_change _change,
+                        const struct watch_record* _previous,
+                        const struct watch_record* _current)
+{
+  struct gnufdisk_devicemanager_watch_event event;
+
+  event.path = _target->path;
+  event.change = _change;
+  event.parent = _current ? _current->parent : _previous->parent;
+  event.previous = _previous ? &_previous->record : NULL;
+  event.current = _current ? &_current->record : NULL;
+
+  (*_watch->callback)(_watch->data, &event);
+}
+
+/* merge the two sorted record lists, return the number of events */
+static int watch_report(struct gnufdisk_devicemanager_watch* _watch,
+                        struct watch_target* _target,
+                        const struct watch_record* _records,
+                        size_t _nrecords)
+{
+  size_t previous;
+  size_t current;
+  int ret;
+
+  ret = 0;
+  previous = 0;
+  current = 0;
+
+  while(previous < _target->nrecords || current < _nrecords)
+    {
+      int order;
+
+      if(previous == _target->nrecords)
+        order = 1;
+      else if(current == _nrecords)
+        order = -1;
+      else
+        order = watch_record_compare(&_target->records[previous], &_records[current]);
+
+      if(order < 0)
+        {
+          watch_event(_watch, _target, GNUFDISK_DEVICEMANAGER_WATCH_REMOVED, &_target->records[previous], NULL);
+          previous++;
+          ret++;
+        }
+      else if(order > 0)
+        {
+          watch_event(_watch, _target, GNUFDISK_DEVICEMANAGER_WATCH_ADDED, NULL, &_records[current]);
+          current++;
+          ret++;
+        }
+      else
+        {
+          if(!watch_record_equal(&_target->records[previous].record, &_records[current].record))
+            {
+              watch_event(_watch, _target, GNUFDISK_DEVICEMANAGER_WATCH_CHANGED,
+                          &_target->records[previous], &_records[current]);
+              ret++;
+            }
+
+          previous++;
+          current++;
+        }
+    }
+
+  return ret;
+}
+
+struct gnufdisk_devicemanager_watch*
+gnufdisk_devicemanager_watch_new(struct gnufdisk_devicemanager* _dm,
+                                 const char* _module,
+                                 const char* _options,
+                                 const char* const* _paths,
+                                 size_t _npaths,
+                                 gnufdisk_devicemanager_watch_callback _callback,
+                                 void* _data)
+{
+  struct gnufdisk_devicemanager_watch* ret;
+
+  GNUFDISK_LOG((DEVICEMANAGER, "perform watch_new on %zu targets", _npaths));
+
+  ret = NULL;
+
+  GNUFDISK_TRY(&watch_throw_handler, _dm)
+    {
+      struct gnufdisk_devicemanager_watch* watch;
+      struct gnufdisk_string* module;
+      struct gnufdisk_string* options;
+      size_t iter;
+
+      if(gnufdisk_check_memory(_dm, sizeof(struct gnufdisk_devicemanager), 0) != 0)
+        GNUFDISK_THROW(0, NULL, EFAULT, NULL, "invalid struct gnufdisk_devicemanager* %p", _dm);
+      else if(_module == NULL || _callback == NULL)
+        GNUFDISK_THROW(0, NULL, EINVAL, NULL, "a watch needs a module and a callback");
+      else if(_npaths > 0 && gnufdisk_check_memory((void*) _paths, sizeof(const char*) * _npaths, 1) != 0)
+        GNUFDISK_THROW(0, NULL, EFAULT, NULL, "invalid paths %p", _paths);
+
+      if((watch = malloc(sizeof(struct gnufdisk_devicemanager_watch))) == NULL)
+        GNUFDISK_THROW(0, NULL, ENOMEM, NULL, "cannot allocate memory");
+
+      memset(watch, 0, sizeof(struct gnufdisk_devicemanager_watch));
+      watch->dm = _dm;
+      watch->callback = _callback;
+      watch->data = _data;
+      watch->uevent = -1;
+      watch->inotify = -1;
+      watch->stop[0] = -1;
+      watch->stop[1] = -1;
+      watch->shm = -1;
+
+      if(gnufdisk_exception_register_unwind_handler(&watch_free, watch) != 0)
+        GNUFDISK_WARNING("gnufdisk_exception_register_unwind_handler failed.");
+
+      if(pipe2(watch->stop, O_NONBLOCK | O_CLOEXEC) != 0)
+        {
+          watch->stop[0] = -1;
+          GNUFDISK_THROW(0, NULL, errno, NULL, "can not create pipe: %s", strerror(errno));
+        }
+
+      if((watch->targets = calloc(_npaths > 0 ? _npaths : 1, sizeof(struct watch_target))) == NULL)
+        GNUFDISK_THROW(0, NULL, ENOMEM, NULL, "cannot allocate memory");
+
+      module = apply_string_new(_module);
+
+      /* a watch never writes */
+      if((options = gnufdisk_string_new("%s%sreadonly",
+                                        _options ? _options : "",
+                                        _options && *_options ? "," : "")) == NULL)
+        GNUFDISK_THROW(0, NULL, ENOMEM, NULL, "cannot allocate memory");
+
+      if(gnufdisk_exception_register_unwind_handler(&apply_string_delete, options) != 0)
+        GNUFDISK_WARNING("gnufdisk_exception_register_unwind_handler failed.");
+
+      watch->device = gnufdisk_device_new(module, options);
+
+      apply_string_release(options);
+      apply_string_release(module);
+
+      /* the sockets exist before the first probe, nothing happening in
+       * between is lost */
+      if((watch->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+        GNUFDISK_LOG((DEVICEMANAGER, "no inotify: %s", strerror(errno)));
+
+      for(iter = 0; iter < _npaths; iter++)
+        {
+          watch->targets[iter].wd = -1;
+          watch->targets[iter].error = EAGAIN; /* not probed yet */
+
+          if((watch->targets[iter].path = strdup(_paths[iter])) == NULL)
+            GNUFDISK_THROW(0, NULL, ENOMEM, NULL, "cannot allocate memory");
+
+          watch->ntargets++;
+
+          watch_attach(watch, &watch->targets[iter]);
+          watch_mark(watch, &watch->targets[iter]);
+
+          if(watch->targets[iter].devpath && watch->uevent == -1
+             && (watch->uevent = watch_uevent_socket()) == -1)
+            GNUFDISK_LOG((DEVICEMANAGER, "no uevents: %s", strerror(errno)));
+        }
+
+      if(gnufdisk_exception_unregister_unwind_handler(&watch_free, watch) != 0)
+        GNUFDISK_WARNING("gnufdisk_exception_unregister_unwind_handler failed.");
+
+      ret = watch;
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      GNUFDISK_LOG((DEVICEMANAGER,
+                    "caught an exception from %s:%d: %s",
+                    exception_info.file,
+                    exception_info.line,
+                    exception_info.message));
+      gnufdisk_userinterface_error(_dm->userinterface, "can not watch devices: %s", exception_info.message);
+      ret = NULL;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  GNUFDISK_LOG((DEVICEMANAGER, "done perform watch_new, result: %p", ret));
+
+  return ret;
+}
+
+static void watch_check(struct gnufdisk_devicemanager_watch* _watch)
+{
+  if(gnufdisk_check_memory(_watch, sizeof(struct gnufdisk_devicemanager_watch), 0) != 0)
+    GNUFDISK_THROW(0, NULL, EFAULT, NULL, "invalid struct gnufdisk_devicemanager_watch* %p", _watch);
+}
+
+int gnufdisk_devicemanager_watch_delete(struct gnufdisk_devicemanager_watch* _watch)
+{
+  int ret;
+
+  ret = 0;
+
+  GNUFDISK_TRY(&watch_throw_handler, NULL)
+    {
+      watch_check(_watch);
+      watch_free(_watch);
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      ret = -1;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  return ret;
+}
+
+int gnufdisk_devicemanager_watch_uevent(struct gnufdisk_devicemanager_watch* _watch,
+                                        const char* _message,
+                                        size_t _size)
+{
+  int ret;
+
+  ret = 0;
+
+  GNUFDISK_TRY(&watch_throw_handler, NULL)
+    {
+      watch_check(_watch);
+
+      if(_size > 0 && gnufdisk_check_memory((void*) _message, _size, 1) != 0)
+        GNUFDISK_THROW(0, NULL, EFAULT, NULL, "invalid uevent %p", _message);
+
+      ret = watch_uevent_mark(_watch, _message, _size);
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      ret = -1;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  return ret;
+}
+
+int gnufdisk_devicemanager_watch_notify(struct gnufdisk_devicemanager_watch* _watch,
+                                        const char* _path)
+{
+  int ret;
+
+  ret = 0;
+
+  GNUFDISK_TRY(&watch_throw_handler, NULL)
+    {
+      size_t iter;
+
+      watch_check(_watch);
+
+      if(gnufdisk_check_memory((void*) _path, 1, 1) != 0)
+        GNUFDISK_THROW(0, NULL, EFAULT, NULL, "invalid path %p", _path);
+
+      for(iter = 0; iter < _watch->ntargets; iter++)
+        if(strcmp(_watch->targets[iter].path, _path) == 0)
+          {
+            watch_mark(_watch, &_watch->targets[iter]);
+            ret++;
+          }
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      ret = -1;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  return ret;
+}
+
+/* rewrite the segment from the records of every target */
+static void watch_publish(struct gnufdisk_devicemanager_watch* _watch)
+{
+  struct gnufdisk_shm_header* header;
+  struct gnufdisk_shm_device* devices;
+  struct gnufdisk_shm_record* records;
+  size_t nrecords;
+  size_t size;
+  size_t path;
+  size_t iter;
+
+  nrecords = 0;
+  size = sizeof(struct gnufdisk_shm_header) + _watch->ntargets * sizeof(struct gnufdisk_shm_device);
+
+  for(iter = 0; iter < _watch->ntargets; iter++)
+    {
+      nrecords += _watch->targets[iter].nrecords;
+      size += _watch->targets[iter].nrecords * sizeof(struct gnufdisk_shm_record);
+      size += strlen(_watch->targets[iter].path) + 1;
+    }
+
+  if(size > UINT32_MAX)
+    GNUFDISK_THROW(0, NULL, EOVERFLOW, NULL, "too many partitions to publish");
+
+  /* grown before the update: readers remap when they see the new size */
+  if(size > _watch->length)
+    {
+      size_t page;
+      size_t length;
+      void* segment;
+
+      page = sysconf(_SC_PAGESIZE);
+      length = (size * 2 + page - 1) / page * page;
+
+      if(ftruncate(_watch->shm, length) != 0)
+        GNUFDISK_THROW(0, NULL, errno, NULL, "can not grow %s: %s", _watch->name, strerror(errno));
+
+      if(_watch->segment)
+        segment = mremap(_watch->segment, _watch->length, length, MREMAP_MAYMOVE);
+      else
+        segment = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, _watch->shm, 0);
+
+      if(segment == MAP_FAILED)
+        GNUFDISK_THROW(0, NULL, errno, NULL, "can not map %s: %s", _watch->name, strerror(errno));
+
+      if(_watch->segment == NULL)
+        memcpy(segment, GNUFDISK_SHM_MAGIC, 8);
+
+      _watch->segment = segment;
+      _watch->length = length;
+    }
+
+  header = (struct gnufdisk_shm_header*) _watch->segment;
+
+  watch_segment_begin(header);
+
+  header->ndevices = _watch->ntargets;
+  header->nrecords = nrecords;
+  header->devices = sizeof(struct gnufdisk_shm_header);
+  header->records = header->devices + _watch->ntargets * sizeof(struct gnufdisk_shm_device);
+
+  devices = (struct gnufdisk_shm_device*) (_watch->segment + header->devices);
+  records = (struct gnufdisk_shm_record*) (_watch->segment + header->records);
+  path = header->records + nrecords * sizeof(struct gnufdisk_shm_record);
+  nrecords = 0;
+
+  for(iter = 0; iter < _watch->ntargets; iter++)
+    {
+      struct watch_target* target;
+      size_t record;
+
+      target = &_watch->targets[iter];
+
+      memset(&devices[iter], 0, sizeof(struct gnufdisk_shm_device));
+      devices[iter].path = path;
+      devices[iter].first = nrecords;
+      devices[iter].nrecords = target->nrecords;
+      devices[iter].error = target->error;
+      devices[iter].sector_size = target->sector_size;
+      devices[iter].generation = target->generation;
+
+      strcpy(_watch->segment + path, target->path);
+      path += strlen(target->path) + 1;
+
+      for(record = 0; record < target->nrecords; record++, nrecords++)
+        {
+          const struct watch_record* r;
+          struct gnufdisk_shm_record* dest;
+
+          r = &target->records[record];
+          dest = &records[nrecords];
+
+          memset(dest, 0, sizeof(struct gnufdisk_shm_record));
+          dest->start = r->record.start;
+          dest->length = r->record.length;
+          dest->number = r->record.number;
+          dest->parent = r->parent;
+          dest->type = r->record.type;
+          dest->flags = r->record.flags;
+          memcpy(dest->guid, r->record.guid, sizeof(dest->guid));
+          memcpy(dest->content, r->record.content, sizeof(dest->content));
+        }
+    }
+
+  __atomic_store_n(&header->size, size, __ATOMIC_RELAXED);
+  __atomic_store_n(&header->generation, _watch->generation, __ATOMIC_RELEASE);
+
+  watch_segment_end(header);
+
+  GNUFDISK_LOG((DEVICEMANAGER, "published generation %llu, %zu bytes",
+                (unsigned long long) _watch->generation, size));
+}
+
+int gnufdisk_devicemanager_watch_update(struct gnufdisk_devicemanager_watch* _watch)
+{
+  size_t iter;
+  int changed;
+  int ret;
+
+  GNUFDISK_LOG((DEVICEMANAGER, "perform watch_update on struct gnufdisk_devicemanager_watch* %p", _watch));
+
+  ret = 0;
+
+  GNUFDISK_TRY(&watch_throw_handler, NULL)
+    {
+      watch_check(_watch);
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      ret = -1;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  if(ret == -1)
+    return -1;
+
+  changed = 0;
+
+  for(iter = 0; iter < _watch->ntargets; iter++)
+    {
+      struct watch_target* target;
+      struct watch_probe probe;
+      int events;
+      int error;
+
+      target = &_watch->targets[iter];
+
+      if(!target->pending)
+        continue;
+
+      /* the callback may mark it again */
+      target->pending = 0;
+      _watch->npending--;
+
+      memset(&probe, 0, sizeof(probe));
+      error = 0;
+
+      GNUFDISK_TRY(&watch_throw_handler, _watch->dm)
+        {
+          if(gnufdisk_exception_register_unwind_handler(&watch_probe_delete, &probe) != 0)
+            GNUFDISK_WARNING("gnufdisk_exception_register_unwind_handler failed.");
+
+          if(target->devpath == NULL && target->wd == -1)
+            watch_attach(_watch, target);
+
+          watch_probe_target(_watch, target, &probe);
+
+          if(gnufdisk_exception_unregister_unwind_handler(&watch_probe_delete, &probe) != 0)
+            GNUFDISK_WARNING("gnufdisk_exception_unregister_unwind_handler failed.");
+        }
+      GNUFDISK_CATCH_DEFAULT
+        {
+          GNUFDISK_LOG((DEVICEMANAGER,
+                        "caught an exception from %s:%d: %s",
+                        exception_info.file,
+                        exception_info.line,
+                        exception_info.message));
+          gnufdisk_userinterface_error(_watch->dm->userinterface, "can not probe %s: %s",
+                                       target->path, exception_info.message);
+          error = exception_info.error != 0 ? exception_info.error : EIO;
+        }
+      GNUFDISK_EXCEPTION_END;
+
+      qsort(probe.records, probe.nrecords, sizeof(struct watch_record), &watch_record_compare);
+
+      events = watch_report(_watch, target, probe.records, probe.nrecords);
+
+      free(target->records);
+      target->records = probe.records;
+      target->nrecords = probe.nrecords;
+
+      if(events > 0 || error != target->error)
+        {
+          target->error = error;
+          target->generation = _watch->generation + 1;
+          changed = 1;
+        }
+
+      ret += events;
+    }
+
+  if(changed)
+    {
+      _watch->generation++;
+
+      if(_watch->shm != -1)
+        {
+          GNUFDISK_TRY(&watch_throw_handler, _watch->dm)
+            {
+              watch_publish(_watch);
+            }
+          GNUFDISK_CATCH_DEFAULT
+            {
+              gnufdisk_userinterface_error(_watch->dm->userinterface, "can not publish %s: %s",
+                                           _watch->name, exception_info.message);
+            }
+          GNUFDISK_EXCEPTION_END;
+        }
+    }
+
+  GNUFDISK_LOG((DEVICEMANAGER, "done perform watch_update, result: %d", ret));
+
+  return ret;
+}
+
+int gnufdisk_devicemanager_watch_publish(struct gnufdisk_devicemanager_watch* _watch,
+                                         const char* _name)
+{
+  int ret;
+
+  GNUFDISK_LOG((DEVICEMANAGER, "perform watch_publish of struct gnufdisk_devicemanager_watch* %p as %s", _watch, _name));
+
+  ret = 0;
+
+  GNUFDISK_TRY(&watch_throw_handler, NULL)
+    {
+      watch_check(_watch);
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      ret = -1;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  if(ret == -1)
+    return -1;
+
+  GNUFDISK_TRY(&watch_throw_handler, _watch->dm)
+    {
+      int shm;
+
+      if(_watch->shm != -1)
+        GNUFDISK_THROW(0, NULL, EBUSY, NULL, "already published as %s", _watch->name);
+      else if(gnufdisk_check_memory((void*) _name, 1, 1) != 0)
+        GNUFDISK_THROW(0, NULL, EFAULT, NULL, "invalid name %p", _name);
+
+      /* a segment left by a publisher that died: its readers are told to
+       * open the new one, then it goes away */
+      if((shm = shm_open(_name, O_RDWR | O_CLOEXEC, 0)) != -1)
+        {
+          struct stat st;
+          void* segment;
+
+          if(fstat(shm, &st) == 0 && st.st_size >= (off_t) sizeof(struct gnufdisk_shm_header)
+             && (segment = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm, 0)) != MAP_FAILED)
+            {
+              if(memcmp(segment, GNUFDISK_SHM_MAGIC, 8) == 0)
+                watch_segment_close(segment);
+
+              munmap(segment, st.st_size);
+            }
+
+          close(shm);
+          shm_unlink(_name);
+        }
+
+      if((_watch->name = strdup(_name)) == NULL)
+        GNUFDISK_THROW(0, NULL, ENOMEM, NULL, "cannot allocate memory");
+
+      if((_watch->shm = shm_open(_name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) == -1)
+        {
+          int error;
+
+          error = errno;
+          free(_watch->name);
+          _watch->name = NULL;
+
+          GNUFDISK_THROW(0, NULL, error, NULL, "can not create %s: %s", _name, strerror(error));
+        }
+
+      watch_publish(_watch);
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      GNUFDISK_LOG((DEVICEMANAGER,
+                    "caught an exception from %s:%d: %s",
+                    exception_info.file,
+                    exception_info.line,
+                    exception_info.message));
+      gnufdisk_userinterface_error(_watch->dm->userinterface, "can not publish %s: %s", _name, exception_info.message);
+      ret = -1;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  GNUFDISK_LOG((DEVICEMANAGER, "done perform watch_publish, result: %d", ret));
+
+  return ret;
+}
+
+int gnufdisk_devicemanager_watch_run(struct gnufdisk_devicemanager_watch* _watch,
+                                     int _settle)
+{
+  char byte;
+  int ret;
+
+  GNUFDISK_LOG((DEVICEMANAGER, "perform watch_run on struct gnufdisk_devicemanager_watch* %p", _watch));
+
+  ret = 0;
+
+  GNUFDISK_TRY(&watch_throw_handler, NULL)
+    {
+      watch_check(_watch);
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      ret = -1;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  if(ret == -1)
+    return -1;
+
+  _watch->settle = _settle > 0 ? _settle : 0;
+
+  while(!_watch->stopped)
+    {
+      struct pollfd fds[3];
+      nfds_t nfds;
+      int timeout;
+
+      timeout = -1;
+
+      if(_watch->npending > 0)
+        {
+          long long left;
+
+          left = _watch->deadline - watch_now();
+          timeout = left > 0 ? (left < INT_MAX ? left : INT_MAX) : 0;
+        }
+
+      if(timeout == 0)
+        {
+          gnufdisk_devicemanager_watch_update(_watch);
+          continue;
+        }
+
+      nfds = 0;
+      fds[nfds].fd = _watch->stop[0];
+      fds[nfds++].events = POLLIN;
+
+      if(_watch->uevent != -1)
+        {
+          fds[nfds].fd = _watch->uevent;
+          fds[nfds++].events = POLLIN;
+        }
+
+      if(_watch->inotify != -1)
+        {
+          fds[nfds].fd = _watch->inotify;
+          fds[nfds++].events = POLLIN;
+        }
+
+      if(poll(fds, nfds, timeout) < 0)
+        {
+          if(errno == EINTR)
+            continue;
+
+          gnufdisk_userinterface_error(_watch->dm->userinterface, "can not wait for events: %s", strerror(errno));
+          ret = -1;
+          break;
+        }
+
+      while(nfds-- > 1)
+        if(fds[nfds].revents & POLLIN)
+          {
+            if(fds[nfds].fd == _watch->uevent)
+              watch_read_uevents(_watch);
+            else
+              watch_read_inotify(_watch);
+          }
+    }
+
+  /* the next run waits again */
+  while(read(_watch->stop[0], &byte, 1) > 0);
+  _watch->stopped = 0;
+
+  GNUFDISK_LOG((DEVICEMANAGER, "done perform watch_run, result: %d", ret));
+
+  return ret;
+}
+
+void gnufdisk_devicemanager_watch_stop(struct gnufdisk_devicemanager_watch* _watch)
+{
+  ssize_t n;
+
+  _watch->stopped = 1;
+  n = write(_watch->stop[1], "", 1);
+  (void) n;
+}
+
+static int stats_throw_handler(void* _data, struct gnufdisk_exception_info* _info, void* _edata)
+{
+  return -1;
+}
+
+int gnufdisk_devicemanager_stats(struct gnufdisk_devicemanager* _dm,
+                                 int _operation,
+                                 struct gnufdisk_stats* _dest)
+{
+  int ret;
+
+  ret = 0;
+
+  GNUFDISK_TRY(&stats_throw_handler, _dm)
+    {
+      if(gnufdisk_check_memory(_dm, sizeof(struct gnufdisk_devicemanager), 0) != 0)
+        GNUFDISK_THROW(0, NULL, EFAULT, NULL, "invalid struct gnufdisk_devicemanager* %p", _dm);
+      else if(gnufdisk_check_memory(_dest, sizeof(struct gnufdisk_stats), 0) != 0)
+        GNUFDISK_THROW(0, NULL, EFAULT, NULL, "invalid struct gnufdisk_stats* %p", _dest);
+
+      /* out of range is how callers find the end of the list */
+      ret = gnufdisk_stats_get(_operation, _dest);
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      GNUFDISK_LOG((DEVICEMANAGER,
+                    "caught an exception from %s:%d: %s",
+                    exception_info.file,
+                    exception_info.line,
+                    exception_info.message));
+      gnufdisk_userinterface_error(_dm->userinterface, "can not get statistics: %s", exception_info.message);
+      ret = -1;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  return ret;
+}
+
+static int stats_reset_throw_handler(void* _data, struct gnufdisk_exception_info* _info, void* _edata)
+{
+  return -1;
+}
+
+int gnufdisk_devicemanager_stats_reset(struct gnufdisk_devicemanager* _dm)
+{
+  int ret;
+
+  ret = 0;
+
+  GNUFDISK_TRY(&stats_reset_throw_handler, _dm)
+    {
+      if(gnufdisk_check_memory(_dm, sizeof(struct gnufdisk_devicemanager), 0) != 0)
+        GNUFDISK_THROW(0, NULL, EFAULT, NULL, "invalid struct gnufdisk_devicemanager* %p", _dm);
+
+      gnufdisk_stats_reset();
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      GNUFDISK_LOG((DEVICEMANAGER,
+                    "caught an exception from %s:%d: %s",
+                    exception_info.file,
+                    exception_info.line,
+                    exception_info.message));
+      gnufdisk_userinterface_error(_dm->userinterface, "can not reset statistics: %s", exception_info.message);
+      ret = -1;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  return ret;
+}
+
+static int stats_prometheus_throw_handler(void* _data, struct gnufdisk_exception_info* _info, void* _edata)
+{
+  return -1;
+}
+
+struct gnufdisk_string* 
+gnufdisk_devicemanager_stats_prometheus(struct gnufdisk_devicemanager* _dm)
+{
+  struct gnufdisk_string* ret;
+
+  ret = NULL;
+
+  GNUFDISK_TRY(&stats_prometheus_throw_handler, _dm)
+    {
+      FILE* stream;
+      char* buf;
+      size_t size;
+
+      if(gnufdisk_check_memory(_dm, sizeof(struct gnufdisk_devicemanager), 0) != 0)
+        GNUFDISK_THROW(0, NULL, EFAULT, NULL, "invalid struct gnufdisk_devicemanager* %p", _dm);
+
+      if((stream = open_memstream(&buf, &size)) == NULL)
+        GNUFDISK_THROW(0, NULL, ENOMEM, NULL, "can not open memory stream: %s", strerror(errno));
+
+      gnufdisk_stats_print_prometheus(stream);
+      fclose(stream);
+
+      gnufdisk_exception_register_unwind_handler(&free, buf);
+
+      ret = gnufdisk_string_new("%s", buf);
+
+      gnufdisk_exception_unregister_unwind_handler(&free, buf);
+
+      free(buf);
+    }
+  GNUFDISK_CATCH_DEFAULT
+    {
+      GNUFDISK_LOG((DEVICEMANAGER,
+                    "caught an exception from %s:%d: %s",
+                    exception_info.file,
+                    exception_info.line,
+                    exception_info.message));
+      gnufdisk_userinterface_error(_dm->userinterface, "can not export statistics: %s", exception_info.message);
+      ret = NULL;
+    }
+  GNUFDISK_EXCEPTION_END;
+
+  return ret;
+}
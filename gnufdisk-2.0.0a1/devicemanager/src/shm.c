@@ -0,0 +1,268 @@
+/* GNU Fidsk (gnufdisk-shm), read the disklabels published by a watch.
+ *
+ * Copyright (C) 2011 Free Software Foundation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA. */
+
+/* The reader side of the seqlock: the sequence is read before and after
+ * copying the segment, the copy is good when both are the same even
+ * number. This library does not depend on the rest of gnufdisk. */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <gnufdisk-shm.h>
+
+#define SHM_SPINS 1024 /* retries before yielding to the publisher */
+#define SHM_YIELDS 1024 /* then give up */
+
+struct gnufdisk_shm {
+  int fd;
+  const char* map;
+  size_t length;
+  char* copy;
+  size_t capacity;
+  uint64_t sequence; /* of the copy, 1: none yet */
+};
+
+struct gnufdisk_shm* gnufdisk_shm_open(const char* _name)
+{
+  struct gnufdisk_shm* ret;
+  struct stat st;
+  void* map;
+  int fd;
+
+  if((fd = shm_open(_name, O_RDONLY | O_CLOEXEC, 0)) == -1)
+    return NULL;
+
+  if(fstat(fd, &st) != 0)
+    goto lb_close;
+
+  if(st.st_size < (off_t) sizeof(struct gnufdisk_shm_header))
+    {
+      errno = EPROTO;
+      goto lb_close;
+    }
+
+  if((map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    goto lb_close;
+
+  if(memcmp(map, GNUFDISK_SHM_MAGIC, 8) != 0)
+    {
+      munmap(map, st.st_size);
+      errno = EPROTO;
+      goto lb_close;
+    }
+
+  if((ret = malloc(sizeof(struct gnufdisk_shm))) == NULL)
+    {
+      munmap(map, st.st_size);
+      goto lb_close;
+    }
+
+  memset(ret, 0, sizeof(struct gnufdisk_shm));
+  ret->fd = fd;
+  ret->map = map;
+  ret->length = st.st_size;
+  ret->sequence = 1;
+
+  return ret;
+
+lb_close:
+  {
+    int error;
+
+    error = errno;
+    close(fd);
+    errno = error;
+  }
+
+  return NULL;
+}
+
+void gnufdisk_shm_close(struct gnufdisk_shm* _shm)
+{
+  munmap((void*) _shm->map, _shm->length);
+  close(_shm->fd);
+  free(_shm->copy);
+  free(_shm);
+}
+
+uint64_t gnufdisk_shm_generation(struct gnufdisk_shm* _shm)
+{
+  const struct gnufdisk_shm_header* header;
+
+  header = (const struct gnufdisk_shm_header*) _shm->map;
+
+  return __atomic_load_n(&header->generation, __ATOMIC_ACQUIRE);
+}
+
+/* the publisher made the segment larger than our mapping */
+static int shm_remap(struct gnufdisk_shm* _shm, size_t _size)
+{
+  struct stat st;
+  void* map;
+
+  if(fstat(_shm->fd, &st) != 0)
+    return -1;
+
+  if((size_t) st.st_size < _size)
+    {
+      errno = EPROTO;
+      return -1;
+    }
+
+  if((map = mremap((void*) _shm->map, _shm->length, st.st_size, MREMAP_MAYMOVE)) == MAP_FAILED)
+    return -1;
+
+  _shm->map = map;
+  _shm->length = st.st_size;
+
+  return 0;
+}
+
+static int shm_valid(const char* _copy, size_t _size)
+{
+  const struct gnufdisk_shm_header* header;
+  const struct gnufdisk_shm_device* devices;
+  size_t iter;
+
+  header = (const struct gnufdisk_shm_header*) _copy;
+
+  if(_size < sizeof(struct gnufdisk_shm_header)
+     || memcmp(header->magic, GNUFDISK_SHM_MAGIC, 8) != 0
+     || header->devices % 8 != 0
+     || header->records % 8 != 0
+     || header->devices > _size
+     || (_size - header->devices) / sizeof(struct gnufdisk_shm_device) < header->ndevices
+     || header->records > _size
+     || (_size - header->records) / sizeof(struct gnufdisk_shm_record) < header->nrecords)
+    return 0;
+
+  devices = (const struct gnufdisk_shm_device*) (_copy + header->devices);
+
+  for(iter = 0; iter < header->ndevices; iter++)
+    if(devices[iter].path >= _size
+       || memchr(_copy + devices[iter].path, '\0', _size - devices[iter].path) == NULL
+       || devices[iter].first > header->nrecords
+       || devices[iter].nrecords > header->nrecords - devices[iter].first)
+      return 0;
+
+  return 1;
+}
+
+int gnufdisk_shm_view(struct gnufdisk_shm* _shm, struct gnufdisk_shm_view* _view)
+{
+  const struct gnufdisk_shm_header* header;
+  int attempt;
+
+  for(attempt = 0; attempt < SHM_SPINS + SHM_YIELDS; attempt++)
+    {
+      uint64_t sequence;
+      uint64_t size;
+
+      if(attempt >= SHM_SPINS)
+        sched_yield();
+
+      header = (const struct gnufdisk_shm_header*) _shm->map;
+      sequence = __atomic_load_n(&header->sequence, __ATOMIC_ACQUIRE);
+
+      if(sequence & 1)
+        continue;
+
+      if(sequence != _shm->sequence)
+        {
+          size = __atomic_load_n(&header->size, __ATOMIC_RELAXED);
+
+          if(size > _shm->length)
+            {
+              if(shm_remap(_shm, size) != 0)
+                return -1;
+
+              continue;
+            }
+
+          if(size > _shm->capacity)
+            {
+              char* copy;
+
+              if((copy = realloc(_shm->copy, size)) == NULL)
+                return -1;
+
+              _shm->copy = copy;
+              _shm->capacity = size;
+            }
+
+          memcpy(_shm->copy, _shm->map, size);
+
+          __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+          if(__atomic_load_n(&header->sequence, __ATOMIC_RELAXED) != sequence)
+            continue;
+
+          if(!shm_valid(_shm->copy, size))
+            {
+              _shm->sequence = 1;
+              errno = EPROTO;
+              return -1;
+            }
+
+          _shm->sequence = sequence;
+        }
+
+      header = (const struct gnufdisk_shm_header*) _shm->copy;
+
+      if(header->flags & GNUFDISK_SHM_CLOSED)
+        {
+          errno = ESTALE;
+          return -1;
+        }
+
+      _view->generation = header->generation;
+      _view->ndevices = header->ndevices;
+      _view->devices = (const struct gnufdisk_shm_device*) (_shm->copy + header->devices);
+      _view->records = (const struct gnufdisk_shm_record*) (_shm->copy + header->records);
+      _view->base = _shm->copy;
+
+      return 0;
+    }
+
+  errno = EAGAIN;
+  return -1;
+}
+
+const struct gnufdisk_shm_device* gnufdisk_shm_find(const struct gnufdisk_shm_view* _view, const char* _path)
+{
+  size_t iter;
+
+  for(iter = 0; iter < _view->ndevices; iter++)
+    if(strcmp(_view->base + _view->devices[iter].path, _path) == 0)
+      return &_view->devices[iter];
+
+  return NULL;
+}
+
+const char* gnufdisk_shm_device_path(const struct gnufdisk_shm_view* _view, const struct gnufdisk_shm_device* _device)
+{
+  return _view->base + _device->path;
+}
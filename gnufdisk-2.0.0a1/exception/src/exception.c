@@ -24,7 +24,6 @@
 #include <stdarg.h>
 #include <signal.h>
 
-#define __USE_GNU
 #include <pthread.h>
 
 #include <gnufdisk-common.h>
@@ -60,17 +59,14 @@ struct exception
 };
 
 struct context {
-  pthread_t id;
   struct exception* current;
 };
 
-struct global_data {
-  struct context** threads;
-  int nthreads;
-};
-
-struct global_data gdata = {0};
-pthread_mutex_t gmutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+/* every thread has its own chain of try blocks, created on the first
+ * GNUFDISK_TRY of the thread and released by the outermost
+ * GNUFDISK_EXCEPTION_END. Threads never look at each other's context, so
+ * no lock is taken on the TRY/THROW path. */
+static __thread struct context* thread_context;
 
 static void fatal(const char* _file, const int _line, const char* _fmt, ...)
 {
@@ -136,98 +132,21 @@ static void exception_delete(struct exception* _e)
 
 static struct context* find_context(void)
 {
-  struct context* ret;
-  pthread_t id;
-  int iter;
-
-  ret = NULL;
-  id = pthread_self();
-
-  pthread_mutex_lock(&gmutex); /* lock global data */
-
-  for(iter = 0; iter < gdata.nthreads; iter++)
-    if(gdata.threads[iter] != NULL && pthread_equal(gdata.threads[iter]->id, id))
-      {
-        ret = gdata.threads[iter];
-        break;
-      }
-  
-  pthread_mutex_unlock(&gmutex); /* lock global data */
-
-  return ret;
+  return thread_context;
 }
 
 static struct context* get_context(void)
 {
-  struct context* ret;
-  pthread_t id;
-  int iter;
-
-  id = pthread_self();
-  ret = NULL;
-
-  pthread_mutex_lock(&gmutex); /* lock global data */
+  if(thread_context == NULL)
+    thread_context = xmalloc(sizeof(struct context));
 
-  ret = find_context();
-
-  /* if ret is NULL we need a new fresh context */
-  if(ret == NULL)
-    {
-      ret = xmalloc(sizeof(struct context));
-
-      ret->id = id;
-
-      for(iter = 0; iter < gdata.nthreads; iter++)
-        if(gdata.threads[iter] == NULL)
-          break;
-
-      if(iter == gdata.nthreads)
-        {
-          struct context** threads;
-          int nthreads;
-
-          /* expand global vector */
-
-          nthreads = gdata.nthreads + 4;
-          threads = xmalloc(sizeof(struct context*) * nthreads);
-          memset(threads, 0, sizeof(struct context*) * nthreads);
-
-          if(gdata.threads)
-            {
-              memcpy(threads, gdata.threads, sizeof(struct context) * gdata.nthreads);
-              free(gdata.threads);
-            }
-
-          gdata.threads = threads;
-          gdata.nthreads = nthreads;
-        }
-
-      gdata.threads[iter] = ret;
-    }
-
-  pthread_mutex_unlock(&gmutex);
-
-  return ret;
+  return thread_context;
 }
 
 static void context_delete(void)
 {
-  pthread_t id;
-  int iter;
-
-  id = pthread_self();
-
-  pthread_mutex_lock(&gmutex);
-
-  for(iter = 0; iter < gdata.nthreads; iter++)
-    if(gdata.threads[iter] != NULL && pthread_equal(gdata.threads[iter]->id, id))
-      {
-        free(gdata.threads[iter]);
-        gdata.threads[iter] = NULL;
-        break;
-      }
-
-  pthread_mutex_unlock(&gmutex);
+  free(thread_context);
+  thread_context = NULL;
 }
 
 static void call_unwind_handlers(struct exception* e)
@@ -0,0 +1,891 @@
+/* GNU Fidsk a program to manage partitions.
+ *
+ * Copyright (C) 2011 Free Software Foundation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA. */
+
+/* gnufdisk-batch: write a partition table described by a script, without
+ * the Guile user interface. The script is read from a file or from the
+ * standard input:
+ *
+ *   # comments and blank lines are ignored
+ *   label: gpt
+ *   2048 512M
+ *   -    1G    primary
+ *   -    4G    extended
+ *   -    1G    logical
+ *
+ * Every partition line is `START SIZE [TYPE]'. START is a sector number or
+ * `-' for the sector after the previous partition (1 MiB for the first
+ * one). SIZE is a number of sectors or a byte count with a K, M, G or T
+ * suffix. TYPE defaults to `primary'; logical partitions go in the last
+ * extended partition of the script. The disklabel may still move the
+ * boundaries to its own alignment.
+ *
+ * With -f the script is read from SCRIPT and every argument is a device:
+ * the same layout is written to all of them in parallel, at most JOBS at a
+ * time and at most N per controller (see gnufdisk_devicemanager_apply).
+ *
+ * With -w nothing is written: every DEVICE is watched and a line is
+ * printed for each partition that appears, changes or goes away, until
+ * the program is interrupted. Block devices are probed again on kernel
+ * uevents, image files when they are written.
+ *
+ *   /dev/sda add 1 2048 1048576 primary ext4
+ *   /dev/sda change 1 2048 2097152 primary ext4
+ *   disk.img remove 1.3
+ *
+ * A partition inside the disklabel of partition P is numbered P.N.
+ *
+ * With -p the partitions are also kept in the shared memory segment NAME,
+ * where other programs read them with libgnufdisk-shm (see gnufdisk-shm.h).
+ *
+ * The program provides its own non interactive userinterface, so the
+ * devicemanager reports errors on stderr and never asks questions. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <gnufdisk-common.h>
+#include <gnufdisk-debug.h>
+#include <gnufdisk-exception.h>
+#include <gnufdisk-device.h>
+#include <gnufdisk-userinterface.h>
+#include <gnufdisk-devicemanager.h>
+
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#define BATCH_MODULE "gnufdisk-backend"
+#define BATCH_ALIGNMENT (1024 * 1024) /* alignment of `-' starts, in bytes */
+#define BATCH_SETTLE 100 /* milliseconds between the first event and the probe */
+
+struct gnufdisk_userinterface {
+  int nref;
+};
+
+struct entry {
+  int line;
+  gnufdisk_integer start; /* -1: after the previous entry */
+  gnufdisk_integer size;
+  int size_shift; /* size is in bytes << size_shift, 0: in sectors */
+  char type[32];
+};
+
+struct script {
+  char label[32];
+  struct entry* entries;
+  int nentries;
+  int size;
+};
+
+static const char* program;
+static struct gnufdisk_devicemanager* dm;
+static struct gnufdisk_devicemanager_watch* watch;
+
+static void die(const char* _fmt, ...)
+{
+  va_list args;
+
+  fprintf(stderr, "%s: ", program);
+
+  va_start(args, _fmt);
+  vfprintf(stderr, _fmt, args);
+  va_end(args);
+
+  fputc('\n', stderr);
+
+  exit(EXIT_FAILURE);
+}
+
+/* userinterface used by the devicemanager */
+
+struct gnufdisk_userinterface*
+gnufdisk_userinterface_new(void)
+{
+  struct gnufdisk_userinterface* ret;
+
+  if((ret = malloc(sizeof(struct gnufdisk_userinterface))) == NULL)
+    return NULL;
+
+  ret->nref = 1;
+
+  return ret;
+}
+
+int gnufdisk_userinterface_ref(struct gnufdisk_userinterface* _ui)
+{
+  _ui->nref++;
+  return 0;
+}
+
+int gnufdisk_userinterface_delete(struct gnufdisk_userinterface* _ui)
+{
+  if(--_ui->nref == 0)
+    free(_ui);
+
+  return 0;
+}
+
+int gnufdisk_userinterface_run(struct gnufdisk_userinterface* _ui,
+                               struct gnufdisk_string* _implementation,
+                               int _argc,
+                               char** _argv)
+{
+  errno = ENOTSUP;
+  return -1;
+}
+
+int gnufdisk_userinterface_print(struct gnufdisk_userinterface* _ui,
+                                 const char* _fmt, ...)
+{
+  va_list args;
+
+  va_start(args, _fmt);
+  vfprintf(stdout, _fmt, args);
+  va_end(args);
+
+  return 0;
+}
+
+int gnufdisk_userinterface_error(struct gnufdisk_userinterface* _ui,
+                                 const char* _fmt, ...)
+{
+  va_list args;
+
+  fprintf(stderr, "%s: ", program);
+
+  va_start(args, _fmt);
+  vfprintf(stderr, _fmt, args);
+  va_end(args);
+
+  fputc('\n', stderr);
+
+  return 0;
+}
+
+/* every question is answered `no', the operation fails instead */
+int gnufdisk_userinterface_yes_no(struct gnufdisk_userinterface* _ui,
+                                  const char* _fmt, ...)
+{
+  return 0;
+}
+
+struct gnufdisk_string*
+gnufdisk_userinterface_get_path(struct gnufdisk_userinterface* _ui,
+                                const char* _fmt, ...)
+{
+  errno = ECANCELED;
+  return NULL;
+}
+
+struct gnufdisk_string*
+gnufdisk_userinterface_get_disklabel_system(struct gnufdisk_userinterface* _ui,
+                                            const char* _fmt, ...)
+{
+  errno = ECANCELED;
+  return NULL;
+}
+
+int gnufdisk_userinterface_get_geometry(struct gnufdisk_userinterface* _ui,
+                                        struct gnufdisk_devicemanager* _dm,
+                                        struct gnufdisk_geometry* _geom,
+                                        const char* _fmt, ...)
+{
+  errno = ECANCELED;
+  return -1;
+}
+
+struct gnufdisk_string*
+gnufdisk_userinterface_get_partition_type(struct gnufdisk_userinterface* _ui,
+                                          const char* _fmt, ...)
+{
+  errno = ECANCELED;
+  return NULL;
+}
+
+/* script parser */
+
+static int parse_size(const char* _s, gnufdisk_integer* _size, int* _shift)
+{
+  char* end;
+  long long n;
+
+  errno = 0;
+  n = strtoll(_s, &end, 10);
+
+  if(errno != 0 || end == _s || n <= 0)
+    return -1;
+
+  *_size = n;
+
+  switch(toupper((unsigned char) *end))
+    {
+    case '\0':
+      *_shift = 0;
+      return 0;
+    case 'K':
+      *_shift = 10;
+      break;
+    case 'M':
+      *_shift = 20;
+      break;
+    case 'G':
+      *_shift = 30;
+      break;
+    case 'T':
+      *_shift = 40;
+      break;
+    default:
+      return -1;
+    }
+
+  /* in bytes it must still fit, rounded up to a sector */
+  if(n > (LLONG_MAX >> *_shift) / 2)
+    return -1;
+
+  /* accept K, KB, KiB */
+  end++;
+  if(*end == 'i' || *end == 'I')
+    end++;
+  if(*end == 'b' || *end == 'B')
+    end++;
+
+  return *end == '\0' ? 0 : -1;
+}
+
+static void parse_script(FILE* _in, const char* _name, struct script* _script)
+{
+  char buf[512];
+  int line;
+
+  memset(_script, 0, sizeof(struct script));
+
+  for(line = 1; fgets(buf, sizeof(buf), _in) != NULL; line++)
+    {
+      char start[64];
+      char size[64];
+      char type[32];
+      char* p;
+      struct entry* e;
+      int n;
+
+      if((p = strchr(buf, '#')) != NULL)
+        *p = '\0';
+
+      for(p = buf; isspace((unsigned char) *p); p++);
+
+      if(*p == '\0')
+        continue;
+
+      if(strncasecmp(p, "label:", 6) == 0)
+        {
+          if(sscanf(p + 6, "%31s", _script->label) != 1)
+            die("%s:%d: missing disklabel system", _name, line);
+          continue;
+        }
+
+      if((n = sscanf(p, "%63s %63s %31s", start, size, type)) < 2)
+        die("%s:%d: expected `START SIZE [TYPE]'", _name, line);
+
+      if(_script->nentries == _script->size)
+        {
+          _script->size = _script->size ? _script->size * 2 : 8;
+
+          if((_script->entries = realloc(_script->entries, _script->size * sizeof(struct entry))) == NULL)
+            die("%s", strerror(errno));
+        }
+
+      e = &_script->entries[_script->nentries++];
+      e->line = line;
+
+      if(strcmp(start, "-") == 0)
+        e->start = -1;
+      else
+        {
+          char* end;
+
+          errno = 0;
+          e->start = strtoll(start, &end, 10);
+
+          if(errno != 0 || *end != '\0' || e->start < 0)
+            die("%s:%d: invalid start `%s'", _name, line, start);
+        }
+
+      if(parse_size(size, &e->size, &e->size_shift) != 0)
+        die("%s:%d: invalid size `%s'", _name, line, size);
+
+      strcpy(e->type, n == 3 ? type : "primary");
+    }
+
+  if(ferror(_in))
+    die("can not read %s: %s", _name, strerror(errno));
+
+  if(_script->label[0] == '\0')
+    die("%s: missing `label:' line", _name);
+}
+
+/* devicemanager helpers, every failure is fatal */
+
+static gnufdisk_integer sector_size(struct gnufdisk_device* _dev)
+{
+  struct gnufdisk_string* param;
+  gnufdisk_integer ret;
+
+  param = gnufdisk_string_new("SECTOR-SIZE");
+
+  if(gnufdisk_devicemanager_device_get_parameter(dm, _dev, param, &ret, sizeof(ret)) != 0
+     || ret <= 0)
+    die("can not determine the sector size");
+
+  gnufdisk_string_delete(param);
+
+  return ret;
+}
+
+/* the disklabel aligns the boundaries to its own grain, it may move them
+ * by up to half the tolerance */
+static struct gnufdisk_partition* create_partition(struct gnufdisk_disklabel* _disk,
+                                                   gnufdisk_integer _start,
+                                                   gnufdisk_integer _end,
+                                                   gnufdisk_integer _tolerance,
+                                                   const char* _type,
+                                                   int _line)
+{
+  struct gnufdisk_range s;
+  struct gnufdisk_range e;
+  struct gnufdisk_string* type;
+  struct gnufdisk_partition* ret;
+  gnufdisk_integer half;
+
+  half = _tolerance / 2;
+
+  /* the ranges are [START - HALF, START + HALF], the geometry ends at
+   * start + length */
+  s = gnufdisk_range_make(_start > half ? _start - half : 0, (_start > half ? half : _start) + half);
+  e = gnufdisk_range_make(_end - half, 2 * half);
+  type = gnufdisk_string_new("%s", _type);
+
+  if((ret = gnufdisk_devicemanager_disklabel_create_partition_range(dm, _disk, s, e, type)) == NULL)
+    die("line %d: can not create partition", _line);
+
+  gnufdisk_string_delete(type);
+
+  return ret;
+}
+
+static void apply(struct gnufdisk_device* _dev, const struct script* _script)
+{
+  struct gnufdisk_disklabel* disk;
+  struct gnufdisk_disklabel* extended;
+  struct gnufdisk_string* system;
+  gnufdisk_integer ssize;
+  gnufdisk_integer tolerance;
+  gnufdisk_integer next;
+  gnufdisk_integer next_logical;
+  int i;
+
+  system = gnufdisk_string_new("%s", _script->label);
+
+  if((disk = gnufdisk_devicemanager_device_create_disklabel(dm, _dev, system)) == NULL)
+    die("can not create %s disklabel", _script->label);
+
+  gnufdisk_string_delete(system);
+
+  ssize = sector_size(_dev);
+  tolerance = BATCH_ALIGNMENT / ssize;
+  next = tolerance;
+  extended = NULL;
+  next_logical = 0;
+
+  for(i = 0; i < _script->nentries; i++)
+    {
+      const struct entry* e;
+      struct gnufdisk_partition* part;
+      gnufdisk_integer start;
+      gnufdisk_integer length;
+      int logical;
+
+      e = &_script->entries[i];
+      logical = strcasecmp(e->type, "logical") == 0;
+
+      if(logical && extended == NULL)
+        die("line %d: logical partition without an extended one", e->line);
+
+      if(e->size_shift)
+        length = ((e->size << e->size_shift) + ssize - 1) / ssize;
+      else
+        length = e->size;
+
+      /* like sfdisk, a following partition starts on the next MiB */
+      if(e->start >= 0)
+        start = e->start;
+      else
+        start = ((logical ? next_logical : next) + tolerance - 1) / tolerance * tolerance;
+
+      part = create_partition(logical ? extended : disk,
+                              start, start + length - 1, tolerance,
+                              e->type, e->line);
+
+      /* continue after the aligned partition */
+      start = gnufdisk_devicemanager_partition_start(dm, part);
+      length = gnufdisk_devicemanager_partition_length(dm, part);
+
+      if(logical)
+        next_logical = start + length;
+      else
+        next = start + length;
+
+      if(strncasecmp(e->type, "extended", 8) == 0)
+        {
+          if(extended)
+            gnufdisk_devicemanager_disklabel_delete(dm, extended);
+
+          if(gnufdisk_devicemanager_partition_have_disklabel(dm, part) <= 0
+             || (extended = gnufdisk_devicemanager_partition_disklabel(dm, part)) == NULL)
+            die("line %d: extended partition has no disklabel", e->line);
+
+          next_logical = start;
+        }
+
+      gnufdisk_devicemanager_partition_delete(dm, part);
+    }
+
+  if(extended)
+    gnufdisk_devicemanager_disklabel_delete(dm, extended);
+
+  gnufdisk_devicemanager_disklabel_delete(dm, disk);
+}
+
+/* the numbers of a disklabel need not be contiguous (an empty MBR slot, a
+ * sparse GPT): they come from its snapshot */
+static void list(struct gnufdisk_disklabel* _disk, const char* _indent)
+{
+  struct gnufdisk_disklabel_snapshot* snapshot;
+  size_t i;
+
+  if((snapshot = gnufdisk_devicemanager_disklabel_snapshot(dm, _disk)) == NULL)
+    die("can not enumerate partitions");
+
+  for(i = 0; i < snapshot->nrecords; i++)
+    {
+      struct gnufdisk_partition* part;
+      struct gnufdisk_string* type;
+
+      if((part = gnufdisk_devicemanager_disklabel_partition(dm, _disk, snapshot->records[i].number)) == NULL)
+        continue;
+
+      type = gnufdisk_devicemanager_partition_type(dm, part);
+
+      printf("%s%d %lld %lld %s\n",
+             _indent,
+             gnufdisk_devicemanager_partition_number(dm, part),
+             (long long) gnufdisk_devicemanager_partition_start(dm, part),
+             (long long) gnufdisk_devicemanager_partition_length(dm, part),
+             type ? gnufdisk_string_c_string(type) : "?");
+
+      if(type)
+        gnufdisk_string_delete(type);
+
+      if(gnufdisk_devicemanager_partition_have_disklabel(dm, part) > 0)
+        {
+          struct gnufdisk_disklabel* inner;
+
+          if((inner = gnufdisk_devicemanager_partition_disklabel(dm, part)) != NULL)
+            {
+              list(inner, "  ");
+              gnufdisk_devicemanager_disklabel_delete(dm, inner);
+            }
+        }
+
+      gnufdisk_devicemanager_partition_delete(dm, part);
+    }
+
+  gnufdisk_disklabel_snapshot_delete(snapshot);
+}
+
+/* the sysfs path of the host adapter of a block device, NULL for anything
+ * else. Devices behind the same adapter share its bandwidth. */
+static char* controller_of(const char* _path)
+{
+  char link[PATH_MAX];
+  char buf[PATH_MAX];
+  struct stat st;
+  char* host;
+  ssize_t n;
+
+  if(stat(_path, &st) != 0 || !S_ISBLK(st.st_mode))
+    return NULL;
+
+  snprintf(link, sizeof(link), "/sys/dev/block/%u:%u", major(st.st_rdev), minor(st.st_rdev));
+
+  if((n = readlink(link, buf, sizeof(buf) - 1)) <= 0)
+    return NULL;
+
+  buf[n] = '\0';
+
+  if((host = strstr(buf, "/host")) == NULL)
+    return NULL;
+
+  if((host = strchr(host + 1, '/')) != NULL)
+    *host = '\0';
+
+  return strdup(buf);
+}
+
+static int apply_all(const struct script* _script,
+                     const char* _module,
+                     const char* _options,
+                     char** _paths,
+                     int _npaths,
+                     size_t _jobs,
+                     size_t _per_controller)
+{
+  struct gnufdisk_devicemanager_layout_partition* partitions;
+  struct gnufdisk_devicemanager_apply_target* targets;
+  struct gnufdisk_devicemanager_layout layout;
+  int extended;
+  int done;
+  int i;
+
+  if((partitions = calloc(_script->nentries + 1, sizeof(struct gnufdisk_devicemanager_layout_partition))) == NULL
+     || (targets = calloc(_npaths, sizeof(struct gnufdisk_devicemanager_apply_target))) == NULL)
+    die("%s", strerror(errno));
+
+  extended = -1;
+
+  for(i = 0; i < _script->nentries; i++)
+    {
+      const struct entry* e;
+      int logical;
+
+      e = &_script->entries[i];
+      logical = strcasecmp(e->type, "logical") == 0;
+
+      if(logical && extended == -1)
+        die("line %d: logical partition without an extended one", e->line);
+
+      partitions[i].start = e->start;
+      partitions[i].length = e->size;
+      partitions[i].length_shift = e->size_shift;
+      partitions[i].type = e->type;
+      partitions[i].parent = logical ? extended : -1;
+
+      if(strncasecmp(e->type, "extended", 8) == 0)
+        extended = i;
+    }
+
+  memset(&layout, 0, sizeof(layout));
+  layout.module = _module;
+  layout.options = _options;
+  layout.system = _script->label;
+  layout.alignment = BATCH_ALIGNMENT;
+  layout.npartitions = _script->nentries;
+  layout.partitions = partitions;
+
+  for(i = 0; i < _npaths; i++)
+    {
+      targets[i].path = _paths[i];
+      targets[i].controller = controller_of(_paths[i]);
+    }
+
+  if((done = gnufdisk_devicemanager_apply(dm, &layout, targets, _npaths, _jobs, _per_controller)) < 0)
+    die("can not apply the layout");
+
+  for(i = 0; i < _npaths; i++)
+    {
+      if(targets[i].result == GNUFDISK_DEVICEMANAGER_APPLY_DONE)
+        printf("%s: ok\n", targets[i].path);
+
+      free((char*) targets[i].controller);
+    }
+
+  free(targets);
+  free(partitions);
+
+  return done == _npaths ? 0 : -1;
+}
+
+static void watch_print(void* _data, const struct gnufdisk_devicemanager_watch_event* _event)
+{
+  static const char* types[] = {"unknown", "primary", "extended", "extended-lba", "logical", "guid"};
+  static const char* changes[] = {"add", "remove", "change"};
+  const struct gnufdisk_partition_record* r;
+  char number[32];
+
+  r = _event->current ? _event->current : _event->previous;
+
+  if(_event->parent)
+    snprintf(number, sizeof(number), "%d.%d", _event->parent, r->number);
+  else
+    snprintf(number, sizeof(number), "%d", r->number);
+
+  printf("%s %s %s", _event->path, changes[_event->change], number);
+
+  if(_event->current)
+    printf(" %lld %lld %s %s",
+           (long long) r->start,
+           (long long) r->length,
+           r->type < sizeof(types) / sizeof(types[0]) ? types[r->type] : "unknown",
+           r->content[0] ? r->content : "-");
+
+  putchar('\n');
+  fflush(stdout);
+}
+
+static void watch_interrupt(int _signal)
+{
+  gnufdisk_devicemanager_watch_stop(watch);
+}
+
+static int watch_all(const char* _module,
+                     const char* _options,
+                     char** _paths,
+                     int _npaths,
+                     int _settle,
+                     const char* _publish)
+{
+  struct sigaction action;
+  int ret;
+
+  if((watch = gnufdisk_devicemanager_watch_new(dm, _module, _options, (const char* const*) _paths, _npaths,
+                                               &watch_print, NULL)) == NULL)
+    return -1;
+
+  if(_publish && gnufdisk_devicemanager_watch_publish(watch, _publish) != 0)
+    {
+      gnufdisk_devicemanager_watch_delete(watch);
+      watch = NULL;
+      return -1;
+    }
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = &watch_interrupt;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  ret = gnufdisk_devicemanager_watch_run(watch, _settle);
+
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+
+  gnufdisk_devicemanager_watch_delete(watch);
+  watch = NULL;
+
+  return ret;
+}
+
+static void print_help(void)
+{
+  fprintf(stderr,
+          "USAGE:\n"
+          "  %s [-n] [-m MODULE] [-o OPTIONS] DEVICE [SCRIPT]\n"
+          "  %s [-m MODULE] [-o OPTIONS] [-j JOBS] [-c N] -f SCRIPT DEVICE...\n"
+          "  %s [-m MODULE] [-o OPTIONS] [-s MS] [-p NAME] -w DEVICE...\n"
+          "\n"
+          "  -n  do not write the new disklabel to DEVICE\n"
+          "  -m  device module (default: " BATCH_MODULE ")\n"
+          "  -o  device module options\n"
+          "  -f  write the layout of SCRIPT to every DEVICE in parallel\n"
+          "  -j  devices written at the same time (default: all)\n"
+          "  -c  devices of the same controller written at the same time\n"
+          "      (default: no limit)\n"
+          "  -w  print the partitions of every DEVICE, then their changes\n"
+          "  -s  wait MS milliseconds after the first event before probing\n"
+          "      (default: %d)\n"
+          "  -p  keep the partitions in the shared memory segment NAME\n"
+          "\n"
+          "The script is read from standard input when SCRIPT is missing or `-'.\n"
+          "\n"
+          "Report bugs to %s\n"
+          "\n",
+          program, program, program, BATCH_SETTLE, PACKAGE_BUGREPORT);
+}
+
+int main(int _argc, char** _argv)
+{
+  struct gnufdisk_userinterface* ui;
+  struct gnufdisk_string* module;
+  struct gnufdisk_string* options;
+  struct gnufdisk_string* path;
+  struct gnufdisk_device* dev;
+  struct gnufdisk_disklabel* disk;
+  struct script script;
+  const char* module_name;
+  const char* module_options;
+  const char* script_name;
+  const char* publish;
+  size_t jobs;
+  size_t per_controller;
+  int dry_run;
+  int multi;
+  int watching;
+  int settle;
+  FILE* in;
+  int opt;
+
+  program = _argv[0];
+
+  module_name = BATCH_MODULE;
+  module_options = "";
+  dry_run = 0;
+  multi = 0;
+  watching = 0;
+  settle = BATCH_SETTLE;
+  script_name = "-";
+  publish = NULL;
+  jobs = 0;
+  per_controller = 0;
+
+  while((opt = getopt(_argc, _argv, "nm:o:f:j:c:ws:p:h")) != -1)
+    switch(opt)
+      {
+      case 'n':
+        dry_run = 1;
+        break;
+      case 'f':
+        multi = 1;
+        script_name = optarg;
+        break;
+      case 'j':
+        jobs = strtoul(optarg, NULL, 10);
+        break;
+      case 'c':
+        per_controller = strtoul(optarg, NULL, 10);
+        break;
+      case 'w':
+        watching = 1;
+        break;
+      case 's':
+        settle = atoi(optarg);
+        break;
+      case 'p':
+        publish = optarg;
+        break;
+      case 'm':
+        module_name = optarg;
+        break;
+      case 'o':
+        module_options = optarg;
+        break;
+      default:
+        print_help();
+        return EXIT_FAILURE;
+      }
+
+  if(publish && !watching)
+    {
+      print_help();
+      return EXIT_FAILURE;
+    }
+
+  if(watching ? (optind == _argc || dry_run || multi)
+     : multi ? (optind == _argc || dry_run) : (optind != _argc - 1 && optind != _argc - 2))
+    {
+      print_help();
+      return EXIT_FAILURE;
+    }
+
+  if(watching)
+    {
+      if((ui = gnufdisk_userinterface_new()) == NULL
+         || (dm = gnufdisk_devicemanager_new(ui)) == NULL)
+        die("can not create devicemanager");
+
+      opt = watch_all(module_name, module_options, _argv + optind, _argc - optind, settle, publish);
+
+      gnufdisk_devicemanager_delete(dm);
+      gnufdisk_userinterface_delete(ui);
+
+      return opt == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+  if(!multi && optind == _argc - 2)
+    script_name = _argv[optind + 1];
+
+  if(strcmp(script_name, "-") == 0)
+    in = stdin;
+  else if((in = fopen(script_name, "r")) == NULL)
+    die("can not open %s: %s", script_name, strerror(errno));
+
+  parse_script(in, script_name, &script);
+
+  if(in != stdin)
+    fclose(in);
+
+  if((ui = gnufdisk_userinterface_new()) == NULL
+     || (dm = gnufdisk_devicemanager_new(ui)) == NULL)
+    die("can not create devicemanager");
+
+  if(multi)
+    {
+      opt = apply_all(&script, module_name, module_options,
+                      _argv + optind, _argc - optind, jobs, per_controller);
+
+      free(script.entries);
+      gnufdisk_devicemanager_delete(dm);
+      gnufdisk_userinterface_delete(ui);
+
+      return opt == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+  module = gnufdisk_string_new("%s", module_name);
+  options = gnufdisk_string_new("%s", module_options);
+  path = gnufdisk_string_new("%s", _argv[optind]);
+
+  if((dev = gnufdisk_devicemanager_device_new(dm, module, options)) == NULL)
+    die("can not load module %s", module_name);
+
+  if(gnufdisk_devicemanager_device_open(dm, dev, path) != 0)
+    die("can not open %s", _argv[optind]);
+
+  apply(dev, &script);
+
+  if(!dry_run && gnufdisk_devicemanager_device_commit(dm, dev) != 0)
+    die("can not write %s", _argv[optind]);
+
+  if((disk = gnufdisk_devicemanager_device_disklabel(dm, dev)) == NULL)
+    die("can not read back the disklabel");
+
+  list(disk, "");
+
+  gnufdisk_devicemanager_disklabel_delete(dm, disk);
+
+  if(gnufdisk_devicemanager_device_close(dm, dev) != 0
+     || gnufdisk_devicemanager_device_delete(dm, dev) != 0)
+    die("can not close %s", _argv[optind]);
+
+  gnufdisk_string_delete(path);
+  gnufdisk_string_delete(options);
+  gnufdisk_string_delete(module);
+  free(script.entries);
+
+  gnufdisk_devicemanager_delete(dm);
+  gnufdisk_userinterface_delete(ui);
+
+  return EXIT_SUCCESS;
+}
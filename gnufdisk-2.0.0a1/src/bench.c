@@ -0,0 +1,680 @@
+/* GNU Fidsk a program to manage partitions.
+ *
+ * Copyright (C) 2011 Free Software Foundation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA. */
+
+/* gnufdisk-bench: build sparse disk images with several layouts and time
+ * the devicemanager API on them. Results are written as CSV, one row per
+ * layout and operation, so that runs of different releases can be
+ * compared. Run through `make bench'. */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+
+#include <gnufdisk-common.h>
+#include <gnufdisk-debug.h>
+#include <gnufdisk-exception.h>
+#include <gnufdisk-device.h>
+#include <gnufdisk-userinterface.h>
+#include <gnufdisk-devicemanager.h>
+
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#ifndef PACKAGE_VERSION
+# define PACKAGE_VERSION "unknown"
+#endif
+
+#define BENCH_MODULE "gnufdisk-backend"
+#define BENCH_PARTITION_SECTORS 64 /* size of every partition in the images */
+#define BENCH_READ_SECTORS 32
+
+enum layout_type {
+  LAYOUT_GPT,
+  LAYOUT_EBR
+};
+
+struct layout {
+  const char* name;
+  enum layout_type type;
+  int entries; /* GPT array entries or EBR logicals */
+};
+
+static const struct layout layouts[] = {
+  {"gpt", LAYOUT_GPT, 128},
+  {"gpt", LAYOUT_GPT, 1024},
+  {"gpt", LAYOUT_GPT, 4096},
+  {"mbr-ebr", LAYOUT_EBR, 4},
+  {"mbr-ebr", LAYOUT_EBR, 64},
+  {"mbr-ebr", LAYOUT_EBR, 256}
+};
+
+static const int sector_sizes[] = { 512, 4096 };
+
+#define NLAYOUTS (sizeof(layouts) / sizeof(layouts[0]))
+#define NSECTOR_SIZES (sizeof(sector_sizes) / sizeof(sector_sizes[0]))
+
+struct options {
+  const char* directory;
+  const char* output;
+  int iterations;
+  int loops;
+  long read_bytes;
+};
+
+struct timing {
+  int iterations;
+  uint64_t total;
+  uint64_t min;
+  uint64_t max;
+  uint64_t bytes;
+};
+
+static const char* program;
+static struct gnufdisk_devicemanager* dm;
+
+static void die(const char* _fmt, ...)
+{
+  va_list args;
+
+  fprintf(stderr, "%s: ", program);
+
+  va_start(args, _fmt);
+  vfprintf(stderr, _fmt, args);
+  va_end(args);
+
+  fputc('\n', stderr);
+
+  exit(EXIT_FAILURE);
+}
+
+static uint64_t now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void timing_add(struct timing* _t, uint64_t _start, uint64_t _bytes)
+{
+  uint64_t elapsed;
+
+  elapsed = now() - _start;
+
+  if(_t->iterations == 0 || elapsed < _t->min)
+    _t->min = elapsed;
+
+  if(elapsed > _t->max)
+    _t->max = elapsed;
+
+  _t->iterations++;
+  _t->total += elapsed;
+  _t->bytes += _bytes;
+}
+
+static void timing_print(FILE* _out, const struct layout* _layout, int _sector_size, const char* _operation, struct timing* _t)
+{
+  double throughput;
+
+  if(_t->iterations == 0)
+    return;
+
+  throughput = _t->bytes > 0 ? _t->bytes / (_t->total / 1e9) : 0;
+
+  fprintf(_out, "%s,%s,%d,%d,%s,%d,%llu,%llu,%llu,%.0f\n",
+          PACKAGE_VERSION, _layout->name, _layout->entries, _sector_size, _operation, _t->iterations,
+          (unsigned long long) (_t->total / _t->iterations),
+          (unsigned long long) _t->min,
+          (unsigned long long) _t->max,
+          throughput);
+}
+
+/* image builders */
+
+static uint32_t crc32(const void* _buf, size_t _size)
+{
+  static uint32_t table[256];
+  const unsigned char* p;
+  uint32_t ret;
+  size_t iter;
+
+  if(table[1] == 0)
+    for(iter = 0; iter < 256; iter++)
+      {
+        uint32_t c;
+        int bit;
+
+        for(c = iter, bit = 0; bit < 8; bit++)
+          c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+
+        table[iter] = c;
+      }
+
+  for(ret = ~0U, p = _buf; _size > 0; _size--, p++)
+    ret = table[(ret ^ *p) & 0xFF] ^ (ret >> 8);
+
+  return ~ret;
+}
+
+static void put16(unsigned char* _p, uint16_t _v)
+{
+  _p[0] = _v;
+  _p[1] = _v >> 8;
+}
+
+static void put32(unsigned char* _p, uint32_t _v)
+{
+  put16(_p, _v);
+  put16(_p + 2, _v >> 16);
+}
+
+static void put64(unsigned char* _p, uint64_t _v)
+{
+  put32(_p, _v);
+  put32(_p + 4, _v >> 32);
+}
+
+static void write_at(int _fd, const void* _buf, size_t _size, uint64_t _sector, int _sector_size)
+{
+  if(pwrite(_fd, _buf, _size, (off_t) _sector * _sector_size) != (ssize_t) _size)
+    die("can not write image: %s", strerror(errno));
+}
+
+static void mbr_entry(unsigned char* _mbr, int _slot, int _type, uint64_t _start, uint64_t _sectors)
+{
+  unsigned char* entry;
+
+  entry = _mbr + 446 + 16 * _slot;
+
+  memset(entry, 0, 16);
+  entry[4] = _type;
+  put32(entry + 8, _start);
+  put32(entry + 12, _sectors > 0xFFFFFFFF ? 0xFFFFFFFF : _sectors);
+
+  _mbr[510] = 0x55;
+  _mbr[511] = 0xAA;
+}
+
+static void gpt_header(unsigned char* _h, uint64_t _current, uint64_t _copy, uint64_t _first, uint64_t _last,
+                       uint64_t _entries_lba, int _entries, uint32_t _array_crc)
+{
+  static const unsigned char disk_guid[16] = "gnufdisk-bench!";
+
+  memset(_h, 0, 92);
+  memcpy(_h, "EFI PART", 8);
+  put32(_h + 8, 0x00010000);
+  put32(_h + 12, 92);
+  put64(_h + 24, _current);
+  put64(_h + 32, _copy);
+  put64(_h + 40, _first);
+  put64(_h + 48, _last);
+  memcpy(_h + 56, disk_guid, 16);
+  put64(_h + 72, _entries_lba);
+  put32(_h + 80, _entries);
+  put32(_h + 84, 128);
+  put32(_h + 88, _array_crc);
+  put32(_h + 16, crc32(_h, 92));
+}
+
+static void build_gpt(int _fd, int _sector_size, int _entries, int _loops)
+{
+  /* Linux filesystem data, 0FC63DAF-8483-4772-8E79-3D69D8477DE4 */
+  static const unsigned char type[16] = {
+    0xAF, 0x3D, 0xC6, 0x0F, 0x83, 0x84, 0x72, 0x47,
+    0x8E, 0x79, 0x3D, 0x69, 0xD8, 0x47, 0x7D, 0xE4
+  };
+  unsigned char* sector;
+  unsigned char* array;
+  uint64_t array_sectors;
+  uint64_t first;
+  uint64_t last;
+  uint64_t total;
+  uint32_t array_crc;
+  int used;
+  int iter;
+
+  array_sectors = ((uint64_t) _entries * 128 + _sector_size - 1) / _sector_size;
+  first = 2 + array_sectors;
+
+  /* half of the slots are used, the free space at the end is for create */
+  used = _entries / 2;
+  last = first + (uint64_t) (used + _loops + 1) * BENCH_PARTITION_SECTORS - 1;
+  total = last + 1 + array_sectors + 1;
+
+  if((sector = calloc(1, _sector_size)) == NULL
+     || (array = calloc(array_sectors, _sector_size)) == NULL)
+    die("out of memory");
+
+  for(iter = 0; iter < used; iter++)
+    {
+      unsigned char* entry;
+
+      entry = array + 128 * iter;
+
+      memcpy(entry, type, 16);
+      put32(entry + 16, iter + 1);
+      memcpy(entry + 20, "bench-partition", 12);
+      put64(entry + 32, first + (uint64_t) iter * BENCH_PARTITION_SECTORS);
+      put64(entry + 40, first + (uint64_t) (iter + 1) * BENCH_PARTITION_SECTORS - 1);
+    }
+
+  array_crc = crc32(array, (size_t) _entries * 128);
+
+  if(ftruncate(_fd, (off_t) total * _sector_size) != 0)
+    die("can not resize image: %s", strerror(errno));
+
+  mbr_entry(sector, 0, 0xEE, 1, total - 1);
+  write_at(_fd, sector, _sector_size, 0, _sector_size);
+
+  memset(sector, 0, _sector_size);
+  gpt_header(sector, 1, total - 1, first, last, 2, _entries, array_crc);
+  write_at(_fd, sector, _sector_size, 1, _sector_size);
+  write_at(_fd, array, array_sectors * _sector_size, 2, _sector_size);
+
+  memset(sector, 0, _sector_size);
+  gpt_header(sector, total - 1, 1, first, last, last + 1, _entries, array_crc);
+  write_at(_fd, array, array_sectors * _sector_size, last + 1, _sector_size);
+  write_at(_fd, sector, _sector_size, total - 1, _sector_size);
+
+  free(array);
+  free(sector);
+}
+
+static void build_ebr(int _fd, int _sector_size, int _logicals, int _loops)
+{
+  unsigned char* sector;
+  uint64_t extended;
+  uint64_t length;
+  int iter;
+
+  /* each logical takes BENCH_PARTITION_SECTORS: its EBR, then the data */
+  extended = 64;
+  length = (uint64_t) (_logicals + _loops + 1) * BENCH_PARTITION_SECTORS;
+
+  if((sector = calloc(1, _sector_size)) == NULL)
+    die("out of memory");
+
+  if(ftruncate(_fd, (off_t) (extended + length) * _sector_size) != 0)
+    die("can not resize image: %s", strerror(errno));
+
+  mbr_entry(sector, 0, 0x0F, extended, length);
+  write_at(_fd, sector, _sector_size, 0, _sector_size);
+
+  for(iter = 0; iter < _logicals; iter++)
+    {
+      uint64_t ebr;
+
+      ebr = extended + (uint64_t) iter * BENCH_PARTITION_SECTORS;
+
+      memset(sector, 0, _sector_size);
+      mbr_entry(sector, 0, 0x83, 1, BENCH_PARTITION_SECTORS - 1);
+
+      if(iter + 1 < _logicals)
+        mbr_entry(sector, 1, 0x05, ebr + BENCH_PARTITION_SECTORS - extended, BENCH_PARTITION_SECTORS);
+
+      write_at(_fd, sector, _sector_size, ebr, _sector_size);
+    }
+
+  free(sector);
+}
+
+static char* build_image(const struct options* _options, const struct layout* _layout, int _sector_size)
+{
+  char* path;
+  int fd;
+
+  if(asprintf(&path, "%s/bench-%s-%d-%d.img", _options->directory, _layout->name, _layout->entries, _sector_size) == -1)
+    die("out of memory");
+
+  if((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1)
+    die("can not create %s: %s", path, strerror(errno));
+
+  if(_layout->type == LAYOUT_GPT)
+    build_gpt(fd, _sector_size, _layout->entries, _options->loops);
+  else
+    build_ebr(fd, _sector_size, _layout->entries, _options->loops);
+
+  if(close(fd) != 0)
+    die("can not write %s: %s", path, strerror(errno));
+
+  return path;
+}
+
+/* devicemanager helpers, every failure is fatal */
+
+static struct gnufdisk_device* open_device(const char* _path, int _sector_size)
+{
+  struct gnufdisk_string* module;
+  struct gnufdisk_string* options;
+  struct gnufdisk_string* path;
+  struct gnufdisk_device* ret;
+
+  module = gnufdisk_string_new(BENCH_MODULE);
+  options = gnufdisk_string_new("sector-size=%d", _sector_size);
+  path = gnufdisk_string_new("%s", _path);
+
+  if((ret = gnufdisk_devicemanager_device_new(dm, module, options)) == NULL)
+    die("can not create device");
+
+  if(gnufdisk_devicemanager_device_open(dm, ret, path) != 0)
+    die("can not open %s", _path);
+
+  gnufdisk_string_delete(path);
+  gnufdisk_string_delete(options);
+  gnufdisk_string_delete(module);
+
+  return ret;
+}
+
+static void close_device(struct gnufdisk_device* _dev)
+{
+  if(gnufdisk_devicemanager_device_close(dm, _dev) != 0
+     || gnufdisk_devicemanager_device_delete(dm, _dev) != 0)
+    die("can not close device");
+}
+
+static struct gnufdisk_disklabel* probe(struct gnufdisk_device* _dev)
+{
+  struct gnufdisk_disklabel* ret;
+
+  if((ret = gnufdisk_devicemanager_device_disklabel(dm, _dev)) == NULL)
+    die("can not probe disklabel");
+
+  return ret;
+}
+
+/* the GPT or the EBR chain is nested in the first partition of the MBR */
+static struct gnufdisk_disklabel* inner_disklabel(struct gnufdisk_disklabel* _disk)
+{
+  struct gnufdisk_partition* container;
+  struct gnufdisk_disklabel* ret;
+
+  if((container = gnufdisk_devicemanager_disklabel_partition(dm, _disk, 1)) == NULL
+     || gnufdisk_devicemanager_partition_have_disklabel(dm, container) <= 0
+     || (ret = gnufdisk_devicemanager_partition_disklabel(dm, container)) == NULL)
+    die("image has no nested disklabel");
+
+  gnufdisk_devicemanager_partition_delete(dm, container);
+
+  return ret;
+}
+
+static void bench_layout(FILE* _out, const struct options* _options, const struct layout* _layout, int _sector_size)
+{
+  struct timing open_timing;
+  struct timing probe_timing;
+  struct timing read_timing;
+  struct timing commit_timing;
+  struct timing create_timing;
+  struct timing remove_timing;
+  struct gnufdisk_device* dev;
+  struct gnufdisk_disklabel* disk;
+  struct gnufdisk_disklabel* inner;
+  struct gnufdisk_partition* part;
+  const char* create_type;
+  uint64_t free_start;
+  char* buf;
+  char* path;
+  long done;
+  int iter;
+
+  memset(&open_timing, 0, sizeof(struct timing));
+  memset(&probe_timing, 0, sizeof(struct timing));
+  memset(&read_timing, 0, sizeof(struct timing));
+  memset(&commit_timing, 0, sizeof(struct timing));
+  memset(&create_timing, 0, sizeof(struct timing));
+  memset(&remove_timing, 0, sizeof(struct timing));
+
+  path = build_image(_options, _layout, _sector_size);
+
+  /* open and probe */
+  for(iter = 0; iter < _options->iterations; iter++)
+    {
+      uint64_t start;
+
+      start = now();
+      dev = open_device(path, _sector_size);
+      timing_add(&open_timing, start, 0);
+
+      start = now();
+      disk = probe(dev);
+      timing_add(&probe_timing, start, 0);
+
+      gnufdisk_devicemanager_disklabel_delete(dm, disk);
+      close_device(dev);
+    }
+
+  dev = open_device(path, _sector_size);
+  disk = probe(dev);
+  inner = inner_disklabel(disk);
+
+  if(gnufdisk_devicemanager_disklabel_count_partitions(dm, inner) != (_layout->type == LAYOUT_GPT ? _layout->entries / 2 : _layout->entries))
+    die("%s: unexpected number of partitions", path);
+
+  /* partition_read throughput */
+  if((part = gnufdisk_devicemanager_disklabel_partition(dm, inner, 1)) == NULL)
+    die("can not get partition 1");
+
+  if((buf = malloc(BENCH_READ_SECTORS * _sector_size)) == NULL)
+    die("out of memory");
+
+  for(done = 0; done < _options->read_bytes; done += BENCH_READ_SECTORS * _sector_size)
+    {
+      uint64_t start;
+
+      start = now();
+
+      if(gnufdisk_devicemanager_partition_read(dm, part, 0, buf, BENCH_READ_SECTORS * _sector_size) < 0)
+        die("can not read partition");
+
+      timing_add(&read_timing, start, BENCH_READ_SECTORS * _sector_size);
+    }
+
+  free(buf);
+  gnufdisk_devicemanager_partition_delete(dm, part);
+
+  /* commit rewrites the unchanged label */
+  for(iter = 0; iter < _options->iterations; iter++)
+    {
+      uint64_t start;
+
+      start = now();
+
+      if(gnufdisk_devicemanager_device_commit(dm, dev) != 0)
+        die("can not commit");
+
+      timing_add(&commit_timing, start, 0);
+    }
+
+  /* create/remove in the free space past the last partition */
+  if(_layout->type == LAYOUT_GPT)
+    {
+      create_type = "PRIMARY";
+      free_start = 2 + ((uint64_t) _layout->entries * 128 + _sector_size - 1) / _sector_size
+        + (uint64_t) (_layout->entries / 2) * BENCH_PARTITION_SECTORS;
+    }
+  else
+    {
+      create_type = "LOGICAL";
+      free_start = 64 + (uint64_t) _layout->entries * BENCH_PARTITION_SECTORS;
+    }
+
+  for(iter = 0; iter < _options->loops; iter++)
+    {
+      struct gnufdisk_geometry* s;
+      struct gnufdisk_geometry* e;
+      struct gnufdisk_string* type;
+      uint64_t first;
+      uint64_t start;
+      int number;
+
+      /* EBR removal is not implemented by the backend, every logical
+       * needs its own space */
+      first = free_start + (_layout->type == LAYOUT_EBR ? (uint64_t) iter * BENCH_PARTITION_SECTORS : 0);
+
+      s = gnufdisk_devicemanager_geometry_new(dm, first + (_layout->type == LAYOUT_EBR), 1);
+      e = gnufdisk_devicemanager_geometry_new(dm, first + BENCH_PARTITION_SECTORS - 1, 1);
+      type = gnufdisk_string_new(create_type);
+
+      start = now();
+
+      if((part = gnufdisk_devicemanager_disklabel_create_partition(dm, inner, s, e, type)) == NULL)
+        die("can not create partition");
+
+      timing_add(&create_timing, start, 0);
+
+      number = gnufdisk_devicemanager_partition_number(dm, part);
+      gnufdisk_devicemanager_partition_delete(dm, part);
+
+      if(_layout->type == LAYOUT_GPT)
+        {
+          start = now();
+
+          if(gnufdisk_devicemanager_disklabel_remove_partition(dm, inner, number) != 0)
+            die("can not remove partition %d", number);
+
+          timing_add(&remove_timing, start, 0);
+        }
+
+      gnufdisk_string_delete(type);
+      gnufdisk_devicemanager_geometry_delete(dm, e);
+      gnufdisk_devicemanager_geometry_delete(dm, s);
+    }
+
+  gnufdisk_devicemanager_disklabel_delete(dm, inner);
+  gnufdisk_devicemanager_disklabel_delete(dm, disk);
+  close_device(dev);
+
+  timing_print(_out, _layout, _sector_size, "device_open", &open_timing);
+  timing_print(_out, _layout, _sector_size, "disklabel_probe", &probe_timing);
+  timing_print(_out, _layout, _sector_size, "partition_read", &read_timing);
+  timing_print(_out, _layout, _sector_size, "device_commit", &commit_timing);
+  timing_print(_out, _layout, _sector_size, "create_partition", &create_timing);
+  timing_print(_out, _layout, _sector_size, "remove_partition", &remove_timing);
+
+  fflush(_out);
+
+  unlink(path);
+  free(path);
+}
+
+static void print_help(void)
+{
+  fprintf(stderr,
+          "USAGE:\n"
+          "  %s [-d DIRECTORY] [-o FILE] [-n ITERATIONS] [-l LOOPS] [-r MEGABYTES]\n"
+          "\n"
+          "  -d  where the sparse images are created (default: .)\n"
+          "  -o  CSV output (default: standard output)\n"
+          "  -n  open/probe/commit repetitions per layout (default: 10)\n"
+          "  -l  create/remove iterations per layout (default: 100)\n"
+          "  -r  megabytes read through partition_read (default: 64)\n"
+          "\n"
+          "The " BENCH_MODULE " module must be in the dynamic linker path.\n"
+          "\n",
+          program);
+}
+
+int main(int _argc, char** _argv)
+{
+  struct gnufdisk_userinterface* ui;
+  struct options options;
+  size_t layout;
+  size_t size;
+  void* handle;
+  FILE* out;
+  int opt;
+
+  program = _argv[0];
+
+  options.directory = ".";
+  options.output = NULL;
+  options.iterations = 10;
+  options.loops = 100;
+  options.read_bytes = 64L << 20;
+
+  while((opt = getopt(_argc, _argv, "d:o:n:l:r:h")) != -1)
+    switch(opt)
+      {
+      case 'd':
+        options.directory = optarg;
+        break;
+      case 'o':
+        options.output = optarg;
+        break;
+      case 'n':
+        options.iterations = atoi(optarg);
+        break;
+      case 'l':
+        options.loops = atoi(optarg);
+        break;
+      case 'r':
+        options.read_bytes = atol(optarg) << 20;
+        break;
+      default:
+        print_help();
+        return EXIT_FAILURE;
+      }
+
+  if(options.iterations < 1 || options.loops < 0 || options.read_bytes < 0)
+    {
+      print_help();
+      return EXIT_FAILURE;
+    }
+
+  /* a missing module would end in an interactive question */
+  if((handle = dlopen(BENCH_MODULE ".so", RTLD_NOW)) == NULL)
+    die("%s", dlerror());
+
+  dlclose(handle);
+
+  if(options.output == NULL)
+    out = stdout;
+  else if((out = fopen(options.output, "w")) == NULL)
+    die("can not open %s: %s", options.output, strerror(errno));
+
+  if((ui = gnufdisk_userinterface_new()) == NULL
+     || (dm = gnufdisk_devicemanager_new(ui)) == NULL)
+    die("can not create devicemanager");
+
+  fprintf(out, "version,layout,entries,sector_size,operation,iterations,mean_ns,min_ns,max_ns,bytes_per_second\n");
+
+  for(layout = 0; layout < NLAYOUTS; layout++)
+    for(size = 0; size < NSECTOR_SIZES; size++)
+      bench_layout(out, &options, &layouts[layout], sector_sizes[size]);
+
+  gnufdisk_devicemanager_delete(dm);
+  gnufdisk_userinterface_delete(ui);
+
+  if(out != stdout && fclose(out) != 0)
+    die("can not write %s: %s", options.output, strerror(errno));
+
+  return EXIT_SUCCESS;
+}
@@ -21,6 +21,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <string.h>
 
 #include <gnufdisk-common.h>
 #include <gnufdisk-debug.h>
@@ -33,6 +34,8 @@
 
 #define GUILE 1
 
+#define MODULE_GNUFDISK_CORE "gnufdisk core"
+
 #define SYM_USERINTERFACE "*userinterface*"
 #define SYM_COMMANDLINE "*command-line*"
 #define SYM_GNUFDISK_HELP "gnufdisk-help"
@@ -53,11 +56,14 @@
 #define SYM_GNUFDISK_DEVICE_GET_PARAMETER "gnufdisk-device-get-parameter"
 #define SYM_GNUFDISK_DEVICE_COMMIT "gnufdisk-device-commit"
 #define SYM_GNUFDISK_DEVICE_CLOSE "gnufdisk-device-close"
+#define SYM_GNUFDISK_DEVICE_PLAN "gnufdisk-device-plan"
 #define SYM_GNUFDISK_DISKLABEL_P "gnufdisk-disklabel?"
 #define SYM_GNUFDISK_DISKLABEL_RAW "gnufdisk-disklabel-raw"
 #define SYM_GNUFDISK_DISKLABEL_SYSTEM "gnufdisk-disklabel-system"
 #define SYM_GNUFDISK_DISKLABEL_PARTITION "gnufdisk-disklabel-partition"
 #define SYM_GNUFDISK_DISKLABEL_COUNT_PARTITIONS "gnufdisk-disklabel-count-partitions"
+#define SYM_GNUFDISK_DISKLABEL_LIST "gnufdisk-disklabel-list"
+#define SYM_GNUFDISK_DISKLABEL_SNAPSHOT "gnufdisk-disklabel-snapshot"
 #define SYM_GNUFDISK_DISKLABEL_CREATE_PARTITION "gnufdisk-disklabel-create-partition"
 #define SYM_GNUFDISK_DISKLABEL_REMOVE_PARTITION "gnufdisk-disklabel-remove-partition"
 #define SYM_GNUFDISK_DISKLABEL_SET_PARAMETER "gnufdisk-disklabel-set-parameter"
@@ -74,12 +80,17 @@
 #define SYM_GNUFDISK_PARTITION_RESIZE "gnufdisk-partition-resize"
 #define SYM_GNUFDISK_PARTITION_READ "gnufdisk-partition-read"
 #define SYM_GNUFDISK_PARTITION_WRITE "gnufdisk-partition-write"
+#define SYM_GNUFDISK_PARTITION_EXPORT "gnufdisk-partition-export"
+#define SYM_GNUFDISK_PARTITION_IMPORT "gnufdisk-partition-import"
+#define SYM_GNUFDISK_PARTITION_DIGEST "gnufdisk-partition-digest"
 #define SYM_GNUFDISK_MAKE_RAW "gnufdisk-make-raw"
 #define SYM_GNUFDISK_RAW_P "gnufdisk-raw?"
 #define SYM_GNUFDISK_RAW_REF "gnufdisk-raw-ref"
 #define SYM_GNUFDISK_RAW_SET_X "gnufdisk-raw-set!"
 #define SYM_GNUFDISK_RAW_LENGTH "gnufdisk-raw-length"
 #define SYM_GNUFDISK_USERINTERFACE_SET_HOOK "gnufdisk-userinterface-set-hook"
+#define SYM_GNUFDISK_STATS "gnufdisk-stats"
+#define SYM_GNUFDISK_STATS_RESET "gnufdisk-stats-reset"
 
 /* non public functions */
 #define SYM_GNUFDISK_USERINTERFACE_PRINT "gnufdisk-userinterface-print"
@@ -103,6 +114,9 @@
  * on top of it.  This second layer use the 16 smob bits to check its type, */
 static scm_t_bits scheme_object_bits;
 
+/* clock at gnufdisk_userinterface_internals__run, for the ui_startup statistic */
+static unsigned long long scheme_startup_clock;
+
 /* We use this structure to generalize the type of data contained in a smob. 
  * When guile call one of the functions related to this object, 
  * the call is diverted to the specific function 
@@ -122,7 +136,6 @@ enum scheme_object_type {
   SCHEME_OBJECT_TYPE_DEVICE,
   SCHEME_OBJECT_TYPE_DISKLABEL,
   SCHEME_OBJECT_TYPE_PARTITION,
-  SCHEME_OBJECT_TYPE_GEOMETRY,
   SCHEME_OBJECT_TYPE_CHS_GEOMETRY,
   SCHEME_OBJECT_TYPE_USERINTERFACE,
   SCHEME_OBJECT_TYPE_RAW
@@ -157,11 +170,6 @@ struct scheme_partition {
   struct gnufdisk_partition* partition;
 };
 
-struct scheme_geometry {
-  struct gnufdisk_devicemanager* dm;
-  struct gnufdisk_geometry* geometry;
-};
-
 struct scheme_raw {
   void* buf;
   size_t size;
@@ -186,9 +194,6 @@ struct scheme_raw {
 #define SCHEME_OBJECT_TYPE_PARTITION_P(_smob)                                  \
   SCHEME_OBJECT_TYPE_P(_smob, SCHEME_OBJECT_TYPE_PARTITION)
 
-#define SCHEME_OBJECT_TYPE_GEOMETRY_P(_smob)                                   \
-  SCHEME_OBJECT_TYPE_P(_smob, SCHEME_OBJECT_TYPE_GEOMETRY)
-
 #define SCHEME_OBJECT_TYPE_CHS_GEOMETRY_P(_smob)                               \
   SCHEME_OBJECT_TYPE_P(_smob, SCHEME_OBJECT_TYPE_CHS_GEOMETRY)
 
@@ -996,120 +1001,32 @@ scheme_partition_scheme_disklabel(SCM _smob)
 }
 #endif
 
-/* geometry SMOB functions */
-static SCM scheme_geometry_mark(struct scheme_object* _object)
+/* geometries are plain pairs (START . END), END has the same meaning as in
+ * struct gnufdisk_geometry. Both fields are fixnums for any real disk, so a
+ * geometry costs one cell and nothing has to be freed. */
+static SCM scheme_range_new(struct gnufdisk_range _r)
 {
-  struct scheme_geometry* geometry;
-
-  geometry = _object->specific;
-
-  /* do nothing */
-
-  return SCM_BOOL_F;
-}
-
-static size_t scheme_geometry_free(struct scheme_object* _object)
-{
-  struct scheme_geometry* geometry;
-
-  geometry = _object->specific;
-
-  if(geometry)
-    {
-      if(geometry->dm)
-        gnufdisk_devicemanager_delete(geometry->dm);
-
-      if(geometry->geometry)
-	gnufdisk_geometry_delete(geometry->geometry);
-
-      memset(geometry, 0, sizeof(struct scheme_geometry));
-
-      free(geometry);
-      
-      return sizeof(struct scheme_geometry);
-    }
-
-  return 0;
-}
-
-static int scheme_geometry_print(struct scheme_object* _obj, SCM _port, scm_print_state* _state)
-{
-  char buffer[1024];
-  struct scheme_geometry* geometry;
-
-  geometry = _obj->specific;
-
-  snprintf(buffer, sizeof(buffer), "#<struct gnufdisk_geometry* %p> )>\n", geometry->geometry);
-
-  scm_c_write(_port, buffer, strlen(buffer));
-
-  return 1;
-}
-
-static SCM scheme_geometry_equalp(struct scheme_object* _obj1, struct scheme_object* _obj2)
-{
-  struct scheme_geometry* geometry1;
-  struct scheme_geometry* geometry2;
-
-  geometry1 = _obj1->specific;
-  geometry2 = _obj2->specific;
-
-  return geometry1 == geometry2 ? SCM_BOOL_T : SCM_BOOL_F;
-}
-
-static SCM scheme_geometry_new(struct gnufdisk_geometry* _geom, 
-                               struct gnufdisk_devicemanager* _dm)
-{
-  struct scheme_geometry* geometry;
-  SCM smob;
-
-  geometry = NULL;
-  smob = NULL;
-
-  scm_dynwind_begin(0);
-
-  geometry = scm_calloc(sizeof(struct scheme_geometry));
-  scm_dynwind_unwind_handler (free, geometry, 0);
-
-  geometry->geometry = _geom;
-
-  gnufdisk_devicemanager_ref(_dm);
-  geometry->dm = _dm;
-
-  smob = scheme_object_new(SCHEME_OBJECT_TYPE_GEOMETRY,
-                           geometry, 
-                           &scheme_geometry_mark, 
-                           &scheme_geometry_free,
-                           &scheme_geometry_print, 
-                           &scheme_geometry_equalp);
-
-  scm_dynwind_end();
-
-  return smob;
+  return scm_cons(scm_from_long_long(_r.start), scm_from_long_long(_r.end));
 }
 
-static struct gnufdisk_geometry* scheme_geometry_to_gnufdisk_geometry(SCM _smob)
+static int scheme_range_p(SCM _obj)
 {
-  struct scheme_geometry* geometry;
-
-  if(!SCHEME_OBJECT_TYPE_GEOMETRY_P(_smob))
-    scm_wrong_type_arg(__FUNCTION__, 1, _smob);
-
-  geometry = scheme_object_specific(_smob);
-
-  return geometry->geometry;
+  return scm_is_pair(_obj) 
+    && scm_is_integer(SCM_CAR(_obj)) 
+    && scm_is_integer(SCM_CDR(_obj));
 }
 
-static struct gnufdisk_devicemanager* scheme_geometry_to_gnufdisk_devicemanager(SCM _smob)
+static struct gnufdisk_range scheme_to_gnufdisk_range(SCM _obj)
 {
-  struct scheme_geometry* geometry;
+  struct gnufdisk_range r;
 
-  if(!SCHEME_OBJECT_TYPE_GEOMETRY_P(_smob))
-    scm_wrong_type_arg(__FUNCTION__, 1, _smob);
+  if(!scheme_range_p(_obj))
+    scm_wrong_type_arg(__FUNCTION__, 1, _obj);
 
-  geometry = scheme_object_specific(_smob);
+  r.start = scm_to_long_long(SCM_CAR(_obj));
+  r.end = scm_to_long_long(SCM_CDR(_obj));
 
-  return geometry->dm;
+  return r;
 }
 
 /* raw SMOB functions */
@@ -1295,6 +1212,85 @@ static SCM scheme_raw_length(SCM _smob)
   return scm_from_size_t(raw->size);
 }
 
+static SCM scheme_stats_entry(struct gnufdisk_stats* _stats)
+{
+  SCM histogram;
+  char name[64];
+  char* iter;
+  int bucket;
+
+  snprintf(name, sizeof(name), "%s", _stats->name);
+
+  for(iter = name; *iter; iter++)
+    if(*iter == '_')
+      *iter = '-';
+
+  histogram = scm_c_make_vector(GNUFDISK_STATS_BUCKETS, SCM_UNSPECIFIED);
+
+  for(bucket = 0; bucket < GNUFDISK_STATS_BUCKETS; bucket++)
+    scm_c_vector_set_x(histogram, bucket, scm_from_ulong_long(_stats->histogram[bucket]));
+
+  return scm_cons(scm_from_locale_symbol(name),
+		  scm_list_5(scm_cons(scm_from_locale_symbol("count"), scm_from_ulong_long(_stats->count)),
+			     scm_cons(scm_from_locale_symbol("bytes"), scm_from_ulong_long(_stats->bytes)),
+			     scm_cons(scm_from_locale_symbol("total-seconds"), scm_from_double(_stats->total_nsec / 1e9)),
+			     scm_cons(scm_from_locale_symbol("max-seconds"), scm_from_double(_stats->max_nsec / 1e9)),
+			     scm_cons(scm_from_locale_symbol("histogram-usec-log2"), histogram)));
+}
+
+static SCM scheme_stats(SCM _smob, SCM _format)
+{
+  struct gnufdisk_devicemanager* dm;
+  struct gnufdisk_stats stats;
+  int op;
+  SCM ret;
+
+  dm = scheme_devicemanager_to_gnufdisk_devicemanager(_smob);
+
+  if(!SCM_UNBNDP(_format))
+    {
+      struct gnufdisk_string* text;
+
+      if(!scm_is_eq(_format, scm_from_locale_symbol("prometheus")))
+	scm_wrong_type_arg(SYM_GNUFDISK_STATS, 2, _format);
+
+      if((text = gnufdisk_devicemanager_stats_prometheus(dm)) == NULL)
+	scm_error(scm_from_locale_symbol("operation-failed"), 
+		  SYM_GNUFDISK_STATS,
+		  "cannot export statistics",
+		  SCM_EOL, SCM_UNDEFINED);
+
+      scm_dynwind_begin(0);
+      scm_dynwind_unwind_handler(&delete_string, text, SCM_F_WIND_EXPLICITLY);
+
+      ret = scm_from_locale_string(gnufdisk_string_c_string(text));
+
+      scm_dynwind_end();
+
+      return ret;
+    }
+
+  for(ret = SCM_EOL, op = 0; gnufdisk_devicemanager_stats(dm, op, &stats) == 0; op++)
+    ret = scm_cons(scheme_stats_entry(&stats), ret);
+
+  return scm_reverse(ret);
+}
+
+static SCM scheme_stats_reset(SCM _smob)
+{
+  struct gnufdisk_devicemanager* dm;
+
+  dm = scheme_devicemanager_to_gnufdisk_devicemanager(_smob);
+
+  if(gnufdisk_devicemanager_stats_reset(dm) != 0)
+    scm_error(scm_from_locale_symbol("operation-failed"), 
+	      SYM_GNUFDISK_STATS_RESET,
+	      "cannot reset statistics",
+	      SCM_EOL, SCM_UNDEFINED);
+
+  return SCM_UNSPECIFIED;
+}
+
 static SCM scheme_preunwind_catch_handler (void* _data, SCM _key, SCM _args)
 {
   if(_data)
@@ -1347,11 +1343,14 @@ static SCM scheme_gnufdisk_help(void)
 	   "    " SYM_GNUFDISK_DEVICE_GET_PARAMETER " device param-name type\n"
 	   "    " SYM_GNUFDISK_DEVICE_COMMIT " device\n"
 	   "    " SYM_GNUFDISK_DEVICE_CLOSE " device\n"
+	   "    " SYM_GNUFDISK_DEVICE_PLAN " device requests [commit]\n"
 	   "    " SYM_GNUFDISK_DISKLABEL_P " disklabel\n"
 	   "    " SYM_GNUFDISK_DISKLABEL_RAW " disklabel\n"
 	   "    " SYM_GNUFDISK_DISKLABEL_SYSTEM " disklabel\n"
 	   "    " SYM_GNUFDISK_DISKLABEL_PARTITION " disklabel number\n"
            "    " SYM_GNUFDISK_DISKLABEL_COUNT_PARTITIONS " disklabel\n"
+	   "    " SYM_GNUFDISK_DISKLABEL_LIST " disklabel\n"
+	   "    " SYM_GNUFDISK_DISKLABEL_SNAPSHOT " disklabel\n"
 	   "    " SYM_GNUFDISK_DISKLABEL_CREATE_PARTITION " disklabel start-geometry end-geometry type\n"
 	   "    " SYM_GNUFDISK_DISKLABEL_REMOVE_PARTITION " disklabel number\n"
 	   "    " SYM_GNUFDISK_DISKLABEL_SET_PARAMETER " disklabel param-name value\n"
@@ -1368,7 +1367,12 @@ static SCM scheme_gnufdisk_help(void)
            "    " SYM_GNUFDISK_PARTITION_RESIZE " partition end-range\n"
            "    " SYM_GNUFDISK_PARTITION_READ " partition start-sector size\n"
            "    " SYM_GNUFDISK_PARTITION_WRITE " partition start-sector raw-data\n"
-           "    " SYM_GNUFDISK_RAW_P " raw\n", 
+           "    " SYM_GNUFDISK_PARTITION_EXPORT " partition image-path\n"
+           "    " SYM_GNUFDISK_PARTITION_IMPORT " partition image-path\n"
+           "    " SYM_GNUFDISK_PARTITION_DIGEST " partition [chunk-size [threads]]\n"
+           "    " SYM_GNUFDISK_RAW_P " raw\n"
+           "    " SYM_GNUFDISK_STATS " devicemanager [prometheus]\n"
+           "    " SYM_GNUFDISK_STATS_RESET " devicemanager\n", 
     scm_current_output_port());
   
   return SCM_BOOL_T;
@@ -1393,12 +1397,8 @@ static SCM scheme_devicemanager_p(SCM _smob)
 
 static SCM scheme_devicemanager_make_geometry(SCM _dm, SCM _start, SCM _length)
 {
-  struct gnufdisk_geometry* geom;
-  struct gnufdisk_devicemanager* dm;
-  gnufdisk_integer start;
-  gnufdisk_integer length;
-
-  dm = scheme_devicemanager_to_gnufdisk_devicemanager(_dm);
+  /* the devicemanager is only checked, geometries do not depend on it */
+  scheme_devicemanager_to_gnufdisk_devicemanager(_dm);
 
   if(!scm_is_integer(_start))
     scm_wrong_type_arg(SYM_GNUFDISK_DEVICEMANAGER_MAKE_GEOMETRY, 1, _start);
@@ -1406,102 +1406,68 @@ static SCM scheme_devicemanager_make_geometry(SCM _dm, SCM _start, SCM _length)
   if(!scm_is_integer(_length))
     scm_wrong_type_arg(SYM_GNUFDISK_DEVICEMANAGER_MAKE_GEOMETRY, 2, _length);
 
-  start = scm_to_int64(_start);
-  length = scm_to_int64(_length);
-
-  if((geom = gnufdisk_devicemanager_geometry_new(dm, start, length)) == NULL)
-    scm_error(scm_from_locale_symbol("operation-failed"), 
-	      SYM_GNUFDISK_DEVICEMANAGER_MAKE_GEOMETRY,
-	      "cannot create geometry",
-	      SCM_EOL, SCM_UNDEFINED);
-
-  return scheme_geometry_new(geom, dm);
+  return scheme_range_new(gnufdisk_range_make(scm_to_int64(_start), scm_to_int64(_length)));
 }
 
-static SCM scheme_geometry_p(SCM _smob)
+static SCM scheme_geometry_p(SCM _obj)
 {
-  return SCHEME_OBJECT_TYPE_GEOMETRY_P(_smob) ? SCM_BOOL_T : SCM_BOOL_F;
+  return scheme_range_p(_obj) ? SCM_BOOL_T : SCM_BOOL_F;
 }
 
-static SCM scheme_geometry_set(SCM _smob, SCM _start, SCM _length)
+static SCM scheme_geometry_set(SCM _obj, SCM _start, SCM _length)
 {
-  struct gnufdisk_devicemanager* dm;
-  struct gnufdisk_geometry* geom;
+  struct gnufdisk_range r;
   gnufdisk_integer start;
   gnufdisk_integer length;
  
+  if(!scheme_range_p(_obj))
+    scm_wrong_type_arg(SYM_GNUFDISK_GEOMETRY_SET, 1, _obj);
+
   if(!scm_is_integer(_start))
     scm_wrong_type_arg(SYM_GNUFDISK_GEOMETRY_SET, 2, _start);
 
   if(!scm_is_integer(_length))
     scm_wrong_type_arg(SYM_GNUFDISK_GEOMETRY_SET, 3, _length);
 
-  dm = scheme_geometry_to_gnufdisk_devicemanager(_smob);
-  geom = scheme_geometry_to_gnufdisk_geometry(_smob);
   start = scm_to_long_long(_start);
   length = scm_to_long_long(_length);
 
-  if(gnufdisk_devicemanager_geometry_set(dm, geom, start, length) == NULL)
+  if(length <= 0)
     scm_error(scm_from_locale_symbol("operation-failed"), 
 	      SYM_GNUFDISK_GEOMETRY_SET,
-	      "cannot set geometry",
-	      SCM_EOL, SCM_UNDEFINED);
+	      "invalid length: ~A",
+	      scm_list_1(_length), SCM_UNDEFINED);
 
-  return _smob;
+  r = gnufdisk_range_make(start, length);
+
+  scm_set_car_x(_obj, scm_from_long_long(r.start));
+  scm_set_cdr_x(_obj, scm_from_long_long(r.end));
+
+  return _obj;
 }
 
-static SCM scheme_geometry_start(SCM _smob)
+static SCM scheme_geometry_start(SCM _obj)
 {
-  struct gnufdisk_devicemanager* dm;
-  struct gnufdisk_geometry* geom;
-  gnufdisk_integer start;
-
-  dm = scheme_geometry_to_gnufdisk_devicemanager(_smob);
-  geom = scheme_geometry_to_gnufdisk_geometry(_smob);
-  
-  if((start = gnufdisk_devicemanager_geometry_start(dm, geom)) == -1)
-    scm_error(scm_from_locale_symbol("operation-failed"), 
-	      SYM_GNUFDISK_GEOMETRY_START,
-	      "cannot get geometry start",
-	      SCM_EOL, SCM_UNDEFINED);
+  if(!scheme_range_p(_obj))
+    scm_wrong_type_arg(SYM_GNUFDISK_GEOMETRY_START, 1, _obj);
 
-  return scm_from_long_long(start);
+  return SCM_CAR(_obj);
 }
 
-static SCM scheme_geometry_end(SCM _smob)
+static SCM scheme_geometry_end(SCM _obj)
 {
-  struct gnufdisk_devicemanager* dm;
-  struct gnufdisk_geometry* geom;
-  gnufdisk_integer end;
-
-  dm = scheme_geometry_to_gnufdisk_devicemanager(_smob);
-  geom = scheme_geometry_to_gnufdisk_geometry(_smob);
-  
-  if((end = gnufdisk_devicemanager_geometry_end(dm, geom)) == -1)
-    scm_error(scm_from_locale_symbol("operation-failed"), 
-	      SYM_GNUFDISK_GEOMETRY_END,
-	      "cannot get geometry end",
-	      SCM_EOL, SCM_UNDEFINED);
+  if(!scheme_range_p(_obj))
+    scm_wrong_type_arg(SYM_GNUFDISK_GEOMETRY_END, 1, _obj);
 
-  return scm_from_long_long(end);
+  return SCM_CDR(_obj);
 }
 
-static SCM scheme_geometry_length(SCM _smob)
+static SCM scheme_geometry_length(SCM _obj)
 {
-  struct gnufdisk_devicemanager* dm;
-  struct gnufdisk_geometry* geom;
-  gnufdisk_integer length;
-
-  dm = scheme_geometry_to_gnufdisk_devicemanager(_smob);
-  geom = scheme_geometry_to_gnufdisk_geometry(_smob);
-  
-  if((length = gnufdisk_devicemanager_geometry_length(dm, geom)) == -1)
-    scm_error(scm_from_locale_symbol("operation-failed"), 
-	      SYM_GNUFDISK_GEOMETRY_LENGTH,
-	      "cannot get geometry length",
-	      SCM_EOL, SCM_UNDEFINED);
+  if(!scheme_range_p(_obj))
+    scm_wrong_type_arg(SYM_GNUFDISK_GEOMETRY_LENGTH, 1, _obj);
 
-  return scm_from_long_long(length);
+  return scm_from_long_long(gnufdisk_range_length(scheme_to_gnufdisk_range(_obj)));
 }
 
 static SCM scheme_devicemanager_make_device(SCM _smob, SCM _mod, SCM _options)
@@ -1770,6 +1736,114 @@ static SCM scheme_device_close(SCM _smob)
   return SCM_BOOL_T;
 }
 
+static gnufdisk_integer scheme_plan_integer(SCM _request, const char* _key, int _pos)
+{
+  SCM value;
+
+  value = scm_assq_ref(_request, scm_from_locale_symbol(_key));
+
+  if(scm_is_false(value))
+    return 0;
+  else if(!scm_is_integer(value))
+    scm_wrong_type_arg(SYM_GNUFDISK_DEVICE_PLAN, _pos, _request);
+
+  return scm_to_long_long(value);
+}
+
+/* Every request is an alist of size, percent, min, max (bytes), align
+ * (default, optimal, minimum or sector), order and type. Return a list
+ * of (start . length) in sectors, in the order of the requests. */
+static SCM scheme_device_plan(SCM _smob, SCM _requests, SCM _commit)
+{
+  static const char* alignments[] = {
+    [GNUFDISK_DEVICEMANAGER_PLAN_ALIGN_DEFAULT] = "default",
+    [GNUFDISK_DEVICEMANAGER_PLAN_ALIGN_OPTIMAL] = "optimal",
+    [GNUFDISK_DEVICEMANAGER_PLAN_ALIGN_MINIMUM] = "minimum",
+    [GNUFDISK_DEVICEMANAGER_PLAN_ALIGN_SECTOR] = "sector"
+  };
+  struct gnufdisk_devicemanager_plan_request* requests;
+  struct gnufdisk_devicemanager* dm;
+  struct gnufdisk_device* dev;
+  size_t nrequests;
+  size_t iter;
+  SCM list;
+  SCM ret;
+
+  if(scm_is_false(scm_list_p(_requests)))
+    scm_wrong_type_arg(SYM_GNUFDISK_DEVICE_PLAN, 2, _requests);
+
+  dm = scheme_device_to_gnufdisk_devicemanager(_smob);
+  dev = scheme_device_to_gnufdisk_device(_smob);
+
+  nrequests = scm_to_size_t(scm_length(_requests));
+
+  scm_dynwind_begin(0);
+
+  requests = scm_calloc(nrequests > 0 ? nrequests * sizeof(struct gnufdisk_devicemanager_plan_request) : 1);
+  scm_dynwind_unwind_handler(&free, requests, SCM_F_WIND_EXPLICITLY);
+
+  for(list = _requests, iter = 0; iter < nrequests; list = scm_cdr(list), iter++)
+    {
+      struct gnufdisk_devicemanager_plan_request* r;
+      SCM request;
+      SCM value;
+
+      r = &requests[iter];
+      request = scm_car(list);
+
+      r->size = scheme_plan_integer(request, "size", 2);
+      r->percent = scheme_plan_integer(request, "percent", 2);
+      r->min = scheme_plan_integer(request, "min", 2);
+      r->max = scheme_plan_integer(request, "max", 2);
+      r->order = scheme_plan_integer(request, "order", 2);
+      r->alignment = GNUFDISK_DEVICEMANAGER_PLAN_ALIGN_DEFAULT;
+      r->type = "PRIMARY";
+
+      value = scm_assq_ref(request, scm_from_locale_symbol("align"));
+
+      if(scm_is_true(value))
+	{
+	  size_t a;
+
+	  for(a = 0; a < sizeof(alignments) / sizeof(alignments[0]); a++)
+	    if(scm_is_eq(value, scm_from_locale_symbol(alignments[a])))
+	      break;
+
+	  if(a == sizeof(alignments) / sizeof(alignments[0]))
+	    scm_wrong_type_arg(SYM_GNUFDISK_DEVICE_PLAN, 2, value);
+
+	  r->alignment = a;
+	}
+
+      value = scm_assq_ref(request, scm_from_locale_symbol("type"));
+
+      if(scm_is_true(value))
+	{
+	  if(!scm_is_string(value))
+	    scm_wrong_type_arg(SYM_GNUFDISK_DEVICE_PLAN, 2, value);
+
+	  r->type = scm_to_locale_string(value);
+	  scm_dynwind_unwind_handler(&free, (void*) r->type, SCM_F_WIND_EXPLICITLY);
+	}
+    }
+
+  if(gnufdisk_devicemanager_device_plan(dm, dev, requests, nrequests,
+					!SCM_UNBNDP(_commit) && scm_is_true(_commit)) != 0)
+    scm_error(scm_from_locale_symbol("operation-failed"), 
+	      SYM_GNUFDISK_DEVICE_PLAN,
+	      "cannot plan layout",
+	      SCM_EOL, SCM_UNDEFINED);
+
+  for(ret = SCM_EOL, iter = nrequests; iter > 0; iter--)
+    ret = scm_cons(scm_cons(scm_from_long_long(requests[iter - 1].start),
+			    scm_from_long_long(requests[iter - 1].length)),
+		   ret);
+
+  scm_dynwind_end();
+
+  return ret;
+}
+
 static SCM scheme_disklabel_raw(SCM _smob)
 {
   struct gnufdisk_devicemanager* dm;
@@ -1860,6 +1934,191 @@ static SCM scheme_disklabel_count_partitions(SCM _smob)
   return scm_from_int(res);
 }
 
+/* commands recorded per partition by scheme_disklabel_list */
+enum {
+  LIST_PARTITION,
+  LIST_NUMBER,
+  LIST_START,
+  LIST_LENGTH,
+  LIST_TYPE,
+  LIST_DELETE,
+  LIST_NCOMMANDS
+};
+
+static void scheme_disklabel_list_cleanup(struct gnufdisk_devicemanager_batch_command* _commands,
+					  size_t _ncommands)
+{
+  size_t iter;
+
+  for(iter = 0; iter < _ncommands; iter++)
+    if(_commands[iter].operation == GNUFDISK_DEVICEMANAGER_BATCH_PARTITION_TYPE
+       && _commands[iter].result.string != NULL)
+      gnufdisk_string_delete(_commands[iter].result.string);
+    else if(_commands[iter].operation == GNUFDISK_DEVICEMANAGER_BATCH_DISKLABEL_PARTITION
+	    && _commands[iter].result.partition != NULL)
+      gnufdisk_partition_delete(_commands[iter].result.partition);
+}
+
+static void delete_snapshot(void* _p)
+{
+  gnufdisk_disklabel_snapshot_delete(_p);
+}
+
+/* Return a list of (number start length type), one for each partition.
+ * The numbers come from a snapshot, they need not be contiguous (an
+ * empty MBR slot, a sparse GPT); the listing itself runs as one
+ * devicemanager batch. */
+static SCM scheme_disklabel_list(SCM _smob)
+{
+  struct gnufdisk_devicemanager* dm;
+  struct gnufdisk_disklabel* disk;
+  struct gnufdisk_disklabel_snapshot* snapshot;
+  struct gnufdisk_devicemanager_batch_command* commands;
+  size_t ncommands;
+  size_t done;
+  size_t iter;
+  SCM ret;
+
+  dm = scheme_disklabel_to_gnufdisk_devicemanager(_smob);
+  disk = scheme_disklabel_to_gnufdisk_disklabel(_smob);
+
+  if((snapshot = gnufdisk_devicemanager_disklabel_snapshot(dm, disk)) == NULL)
+    scm_error(scm_from_locale_symbol("operation-failed"), 
+	      SYM_GNUFDISK_DISKLABEL_LIST,
+	      "cannot enumerate partitions",
+	      SCM_EOL, SCM_UNDEFINED);
+
+  scm_dynwind_begin(0);
+  scm_dynwind_unwind_handler(&delete_snapshot, snapshot, SCM_F_WIND_EXPLICITLY);
+
+  ncommands = snapshot->nrecords * LIST_NCOMMANDS;
+
+  commands = scm_calloc(ncommands > 0 ? ncommands * sizeof(struct gnufdisk_devicemanager_batch_command) : 1);
+  scm_dynwind_free(commands);
+
+  for(iter = 0; iter < ncommands; iter += LIST_NCOMMANDS)
+    {
+      commands[iter + LIST_PARTITION].operation = GNUFDISK_DEVICEMANAGER_BATCH_DISKLABEL_PARTITION;
+      commands[iter + LIST_PARTITION].object = disk;
+      commands[iter + LIST_PARTITION].source = -1;
+      commands[iter + LIST_PARTITION].number = snapshot->records[iter / LIST_NCOMMANDS].number;
+      commands[iter + LIST_NUMBER].operation = GNUFDISK_DEVICEMANAGER_BATCH_PARTITION_NUMBER;
+      commands[iter + LIST_START].operation = GNUFDISK_DEVICEMANAGER_BATCH_PARTITION_START;
+      commands[iter + LIST_LENGTH].operation = GNUFDISK_DEVICEMANAGER_BATCH_PARTITION_LENGTH;
+      commands[iter + LIST_TYPE].operation = GNUFDISK_DEVICEMANAGER_BATCH_PARTITION_TYPE;
+      commands[iter + LIST_DELETE].operation = GNUFDISK_DEVICEMANAGER_BATCH_PARTITION_DELETE;
+
+      commands[iter + LIST_NUMBER].source = iter + LIST_PARTITION;
+      commands[iter + LIST_START].source = iter + LIST_PARTITION;
+      commands[iter + LIST_LENGTH].source = iter + LIST_PARTITION;
+      commands[iter + LIST_TYPE].source = iter + LIST_PARTITION;
+      commands[iter + LIST_DELETE].source = iter + LIST_PARTITION;
+    }
+
+  if((done = gnufdisk_devicemanager_batch(dm, commands, ncommands)) != ncommands)
+    {
+      scheme_disklabel_list_cleanup(commands, done);
+      scm_error(scm_from_locale_symbol("operation-failed"), 
+		SYM_GNUFDISK_DISKLABEL_LIST,
+		"cannot list partitions",
+		SCM_EOL, SCM_UNDEFINED);
+    }
+
+  for(ret = SCM_EOL, iter = ncommands; iter > 0; iter -= LIST_NCOMMANDS)
+    {
+      struct gnufdisk_devicemanager_batch_command* cmd;
+
+      cmd = &commands[iter - LIST_NCOMMANDS];
+
+      ret = scm_cons(scm_list_4(scm_from_long_long(cmd[LIST_NUMBER].result.integer),
+				scm_from_long_long(cmd[LIST_START].result.integer),
+				scm_from_long_long(cmd[LIST_LENGTH].result.integer),
+				scm_from_locale_string(gnufdisk_string_c_string(cmd[LIST_TYPE].result.string))),
+		     ret);
+    }
+
+  scheme_disklabel_list_cleanup(commands, ncommands);
+
+  scm_dynwind_end();
+
+  return ret;
+}
+
+/* GPT stores the first three GUID fields little endian */
+static SCM scheme_guid_to_string(const unsigned char* _guid)
+{
+  char text[37];
+
+  snprintf(text, sizeof(text), 
+	   "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+	   _guid[3], _guid[2], _guid[1], _guid[0], _guid[5], _guid[4], _guid[7], _guid[6],
+	   _guid[8], _guid[9], _guid[10], _guid[11], _guid[12], _guid[13], _guid[14], _guid[15]);
+
+  return scm_from_locale_string(text);
+}
+
+/* Return a vector with #(number start length type have-disklabel guid content)
+ * for each partition, built from a single disklabel snapshot. */
+static SCM scheme_disklabel_snapshot(SCM _smob)
+{
+  static const char* types[] = {
+    [GNUFDISK_PARTITION_TYPE_UNKNOWN] = "unknown",
+    [GNUFDISK_PARTITION_TYPE_PRIMARY] = "primary",
+    [GNUFDISK_PARTITION_TYPE_EXTENDED] = "extended",
+    [GNUFDISK_PARTITION_TYPE_EXTENDED_LBA] = "extended-lba",
+    [GNUFDISK_PARTITION_TYPE_LOGICAL] = "logical",
+    [GNUFDISK_PARTITION_TYPE_GUID] = "guid"
+  };
+  struct gnufdisk_devicemanager* dm;
+  struct gnufdisk_disklabel* disk;
+  struct gnufdisk_disklabel_snapshot* snapshot;
+  size_t iter;
+  SCM ret;
+
+  dm = scheme_disklabel_to_gnufdisk_devicemanager(_smob);
+  disk = scheme_disklabel_to_gnufdisk_disklabel(_smob);
+
+  if((snapshot = gnufdisk_devicemanager_disklabel_snapshot(dm, disk)) == NULL)
+    scm_error(scm_from_locale_symbol("operation-failed"), 
+	      SYM_GNUFDISK_DISKLABEL_SNAPSHOT,
+	      "cannot snapshot disklabel",
+	      SCM_EOL, SCM_UNDEFINED);
+
+  scm_dynwind_begin(0);
+  scm_dynwind_unwind_handler(&delete_snapshot, snapshot, SCM_F_WIND_EXPLICITLY);
+
+  ret = scm_c_make_vector(snapshot->nrecords, SCM_UNSPECIFIED);
+
+  for(iter = 0; iter < snapshot->nrecords; iter++)
+    {
+      struct gnufdisk_partition_record* record;
+      SCM entry;
+
+      record = &snapshot->records[iter];
+      entry = scm_c_make_vector(7, SCM_BOOL_F);
+
+      scm_c_vector_set_x(entry, 0, scm_from_int(record->number));
+      scm_c_vector_set_x(entry, 1, scm_from_long_long(record->start));
+      scm_c_vector_set_x(entry, 2, scm_from_long_long(record->length));
+      scm_c_vector_set_x(entry, 3, 
+			 scm_from_locale_symbol(record->type <= GNUFDISK_PARTITION_TYPE_GUID 
+						? types[record->type] : "unknown"));
+      scm_c_vector_set_x(entry, 4, scm_from_bool(record->flags & GNUFDISK_PARTITION_HAVE_DISKLABEL));
+
+      if(record->flags & GNUFDISK_PARTITION_HAVE_GUID)
+	scm_c_vector_set_x(entry, 5, scheme_guid_to_string(record->guid));
+
+      if(record->content[0] != 0)
+	scm_c_vector_set_x(entry, 6, scm_from_locale_string(record->content));
+
+      scm_c_vector_set_x(ret, iter, entry);
+    }
+
+  scm_dynwind_end();
+
+  return ret;
+}
+
 static SCM scheme_partition_p(SCM _smob)
 {
   return SCHEME_OBJECT_TYPE_PARTITION_P(_smob) ? SCM_BOOL_T : SCM_BOOL_F;
@@ -1869,8 +2128,8 @@ static SCM scheme_disklabel_create_partition(SCM _smob, SCM _start, SCM _end, SC
 {
   struct gnufdisk_devicemanager* dm;
   struct gnufdisk_disklabel* disk;
-  struct gnufdisk_geometry* start;
-  struct gnufdisk_geometry* end;
+  struct gnufdisk_range start;
+  struct gnufdisk_range end;
   struct gnufdisk_string* type;
   struct gnufdisk_partition* part;
 
@@ -1881,13 +2140,13 @@ static SCM scheme_disklabel_create_partition(SCM _smob, SCM _start, SCM _end, SC
 
   dm = scheme_disklabel_to_gnufdisk_devicemanager(_smob);
   disk = scheme_disklabel_to_gnufdisk_disklabel(_smob);
-  start = scheme_geometry_to_gnufdisk_geometry(_start);
-  end = scheme_geometry_to_gnufdisk_geometry(_end);
+  start = scheme_to_gnufdisk_range(_start);
+  end = scheme_to_gnufdisk_range(_end);
 
   type = scm_to_gnufdisk_string(_type);
   scm_dynwind_unwind_handler(&delete_string, type, 0);
 
-  if((part = gnufdisk_devicemanager_disklabel_create_partition(dm, disk, start, end, type)) == NULL)
+  if((part = gnufdisk_devicemanager_disklabel_create_partition_range(dm, disk, start, end, type)) == NULL)
     scm_error(scm_from_locale_symbol("operation-failed"), 
 	      SYM_GNUFDISK_DISKLABEL_CREATE_PARTITION,
 	      "cannot create partition",
@@ -2159,22 +2418,20 @@ static SCM scheme_partition_geometry(SCM _smob)
 {
   struct gnufdisk_devicemanager* dm;
   struct gnufdisk_partition* part;
-  gnufdisk_integer start;
-  gnufdisk_integer length;
-  struct gnufdisk_geometry* geometry;
+  struct gnufdisk_range range;
 
   dm = scheme_partition_to_gnufdisk_devicemanager(_smob);
   part = scheme_partition_to_gnufdisk_partition(_smob);
  
-  if((start = gnufdisk_devicemanager_partition_start(dm, part)) == -1
-    || (length = gnufdisk_devicemanager_partition_length(dm, part)) == -1 
-    || (geometry = gnufdisk_devicemanager_geometry_new(dm, start, length)) == NULL)
+  range = gnufdisk_devicemanager_partition_range(dm, part);
+
+  if(range.start == -1)
     scm_error(scm_from_locale_symbol("operation-failed"), 
 	      SYM_GNUFDISK_PARTITION_GEOMETRY,
 	      "cannot get geometry",
 	      SCM_EOL, SCM_UNDEFINED);
  
-  return scheme_geometry_new(geometry, scheme_partition_to_gnufdisk_devicemanager(_smob));
+  return scheme_range_new(range);
 }
 
 static SCM scheme_partition_number(SCM _smob)
@@ -2235,13 +2492,13 @@ static SCM scheme_partition_move(SCM _smob, SCM _start)
 {
   struct gnufdisk_devicemanager* dm;
   struct gnufdisk_partition* part;
-  struct gnufdisk_geometry* geom;
+  struct gnufdisk_range range;
 
   dm = scheme_partition_to_gnufdisk_devicemanager(_smob);
   part = scheme_partition_to_gnufdisk_partition(_smob);
-  geom = scheme_geometry_to_gnufdisk_geometry(_start);
+  range = scheme_to_gnufdisk_range(_start);
 
-  if(gnufdisk_devicemanager_partition_move(dm, part, geom) != 0)
+  if(gnufdisk_devicemanager_partition_move_range(dm, part, range) != 0)
     scm_error(scm_from_locale_symbol("operation-failed"), 
 	      SYM_GNUFDISK_PARTITION_MOVE,
 	      "cannot move partition",
@@ -2254,13 +2511,13 @@ static SCM scheme_partition_resize(SCM _smob, SCM _start)
 {
   struct gnufdisk_devicemanager* dm;
   struct gnufdisk_partition* part;
-  struct gnufdisk_geometry* geom;
+  struct gnufdisk_range range;
 
   dm = scheme_partition_to_gnufdisk_devicemanager(_smob);
   part = scheme_partition_to_gnufdisk_partition(_smob);
-  geom = scheme_geometry_to_gnufdisk_geometry(_start);
+  range = scheme_to_gnufdisk_range(_start);
 
-  if(gnufdisk_devicemanager_partition_resize(dm, part, geom) != 0)
+  if(gnufdisk_devicemanager_partition_resize_range(dm, part, range) != 0)
     scm_error(scm_from_locale_symbol("operation-failed"), 
 	      SYM_GNUFDISK_PARTITION_RESIZE,
 	      "cannot resize partition",
@@ -2332,6 +2589,138 @@ static SCM scheme_partition_write(SCM _smob, SCM _start, SCM _raw)
   return SCM_BOOL_T;
 }
 
+static SCM scheme_partition_export(SCM _smob, SCM _path)
+{
+  struct gnufdisk_devicemanager* dm;
+  struct gnufdisk_partition* part;
+  struct gnufdisk_string* path;
+
+  if(!scm_is_string(_path))
+    scm_wrong_type_arg(SYM_GNUFDISK_PARTITION_EXPORT, 2, _path);
+
+  dm = scheme_partition_to_gnufdisk_devicemanager(_smob);
+  part = scheme_partition_to_gnufdisk_partition(_smob);
+
+  scm_dynwind_begin(0);
+
+  path = scm_to_gnufdisk_string(_path);
+  scm_dynwind_unwind_handler(&delete_string, path, 0);
+
+  if(gnufdisk_devicemanager_partition_export(dm, part, path) != 0)
+    scm_error(scm_from_locale_symbol("operation-failed"), 
+	      SYM_GNUFDISK_PARTITION_EXPORT,
+	      "cannot export partition",
+	      SCM_EOL, SCM_UNDEFINED);
+
+  scm_dynwind_end();
+
+  gnufdisk_string_delete(path);
+
+  return SCM_BOOL_T;
+}
+
+static SCM scheme_partition_import(SCM _smob, SCM _path)
+{
+  struct gnufdisk_devicemanager* dm;
+  struct gnufdisk_partition* part;
+  struct gnufdisk_string* path;
+
+  if(!scm_is_string(_path))
+    scm_wrong_type_arg(SYM_GNUFDISK_PARTITION_IMPORT, 2, _path);
+
+  dm = scheme_partition_to_gnufdisk_devicemanager(_smob);
+  part = scheme_partition_to_gnufdisk_partition(_smob);
+
+  scm_dynwind_begin(0);
+
+  path = scm_to_gnufdisk_string(_path);
+  scm_dynwind_unwind_handler(&delete_string, path, 0);
+
+  if(gnufdisk_devicemanager_partition_import(dm, part, path) != 0)
+    scm_error(scm_from_locale_symbol("operation-failed"), 
+	      SYM_GNUFDISK_PARTITION_IMPORT,
+	      "cannot import partition",
+	      SCM_EOL, SCM_UNDEFINED);
+
+  scm_dynwind_end();
+
+  gnufdisk_string_delete(path);
+
+  return SCM_BOOL_T;
+}
+
+static SCM scheme_digest_to_string(const unsigned char* _digest)
+{
+  char hex[2 * GNUFDISK_DIGEST_SIZE + 1];
+  int iter;
+
+  for(iter = 0; iter < GNUFDISK_DIGEST_SIZE; iter++)
+    sprintf(hex + 2 * iter, "%02x", _digest[iter]);
+
+  return scm_from_locale_string(hex);
+}
+
+static void delete_digest(void* _p)
+{
+  gnufdisk_digest_delete(_p);
+}
+
+static SCM scheme_partition_digest(SCM _smob, SCM _chunk_size, SCM _threads)
+{
+  struct gnufdisk_devicemanager* dm;
+  struct gnufdisk_partition* part;
+  struct gnufdisk_digest* digest;
+  gnufdisk_integer chunk_size;
+  int threads;
+  size_t iter;
+  SCM chunks;
+  SCM ret;
+
+  chunk_size = 0;
+  threads = 0;
+
+  if(!SCM_UNBNDP(_chunk_size))
+    {
+      if(!scm_is_integer(_chunk_size))
+	scm_wrong_type_arg(SYM_GNUFDISK_PARTITION_DIGEST, 2, _chunk_size);
+
+      chunk_size = scm_to_long_long(_chunk_size);
+    }
+
+  if(!SCM_UNBNDP(_threads))
+    {
+      if(!scm_is_integer(_threads))
+	scm_wrong_type_arg(SYM_GNUFDISK_PARTITION_DIGEST, 3, _threads);
+
+      threads = scm_to_int(_threads);
+    }
+
+  dm = scheme_partition_to_gnufdisk_devicemanager(_smob);
+  part = scheme_partition_to_gnufdisk_partition(_smob);
+
+  if((digest = gnufdisk_devicemanager_partition_digest(dm, part, chunk_size, threads)) == NULL)
+    scm_error(scm_from_locale_symbol("operation-failed"), 
+	      SYM_GNUFDISK_PARTITION_DIGEST,
+	      "cannot digest partition",
+	      SCM_EOL, SCM_UNDEFINED);
+
+  scm_dynwind_begin(0);
+  scm_dynwind_unwind_handler(&delete_digest, digest, SCM_F_WIND_EXPLICITLY);
+
+  chunks = scm_c_make_vector(digest->nchunks, SCM_UNSPECIFIED);
+
+  for(iter = 0; iter < digest->nchunks; iter++)
+    scm_c_vector_set_x(chunks, iter, scheme_digest_to_string(digest->chunks[iter]));
+
+  ret = scm_list_3(scm_cons(scm_from_locale_symbol("root"), scheme_digest_to_string(digest->root)),
+		   scm_cons(scm_from_locale_symbol("chunk-size"), scm_from_long_long(digest->chunk_size)),
+		   scm_cons(scm_from_locale_symbol("chunks"), chunks));
+
+  scm_dynwind_end();
+
+  return ret;
+}
+
 static SCM scheme_userinterface_set_hook(SCM _ui, SCM _hook, SCM _proc)
 {
   struct {
@@ -2823,8 +3212,7 @@ static SCM scheme_userinterface_get_geometry_thunk(void* _p)
 {
   struct gnufdisk_stack* args;
   struct gnufdisk_userinterface* ui;
-  struct gnufdisk_devicemanager* dm;
-  struct gnufdisk_geometry* geom;
+  SCM* geom;
   const char* message;
 
   if(gnufdisk_check_memory(_p, 1, 1) != 0)
@@ -2832,8 +3220,7 @@ static SCM scheme_userinterface_get_geometry_thunk(void* _p)
 
   args = _p;
 
-  gnufdisk_stack_pop(args, &dm, sizeof(struct gnufdisk_devicemanager*));
-  gnufdisk_stack_pop(args, &geom, sizeof(struct gnufdisk_geometry*));
+  gnufdisk_stack_pop(args, &geom, sizeof(SCM*));
   gnufdisk_stack_pop(args, &message, sizeof(char*));
   gnufdisk_stack_pop(args, &ui, sizeof(struct gnufdisk_userinterface*));
 
@@ -2845,7 +3232,7 @@ static SCM scheme_userinterface_get_geometry_thunk(void* _p)
 
   return scm_call_2(ui->get_geometry, 
 		    scm_from_locale_string(message), 
-		    scheme_geometry_new(geom,   dm));
+		    *geom);
 }
 
 int
@@ -2856,7 +3243,9 @@ gnufdisk_userinterface_internals__get_geometry(struct gnufdisk_userinterface* _u
 {
   struct gnufdisk_stack* args;
   char* message;
-  struct gnufdisk_geometry* tmpgeom;
+  struct gnufdisk_range range;
+  SCM* pgeom;
+  SCM geom;
   SCM stack;
   SCM res;
   int err;
@@ -2864,7 +3253,6 @@ gnufdisk_userinterface_internals__get_geometry(struct gnufdisk_userinterface* _u
 
   args = NULL;
   message = NULL;
-  tmpgeom = NULL;
 
   if(gnufdisk_vasprintf(&message, _fmt, _args) == -1) 
     {
@@ -2879,18 +3267,22 @@ gnufdisk_userinterface_internals__get_geometry(struct gnufdisk_userinterface* _u
       goto lb_out;
     }
 
-  if((tmpgeom = gnufdisk_devicemanager_geometry_duplicate(_dm, _geom)) == NULL)
+  /* the hook works on a copy, _geom is updated only if it returns #t */
+  if((range.start = gnufdisk_devicemanager_geometry_start(_dm, _geom)) == -1
+     || (range.end = gnufdisk_devicemanager_geometry_end(_dm, _geom)) == -1)
     {
       err = errno;
       ret = -1;
+      goto lb_out;
     }
 
+  geom = scheme_range_new(range);
+  pgeom = &geom;
+
   if(gnufdisk_stack_push(args, &_ui, sizeof(struct gnufdisk_userinterface*)) != 0
      || gnufdisk_stack_push(args, &message, sizeof(char*)) != 0
-     || gnufdisk_stack_push(args, &tmpgeom, sizeof(struct gnufdisk_geometry*)) != 0
-     || gnufdisk_stack_push(args, &_dm, sizeof(struct gnufdisk_devicemanager*)) != 0)
+     || gnufdisk_stack_push(args, &pgeom, sizeof(SCM*)) != 0)
     {
-      gnufdisk_devicemanager_geometry_delete(_dm, tmpgeom);
       err = errno;
       ret = -1;
       goto lb_out;
@@ -2902,17 +3294,23 @@ gnufdisk_userinterface_internals__get_geometry(struct gnufdisk_userinterface* _u
 
   if(!scm_is_bool(res) || !scm_is_true(res))
     {
-      gnufdisk_devicemanager_geometry_delete(_dm, tmpgeom);
       err = ECANCELED;
       ret = -1;
       goto lb_out;
     }
+  else if(!scheme_range_p(geom))
+    {
+      err = EINVAL;
+      ret = -1;
+      goto lb_out;
+    }
 
+  range = scheme_to_gnufdisk_range(geom);
 
   gnufdisk_devicemanager_geometry_set(_dm,
 				      _geom, 
-				      gnufdisk_devicemanager_geometry_start(_dm, tmpgeom),
-				      gnufdisk_devicemanager_geometry_length(_dm, tmpgeom));
+				      range.start,
+				      range.end - range.start);
   ret = 0;
   err = 0;
 
@@ -3019,6 +3417,36 @@ lb_out:
   return ret;
 }
 
+/* A compiled implementation (.go, see `guild compile') is loaded as is.
+ * Sources go through primitive-load-path, which picks up a fresh compiled
+ * file from %load-compiled-path or the auto-compilation cache and
+ * refreshes the cache when the source is newer. */
+static void scheme_load_implementation(const char* _path)
+{
+  char* path;
+  size_t len;
+
+  len = strlen(_path);
+
+  if(len > 3 && strcmp(_path + len - 3, ".go") == 0)
+    {
+      scm_load_compiled_with_vm(scm_from_locale_string(_path));
+      return;
+    }
+
+  /* primitive-load-path searches %load-path for relative names */
+  if((path = realpath(_path, NULL)) == NULL)
+    scm_syserror_msg("scheme_load_implementation", "can not resolve ~A", 
+		     scm_list_1(scm_from_locale_string(_path)), errno);
+
+  scm_dynwind_begin(0);
+  scm_dynwind_free(path);
+
+  scm_c_primitive_load_path(path);
+
+  scm_dynwind_end();
+}
+
 /* expect _ui, _implementation, _argc, _argv on struct gnufdisk_stack* _p */
 static SCM scheme_userinterface_run_thunk(void* _p)
 {
@@ -3043,6 +3471,8 @@ static SCM scheme_userinterface_run_thunk(void* _p)
 
   scheme_export_env(ui, argc, argv);
 
+  gnufdisk_stats_record(GNUFDISK_STATS_UI_STARTUP, scheme_startup_clock, 0);
+
   if(ui->shell_mode)
     {
       int dummy_argc = 1;
@@ -3056,7 +3486,7 @@ static SCM scheme_userinterface_run_thunk(void* _p)
       GNUFDISK_LOG((GUILE, "run struct gnufdisk_userinterface* %p with implementation `%s'", 
 		    ui, gnufdisk_string_c_string(implementation)));
       
-      scm_c_primitive_load(gnufdisk_string_c_string(implementation));
+      scheme_load_implementation(gnufdisk_string_c_string(implementation));
     }
 
   return SCM_BOOL_T;
@@ -3114,6 +3544,8 @@ int gnufdisk_userinterface_internals__run(struct gnufdisk_userinterface* _ui,
       goto lb_out;
     }
 
+  scheme_startup_clock = gnufdisk_stats_clock();
+
   if((err = (int) scm_with_guile(scheme_main, args)) != 0)
     ret = -1;
 
@@ -3126,6 +3558,132 @@ lb_out:
   return ret;
 }
 
+/* procedures exported by the (gnufdisk core) module */
+struct scheme_binding {
+  const char* name;
+  int req;
+  int opt;
+  int rst;
+  SCM (*fcn)();
+};
+
+static const struct scheme_binding scheme_bindings[] = {
+  {SYM_GNUFDISK_USERINTERFACE_SET_HOOK, 3, 0, 0, (SCM (*)()) &scheme_userinterface_set_hook},
+  {SYM_GNUFDISK_DEVICEMANAGER_MAKE_GEOMETRY, 3, 0, 0, (SCM (*)()) &scheme_devicemanager_make_geometry},
+  {SYM_GNUFDISK_GEOMETRY_P, 1, 0, 0, (SCM (*)()) &scheme_geometry_p},
+  {SYM_GNUFDISK_GEOMETRY_SET, 3, 0, 0, (SCM (*)()) &scheme_geometry_set},
+  {SYM_GNUFDISK_GEOMETRY_START, 1, 0, 0, (SCM (*)()) &scheme_geometry_start},
+  {SYM_GNUFDISK_GEOMETRY_END, 1, 0, 0, (SCM (*)()) &scheme_geometry_end},
+  {SYM_GNUFDISK_GEOMETRY_LENGTH, 1, 0, 0, (SCM (*)()) &scheme_geometry_length},
+  {SYM_GNUFDISK_MAKE_DEVICEMANAGER, 1, 0, 0, (SCM (*)()) &scheme_make_devicemanager},
+  {SYM_GNUFDISK_DEVICEMANAGER_P, 1, 0, 0, (SCM (*)()) &scheme_devicemanager_p},
+  {SYM_GNUFDISK_DEVICEMANAGER_MAKE_DEVICE, 3, 0, 0, (SCM (*)()) &scheme_devicemanager_make_device},
+  {SYM_GNUFDISK_DEVICE_P, 1, 0, 0, (SCM (*)()) &scheme_device_p},
+  {SYM_GNUFDISK_DEVICE_OPEN, 2, 0, 0, (SCM (*)()) &scheme_device_open},
+  {SYM_GNUFDISK_DEVICE_DISKLABEL, 1, 0, 0, (SCM (*)()) &scheme_device_disklabel},
+  {SYM_GNUFDISK_DEVICE_CREATE_DISKLABEL, 2, 0, 0, (SCM (*)()) &scheme_device_create_disklabel},
+  {SYM_GNUFDISK_DEVICE_SET_PARAMETER, 3, 0, 0, (SCM (*)()) &scheme_device_set_parameter},
+  {SYM_GNUFDISK_DEVICE_GET_PARAMETER, 3, 0, 0, (SCM (*)()) &scheme_device_get_parameter},
+  {SYM_GNUFDISK_DEVICE_COMMIT, 1, 0, 0, (SCM (*)()) &scheme_device_commit},
+  {SYM_GNUFDISK_DEVICE_CLOSE, 1, 0, 0, (SCM (*)()) &scheme_device_close},
+  {SYM_GNUFDISK_DEVICE_PLAN, 2, 1, 0, (SCM (*)()) &scheme_device_plan},
+  {SYM_GNUFDISK_DISKLABEL_P, 1, 0, 0, (SCM (*)()) &scheme_disklabel_p},
+  {SYM_GNUFDISK_DISKLABEL_RAW, 1, 0, 0, (SCM (*)()) &scheme_disklabel_raw},
+  {SYM_GNUFDISK_DISKLABEL_SYSTEM, 1, 0, 0, (SCM (*)()) &scheme_disklabel_system},
+  {SYM_GNUFDISK_DISKLABEL_PARTITION, 2, 0, 0, (SCM (*)()) &scheme_disklabel_partition},
+  {SYM_GNUFDISK_DISKLABEL_COUNT_PARTITIONS, 1, 0, 0, (SCM (*)()) &scheme_disklabel_count_partitions},
+  {SYM_GNUFDISK_DISKLABEL_LIST, 1, 0, 0, (SCM (*)()) &scheme_disklabel_list},
+  {SYM_GNUFDISK_DISKLABEL_SNAPSHOT, 1, 0, 0, (SCM (*)()) &scheme_disklabel_snapshot},
+  {SYM_GNUFDISK_PARTITION_P, 1, 0, 0, (SCM (*)()) &scheme_partition_p},
+  {SYM_GNUFDISK_DISKLABEL_CREATE_PARTITION, 4, 0, 0, (SCM (*)()) &scheme_disklabel_create_partition},
+  {SYM_GNUFDISK_DISKLABEL_REMOVE_PARTITION, 2, 0, 0, (SCM (*)()) &scheme_disklabel_remove_partition},
+  {SYM_GNUFDISK_DISKLABEL_SET_PARAMETER, 3, 0, 0, (SCM (*)()) &scheme_disklabel_set_parameter},
+  {SYM_GNUFDISK_DISKLABEL_GET_PARAMETER, 3, 0, 0, (SCM (*)()) &scheme_disklabel_get_parameter},
+  {SYM_GNUFDISK_PARTITION_SET_PARAMETER, 3, 0, 0, (SCM (*)()) &scheme_partition_set_parameter},
+  {SYM_GNUFDISK_PARTITION_GET_PARAMETER, 3, 0, 0, (SCM (*)()) &scheme_partition_get_parameter},
+  {SYM_GNUFDISK_PARTITION_TYPE, 1, 0, 0, (SCM (*)()) &scheme_partition_type},
+  {SYM_GNUFDISK_PARTITION_GEOMETRY, 1, 0, 0, (SCM (*)()) &scheme_partition_geometry},
+  {SYM_GNUFDISK_PARTITION_NUMBER, 1, 0, 0, (SCM (*)()) &scheme_partition_number},
+  {SYM_GNUFDISK_PARTITION_HAVE_DISKLABEL, 1, 0, 0, (SCM (*)()) &scheme_partition_have_disklabel},
+  {SYM_GNUFDISK_PARTITION_DISKLABEL, 1, 0, 0, (SCM (*)()) &scheme_partition_disklabel},
+  {SYM_GNUFDISK_PARTITION_MOVE, 2, 0, 0, (SCM (*)()) &scheme_partition_move},
+  {SYM_GNUFDISK_PARTITION_RESIZE, 2, 0, 0, (SCM (*)()) &scheme_partition_resize},
+  {SYM_GNUFDISK_PARTITION_READ, 3, 0, 0, (SCM (*)()) &scheme_partition_read},
+  {SYM_GNUFDISK_PARTITION_WRITE, 3, 0, 0, (SCM (*)()) &scheme_partition_write},
+  {SYM_GNUFDISK_PARTITION_EXPORT, 2, 0, 0, (SCM (*)()) &scheme_partition_export},
+  {SYM_GNUFDISK_PARTITION_IMPORT, 2, 0, 0, (SCM (*)()) &scheme_partition_import},
+  {SYM_GNUFDISK_PARTITION_DIGEST, 1, 2, 0, (SCM (*)()) &scheme_partition_digest},
+  {SYM_GNUFDISK_MAKE_RAW, 1, 0, 0, (SCM (*)()) &scheme_make_raw},
+  {SYM_GNUFDISK_RAW_P, 1, 0, 0, (SCM (*)()) &scheme_raw_p},
+  {SYM_GNUFDISK_RAW_REF, 2, 0, 0, (SCM (*)()) &scheme_raw_ref},
+  {SYM_GNUFDISK_RAW_SET_X, 3, 0, 0, (SCM (*)()) &scheme_raw_set_x},
+  {SYM_GNUFDISK_RAW_LENGTH, 1, 0, 0, (SCM (*)()) &scheme_raw_length},
+  {SYM_GNUFDISK_STATS, 1, 1, 0, (SCM (*)()) &scheme_stats},
+  {SYM_GNUFDISK_STATS_RESET, 1, 0, 0, (SCM (*)()) &scheme_stats_reset},
+  {NULL, 0, 0, 0, NULL}
+};
+
+static void scheme_set_binder(SCM _module, SCM _binder)
+{
+  scm_call_2(scm_c_public_ref("guile", "set-module-binder!"), _module, _binder);
+}
+
+static const struct scheme_binding* scheme_binding_find(const char* _name)
+{
+  const struct scheme_binding* iter;
+
+  for(iter = scheme_bindings; iter->name != NULL; iter++)
+    if(strcmp(iter->name, _name) == 0)
+      return iter;
+
+  return NULL;
+}
+
+static SCM scheme_core_define(void* _binding)
+{
+  const struct scheme_binding* binding;
+
+  binding = _binding;
+
+  scm_c_define_gsubr(binding->name, binding->req, binding->opt, binding->rst, binding->fcn);
+  scm_c_export(binding->name, NULL);
+
+  return SCM_UNSPECIFIED;
+}
+
+/* Binder of the (gnufdisk core) public interface. The module is created
+ * empty and a procedure is defined the first time a lookup reaches it,
+ * so a script pays only for the bindings it uses. The names found in
+ * (guile) or in the top level module never get here. */
+static SCM scheme_core_binder(SCM _interface, SCM _symbol, SCM _define)
+{
+  const struct scheme_binding* binding;
+  char* name;
+
+  if(scm_is_true(_define))
+    return SCM_BOOL_F;
+
+  name = scm_to_locale_string(scm_symbol_to_string(_symbol));
+  binding = scheme_binding_find(name);
+  free(name);
+
+  if(binding == NULL)
+    return SCM_BOOL_F;
+
+  GNUFDISK_LOG((GUILE, "bind %s in module (" MODULE_GNUFDISK_CORE ")", binding->name));
+
+  scm_c_call_with_current_module(scm_c_resolve_module(MODULE_GNUFDISK_CORE),
+				 &scheme_core_define, (void*) binding);
+
+  return scm_module_variable(_interface, _symbol);
+}
+
+static void scheme_core_declare(void* _unused)
+{
+  scheme_set_binder(scm_module_public_interface(scm_current_module()),
+		    scm_c_make_gsubr("gnufdisk-core-binder", 3, 0, 0, (SCM (*)()) &scheme_core_binder));
+}
+
 static void scheme_export_env(struct gnufdisk_userinterface* _ui, int argc, char** _argv)
 {
   SCM command_line;
@@ -3140,50 +3698,9 @@ static void scheme_export_env(struct gnufdisk_userinterface* _ui, int argc, char
   if(_ui->shell_mode)
     scm_c_define_gsubr(SYM_GNUFDISK_HELP, 0, 0, 0, (SCM (*)()) &scheme_gnufdisk_help);
   
-  scm_c_define_gsubr(SYM_GNUFDISK_USERINTERFACE_SET_HOOK, 3, 0, 0, (SCM (*)()) &scheme_userinterface_set_hook);
-  scm_c_define_gsubr(SYM_GNUFDISK_DEVICEMANAGER_MAKE_GEOMETRY, 3, 0, 0, (SCM (*)()) &scheme_devicemanager_make_geometry);
-  scm_c_define_gsubr(SYM_GNUFDISK_GEOMETRY_P, 1, 0, 0, (SCM (*)()) &scheme_geometry_p);
-  scm_c_define_gsubr(SYM_GNUFDISK_GEOMETRY_SET, 3, 0, 0, (SCM (*)()) &scheme_geometry_set);
-  scm_c_define_gsubr(SYM_GNUFDISK_GEOMETRY_START, 1, 0, 0, (SCM (*)()) &scheme_geometry_start);
-  scm_c_define_gsubr(SYM_GNUFDISK_GEOMETRY_END, 1, 0, 0, (SCM (*)()) &scheme_geometry_end);
-  scm_c_define_gsubr(SYM_GNUFDISK_GEOMETRY_LENGTH, 1, 0, 0, (SCM (*)()) &scheme_geometry_length);
-  scm_c_define_gsubr(SYM_GNUFDISK_MAKE_DEVICEMANAGER, 1, 0, 0, (SCM (*)()) &scheme_make_devicemanager);
-  scm_c_define_gsubr(SYM_GNUFDISK_DEVICEMANAGER_P, 1, 0, 0, (SCM (*)()) &scheme_devicemanager_p);
-  scm_c_define_gsubr(SYM_GNUFDISK_DEVICEMANAGER_MAKE_DEVICE, 3, 0, 0, (SCM (*)()) &scheme_devicemanager_make_device);
-  scm_c_define_gsubr(SYM_GNUFDISK_DEVICE_P, 1, 0, 0, (SCM (*)()) &scheme_device_p);
-  scm_c_define_gsubr(SYM_GNUFDISK_DEVICE_OPEN, 2, 0, 0, (SCM (*)()) &scheme_device_open);
-  scm_c_define_gsubr(SYM_GNUFDISK_DEVICE_DISKLABEL, 1, 0, 0, (SCM (*)()) &scheme_device_disklabel);
-  scm_c_define_gsubr(SYM_GNUFDISK_DEVICE_CREATE_DISKLABEL, 2, 0, 0, (SCM (*)()) &scheme_device_create_disklabel);
-  scm_c_define_gsubr(SYM_GNUFDISK_DEVICE_SET_PARAMETER, 3, 0, 0, (SCM (*)()) &scheme_device_set_parameter);
-  scm_c_define_gsubr(SYM_GNUFDISK_DEVICE_GET_PARAMETER, 3, 0, 0, (SCM (*)()) &scheme_device_get_parameter);
-  scm_c_define_gsubr(SYM_GNUFDISK_DEVICE_COMMIT, 1, 0, 0, (SCM (*)()) &scheme_device_commit);
-  scm_c_define_gsubr(SYM_GNUFDISK_DEVICE_CLOSE, 1, 0, 0, (SCM (*)()) &scheme_device_close);
-  scm_c_define_gsubr(SYM_GNUFDISK_DISKLABEL_P, 1, 0, 0, (SCM (*)()) &scheme_disklabel_p);
-  scm_c_define_gsubr(SYM_GNUFDISK_DISKLABEL_RAW, 1, 0, 0, (SCM (*)()) &scheme_disklabel_raw);
-  scm_c_define_gsubr(SYM_GNUFDISK_DISKLABEL_SYSTEM, 1, 0, 0, (SCM (*)()) &scheme_disklabel_system);
-  scm_c_define_gsubr(SYM_GNUFDISK_DISKLABEL_PARTITION, 2, 0, 0, (SCM (*)()) &scheme_disklabel_partition);
-  scm_c_define_gsubr(SYM_GNUFDISK_DISKLABEL_COUNT_PARTITIONS, 1, 0, 0, (SCM (*)()) &scheme_disklabel_count_partitions);
-  scm_c_define_gsubr(SYM_GNUFDISK_PARTITION_P, 1, 0, 0, (SCM (*)()) &scheme_partition_p);
-  scm_c_define_gsubr(SYM_GNUFDISK_DISKLABEL_CREATE_PARTITION, 4, 0, 0, (SCM (*)()) &scheme_disklabel_create_partition);
-  scm_c_define_gsubr(SYM_GNUFDISK_DISKLABEL_REMOVE_PARTITION, 2, 0, 0, (SCM (*)()) &scheme_disklabel_remove_partition);
-  scm_c_define_gsubr(SYM_GNUFDISK_DISKLABEL_SET_PARAMETER, 3, 0, 0, (SCM (*)()) &scheme_disklabel_set_parameter);
-  scm_c_define_gsubr(SYM_GNUFDISK_DISKLABEL_GET_PARAMETER, 3, 0, 0, (SCM (*)()) &scheme_disklabel_get_parameter);
-  scm_c_define_gsubr(SYM_GNUFDISK_PARTITION_SET_PARAMETER, 3, 0, 0, (SCM (*)()) &scheme_partition_set_parameter);
-  scm_c_define_gsubr(SYM_GNUFDISK_PARTITION_GET_PARAMETER, 3, 0, 0, (SCM (*)()) &scheme_partition_get_parameter);
-  scm_c_define_gsubr(SYM_GNUFDISK_PARTITION_TYPE, 1, 0, 0, (SCM (*)()) &scheme_partition_type);
-  scm_c_define_gsubr(SYM_GNUFDISK_PARTITION_GEOMETRY, 1, 0, 0, (SCM (*)()) &scheme_partition_geometry);
-  scm_c_define_gsubr(SYM_GNUFDISK_PARTITION_NUMBER, 1, 0, 0, (SCM (*)()) &scheme_partition_number);
-  scm_c_define_gsubr(SYM_GNUFDISK_PARTITION_HAVE_DISKLABEL, 1, 0, 0, (SCM (*)()) &scheme_partition_have_disklabel);
-  scm_c_define_gsubr(SYM_GNUFDISK_PARTITION_DISKLABEL, 1, 0, 0, (SCM (*)()) &scheme_partition_disklabel);
-  scm_c_define_gsubr(SYM_GNUFDISK_PARTITION_MOVE, 2, 0, 0, (SCM (*)()) &scheme_partition_move);
-  scm_c_define_gsubr(SYM_GNUFDISK_PARTITION_RESIZE, 2, 0, 0, (SCM (*)()) &scheme_partition_resize);
-  scm_c_define_gsubr(SYM_GNUFDISK_PARTITION_READ, 3, 0, 0, (SCM (*)()) &scheme_partition_read);
-  scm_c_define_gsubr(SYM_GNUFDISK_PARTITION_WRITE, 3, 0, 0, (SCM (*)()) &scheme_partition_write);
-  scm_c_define_gsubr(SYM_GNUFDISK_MAKE_RAW, 1, 0, 0, (SCM (*)()) &scheme_make_raw);
-  scm_c_define_gsubr(SYM_GNUFDISK_RAW_P, 1, 0, 0, (SCM (*)()) &scheme_raw_p);
-  scm_c_define_gsubr(SYM_GNUFDISK_RAW_REF, 2, 0, 0, (SCM (*)()) &scheme_raw_ref);
-  scm_c_define_gsubr(SYM_GNUFDISK_RAW_SET_X, 3, 0, 0, (SCM (*)()) &scheme_raw_set_x);
-  scm_c_define_gsubr(SYM_GNUFDISK_RAW_LENGTH, 1, 0, 0, (SCM (*)()) &scheme_raw_length);
+  /* existing scripts expect the bindings in the current module */
+  scm_c_define_module(MODULE_GNUFDISK_CORE, &scheme_core_declare, NULL);
+  scm_c_use_module(MODULE_GNUFDISK_CORE);
 
   scm_c_define(SYM_USERINTERFACE, scheme_userinterface_new(_ui));
 